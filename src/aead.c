@@ -0,0 +1,369 @@
+/* aead.c - OpenPGP AEAD encrypted data (SEIPD v2)
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+
+/* The body of a version 2 symmetrically encrypted and integrity
+   protected data packet (RFC 9580, section 5.13.2) following the
+   version octet consists of a header giving the cipher, the AEAD
+   algorithm, the chunk size and a salt, the chunks of plaintext
+   each encrypted and followed by its authentication tag, and a final
+   tag authenticating the total length.  As every chunk uses its own
+   nonce, the chunks are independent of each other and are processed
+   in parallel.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tgpgdefs.h"
+#include "cryptglue.h"
+#include "parallel.h"
+#include "aead.h"
+
+/* The maximum nonce length of all AEAD algorithms.  */
+#define MAX_NONCE_LEN 16
+
+/* The length of the part of the nonce taken from the key derivation;
+   the remaining 8 octets are the chunk index.  */
+#define IV_LEN(noncelen) ((noncelen) - 8)
+
+/* The length of the associated data of a chunk and of the final
+   tag.  */
+#define ADATA_LEN 5
+#define FINAL_ADATA_LEN (ADATA_LEN + 8)
+
+/* The state shared by the workers processing the chunks of one
+   message.  */
+struct aead_job_s
+{
+  int do_encrypt;
+  int cipher_algo;
+  int aead_algo;
+  unsigned char key[32];
+  size_t keylen;
+  unsigned char iv[MAX_NONCE_LEN];
+  size_t noncelen;
+  unsigned char adata[ADATA_LEN];
+  size_t chunksize;
+  size_t length;          /* Total length of the plaintext.  */
+  size_t nchunks;
+  char *out;
+  const char *in;
+  void **handles;         /* One AEAD handle per worker.  */
+};
+
+
+/* Store the 64 bit value V as big endian number at P.  */
+static void
+put_u64 (unsigned char *p, uint64_t v)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, v >>= 8)
+    p[i] = v & 0xff;
+}
+
+
+/* Return the number of chunks required for LENGTH bytes of plaintext
+   using chunks of CHUNKSIZE bytes.  */
+static size_t
+count_chunks (size_t length, size_t chunksize)
+{
+  return (length + chunksize - 1) / chunksize;
+}
+
+
+/* Return the length of the body of a version 2 encrypted data packet
+   (not counting the version octet) for LENGTH bytes of plaintext
+   using the chunk size given by HDR.  */
+size_t
+_tgpg_aead_length (const struct aead_header_s *hdr, size_t length)
+{
+  size_t chunksize = AEAD_CHUNK_SIZE (hdr->chunkbits);
+
+  return (AEAD_HEADER_LEN + length
+          + count_chunks (length, chunksize) * AEAD_TAGLEN
+          + AEAD_TAGLEN);
+}
+
+
+/* Parse the header of the body of a version 2 encrypted data packet
+   (right after the version octet) at DATA of LENGTH bytes into HDR.  */
+int
+_tgpg_aead_parse_header (const char *data, size_t length,
+                         struct aead_header_s *hdr)
+{
+  const unsigned char *s = (const unsigned char *) data;
+
+  if (length < AEAD_HEADER_LEN)
+    return TGPG_INV_PKT;
+  hdr->cipher_algo = s[0];
+  hdr->aead_algo = s[1];
+  hdr->chunkbits = s[2];
+  memcpy (hdr->salt, s + 3, AEAD_SALT_LEN);
+
+  if (_tgpg_cipher_blocklen (hdr->cipher_algo) != 16
+      || _tgpg_cipher_keylen (hdr->cipher_algo) > 32
+      || !_tgpg_cipher_aead_noncelen (hdr->aead_algo))
+    return TGPG_INV_ALGO;
+  if (hdr->chunkbits > AEAD_MAX_CHUNKBITS)
+    return TGPG_INV_PKT;
+  return 0;
+}
+
+
+/* Derive the message key and the IV for HDR from the session key KEY
+   of length KEYLEN and set up JOB accordingly.  */
+static int
+setup_job (struct aead_job_s *job, const struct aead_header_s *hdr,
+           const void *key, size_t keylen)
+{
+  int rc;
+  unsigned char okm[32 + MAX_NONCE_LEN];
+
+  job->cipher_algo = hdr->cipher_algo;
+  job->aead_algo = hdr->aead_algo;
+  job->keylen = _tgpg_cipher_keylen (hdr->cipher_algo);
+  job->noncelen = _tgpg_cipher_aead_noncelen (hdr->aead_algo);
+  job->chunksize = AEAD_CHUNK_SIZE (hdr->chunkbits);
+  if (!job->keylen || job->keylen != keylen || job->keylen > sizeof job->key
+      || !job->noncelen)
+    return TGPG_INV_ALGO;
+
+  /* The associated data is the packet tag and version followed by the
+     first three octets of the header.  It is also the info for the
+     key derivation.  */
+  job->adata[0] = 0xc0 | PKT_ENCRYPTED_MDC;
+  job->adata[1] = 2;
+  job->adata[2] = hdr->cipher_algo;
+  job->adata[3] = hdr->aead_algo;
+  job->adata[4] = hdr->chunkbits;
+
+  rc = _tgpg_hkdf (MD_ALGO_SHA256, okm, job->keylen + IV_LEN (job->noncelen),
+                   key, keylen, hdr->salt, AEAD_SALT_LEN,
+                   job->adata, ADATA_LEN);
+  if (!rc)
+    {
+      memcpy (job->key, okm, job->keylen);
+      memcpy (job->iv, okm + job->keylen, IV_LEN (job->noncelen));
+    }
+  wipememory (okm, sizeof okm);
+  return rc;
+}
+
+
+/* Process the chunk with index IDX, or the final tag if IDX equals
+   the number of chunks, using the handle of WORKER.  */
+static int
+do_chunk (void *arg, unsigned int worker, size_t idx)
+{
+  struct aead_job_s *job = arg;
+  unsigned char nonce[MAX_NONCE_LEN];
+  unsigned char adata[FINAL_ADATA_LEN];
+  size_t adatalen, offset, n;
+  const char *in;
+  char *out, *tag;
+  int rc;
+
+  if (!job->handles[worker])
+    {
+      rc = _tgpg_cipher_aead_open (&job->handles[worker],
+                                   job->cipher_algo, job->aead_algo,
+                                   job->key, job->keylen);
+      if (rc)
+        return rc;
+    }
+
+  memcpy (nonce, job->iv, IV_LEN (job->noncelen));
+  put_u64 (nonce + IV_LEN (job->noncelen), idx);
+  memcpy (adata, job->adata, ADATA_LEN);
+  adatalen = ADATA_LEN;
+
+  offset = idx * job->chunksize;
+  if (idx < job->nchunks)
+    {
+      n = job->length - offset;
+      if (n > job->chunksize)
+        n = job->chunksize;
+    }
+  else
+    {
+      /* The final tag authenticates the total length.  */
+      offset = job->length;
+      n = 0;
+      put_u64 (adata + ADATA_LEN, job->length);
+      adatalen = FINAL_ADATA_LEN;
+    }
+
+  /* Chunk IDX is preceded by IDX tags in the ciphertext.  */
+  if (job->do_encrypt)
+    {
+      in = job->in + offset;
+      out = job->out + offset + idx * AEAD_TAGLEN;
+      tag = out + n;
+    }
+  else
+    {
+      in = job->in + offset + idx * AEAD_TAGLEN;
+      out = job->out + offset;
+      tag = (char *) in + n;
+    }
+
+  return _tgpg_cipher_aead_crypt (job->handles[worker], job->do_encrypt,
+                                  nonce, job->noncelen, adata, adatalen,
+                                  out, in, n, tag);
+}
+
+
+/* Run the chunks of JOB using NWORKERS workers.  If FINAL is set, the
+   final tag is processed along with the chunks.  */
+static int
+run_job (struct aead_job_s *job, unsigned int nworkers, int final)
+{
+  int rc;
+  unsigned int i;
+  size_t njobs = job->nchunks + !!final;
+
+  nworkers = _tgpg_parallel_workers (nworkers, njobs);
+  job->handles = xtrycalloc (nworkers, sizeof *job->handles);
+  if (!job->handles)
+    return TGPG_SYSERROR;
+
+  rc = _tgpg_parallel_run (nworkers, njobs, do_chunk, job);
+
+  for (i = 0; i < nworkers; i++)
+    _tgpg_cipher_aead_close (job->handles[i]);
+  xfree (job->handles);
+  job->handles = NULL;
+  return rc;
+}
+
+
+/* Encrypt LENGTH bytes of plaintext from IN with the session key KEY
+   of length KEYLEN using the parameters from HDR, and store the body
+   of a version 2 encrypted data packet (without the version octet) at
+   OUT, which must provide space for _tgpg_aead_length (HDR, LENGTH)
+   bytes.  The chunks are encrypted by up to NWORKERS workers; 0
+   means one per CPU.  */
+int
+_tgpg_aead_encrypt (const struct aead_header_s *hdr,
+                    const void *key, size_t keylen, unsigned int nworkers,
+                    char *out, const char *in, size_t length)
+{
+  int rc;
+  struct aead_job_s job;
+  unsigned char *p = (unsigned char *) out;
+
+  memset (&job, 0, sizeof job);
+  rc = setup_job (&job, hdr, key, keylen);
+  if (rc)
+    goto leave;
+
+  *p++ = hdr->cipher_algo;
+  *p++ = hdr->aead_algo;
+  *p++ = hdr->chunkbits;
+  memcpy (p, hdr->salt, AEAD_SALT_LEN);
+
+  job.do_encrypt = 1;
+  job.length = length;
+  job.nchunks = count_chunks (length, job.chunksize);
+  job.in = in;
+  job.out = out + AEAD_HEADER_LEN;
+  rc = run_job (&job, nworkers, 1);
+
+ leave:
+  wipememory (&job, sizeof job);
+  return rc;
+}
+
+
+/* Decrypt the body of a version 2 encrypted data packet (without the
+   version octet) at IN of INLEN bytes, using the session key KEY of
+   length KEYLEN.  The plaintext is stored at OUT, which must provide
+   space for INLEN bytes; its length is stored at R_OUTLEN.  The
+   chunks are decrypted by up to NWORKERS workers; 0 means one per
+   CPU.  The final tag is checked first, so that a truncated message
+   is detected before any work is done.  If any chunk fails to
+   authenticate, TGPG_MDC_FAILED is returned and no further chunks
+   are processed.  */
+int
+_tgpg_aead_decrypt (const void *key, size_t keylen, unsigned int nworkers,
+                    char *out, size_t *r_outlen,
+                    const char *in, size_t inlen)
+{
+  int rc;
+  struct aead_header_s hdr;
+  struct aead_job_s job;
+  void *hd = NULL;
+  size_t n, rest;
+
+  *r_outlen = 0;
+  memset (&job, 0, sizeof job);
+
+  rc = _tgpg_aead_parse_header (in, inlen, &hdr);
+  if (rc)
+    goto leave;
+  rc = setup_job (&job, &hdr, key, keylen);
+  if (rc)
+    goto leave;
+  in += AEAD_HEADER_LEN;
+  inlen -= AEAD_HEADER_LEN;
+
+  /* Compute the number of chunks from the length of the ciphertext.
+     Every chunk but the last is full, and no chunk is empty.  */
+  if (inlen < AEAD_TAGLEN)
+    {
+      rc = TGPG_INV_MSG;
+      goto leave;
+    }
+  n = inlen - AEAD_TAGLEN;
+  job.nchunks = n / (job.chunksize + AEAD_TAGLEN);
+  rest = n % (job.chunksize + AEAD_TAGLEN);
+  if (rest)
+    {
+      if (rest <= AEAD_TAGLEN)
+        {
+          rc = TGPG_INV_MSG;
+          goto leave;
+        }
+      job.nchunks++;
+    }
+  job.length = n - job.nchunks * AEAD_TAGLEN;
+  job.in = in;
+  job.out = out;
+
+  /* Check the final tag first.  */
+  job.handles = &hd;
+  rc = do_chunk (&job, 0, job.nchunks);
+  _tgpg_cipher_aead_close (hd);
+  job.handles = NULL;
+  if (rc)
+    goto leave;
+
+  rc = run_job (&job, nworkers, 0);
+  if (!rc)
+    *r_outlen = job.length;
+
+ leave:
+  wipememory (&job, sizeof job);
+  return rc;
+}
@@ -0,0 +1,59 @@
+/* aead.h - OpenPGP AEAD encrypted data (SEIPD v2)
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+
+#ifndef AEAD_H
+#define AEAD_H
+
+#include "tgpgdefs.h"
+
+/* The length of the salt of a version 2 encrypted data packet.  */
+#define AEAD_SALT_LEN 32
+
+/* The length of the header (cipher, AEAD algorithm, chunk size and
+   salt) following the version octet.  */
+#define AEAD_HEADER_LEN (3 + AEAD_SALT_LEN)
+
+/* The chunk size is encoded as exponent C meaning 2^(C+6) bytes.  We
+   use 256 KiB chunks by default; OpenPGP allows up to 4 MiB.  */
+#define AEAD_CHUNK_SIZE(c)     ((size_t) 1 << ((c) + 6))
+#define AEAD_DEFAULT_CHUNKBITS 12
+#define AEAD_MAX_CHUNKBITS     16
+
+/* The parameters of a version 2 encrypted data packet.  */
+struct aead_header_s
+{
+  int cipher_algo;
+  int aead_algo;
+  unsigned int chunkbits;
+  unsigned char salt[AEAD_SALT_LEN];
+};
+
+size_t _tgpg_aead_length (const struct aead_header_s *hdr, size_t length);
+int _tgpg_aead_parse_header (const char *data, size_t length,
+                             struct aead_header_s *hdr);
+int _tgpg_aead_encrypt (const struct aead_header_s *hdr,
+                        const void *key, size_t keylen, unsigned int nworkers,
+                        char *out, const char *in, size_t length);
+int _tgpg_aead_decrypt (const void *key, size_t keylen, unsigned int nworkers,
+                        char *out, size_t *r_outlen,
+                        const char *in, size_t inlen);
+
+#endif /*AEAD_H*/
@@ -0,0 +1,547 @@
+/* armor.c - OpenPGP ASCII armor
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tgpgdefs.h"
+#include "armor.h"
+
+/* The armor lines we know about.  */
+#define BEGIN_LINE	"-----BEGIN PGP "
+#define END_LINE	"-----END PGP "
+#define LINE_TAIL	"-----"
+
+/* The number of base64 characters per line when armoring.  */
+#define LINE_LENGTH	64
+
+/* The initial value of the CRC-24 checksum.  */
+#define CRC24_INIT	0xb704ceUL
+
+/* Markers in the decoding table.  */
+#define B64_SKIP	0x40	/* Whitespace, which is ignored.  */
+#define B64_INVALID	0x80	/* Anything else.  */
+
+static const char b64chars[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Map a character to its base64 value or one of the markers.  */
+static const unsigned char b64tab[256] =
+  {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x40, 0x40,
+    0x40, 0x40, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,
+    0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24,
+    0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80
+  };
+
+/* Lookup tables for the CRC-24 as defined by OpenPGP (generator
+   0x864cfb).  The first table is the usual byte-wise table; the
+   entries of table N are the checksums of a byte followed by N zero
+   bytes.  This allows to process three bytes, i.e. the output of one
+   radix-64 quad, with three independent lookups.  */
+static const uint32_t crc24tab[3][256] =
+  {
+    {
+      0x000000, 0x864cfb, 0x8ad50d, 0x0c99f6, 0x93e6e1, 0x15aa1a,
+      0x1933ec, 0x9f7f17, 0xa18139, 0x27cdc2, 0x2b5434, 0xad18cf,
+      0x3267d8, 0xb42b23, 0xb8b2d5, 0x3efe2e, 0xc54e89, 0x430272,
+      0x4f9b84, 0xc9d77f, 0x56a868, 0xd0e493, 0xdc7d65, 0x5a319e,
+      0x64cfb0, 0xe2834b, 0xee1abd, 0x685646, 0xf72951, 0x7165aa,
+      0x7dfc5c, 0xfbb0a7, 0x0cd1e9, 0x8a9d12, 0x8604e4, 0x00481f,
+      0x9f3708, 0x197bf3, 0x15e205, 0x93aefe, 0xad50d0, 0x2b1c2b,
+      0x2785dd, 0xa1c926, 0x3eb631, 0xb8faca, 0xb4633c, 0x322fc7,
+      0xc99f60, 0x4fd39b, 0x434a6d, 0xc50696, 0x5a7981, 0xdc357a,
+      0xd0ac8c, 0x56e077, 0x681e59, 0xee52a2, 0xe2cb54, 0x6487af,
+      0xfbf8b8, 0x7db443, 0x712db5, 0xf7614e, 0x19a3d2, 0x9fef29,
+      0x9376df, 0x153a24, 0x8a4533, 0x0c09c8, 0x00903e, 0x86dcc5,
+      0xb822eb, 0x3e6e10, 0x32f7e6, 0xb4bb1d, 0x2bc40a, 0xad88f1,
+      0xa11107, 0x275dfc, 0xdced5b, 0x5aa1a0, 0x563856, 0xd074ad,
+      0x4f0bba, 0xc94741, 0xc5deb7, 0x43924c, 0x7d6c62, 0xfb2099,
+      0xf7b96f, 0x71f594, 0xee8a83, 0x68c678, 0x645f8e, 0xe21375,
+      0x15723b, 0x933ec0, 0x9fa736, 0x19ebcd, 0x8694da, 0x00d821,
+      0x0c41d7, 0x8a0d2c, 0xb4f302, 0x32bff9, 0x3e260f, 0xb86af4,
+      0x2715e3, 0xa15918, 0xadc0ee, 0x2b8c15, 0xd03cb2, 0x567049,
+      0x5ae9bf, 0xdca544, 0x43da53, 0xc596a8, 0xc90f5e, 0x4f43a5,
+      0x71bd8b, 0xf7f170, 0xfb6886, 0x7d247d, 0xe25b6a, 0x641791,
+      0x688e67, 0xeec29c, 0x3347a4, 0xb50b5f, 0xb992a9, 0x3fde52,
+      0xa0a145, 0x26edbe, 0x2a7448, 0xac38b3, 0x92c69d, 0x148a66,
+      0x181390, 0x9e5f6b, 0x01207c, 0x876c87, 0x8bf571, 0x0db98a,
+      0xf6092d, 0x7045d6, 0x7cdc20, 0xfa90db, 0x65efcc, 0xe3a337,
+      0xef3ac1, 0x69763a, 0x578814, 0xd1c4ef, 0xdd5d19, 0x5b11e2,
+      0xc46ef5, 0x42220e, 0x4ebbf8, 0xc8f703, 0x3f964d, 0xb9dab6,
+      0xb54340, 0x330fbb, 0xac70ac, 0x2a3c57, 0x26a5a1, 0xa0e95a,
+      0x9e1774, 0x185b8f, 0x14c279, 0x928e82, 0x0df195, 0x8bbd6e,
+      0x872498, 0x016863, 0xfad8c4, 0x7c943f, 0x700dc9, 0xf64132,
+      0x693e25, 0xef72de, 0xe3eb28, 0x65a7d3, 0x5b59fd, 0xdd1506,
+      0xd18cf0, 0x57c00b, 0xc8bf1c, 0x4ef3e7, 0x426a11, 0xc426ea,
+      0x2ae476, 0xaca88d, 0xa0317b, 0x267d80, 0xb90297, 0x3f4e6c,
+      0x33d79a, 0xb59b61, 0x8b654f, 0x0d29b4, 0x01b042, 0x87fcb9,
+      0x1883ae, 0x9ecf55, 0x9256a3, 0x141a58, 0xefaaff, 0x69e604,
+      0x657ff2, 0xe33309, 0x7c4c1e, 0xfa00e5, 0xf69913, 0x70d5e8,
+      0x4e2bc6, 0xc8673d, 0xc4fecb, 0x42b230, 0xddcd27, 0x5b81dc,
+      0x57182a, 0xd154d1, 0x26359f, 0xa07964, 0xace092, 0x2aac69,
+      0xb5d37e, 0x339f85, 0x3f0673, 0xb94a88, 0x87b4a6, 0x01f85d,
+      0x0d61ab, 0x8b2d50, 0x145247, 0x921ebc, 0x9e874a, 0x18cbb1,
+      0xe37b16, 0x6537ed, 0x69ae1b, 0xefe2e0, 0x709df7, 0xf6d10c,
+      0xfa48fa, 0x7c0401, 0x42fa2f, 0xc4b6d4, 0xc82f22, 0x4e63d9,
+      0xd11cce, 0x575035, 0x5bc9c3, 0xdd8538
+    },
+    {
+      0x000000, 0x668f48, 0xcd1e90, 0xab91d8, 0x1c71db, 0x7afe93,
+      0xd16f4b, 0xb7e003, 0x38e3b6, 0x5e6cfe, 0xf5fd26, 0x93726e,
+      0x24926d, 0x421d25, 0xe98cfd, 0x8f03b5, 0x71c76c, 0x174824,
+      0xbcd9fc, 0xda56b4, 0x6db6b7, 0x0b39ff, 0xa0a827, 0xc6276f,
+      0x4924da, 0x2fab92, 0x843a4a, 0xe2b502, 0x555501, 0x33da49,
+      0x984b91, 0xfec4d9, 0xe38ed8, 0x850190, 0x2e9048, 0x481f00,
+      0xffff03, 0x99704b, 0x32e193, 0x546edb, 0xdb6d6e, 0xbde226,
+      0x1673fe, 0x70fcb6, 0xc71cb5, 0xa193fd, 0x0a0225, 0x6c8d6d,
+      0x9249b4, 0xf4c6fc, 0x5f5724, 0x39d86c, 0x8e386f, 0xe8b727,
+      0x4326ff, 0x25a9b7, 0xaaaa02, 0xcc254a, 0x67b492, 0x013bda,
+      0xb6dbd9, 0xd05491, 0x7bc549, 0x1d4a01, 0x41514b, 0x27de03,
+      0x8c4fdb, 0xeac093, 0x5d2090, 0x3bafd8, 0x903e00, 0xf6b148,
+      0x79b2fd, 0x1f3db5, 0xb4ac6d, 0xd22325, 0x65c326, 0x034c6e,
+      0xa8ddb6, 0xce52fe, 0x309627, 0x56196f, 0xfd88b7, 0x9b07ff,
+      0x2ce7fc, 0x4a68b4, 0xe1f96c, 0x877624, 0x087591, 0x6efad9,
+      0xc56b01, 0xa3e449, 0x14044a, 0x728b02, 0xd91ada, 0xbf9592,
+      0xa2df93, 0xc450db, 0x6fc103, 0x094e4b, 0xbeae48, 0xd82100,
+      0x73b0d8, 0x153f90, 0x9a3c25, 0xfcb36d, 0x5722b5, 0x31adfd,
+      0x864dfe, 0xe0c2b6, 0x4b536e, 0x2ddc26, 0xd318ff, 0xb597b7,
+      0x1e066f, 0x788927, 0xcf6924, 0xa9e66c, 0x0277b4, 0x64f8fc,
+      0xebfb49, 0x8d7401, 0x26e5d9, 0x406a91, 0xf78a92, 0x9105da,
+      0x3a9402, 0x5c1b4a, 0x82a296, 0xe42dde, 0x4fbc06, 0x29334e,
+      0x9ed34d, 0xf85c05, 0x53cddd, 0x354295, 0xba4120, 0xdcce68,
+      0x775fb0, 0x11d0f8, 0xa630fb, 0xc0bfb3, 0x6b2e6b, 0x0da123,
+      0xf365fa, 0x95eab2, 0x3e7b6a, 0x58f422, 0xef1421, 0x899b69,
+      0x220ab1, 0x4485f9, 0xcb864c, 0xad0904, 0x0698dc, 0x601794,
+      0xd7f797, 0xb178df, 0x1ae907, 0x7c664f, 0x612c4e, 0x07a306,
+      0xac32de, 0xcabd96, 0x7d5d95, 0x1bd2dd, 0xb04305, 0xd6cc4d,
+      0x59cff8, 0x3f40b0, 0x94d168, 0xf25e20, 0x45be23, 0x23316b,
+      0x88a0b3, 0xee2ffb, 0x10eb22, 0x76646a, 0xddf5b2, 0xbb7afa,
+      0x0c9af9, 0x6a15b1, 0xc18469, 0xa70b21, 0x280894, 0x4e87dc,
+      0xe51604, 0x83994c, 0x34794f, 0x52f607, 0xf967df, 0x9fe897,
+      0xc3f3dd, 0xa57c95, 0x0eed4d, 0x686205, 0xdf8206, 0xb90d4e,
+      0x129c96, 0x7413de, 0xfb106b, 0x9d9f23, 0x360efb, 0x5081b3,
+      0xe761b0, 0x81eef8, 0x2a7f20, 0x4cf068, 0xb234b1, 0xd4bbf9,
+      0x7f2a21, 0x19a569, 0xae456a, 0xc8ca22, 0x635bfa, 0x05d4b2,
+      0x8ad707, 0xec584f, 0x47c997, 0x2146df, 0x96a6dc, 0xf02994,
+      0x5bb84c, 0x3d3704, 0x207d05, 0x46f24d, 0xed6395, 0x8becdd,
+      0x3c0cde, 0x5a8396, 0xf1124e, 0x979d06, 0x189eb3, 0x7e11fb,
+      0xd58023, 0xb30f6b, 0x04ef68, 0x626020, 0xc9f1f8, 0xaf7eb0,
+      0x51ba69, 0x373521, 0x9ca4f9, 0xfa2bb1, 0x4dcbb2, 0x2b44fa,
+      0x80d522, 0xe65a6a, 0x6959df, 0x0fd697, 0xa4474f, 0xc2c807,
+      0x752804, 0x13a74c, 0xb83694, 0xdeb9dc
+    },
+    {
+      0x000000, 0x8309d7, 0x805f55, 0x035682, 0x86f251, 0x05fb86,
+      0x06ad04, 0x85a4d3, 0x8ba859, 0x08a18e, 0x0bf70c, 0x88fedb,
+      0x0d5a08, 0x8e53df, 0x8d055d, 0x0e0c8a, 0x911c49, 0x12159e,
+      0x11431c, 0x924acb, 0x17ee18, 0x94e7cf, 0x97b14d, 0x14b89a,
+      0x1ab410, 0x99bdc7, 0x9aeb45, 0x19e292, 0x9c4641, 0x1f4f96,
+      0x1c1914, 0x9f10c3, 0xa47469, 0x277dbe, 0x242b3c, 0xa722eb,
+      0x228638, 0xa18fef, 0xa2d96d, 0x21d0ba, 0x2fdc30, 0xacd5e7,
+      0xaf8365, 0x2c8ab2, 0xa92e61, 0x2a27b6, 0x297134, 0xaa78e3,
+      0x356820, 0xb661f7, 0xb53775, 0x363ea2, 0xb39a71, 0x3093a6,
+      0x33c524, 0xb0ccf3, 0xbec079, 0x3dc9ae, 0x3e9f2c, 0xbd96fb,
+      0x383228, 0xbb3bff, 0xb86d7d, 0x3b64aa, 0xcea429, 0x4dadfe,
+      0x4efb7c, 0xcdf2ab, 0x485678, 0xcb5faf, 0xc8092d, 0x4b00fa,
+      0x450c70, 0xc605a7, 0xc55325, 0x465af2, 0xc3fe21, 0x40f7f6,
+      0x43a174, 0xc0a8a3, 0x5fb860, 0xdcb1b7, 0xdfe735, 0x5ceee2,
+      0xd94a31, 0x5a43e6, 0x591564, 0xda1cb3, 0xd41039, 0x5719ee,
+      0x544f6c, 0xd746bb, 0x52e268, 0xd1ebbf, 0xd2bd3d, 0x51b4ea,
+      0x6ad040, 0xe9d997, 0xea8f15, 0x6986c2, 0xec2211, 0x6f2bc6,
+      0x6c7d44, 0xef7493, 0xe17819, 0x6271ce, 0x61274c, 0xe22e9b,
+      0x678a48, 0xe4839f, 0xe7d51d, 0x64dcca, 0xfbcc09, 0x78c5de,
+      0x7b935c, 0xf89a8b, 0x7d3e58, 0xfe378f, 0xfd610d, 0x7e68da,
+      0x706450, 0xf36d87, 0xf03b05, 0x7332d2, 0xf69601, 0x759fd6,
+      0x76c954, 0xf5c083, 0x1b04a9, 0x980d7e, 0x9b5bfc, 0x18522b,
+      0x9df6f8, 0x1eff2f, 0x1da9ad, 0x9ea07a, 0x90acf0, 0x13a527,
+      0x10f3a5, 0x93fa72, 0x165ea1, 0x955776, 0x9601f4, 0x150823,
+      0x8a18e0, 0x091137, 0x0a47b5, 0x894e62, 0x0ceab1, 0x8fe366,
+      0x8cb5e4, 0x0fbc33, 0x01b0b9, 0x82b96e, 0x81efec, 0x02e63b,
+      0x8742e8, 0x044b3f, 0x071dbd, 0x84146a, 0xbf70c0, 0x3c7917,
+      0x3f2f95, 0xbc2642, 0x398291, 0xba8b46, 0xb9ddc4, 0x3ad413,
+      0x34d899, 0xb7d14e, 0xb487cc, 0x378e1b, 0xb22ac8, 0x31231f,
+      0x32759d, 0xb17c4a, 0x2e6c89, 0xad655e, 0xae33dc, 0x2d3a0b,
+      0xa89ed8, 0x2b970f, 0x28c18d, 0xabc85a, 0xa5c4d0, 0x26cd07,
+      0x259b85, 0xa69252, 0x233681, 0xa03f56, 0xa369d4, 0x206003,
+      0xd5a080, 0x56a957, 0x55ffd5, 0xd6f602, 0x5352d1, 0xd05b06,
+      0xd30d84, 0x500453, 0x5e08d9, 0xdd010e, 0xde578c, 0x5d5e5b,
+      0xd8fa88, 0x5bf35f, 0x58a5dd, 0xdbac0a, 0x44bcc9, 0xc7b51e,
+      0xc4e39c, 0x47ea4b, 0xc24e98, 0x41474f, 0x4211cd, 0xc1181a,
+      0xcf1490, 0x4c1d47, 0x4f4bc5, 0xcc4212, 0x49e6c1, 0xcaef16,
+      0xc9b994, 0x4ab043, 0x71d4e9, 0xf2dd3e, 0xf18bbc, 0x72826b,
+      0xf726b8, 0x742f6f, 0x7779ed, 0xf4703a, 0xfa7cb0, 0x797567,
+      0x7a23e5, 0xf92a32, 0x7c8ee1, 0xff8736, 0xfcd1b4, 0x7fd863,
+      0xe0c8a0, 0x63c177, 0x6097f5, 0xe39e22, 0x663af1, 0xe53326,
+      0xe665a4, 0x656c73, 0x6b60f9, 0xe8692e, 0xeb3fac, 0x68367b,
+      0xed92a8, 0x6e9b7f, 0x6dcdfd, 0xeec42a
+    }
+  };
+
+
+/* Update the CRC-24 checksum CRC with the byte B.  */
+#define crc24_putc(crc,b) \
+            ((((crc) << 8) ^ crc24tab[0][(((crc) >> 16) ^ (b)) & 0xff]) \
+             & 0xffffff)
+
+/* Update the CRC-24 checksum CRC with the three bytes at P.  */
+#define crc24_put3(crc,p) \
+            (crc24tab[2][(((crc) >> 16) ^ (p)[0]) & 0xff]  \
+             ^ crc24tab[1][(((crc) >> 8) ^ (p)[1]) & 0xff] \
+             ^ crc24tab[0][((crc) ^ (p)[2]) & 0xff])
+
+
+/* Return the start of the first line in the LENGTH bytes at IMAGE
+   which begins with the string PREFIX or NULL if there is no such
+   line.  */
+static const char *
+find_line (const char *image, size_t length, const char *prefix)
+{
+  const char *end = image + length;
+  const char *s;
+  size_t n = strlen (prefix);
+
+  for (s = image; s && (size_t) (end - s) >= n; )
+    {
+      if (!memcmp (s, prefix, n))
+        return s;
+      s = memchr (s, '\n', end - s);
+      if (s)
+        s++;
+    }
+  return NULL;
+}
+
+
+/* Return the start of the line following the one at S or END if
+   there is none.  */
+static const char *
+next_line (const char *s, const char *end)
+{
+  s = memchr (s, '\n', end - s);
+  return s ? s + 1 : end;
+}
+
+
+/* Return true if the line at S (not including its terminator)
+   consists only of whitespace.  */
+static int
+blank_line_p (const char *s, const char *end)
+{
+  for (; s < end && *s != '\n'; s++)
+    if (b64tab[(unsigned char) *s] != B64_SKIP)
+      return 0;
+  return 1;
+}
+
+
+/* Check whether the LENGTH bytes at IMAGE are an ASCII armored
+   message and return its type.  A binary OpenPGP message always
+   starts with an octet having the high bit set, thus we only need
+   to look for the armor line if this is not the case.  */
+enum armor_types
+_tgpg_armor_type (const char *image, size_t length)
+{
+  const char *s;
+
+  if (!length || (*(const unsigned char *) image & 0x80))
+    return ARMOR_NONE;
+
+  s = find_line (image, length, BEGIN_LINE);
+  if (!s)
+    return ARMOR_NONE;
+  s += strlen (BEGIN_LINE);
+  if ((size_t) (image + length - s) >= strlen ("SIGNED MESSAGE" LINE_TAIL)
+      && !memcmp (s, "SIGNED MESSAGE" LINE_TAIL,
+                  strlen ("SIGNED MESSAGE" LINE_TAIL)))
+    return ARMOR_CLEARSIGNED;
+  return ARMOR_RADIX64;
+}
+
+
+/* Decode the radix-64 data of the armored message in BUF and replace
+   the content of BUF by the decoded binary message.  Whitespace and
+   line breaks are ignored and the CRC-24 checksum is computed while
+   decoding; if the armor carries a checksum line, it is verified.
+   Returns 0 on success.  */
+int
+_tgpg_dearmor (bufdesc_t buf)
+{
+  int rc;
+  const unsigned char *s, *end;
+  unsigned char *buffer, *d;
+  uint32_t crc = CRC24_INIT;
+  uint32_t val;
+  unsigned int c0, c1, c2, c3;
+  size_t allocated;
+  int n;
+
+  if (_tgpg_armor_type (buf->image, buf->length) != ARMOR_RADIX64)
+    return TGPG_INV_DATA;
+
+  end = (const unsigned char *) buf->image + buf->length;
+  s = (const unsigned char *) find_line (buf->image, buf->length, BEGIN_LINE);
+
+  /* Skip the armor line and the armor headers.  The headers end at
+     an empty line; we also accept a missing empty line if the data
+     starts right away.  */
+  s = (const unsigned char *) next_line ((const char *) s, (const char *) end);
+  while (s < end && !blank_line_p ((const char *) s, (const char *) end))
+    {
+      const char *eol = next_line ((const char *) s, (const char *) end);
+
+      if (!memchr (s, ':', eol - (const char *) s))
+        break;
+      s = (const unsigned char *) eol;
+    }
+
+  /* Every four characters of radix-64 data yield three bytes.  */
+  allocated = (end - s) / 4 * 3 + 3;
+  buffer = d = xtrymalloc (allocated);
+  if (!buffer)
+    return TGPG_SYSERROR;
+
+  val = 0;
+  n = 0;
+  while (s < end)
+    {
+      /* The fast path: decode whole quads as long as they consist of
+         valid characters.  This covers all but the last few
+         characters of each line.  */
+      if (!n)
+        while (end - s >= 4
+               && !(((c0 = b64tab[s[0]]) | (c1 = b64tab[s[1]])
+                     | (c2 = b64tab[s[2]]) | (c3 = b64tab[s[3]])) & 0xc0))
+          {
+            val = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
+            d[0] = val >> 16;
+            d[1] = val >> 8;
+            d[2] = val;
+            crc = crc24_put3 (crc, d);
+            d += 3;
+            s += 4;
+          }
+      if (s == end)
+        break;
+
+      c0 = b64tab[*s];
+      if (c0 == B64_SKIP)
+        {
+          s++;
+          continue;
+        }
+      if (c0 & B64_INVALID)
+        break;  /* Padding, checksum or end of the armor.  */
+
+      val = (val << 6) | c0;
+      s++;
+      if (++n == 4)
+        {
+          d[0] = val >> 16;
+          d[1] = val >> 8;
+          d[2] = val;
+          crc = crc24_put3 (crc, d);
+          d += 3;
+          val = 0;
+          n = 0;
+        }
+    }
+
+  /* Flush an incomplete quad and skip its padding.  */
+  if (n == 1)
+    {
+      rc = TGPG_INV_DATA;
+      goto leave;
+    }
+  if (n)
+    {
+      val <<= 6 * (4 - n);
+      *d = val >> 16;
+      crc = crc24_putc (crc, *d);
+      d++;
+      if (n == 3)
+        {
+          *d = val >> 8;
+          crc = crc24_putc (crc, *d);
+          d++;
+        }
+      for (; n < 4 && s < end && *s == '='; n++)
+        s++;
+    }
+
+  while (s < end && b64tab[*s] == B64_SKIP)
+    s++;
+
+  /* The checksum is optional.  */
+  if (s < end && *s == '=')
+    {
+      s++;
+      if (end - s < 4
+          || ((c0 = b64tab[s[0]]) | (c1 = b64tab[s[1]])
+              | (c2 = b64tab[s[2]]) | (c3 = b64tab[s[3]])) & 0xc0)
+        {
+          rc = TGPG_INV_DATA;
+          goto leave;
+        }
+      if (((c0 << 18) | (c1 << 12) | (c2 << 6) | c3) != crc)
+        {
+          rc = TGPG_INV_DATA;
+          goto leave;
+        }
+      s += 4;
+      while (s < end && b64tab[*s] == B64_SKIP)
+        s++;
+    }
+
+  if ((size_t) (end - s) < strlen (END_LINE)
+      || memcmp (s, END_LINE, strlen (END_LINE)))
+    {
+      rc = TGPG_INV_DATA;
+      goto leave;
+    }
+
+  xfree (buf->buffer);
+  buf->buffer = (char *) buffer;
+  buf->allocated = allocated;
+  buf->image = buf->buffer;
+  buf->length = d - buffer;
+  return 0;
+
+ leave:
+  xfree (buffer);
+  return rc;
+}
+
+
+/* Copy the string S to D and return a pointer to the end of the
+   copy.  */
+static char *
+append (char *d, const char *s)
+{
+  size_t n = strlen (s);
+
+  memcpy (d, s, n);
+  return d + n;
+}
+
+
+/* Replace the content of BUF by its ASCII armored form using LABEL
+   (e.g. "MESSAGE") for the armor lines.  Returns 0 on success.  */
+int
+_tgpg_enarmor (bufdesc_t buf, const char *label)
+{
+  const unsigned char *s, *end;
+  char *buffer, *d;
+  uint32_t crc = CRC24_INIT;
+  uint32_t val;
+  size_t length, nlines, allocated;
+  int n;
+
+  length = buf->length;
+  nlines = (length + LINE_LENGTH / 4 * 3 - 1) / (LINE_LENGTH / 4 * 3);
+  allocated = (strlen (BEGIN_LINE) + strlen (label) + strlen (LINE_TAIL) + 2
+               + (length + 2) / 3 * 4 + nlines
+               + 6 /* checksum line */
+               + strlen (END_LINE) + strlen (label) + strlen (LINE_TAIL) + 1);
+  buffer = d = xtrymalloc (allocated);
+  if (!buffer)
+    return TGPG_SYSERROR;
+
+  d = append (append (append (d, BEGIN_LINE), label), LINE_TAIL);
+  *d++ = '\n';
+  *d++ = '\n';
+
+  s = (const unsigned char *) buf->image;
+  end = s + length;
+  n = 0;
+  while (end - s >= 3)
+    {
+      crc = crc24_put3 (crc, s);
+      val = (s[0] << 16) | (s[1] << 8) | s[2];
+      d[0] = b64chars[val >> 18];
+      d[1] = b64chars[(val >> 12) & 0x3f];
+      d[2] = b64chars[(val >> 6) & 0x3f];
+      d[3] = b64chars[val & 0x3f];
+      d += 4;
+      s += 3;
+      if ((n += 4) == LINE_LENGTH)
+        {
+          *d++ = '\n';
+          n = 0;
+        }
+    }
+  if (s < end)
+    {
+      crc = crc24_putc (crc, s[0]);
+      val = s[0] << 16;
+      if (end - s == 2)
+        {
+          crc = crc24_putc (crc, s[1]);
+          val |= s[1] << 8;
+        }
+      d[0] = b64chars[val >> 18];
+      d[1] = b64chars[(val >> 12) & 0x3f];
+      d[2] = end - s == 2 ? b64chars[(val >> 6) & 0x3f] : '=';
+      d[3] = '=';
+      d += 4;
+      n += 4;
+    }
+  if (n)
+    *d++ = '\n';
+
+  *d++ = '=';
+  *d++ = b64chars[crc >> 18];
+  *d++ = b64chars[(crc >> 12) & 0x3f];
+  *d++ = b64chars[(crc >> 6) & 0x3f];
+  *d++ = b64chars[crc & 0x3f];
+  *d++ = '\n';
+
+  d = append (append (append (d, END_LINE), label), LINE_TAIL);
+  *d++ = '\n';
+  assert (d - buffer == allocated);
+
+  xfree (buf->buffer);
+  buf->buffer = buffer;
+  buf->allocated = allocated;
+  buf->image = buf->buffer;
+  buf->length = allocated;
+  return 0;
+}
@@ -0,0 +1,36 @@
+/* armor.h - OpenPGP ASCII armor
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#ifndef ARMOR_H
+#define ARMOR_H
+
+/* The kinds of ASCII armor we distinguish.  */
+enum armor_types
+  {
+    ARMOR_NONE        = 0,  /* Not armored (i.e. binary).  */
+    ARMOR_RADIX64     = 1,  /* Radix-64 encoded packets.  */
+    ARMOR_CLEARSIGNED = 2   /* A cleartext signature.  */
+  };
+
+enum armor_types _tgpg_armor_type (const char *image, size_t length);
+int _tgpg_dearmor (bufdesc_t buf);
+int _tgpg_enarmor (bufdesc_t buf, const char *label);
+
+#endif /*ARMOR_H*/
@@ -0,0 +1,385 @@
+/* compress.c - Compression of OpenPGP messages
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#ifdef HAVE_ZIP
+# include <zlib.h>
+#endif
+#ifdef HAVE_BZIP2
+# include <bzlib.h>
+#endif
+
+#include "tgpgdefs.h"
+#include "compress.h"
+
+/* The amount of output we always allow regardless of the ratio
+   limit.  Small messages may well have a large compression ratio.  */
+#define MIN_OUTPUT_LIMIT  (1024 * 1024)
+
+/* The initial size of the output buffer relative to the input.  */
+#define INITIAL_RATIO     4
+
+/* When compressing, the first SAMPLE_SIZE bytes are used to decide
+   whether the data is compressible at all.  */
+#define SAMPLE_SIZE       (64 * 1024)
+
+
+/* An input cursor over a list of segments.  */
+struct input_s
+{
+  const struct segment_s *segs;
+  size_t nsegs;
+  size_t idx;           /* The current segment.  */
+  size_t off;           /* The offset into the current segment.  */
+};
+
+
+/* Return the next chunk of at most MAX bytes, which must not exceed
+   UINT_MAX, from the input IN and store its address at R_PTR.
+   Returns 0 at the end of the input.  */
+static unsigned int
+next_input (struct input_s *in, size_t max, char **r_ptr)
+{
+  size_t n;
+
+  while (in->idx < in->nsegs && in->off == in->segs[in->idx].length)
+    {
+      in->idx++;
+      in->off = 0;
+    }
+  if (in->idx == in->nsegs)
+    return 0;
+
+  n = in->segs[in->idx].length - in->off;
+  if (n > max)
+    n = max;
+  *r_ptr = in->segs[in->idx].data + in->off;
+  in->off += n;
+  return n;
+}
+
+
+/* Return the number of bytes of free space in OUT, which is at most
+   UINT_MAX, and store its address at R_PTR.  The buffer is enlarged
+   if it is full, but never beyond LIMIT bytes.  */
+static int
+next_output (bufdesc_t out, size_t limit, char **r_ptr, unsigned int *r_len)
+{
+  size_t n;
+  char *buf;
+
+  if (out->length == out->allocated)
+    {
+      if (out->allocated == limit)
+        return TGPG_TOO_LARGE;
+
+      n = out->allocated * 2;
+      if (n < out->allocated || n > limit)
+        n = limit;
+      buf = xtryrealloc (out->buffer, n);
+      if (!buf)
+        return TGPG_SYSERROR;
+      out->buffer = buf;
+      out->image = buf;
+      out->allocated = n;
+    }
+
+  n = out->allocated - out->length;
+  if (n > UINT_MAX)
+    n = UINT_MAX;
+  *r_ptr = out->buffer + out->length;
+  *r_len = n;
+  return 0;
+}
+
+
+#ifdef HAVE_ZIP
+/* Inflate the ZIP (raw deflate) or ZLIB compressed data from IN into
+   OUT.  */
+static int
+do_inflate (int algo, struct input_s *in, bufdesc_t out, size_t limit)
+{
+  int rc = 0;
+  int zrc;
+  z_stream zs;
+  char *ptr;
+  unsigned int len;
+
+  memset (&zs, 0, sizeof zs);
+  /* ZIP is a raw deflate stream, which is indicated by negative
+     window bits.  We accept at most the largest window deflate
+     defines, so that the memory used for inflating is bounded.  */
+  zrc = inflateInit2 (&zs, algo == COMPRESS_ALGO_ZIP ? -MAX_WBITS : MAX_WBITS);
+  if (zrc != Z_OK)
+    return zrc == Z_MEM_ERROR ? TGPG_SYSERROR : TGPG_BUG;
+
+  do
+    {
+      if (!zs.avail_in)
+        {
+          zs.avail_in = next_input (in, UINT_MAX, &ptr);
+          zs.next_in = (Bytef *) ptr;
+          if (!zs.avail_in)
+            {
+              rc = TGPG_INV_DATA;  /* Truncated.  */
+              break;
+            }
+        }
+
+      rc = next_output (out, limit, &ptr, &len);
+      if (rc)
+        break;
+      zs.next_out = (Bytef *) ptr;
+      zs.avail_out = len;
+
+      zrc = inflate (&zs, Z_NO_FLUSH);
+      out->length += len - zs.avail_out;
+      if (zrc == Z_MEM_ERROR)
+        rc = TGPG_SYSERROR;
+      else if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR)
+        rc = TGPG_INV_DATA;
+    }
+  while (!rc && zrc != Z_STREAM_END);
+
+  inflateEnd (&zs);
+  return rc;
+}
+#endif /*HAVE_ZIP*/
+
+
+#ifdef HAVE_ZIP
+/* Deflate the LENGTH bytes of input IN using the ZIP (raw deflate)
+   or ZLIB format and the compression LEVEL and append the result to
+   OUT.  */
+static int
+do_deflate (int algo, int level, struct input_s *in, size_t length,
+            bufdesc_t out)
+{
+  int rc = 0;
+  int zrc, flush;
+  z_stream zs;
+  size_t start = out->length;
+  size_t left = length;
+  char *ptr;
+  unsigned int len;
+  int sampling;
+
+  memset (&zs, 0, sizeof zs);
+  zrc = deflateInit2 (&zs, level, Z_DEFLATED,
+                      algo == COMPRESS_ALGO_ZIP ? -MAX_WBITS : MAX_WBITS,
+                      8, Z_DEFAULT_STRATEGY);
+  if (zrc != Z_OK)
+    return zrc == Z_MEM_ERROR ? TGPG_SYSERROR : TGPG_INV_VAL;
+
+  /* The sample is fed and flushed on its own, so that we can tell
+     how well it compressed.  Short data is simply compressed.  */
+  sampling = length > SAMPLE_SIZE;
+
+  do
+    {
+      if (!zs.avail_in && left)
+        {
+          zs.avail_in = next_input (in, (sampling
+                                         ? SAMPLE_SIZE - (length - left)
+                                         : UINT_MAX), &ptr);
+          zs.next_in = (Bytef *) ptr;
+          left -= zs.avail_in;
+        }
+      if (sampling)
+        flush = length - left == SAMPLE_SIZE ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+      else
+        flush = left ? Z_NO_FLUSH : Z_FINISH;
+
+      rc = next_output (out, (size_t) -1, &ptr, &len);
+      if (rc)
+        break;
+      zs.next_out = (Bytef *) ptr;
+      zs.avail_out = len;
+
+      zrc = deflate (&zs, flush);
+      out->length += len - zs.avail_out;
+      if (zrc == Z_STREAM_ERROR)
+        rc = TGPG_BUG;
+      else if (flush == Z_SYNC_FLUSH && !zs.avail_in && zs.avail_out)
+        {
+          /* The sample has been flushed.  Give up if it did not
+             shrink by at least 1/16.  */
+          if (zs.total_out > SAMPLE_SIZE - SAMPLE_SIZE / 16)
+            {
+              out->length = start;
+              break;
+            }
+          sampling = 0;
+        }
+    }
+  while (!rc && zrc != Z_STREAM_END);
+
+  deflateEnd (&zs);
+  return rc;
+}
+#endif /*HAVE_ZIP*/
+
+
+#ifdef HAVE_BZIP2
+/* Decompress the BZIP2 compressed data from IN into OUT.  */
+static int
+do_bunzip2 (struct input_s *in, bufdesc_t out, size_t limit)
+{
+  int rc = 0;
+  int bzrc;
+  bz_stream bs;
+  char *ptr;
+  unsigned int len;
+
+  memset (&bs, 0, sizeof bs);
+  bzrc = BZ2_bzDecompressInit (&bs, 0, 0);
+  if (bzrc != BZ_OK)
+    return bzrc == BZ_MEM_ERROR ? TGPG_SYSERROR : TGPG_BUG;
+
+  do
+    {
+      if (!bs.avail_in)
+        {
+          bs.avail_in = next_input (in, UINT_MAX, &bs.next_in);
+          if (!bs.avail_in)
+            {
+              rc = TGPG_INV_DATA;  /* Truncated.  */
+              break;
+            }
+        }
+
+      rc = next_output (out, limit, &ptr, &len);
+      if (rc)
+        break;
+      bs.next_out = ptr;
+      bs.avail_out = len;
+
+      bzrc = BZ2_bzDecompress (&bs);
+      out->length += len - bs.avail_out;
+      if (bzrc == BZ_MEM_ERROR)
+        rc = TGPG_SYSERROR;
+      else if (bzrc != BZ_OK && bzrc != BZ_STREAM_END)
+        rc = TGPG_INV_DATA;
+    }
+  while (!rc && bzrc != BZ_STREAM_END);
+
+  BZ2_bzDecompressEnd (&bs);
+  return rc;
+}
+#endif /*HAVE_BZIP2*/
+
+
+/* Decompress the data described by the NSEGS segments at SEGS using
+   the OpenPGP compression algorithm ALGO and store the result in the
+   empty buffer OUT.  The data is processed a segment at a time and
+   the output buffer grows as needed.  If MAX_RATIO is not zero,
+   decompression is aborted with TGPG_TOO_LARGE as soon as the output
+   exceeds MAX_RATIO times the size of the input; this protects
+   against compression bombs.  */
+int
+_tgpg_decompress (int algo, const struct segment_s *segs, size_t nsegs,
+                  unsigned int max_ratio, bufdesc_t out)
+{
+  struct input_s in = { segs, nsegs, 0, 0 };
+  size_t i, inlen, limit, initial;
+
+  for (inlen = i = 0; i < nsegs; i++)
+    inlen += segs[i].length;
+
+  limit = (size_t) -1;
+  if (max_ratio)
+    {
+      if (inlen <= limit / max_ratio)
+        limit = inlen * max_ratio;
+      if (limit < MIN_OUTPUT_LIMIT)
+        limit = MIN_OUTPUT_LIMIT;
+    }
+
+  /* Start with a buffer large enough for typical compression ratios,
+     so that it rarely needs to be reallocated.  */
+  initial = inlen <= limit / INITIAL_RATIO ? inlen * INITIAL_RATIO : limit;
+  if (!initial)
+    initial = 1;
+  out->buffer = xtrymalloc (initial);
+  if (!out->buffer)
+    return TGPG_SYSERROR;
+  out->image = out->buffer;
+  out->allocated = initial;
+  out->length = 0;
+
+  switch (algo)
+    {
+#ifdef HAVE_ZIP
+    case COMPRESS_ALGO_ZIP:
+    case COMPRESS_ALGO_ZLIB:
+      return do_inflate (algo, &in, out, limit);
+#endif
+#ifdef HAVE_BZIP2
+    case COMPRESS_ALGO_BZIP2:
+      return do_bunzip2 (&in, out, limit);
+#endif
+    default:
+      return TGPG_INV_ALGO;
+    }
+}
+
+
+/* Compress the data described by the NSEGS segments at SEGS using
+   the OpenPGP compression algorithm ALGO and the compression LEVEL
+   (-1 for the default) and store the result in the empty buffer OUT
+   after OFFSET bytes left free for the caller.  The data is read a
+   segment at a time and OUT grows as needed.  If the first part of
+   the data turns out to be incompressible, compression is given up
+   early and OUT is left with just the OFFSET bytes; the data should
+   then be stored uncompressed.  */
+int
+_tgpg_compress (int algo, int level, const struct segment_s *segs,
+                size_t nsegs, size_t offset, bufdesc_t out)
+{
+  struct input_s in = { segs, nsegs, 0, 0 };
+  size_t i, length, initial;
+
+  for (length = i = 0; i < nsegs; i++)
+    length += segs[i].length;
+
+  initial = offset + length / INITIAL_RATIO + 64;
+  out->buffer = xtrymalloc (initial);
+  if (!out->buffer)
+    return TGPG_SYSERROR;
+  out->image = out->buffer;
+  out->allocated = initial;
+  out->length = offset;
+
+  switch (algo)
+    {
+#ifdef HAVE_ZIP
+    case COMPRESS_ALGO_ZIP:
+    case COMPRESS_ALGO_ZLIB:
+      return do_deflate (algo, level, &in, length, out);
+#endif
+    default:
+      return TGPG_INV_ALGO;
+    }
+}
@@ -0,0 +1,30 @@
+/* compress.h - Compression of OpenPGP messages
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+int _tgpg_decompress (int algo, const struct segment_s *segs, size_t nsegs,
+                      unsigned int max_ratio, bufdesc_t out);
+int _tgpg_compress (int algo, int level, const struct segment_s *segs,
+                    size_t nsegs, size_t offset, bufdesc_t out);
+
+#endif /*COMPRESS_H*/
@@ -0,0 +1,580 @@
+/* cryptafalg.c - Bulk CFB using the Linux kernel crypto API.
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+/* This backend passes large CFB requests to the ciphers registered
+   with the kernel crypto API through AF_ALG sockets and takes
+   everything else from the in-process backend it is stacked on.  The
+   input is mapped into a pipe with vmsplice and spliced from there
+   into the operation socket, so that it is not copied through user
+   space; only the result is read back.
+
+   Kernels since 6.10 no longer provide the cfb template.  CFB
+   decryption can still be done using ECB: the plaintext is the
+   ciphertext XORed with the encryption of the ciphertext block before
+   it.  CFB encryption is inherently sequential and is thus done in
+   process on those kernels.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_alg.h>
+
+#include "tgpgdefs.h"
+#include "cryptglue.h"
+
+#ifndef SOL_ALG
+# define SOL_ALG 279
+#endif
+
+/* Requests shorter than this are done in process.  A request to the
+   kernel takes about ten system calls.  */
+#define AFALG_MIN_LENGTH 16384
+
+/* The data is passed to the kernel in chunks of this size, which is
+   the default capacity of a pipe.  */
+#define AFALG_CHUNK 65536
+
+/* The largest block length and key length of the supported ciphers.  */
+#define MAX_BLOCKLEN 16
+#define MAX_KEYLEN 32
+
+/* How the kernel is used for a cipher.  */
+enum kernel_modes
+  {
+    KMODE_UNKNOWN = 0,  /* Not yet probed.  */
+    KMODE_NONE,         /* Not available; everything is done in process.  */
+    KMODE_CFB,          /* Using cfb(ALGO).  */
+    KMODE_ECB           /* Using ecb(ALGO); decryption only.  */
+  };
+
+
+/* The backend providing all other primitives.  Set by
+   _tgpg_crypto_select before calling our init function.  */
+const struct crypto_backend_s *_tgpg_afalg_base;
+
+/* The name of this backend including the one of the base.  */
+static char backend_name[32];
+
+struct afalg_hd_s
+{
+  const struct crypto_backend_s *base; /* The backend owning HD.  */
+  void *hd;                     /* Its handle, used for short data.  */
+  int algo;
+  int mode;
+  size_t blocklen;
+  enum kernel_modes kmode;
+  int tfmfd;                    /* The bound algorithm socket or -1.  */
+  int opfd;                     /* The operation socket or -1.  */
+  int pipefd[2];                /* The pipe to splice through or -1.  */
+  int keyset;                   /* KEY has been set on TFMFD.  */
+  unsigned char key[MAX_KEYLEN];
+  size_t keylen;
+  int tracked;                  /* REG and POS are valid.  */
+  unsigned char reg[MAX_BLOCKLEN]; /* The last BLOCKLEN bytes of the
+                                      ciphertext, starting with the IV.  */
+  size_t pos;                   /* Offset into the current block.  */
+  unsigned char *buffer;        /* AFALG_CHUNK bytes for in-place use.  */
+};
+
+
+/* Return the kernel name of the cipher ALGO or NULL.  */
+static const char *
+kernel_cipher_name (int algo)
+{
+  switch (algo)
+    {
+    case CIPHER_ALGO_3DES:   return "des3_ede";
+    case CIPHER_ALGO_CAST5:  return "cast5";
+    case CIPHER_ALGO_AES:
+    case CIPHER_ALGO_AES192:
+    case CIPHER_ALGO_AES256: return "aes";
+    default: return NULL;
+    }
+}
+
+
+/* Return a socket bound to the skcipher TEMPLATE(NAME) or -1.  */
+static int
+bind_cipher (const char *template, const char *name)
+{
+  struct sockaddr_alg sa;
+  int fd;
+
+  memset (&sa, 0, sizeof sa);
+  sa.salg_family = AF_ALG;
+  strcpy ((char *) sa.salg_type, "skcipher");
+  if (snprintf ((char *) sa.salg_name, sizeof sa.salg_name, "%s(%s)",
+                template, name) >= sizeof sa.salg_name)
+    return -1;
+
+  fd = socket (AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (bind (fd, (struct sockaddr *) &sa, sizeof sa))
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/* Close the kernel resources of HD and do everything in process from
+   now on.  */
+static void
+kernel_release (struct afalg_hd_s *hd)
+{
+  if (hd->opfd != -1)
+    close (hd->opfd);
+  if (hd->tfmfd != -1)
+    close (hd->tfmfd);
+  if (hd->pipefd[0] != -1)
+    {
+      close (hd->pipefd[0]);
+      close (hd->pipefd[1]);
+    }
+  hd->opfd = hd->tfmfd = hd->pipefd[0] = hd->pipefd[1] = -1;
+  hd->kmode = KMODE_NONE;
+}
+
+
+/* Make sure the kernel can be used for HD with the current key.
+   Returns 0 if it can.  */
+static int
+kernel_prepare (struct afalg_hd_s *hd)
+{
+  const char *name;
+
+  if (hd->kmode == KMODE_UNKNOWN)
+    {
+      hd->kmode = KMODE_NONE;
+      name = kernel_cipher_name (hd->algo);
+      if (!name)
+        return -1;
+      if ((hd->tfmfd = bind_cipher ("cfb", name)) != -1)
+        hd->kmode = KMODE_CFB;
+      else if ((hd->tfmfd = bind_cipher ("ecb", name)) != -1)
+        hd->kmode = KMODE_ECB;
+      else
+        return -1;
+    }
+  if (hd->kmode == KMODE_NONE)
+    return -1;
+
+  if (!hd->keyset)
+    {
+      /* The key can't be changed while an operation socket
+         exists.  */
+      if (hd->opfd != -1)
+        close (hd->opfd);
+      hd->opfd = -1;
+      if (setsockopt (hd->tfmfd, SOL_ALG, ALG_SET_KEY, hd->key, hd->keylen)
+          || (hd->opfd = accept4 (hd->tfmfd, NULL, 0, SOCK_CLOEXEC)) == -1)
+        goto fail;
+      hd->keyset = 1;
+    }
+
+  if (hd->pipefd[0] == -1 && pipe2 (hd->pipefd, O_CLOEXEC))
+    {
+      hd->pipefd[0] = hd->pipefd[1] = -1;
+      goto fail;
+    }
+  if (!hd->buffer && !(hd->buffer = xtrymalloc (AFALG_CHUNK)))
+    goto fail;
+  return 0;
+
+ fail:
+  kernel_release (hd);
+  return -1;
+}
+
+
+/* Start a request on the operation socket of HD.  The IV is only
+   sent in CFB mode.  DATA of LENGTH bytes is the first part of the
+   input; MORE tells whether more input follows.  */
+static int
+kernel_start (struct afalg_hd_s *hd, int do_encrypt,
+              const void *data, size_t length, int more)
+{
+  char cbuf[CMSG_SPACE (sizeof (int))
+            + CMSG_SPACE (sizeof (struct af_alg_iv) + MAX_BLOCKLEN)];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct af_alg_iv *aiv;
+  struct iovec iov;
+
+  memset (cbuf, 0, sizeof cbuf);
+  memset (&msg, 0, sizeof msg);
+  msg.msg_control = cbuf;
+  msg.msg_controllen = CMSG_SPACE (sizeof (int));
+  if (hd->kmode == KMODE_CFB)
+    msg.msg_controllen += CMSG_SPACE (sizeof *aiv + hd->blocklen);
+  iov.iov_base = (void *) data;
+  iov.iov_len = length;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  /* With ECB the key stream is computed by encrypting.  */
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_ALG;
+  cmsg->cmsg_type = ALG_SET_OP;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  *(int *) CMSG_DATA (cmsg) = (do_encrypt || hd->kmode == KMODE_ECB)
+    ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+
+  if (hd->kmode == KMODE_CFB)
+    {
+      cmsg = CMSG_NXTHDR (&msg, cmsg);
+      cmsg->cmsg_level = SOL_ALG;
+      cmsg->cmsg_type = ALG_SET_IV;
+      cmsg->cmsg_len = CMSG_LEN (sizeof *aiv + hd->blocklen);
+      aiv = (struct af_alg_iv *) CMSG_DATA (cmsg);
+      aiv->ivlen = hd->blocklen;
+      memcpy (aiv->iv, hd->reg, hd->blocklen);
+    }
+
+  return sendmsg (hd->opfd, &msg, more ? MSG_MORE : 0) == length ? 0 : -1;
+}
+
+
+/* Pass LENGTH bytes at DATA to the operation socket of HD without
+   copying them: vmsplice maps the pages into the pipe and splice
+   moves them on to the socket.  This ends the request.  */
+static int
+kernel_splice (struct afalg_hd_s *hd, const unsigned char *data,
+               size_t length)
+{
+  struct iovec iov;
+  ssize_t n, m;
+
+  while (length)
+    {
+      iov.iov_base = (void *) data;
+      iov.iov_len = length;
+      n = vmsplice (hd->pipefd[1], &iov, 1, 0);
+      if (n <= 0)
+        return -1;
+      data += n;
+      length -= n;
+      while (n)
+        {
+          m = splice (hd->pipefd[0], NULL, hd->opfd, NULL, n,
+                      length ? SPLICE_F_MORE : 0);
+          if (m <= 0)
+            return -1;
+          n -= m;
+        }
+    }
+  return 0;
+}
+
+
+/* Read LENGTH bytes of the result from the operation socket of HD
+   into BUFFER.  */
+static int
+kernel_read (struct afalg_hd_s *hd, unsigned char *buffer, size_t length)
+{
+  ssize_t n;
+
+  while (length)
+    {
+      n = read (hd->opfd, buffer, length);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      buffer += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+/* Run LENGTH bytes, a multiple of the block length, through the
+   kernel.  HD must be at a block boundary.  Returns the number of
+   bytes done, which is less than LENGTH if the kernel failed.  */
+static size_t
+kernel_crypt (struct afalg_hd_s *hd, int do_encrypt,
+              unsigned char *out, const unsigned char *in, size_t length)
+{
+  size_t bs = hd->blocklen;
+  size_t done, n, i;
+  unsigned char *dst;
+  unsigned char next[MAX_BLOCKLEN];
+
+  for (done = 0; done < length; done += n)
+    {
+      n = length - done;
+      if (n > AFALG_CHUNK)
+        n = AFALG_CHUNK;
+
+      /* The result is read to the buffer if it would overwrite input
+         which is still needed.  */
+      dst = (out + done < in + done + n && in + done < out + done + n)
+        ? hd->buffer : out + done;
+
+      if (hd->kmode == KMODE_ECB)
+        {
+          /* Encrypt the register followed by all but the last
+             ciphertext block.  */
+          if (kernel_start (hd, 1, hd->reg, bs, n > bs)
+              || kernel_splice (hd, in + done, n - bs)
+              || kernel_read (hd, dst, n))
+            break;
+          memcpy (hd->reg, in + done + n - bs, bs);
+          for (i = 0; i < n; i++)
+            out[done + i] = dst[i] ^ in[done + i];
+        }
+      else
+        {
+          if (!do_encrypt)
+            memcpy (next, in + done + n - bs, bs);
+          if (kernel_start (hd, do_encrypt, NULL, 0, 1)
+              || kernel_splice (hd, in + done, n)
+              || kernel_read (hd, dst, n))
+            break;
+          if (dst != out + done)
+            memcpy (out + done, dst, n);
+          memcpy (hd->reg, do_encrypt ? out + done + n - bs : next, bs);
+        }
+    }
+
+  if (done < length)
+    kernel_release (hd);
+  return done;
+}
+
+
+/* Shift the LENGTH bytes of ciphertext at DATA into the register of
+   HD.  */
+static void
+track (struct afalg_hd_s *hd, const unsigned char *data, size_t length)
+{
+  size_t bs = hd->blocklen;
+
+  if (length >= bs)
+    memcpy (hd->reg, data + length - bs, bs);
+  else
+    {
+      memmove (hd->reg, hd->reg + length, bs - length);
+      memcpy (hd->reg + bs - length, data, length);
+    }
+  hd->pos = (hd->pos + length) % bs;
+}
+
+
+/* Run LENGTH bytes through the in-process handle of HD.  */
+static int
+base_crypt (struct afalg_hd_s *hd, int do_encrypt,
+            unsigned char *out, const unsigned char *in, size_t length)
+{
+  int rc;
+
+  if (hd->tracked && !do_encrypt)
+    track (hd, in, length);
+  rc = hd->base->cipher_crypt (hd->hd, do_encrypt, out, in, length);
+  if (hd->tracked && do_encrypt)
+    track (hd, out, length);
+  return rc;
+}
+
+
+
+static int
+afalg_cipher_open (void **r_hd, int algo, int mode)
+{
+  struct afalg_hd_s *hd;
+  int rc;
+
+  *r_hd = NULL;
+  hd = xtrycalloc (1, sizeof *hd);
+  if (!hd)
+    return TGPG_SYSERROR;
+  hd->base = _tgpg_afalg_base;
+  rc = hd->base->cipher_open (&hd->hd, algo, mode);
+  if (rc)
+    {
+      xfree (hd);
+      return rc;
+    }
+  hd->algo = algo;
+  hd->mode = mode;
+  hd->blocklen = hd->base->cipher_blocklen (algo);
+  hd->kmode = (mode == CIPHER_MODE_CFB && hd->blocklen <= MAX_BLOCKLEN)
+    ? KMODE_UNKNOWN : KMODE_NONE;
+  hd->tfmfd = hd->opfd = hd->pipefd[0] = hd->pipefd[1] = -1;
+  *r_hd = hd;
+  return 0;
+}
+
+
+static int
+afalg_cipher_setup (void *hd_, int do_encrypt,
+                    const void *key, size_t keylen,
+                    const void *iv, size_t ivlen)
+{
+  struct afalg_hd_s *hd = hd_;
+  int rc;
+
+  rc = hd->base->cipher_setup (hd->hd, do_encrypt, key, keylen, iv, ivlen);
+  if (rc || hd->kmode == KMODE_NONE)
+    return rc;
+
+  if (key)
+    {
+      if (keylen > MAX_KEYLEN)
+        {
+          kernel_release (hd);
+          return 0;
+        }
+      memcpy (hd->key, key, keylen);
+      hd->keylen = keylen;
+      hd->keyset = 0;
+    }
+  hd->tracked = (ivlen == hd->blocklen);
+  if (hd->tracked)
+    memcpy (hd->reg, iv, ivlen);
+  hd->pos = 0;
+  return 0;
+}
+
+
+static int
+afalg_cipher_crypt (void *hd_, int do_encrypt,
+                    void *out_, const void *in_, size_t length)
+{
+  struct afalg_hd_s *hd = hd_;
+  unsigned char *out = out_;
+  const unsigned char *in = in_;
+  size_t bs = hd->blocklen;
+  size_t n;
+  int rc;
+
+  if (hd->kmode == KMODE_NONE || !hd->tracked || length < AFALG_MIN_LENGTH
+      || (do_encrypt && hd->kmode == KMODE_ECB))
+    return base_crypt (hd, do_encrypt, out, in, length);
+
+  /* Complete the current block in process.  */
+  n = hd->pos ? bs - hd->pos : 0;
+  if (n)
+    {
+      rc = base_crypt (hd, do_encrypt, out, in, n);
+      if (rc)
+        return rc;
+      out += n;
+      in += n;
+      length -= n;
+    }
+
+  if (!kernel_prepare (hd) && !(do_encrypt && hd->kmode == KMODE_ECB))
+    {
+      n = kernel_crypt (hd, do_encrypt, out, in, length - length % bs);
+      if (n)
+        {
+          /* Continue in process with the register as IV.  */
+          rc = hd->base->cipher_setup (hd->hd, do_encrypt, NULL, 0,
+                                       hd->reg, bs);
+          if (rc)
+            return rc;
+          out += n;
+          in += n;
+          length -= n;
+        }
+    }
+
+  return base_crypt (hd, do_encrypt, out, in, length);
+}
+
+
+static void
+afalg_cipher_close (void *hd_)
+{
+  struct afalg_hd_s *hd = hd_;
+
+  if (!hd)
+    return;
+  kernel_release (hd);
+  hd->base->cipher_close (hd->hd);
+  wipememory (hd->key, sizeof hd->key);
+  xfree (hd->buffer);
+  xfree (hd);
+}
+
+
+/* Whether AES can be used through AF_ALG.  This is checked by
+   afalg_init, so that afalg_kernel may be called from any thread.  */
+static int aes_usable;
+
+
+/* Return "afalg" if AES can be used through AF_ALG or the kernel of
+   the base backend.  */
+static const char *
+afalg_kernel (void)
+{
+  return aes_usable ? "afalg" : _tgpg_afalg_base->kernel ();
+}
+
+
+/* Initialize the base backend and take all primitives but the block
+   ciphers from it.  Not having AF_ALG is not an error; everything is
+   done in process then.  */
+static int
+afalg_init (void)
+{
+  struct crypto_backend_s *self = &_tgpg_crypto_afalg;
+  int rc, fd;
+
+  rc = _tgpg_afalg_base->init ();
+  if (rc)
+    return rc;
+
+  fd = bind_cipher ("cfb", "aes");
+  if (fd == -1)
+    fd = bind_cipher ("ecb", "aes");
+  aes_usable = (fd != -1);
+  if (fd != -1)
+    close (fd);
+
+  snprintf (backend_name, sizeof backend_name, "%s+afalg",
+            _tgpg_afalg_base->name);
+  *self = *_tgpg_afalg_base;
+  self->name = backend_name;
+  self->init = afalg_init;
+  self->kernel = afalg_kernel;
+  self->cipher_open = afalg_cipher_open;
+  self->cipher_setup = afalg_cipher_setup;
+  self->cipher_crypt = afalg_cipher_crypt;
+  self->cipher_close = afalg_cipher_close;
+  return 0;
+}
+
+
+/* Only the init function is valid before it has been called.  */
+struct crypto_backend_s _tgpg_crypto_afalg =
+  {
+    "afalg",
+    afalg_init
+  };
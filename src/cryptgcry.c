@@ -0,0 +1,688 @@
+/* cryptgcry.c - Crypto backend using libgcrypt.
+   Copyright (C) 2007,2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <gcrypt.h>
+
+#include "tgpgdefs.h"
+#include "cryptglue.h"
+
+/* Note that the OpenPGP ids of the ciphers and hash algorithms are
+   also the ids used by libgcrypt.  */
+
+
+/* Map gpg-error codes to tgpg error codes.  */
+static int
+maperr (gpg_error_t err)
+{
+  return err? TGPG_CRYPT_ERR : 0;
+}
+
+
+/* Return true if the hardware feature FLAG is listed in the list
+   HWFLIST returned by the backend.  */
+static int
+have_hwflag (const char *hwflist, const char *flag)
+{
+  size_t n = strlen (flag);
+  const char *p;
+
+  for (p = hwflist; (p = strstr (p, flag)); p += n)
+    if (p > hwflist && p[-1] == ':'
+        && (p[n] == ':' || !p[n] || p[n] == '\n'))
+      return 1;
+  return 0;
+}
+
+
+/* The name of the AES implementation libgcrypt uses on this CPU.  It
+   is determined by gc_init, so that gc_kernel may be called from any
+   thread.  */
+static const char *kernel_name = "generic";
+
+/* Set KERNEL_NAME from the hardware features libgcrypt reports.  */
+static void
+detect_kernel (void)
+{
+  static const struct
+  {
+    const char *flag;
+    const char *name;
+  } kernels[] =
+    {
+      /* The wide VAES path is used for bulk CFB decryption and needs
+         AVX2 as well.  */
+      { "intel-vaes-vpclmul", "vaes" },
+      { "intel-aesni",        "aesni" },
+      { "arm-aes",            "armv8-ce" },
+      { "ppc-vcrypto",        "ppc-vcrypto" },
+      { "s390x-msa",          "s390x-msa" },
+      { "padlock-aes",        "padlock" }
+    };
+  char *hwflist;
+  size_t i;
+
+  hwflist = gcry_get_config (0, "hwflist");
+  for (i = 0; hwflist && i < sizeof kernels / sizeof *kernels; i++)
+    if (have_hwflag (hwflist, kernels[i].flag)
+        && (i || have_hwflag (hwflist, "intel-avx2")))
+      {
+        kernel_name = kernels[i].name;
+        break;
+      }
+  gcry_free (hwflist);
+}
+
+
+static int
+gc_init (void)
+{
+  detect_kernel ();
+  return 0;
+}
+
+
+static const char *
+gc_kernel (void)
+{
+  return kernel_name;
+}
+
+
+
+/*
+
+     P U B K E Y   F u n c t i o n s
+
+*/
+
+static int
+gc_pk_decrypt (int algo, tgpg_mpi_t seckey, tgpg_mpi_t encdat,
+               char **r_plain, size_t *r_plainlen)
+{
+  int rc;
+  gcry_sexp_t s_plain, s_data, s_key, s_list;
+  const char *result;
+  size_t resultlen;
+
+  if (algo == PK_ALGO_RSA)
+    {
+      rc = gcry_sexp_build (&s_data, NULL, "(enc-val(rsa(a%b)))",
+                            (int)encdat[0].valuelen, encdat[0].value);
+      if (rc)
+        return TGPG_INV_DATA;
+
+      /* Use the pre-built S-expression of compiled keys.  */
+      if (seckey[6].value)
+        rc = gcry_sexp_new (&s_key, seckey[6].value, seckey[6].valuelen, 0);
+      else
+        rc = gcry_sexp_build (&s_key, NULL,
+                              "(private-key(rsa(n%b)(e%b)(d%b)(p%b)(q%b)(u%b)))",
+                              (int)seckey[0].valuelen, seckey[0].value,
+                              (int)seckey[1].valuelen, seckey[1].value,
+                              (int)seckey[2].valuelen, seckey[2].value,
+                              (int)seckey[3].valuelen, seckey[3].value,
+                              (int)seckey[4].valuelen, seckey[4].value,
+                              (int)seckey[5].valuelen, seckey[5].value);
+      if (rc)
+        {
+          gcry_sexp_release (s_data);
+          return TGPG_INV_DATA;
+        }
+    }
+  else
+    {
+      rc = gcry_sexp_build (&s_data, NULL, "(enc-val(ecdh(e%b)))",
+                            (int)encdat[0].valuelen, encdat[0].value);
+      if (rc)
+        return TGPG_INV_DATA;
+
+      if (seckey[6].value)
+        rc = gcry_sexp_new (&s_key, seckey[6].value, seckey[6].valuelen, 0);
+      else
+        rc = gcry_sexp_build (&s_key, NULL,
+                              "(private-key(ecc(curve Curve25519)"
+                              "(flags djb-tweak)(q%b)(d%b)))",
+                              (int)seckey[1].valuelen, seckey[1].value,
+                              (int)seckey[3].valuelen, seckey[3].value);
+      if (rc)
+        {
+          gcry_sexp_release (s_data);
+          return TGPG_INV_DATA;
+        }
+    }
+
+  rc = gcry_pk_decrypt (&s_plain, s_data, s_key);
+  gcry_sexp_release (s_data);
+  gcry_sexp_release (s_key);
+  if (rc)
+    return TGPG_CRYPT_ERR;
+
+  /* ECDH returns the shared point as a (value) list, RSA the bare
+     value.  */
+  s_list = gcry_sexp_find_token (s_plain, "value", 0);
+  if (s_list)
+    result = gcry_sexp_nth_data (s_list, 1, &resultlen);
+  else
+    result = gcry_sexp_nth_data (s_plain, 0, &resultlen);
+  if (!result || !resultlen)
+    {
+      gcry_sexp_release (s_list);
+      gcry_sexp_release (s_plain);
+      return TGPG_CRYPT_ERR;
+    }
+
+  *r_plain = xtrymalloc (resultlen);
+  if (!*r_plain)
+    {
+      gcry_sexp_release (s_list);
+      gcry_sexp_release (s_plain);
+      return TGPG_SYSERROR;
+    }
+
+  memcpy (*r_plain, result, resultlen);
+  *r_plainlen = resultlen;
+  gcry_sexp_release (s_list);
+  gcry_sexp_release (s_plain);
+  return rc;
+}
+
+
+static int
+gc_pk_encrypt (int algo, tgpg_mpi_t pubkey,
+               const char *plain, size_t plainlen,
+               tgpg_mpi_t *r_encdat, size_t *r_enclen)
+{
+  int rc;
+  int i;
+  gcry_sexp_t s_plain, s_key, s_cipher, s_list;
+  const char *keys = "ab";
+
+  if (algo == PK_ALGO_RSA)
+    {
+      rc = gcry_sexp_build (&s_plain, NULL,
+                            "(data(flags)(value%b))",
+                            (int) plainlen, plain);
+      if (rc)
+        return TGPG_INV_DATA;
+
+      rc = gcry_sexp_build (&s_key, NULL,
+			    "(public-key(rsa(n%b)(e%b)))",
+                            (int) pubkey[0].valuelen, pubkey[0].value,
+                            (int) pubkey[1].valuelen, pubkey[1].value);
+      if (rc)
+        {
+          gcry_sexp_release (s_plain);
+          return TGPG_INV_DATA;
+        }
+    }
+  else
+    {
+      rc = gcry_sexp_build (&s_plain, NULL,
+                            "(data(flags raw)(value%b))",
+                            (int) plainlen, plain);
+      if (rc)
+        return TGPG_INV_DATA;
+
+      rc = gcry_sexp_build (&s_key, NULL,
+                            "(public-key(ecc(curve Curve25519)"
+                            "(flags djb-tweak)(q%b)))",
+                            (int) pubkey[1].valuelen, pubkey[1].value);
+      if (rc)
+        {
+          gcry_sexp_release (s_plain);
+          return TGPG_INV_DATA;
+        }
+      keys = "es";
+    }
+
+  rc = gcry_pk_encrypt (&s_cipher, s_plain, s_key);
+  gcry_sexp_release (s_plain);
+  gcry_sexp_release (s_key);
+  if (rc)
+    return TGPG_CRYPT_ERR;
+
+  *r_enclen = _tgpg_pk_get_nenc (algo);
+  *r_encdat = xtrycalloc (*r_enclen, sizeof **r_encdat);
+  if (*r_encdat == NULL)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+
+  for (i = 0; i < *r_enclen; i++)
+    {
+      tgpg_mpi_t r = &(*r_encdat)[i];
+
+      s_list = gcry_sexp_find_token (s_cipher, &keys[i], 1);
+
+      errno = 0;
+      r->value =
+        gcry_sexp_nth_buffer (s_list, 1, &r->valuelen);
+      gcry_sexp_release (s_list);
+      if (r->value == NULL)
+        {
+          rc = errno != 0 ? TGPG_SYSERROR : TGPG_BUG;
+          goto leave;
+        }
+    }
+
+ leave:
+  gcry_sexp_release (s_cipher);
+  return rc;
+}
+
+
+
+/*
+
+     C I P H E R   F u n c t i o n s
+
+*/
+
+static unsigned int
+gc_cipher_blocklen (int algo)
+{
+  return gcry_cipher_get_algo_blklen (algo);
+}
+
+
+static unsigned int
+gc_cipher_keylen (int algo)
+{
+  return gcry_cipher_get_algo_keylen (algo);
+}
+
+
+static int
+gc_cipher_open (void **r_hd, int algo, int mode)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t hd;
+
+  *r_hd = NULL;
+  switch (mode)
+    {
+    case CIPHER_MODE_CBC: mode = GCRY_CIPHER_MODE_CBC; break;
+    case CIPHER_MODE_CFB: mode = GCRY_CIPHER_MODE_CFB; break;
+    default: return TGPG_BUG;
+    }
+
+  err = gcry_cipher_open (&hd, algo, mode, 0);
+  if (err)
+    return gpg_err_code (err) == GPG_ERR_CIPHER_ALGO? TGPG_INV_ALGO
+      : maperr (err);
+  *r_hd = hd;
+  return 0;
+}
+
+
+static int
+gc_cipher_setup (void *hd, int do_encrypt,
+                 const void *key, size_t keylen,
+                 const void *iv, size_t ivlen)
+{
+  gpg_error_t err = 0;
+
+  if (key)
+    err = gcry_cipher_setkey (hd, key, keylen);
+  if (!err)
+    err = gcry_cipher_setiv (hd, iv, ivlen);
+  return maperr (err);
+}
+
+
+static int
+gc_cipher_crypt (void *hd, int do_encrypt,
+                 void *out, const void *in, size_t length)
+{
+  return maperr ((do_encrypt ? gcry_cipher_encrypt : gcry_cipher_decrypt)
+                 (hd, out, length, in, length));
+}
+
+
+static void
+gc_cipher_close (void *hd)
+{
+  gcry_cipher_close (hd);
+}
+
+
+static int
+gc_aead_open (void **r_hd, int algo, int aead_algo,
+              const void *key, size_t keylen)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t hd;
+  int mode;
+
+  *r_hd = NULL;
+  switch (aead_algo)
+    {
+    case AEAD_ALGO_EAX: mode = GCRY_CIPHER_MODE_EAX; break;
+    case AEAD_ALGO_OCB: mode = GCRY_CIPHER_MODE_OCB; break;
+    case AEAD_ALGO_GCM: mode = GCRY_CIPHER_MODE_GCM; break;
+    default: return TGPG_INV_ALGO;
+    }
+
+  err = gcry_cipher_open (&hd, algo, mode, 0);
+  if (err)
+    return gpg_err_code (err) == GPG_ERR_CIPHER_ALGO? TGPG_INV_ALGO
+      : maperr (err);
+  err = gcry_cipher_setkey (hd, key, keylen);
+  if (err)
+    {
+      gcry_cipher_close (hd);
+      return maperr (err);
+    }
+
+  *r_hd = hd;
+  return 0;
+}
+
+
+static void
+gc_aead_close (void *hd)
+{
+  gcry_cipher_close (hd);
+}
+
+
+static int
+gc_aead_crypt (void *hd, int do_encrypt,
+               const void *nonce, size_t noncelen,
+               const void *adata, size_t adatalen,
+               void *out, const void *in, size_t length,
+               void *tag)
+{
+  gpg_error_t err;
+
+  err = gcry_cipher_setiv (hd, nonce, noncelen);
+  if (!err)
+    err = gcry_cipher_authenticate (hd, adata, adatalen);
+  if (!err)
+    err = gcry_cipher_final (hd);
+  if (!err)
+    err = (do_encrypt ? gcry_cipher_encrypt : gcry_cipher_decrypt)
+      (hd, out, length, in, length);
+  if (err)
+    return maperr (err);
+
+  if (do_encrypt)
+    err = gcry_cipher_gettag (hd, tag, AEAD_TAGLEN);
+  else
+    {
+      err = gcry_cipher_checktag (hd, tag, AEAD_TAGLEN);
+      if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+        return TGPG_MDC_FAILED;
+    }
+  return maperr (err);
+}
+
+
+static int
+gc_keywrap (int do_wrap, int algo, const void *kek, size_t keklen,
+            void *out, const void *in, size_t inlen)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t hd;
+
+  err = gcry_cipher_open (&hd, algo, GCRY_CIPHER_MODE_AESWRAP,
+                          GCRY_CIPHER_SECURE);
+  if (err)
+    return gpg_err_code (err) == GPG_ERR_CIPHER_ALGO? TGPG_INV_ALGO
+      : maperr (err);
+  err = gcry_cipher_setkey (hd, kek, keklen);
+  if (!err)
+    {
+      if (do_wrap)
+        err = gcry_cipher_encrypt (hd, out, inlen + 8, in, inlen);
+      else
+        err = gcry_cipher_decrypt (hd, out, inlen - 8, in, inlen);
+    }
+  gcry_cipher_close (hd);
+  if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+    return TGPG_WRONG_KEY;
+  return maperr (err);
+}
+
+
+
+/*
+
+     H A S H   F u n c t i o n s
+
+*/
+
+static unsigned int
+gc_hash_dlen (int algo)
+{
+  return gcry_md_get_algo_dlen (algo);
+}
+
+
+static int
+gc_hash_buffers (int algo, unsigned char *digest,
+                 const struct segment_s *iov, size_t iovcnt)
+{
+  gcry_buffer_t bufs[4];
+  size_t i;
+
+  if (iovcnt > sizeof bufs / sizeof *bufs)
+    return TGPG_BUG;
+
+  for (i = 0; i < iovcnt; i++)
+    {
+      bufs[i].size = 0;
+      bufs[i].off = 0;
+      bufs[i].len = iov[i].length;
+      bufs[i].data = iov[i].data;
+    }
+  return maperr (gcry_md_hash_buffers (algo, 0, digest, bufs, iovcnt));
+}
+
+
+static int
+gc_hash_open (void **r_hd, int algo, int secure)
+{
+  gpg_error_t err;
+  gcry_md_hd_t hd;
+
+  *r_hd = NULL;
+  err = gcry_md_open (&hd, algo, secure? GCRY_MD_FLAG_SECURE : 0);
+  if (err)
+    return maperr (err);
+  *r_hd = hd;
+  return 0;
+}
+
+
+static void
+gc_hash_close (void *hd)
+{
+  gcry_md_close (hd);
+}
+
+
+static void
+gc_hash_reset (void *hd)
+{
+  gcry_md_reset (hd);
+}
+
+
+static void
+gc_hash_write (void *hd, const void *buffer, size_t length)
+{
+  gcry_md_write (hd, buffer, length);
+}
+
+
+static const void *
+gc_hash_read (void *hd)
+{
+  return gcry_md_read (hd, 0);
+}
+
+
+static int
+gc_hkdf (int algo, void *out, size_t length,
+         const void *ikm, size_t ikmlen,
+         const void *salt, size_t saltlen,
+         const void *info, size_t infolen)
+{
+  gpg_error_t err;
+  gcry_md_hd_t hd;
+  unsigned char prk[64];
+  unsigned char *p = out;
+  size_t dlen, n;
+  unsigned char i;
+
+  dlen = gcry_md_get_algo_dlen (algo);
+  if (!dlen || dlen > sizeof prk || length > 255 * dlen)
+    return TGPG_INV_VAL;
+
+  err = gcry_md_open (&hd, algo, GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE);
+  if (err)
+    return maperr (err);
+
+  /* Extract.  */
+  err = gcry_md_setkey (hd, salt, saltlen);
+  if (err)
+    goto leave;
+  gcry_md_write (hd, ikm, ikmlen);
+  memcpy (prk, gcry_md_read (hd, 0), dlen);
+
+  /* Expand.  */
+  gcry_md_reset (hd);
+  err = gcry_md_setkey (hd, prk, dlen);
+  for (i = 1; !err && length; i++)
+    {
+      if (i > 1)
+        {
+          gcry_md_reset (hd);
+          gcry_md_write (hd, p - dlen, dlen);
+        }
+      gcry_md_write (hd, info, infolen);
+      gcry_md_write (hd, &i, 1);
+
+      n = length < dlen ? length : dlen;
+      memcpy (p, gcry_md_read (hd, 0), n);
+      p += n;
+      length -= n;
+    }
+
+ leave:
+  wipememory (prk, sizeof prk);
+  gcry_md_close (hd);
+  return maperr (err);
+}
+
+
+
+/*
+
+     R A N D O M   F u n c t i o n s
+
+*/
+
+static void
+gc_randomize (unsigned char *buffer, size_t length)
+{
+  gcry_randomize (buffer, length, GCRY_STRONG_RANDOM);
+}
+
+
+static void
+gc_create_nonce (unsigned char *buffer, size_t length)
+{
+  gcry_create_nonce (buffer, length);
+}
+
+
+const struct crypto_backend_s _tgpg_crypto_gcrypt =
+  {
+    "gcrypt",
+    gc_init,
+    gc_kernel,
+    gc_pk_decrypt,
+    gc_pk_encrypt,
+    gc_cipher_blocklen,
+    gc_cipher_keylen,
+    gc_cipher_open,
+    gc_cipher_setup,
+    gc_cipher_crypt,
+    gc_cipher_close,
+    gc_aead_open,
+    gc_aead_close,
+    gc_aead_crypt,
+    gc_keywrap,
+    gc_hash_dlen,
+    gc_hash_buffers,
+    gc_hash_open,
+    gc_hash_close,
+    gc_hash_reset,
+    gc_hash_write,
+    gc_hash_read,
+    gc_hkdf,
+    gc_randomize,
+    gc_create_nonce
+  };
+
+
+
+/* Convert the S-expression TEXT of LENGTH bytes, which may be in
+   advanced or canonical format, to canonical format.  The result is
+   stored in an allocated buffer at R_SEXP and its length at R_LEN.
+   Key files are always S-expressions, thus this is done with
+   libgcrypt whatever backend has been selected.  */
+int
+_tgpg_sexp_canon (const char *text, size_t length,
+                  unsigned char **r_sexp, size_t *r_len)
+{
+  gcry_sexp_t sexp;
+  unsigned char *buffer;
+  size_t n;
+
+  *r_sexp = NULL;
+  *r_len = 0;
+
+  if (gcry_sexp_new (&sexp, text, length, 1))
+    return TGPG_INV_DATA;
+
+  n = gcry_sexp_sprint (sexp, GCRYSEXP_FMT_CANON, NULL, 0);
+  buffer = n ? xtrymalloc (n) : NULL;
+  if (!buffer)
+    {
+      gcry_sexp_release (sexp);
+      return n ? TGPG_SYSERROR : TGPG_INV_DATA;
+    }
+  n = gcry_sexp_sprint (sexp, GCRYSEXP_FMT_CANON, buffer, n);
+  gcry_sexp_release (sexp);
+
+  *r_sexp = buffer;
+  *r_len = n;
+  return 0;
+}
@@ -1,4 +1,4 @@
-/* cryptglue.c - Crypto glue layer using libgcrypt.
+/* cryptglue.c - Crypto glue layer.
    Copyright (C) 2007,2015 g10 Code GmbH
 
    This file is part of TGPG.
@@ -24,8 +24,12 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
-
-#include <gcrypt.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #include "tgpgdefs.h"
 #include "cryptglue.h"
@@ -33,13 +37,54 @@
 /* The size of the buffer we allocate for hash contexts. */
 #define HASH_BUFFERSIZE 1024
 
+/* The largest block and key lengths of the supported ciphers.  */
+#define MAX_BLOCKLEN 16
+#define MAX_KEYLEN   32
 
 
-/* Map gpg-error codes to tgpg error codes.  */
-static int
-maperr (gpg_error_t err)
+/* The backend used by all functions below.  */
+const struct crypto_backend_s *_tgpg_crypto = &_tgpg_crypto_gcrypt;
+
+
+/* Select and initialize the backend requested by the TGPG_FLAG_BACKEND
+   bits of FLAGS.  Returns TGPG_NOT_IMPL if the backend has not been
+   built.  */
+int
+_tgpg_crypto_select (int flags)
+{
+  const struct crypto_backend_s *backend = &_tgpg_crypto_gcrypt;
+  int rc;
+
+  if ((flags & TGPG_FLAG_BACKEND_OPENSSL))
+    {
+#ifdef HAVE_OPENSSL
+      backend = &_tgpg_crypto_openssl;
+#else
+      return TGPG_NOT_IMPL;
+#endif
+    }
+  if ((flags & TGPG_FLAG_BACKEND_AFALG))
+    {
+#ifdef HAVE_AFALG
+      _tgpg_afalg_base = backend;
+      backend = &_tgpg_crypto_afalg;
+#else
+      return TGPG_NOT_IMPL;
+#endif
+    }
+
+  rc = backend->init ();
+  if (!rc)
+    _tgpg_crypto = backend;
+  return rc;
+}
+
+
+/* Return the name of the crypto backend selected by tgpg_init.  */
+const char *
+tgpg_crypto_backend (void)
 {
-  return err? TGPG_CRYPT_ERR : 0;
+  return _tgpg_crypto->name;
 }
 
 
@@ -51,6 +96,33 @@ maperr (gpg_error_t err)
 
 */
 
+/* The OID of Curve25519, the only curve supported for ECDH.  */
+static const unsigned char oid_curve25519[] =
+  { 0x2b, 0x06, 0x01, 0x04, 0x01, 0x97, 0x55, 0x01, 0x05, 0x01 };
+
+/* Return true if the curve OID in MPI denotes Curve25519.  */
+static int
+is_curve25519 (tgpg_mpi_t oid)
+{
+  return (oid->valuelen == sizeof oid_curve25519
+          && !memcmp (oid->value, oid_curve25519, sizeof oid_curve25519));
+}
+
+/* Return the length in bits of the big endian number of LENGTH bytes
+   at VALUE, which starts with a non-zero byte.  */
+static unsigned int
+mpi_nbits (const unsigned char *value, size_t length)
+{
+  unsigned int nbits = length << 3;
+  unsigned char c;
+
+  if (!length)
+    return 0;
+  for (c = value[0]; c && !(c & 0x80); c <<= 1)
+    nbits--;
+  return nbits;
+}
+
 /* Return the number of parameters required to encrypt using the
    public key algorithm with ALGO.  ALGO is of course an OpenPGP id.
    The function returns 0 for not supported algorithms.  */
@@ -61,6 +133,7 @@ _tgpg_pk_get_nenc (int algo)
     {
     case PK_ALGO_RSA: return 1;
     case PK_ALGO_ELG: return 2;
+    case PK_ALGO_ECDH: return 2;
     default: return 0;
     }
 }
@@ -81,149 +154,75 @@ _tgpg_pk_get_nsig (int algo)
 
 
 
+/* Return true if the public key algorithm ALGO with the parameters
+   KEY is supported.  */
+static int
+pk_supported (int algo, tgpg_mpi_t key)
+{
+  switch (algo)
+    {
+    case PK_ALGO_RSA: return 1;
+    case PK_ALGO_ECDH: return is_curve25519 (&key[0]);
+    default: return 0;
+    }
+}
+
+
 /* Run a decrypt operation on the data in ENCDAT using the provided key
    SECKEY and algorithm ALGO.  On success the result is stored as a
    new allocated buffer at the address R_PLAN and its length at
-   R_PLAINLEN.  On error PLAIN and R_PLAINLEN are set to NULL/0.*/
+   R_PLAINLEN.  On error PLAIN and R_PLAINLEN are set to NULL/0.  For
+   ECDH the result is the shared point computed from the ephemeral
+   point in ENCDAT[0]; the key wrapping is done by the caller.  */
 int
 _tgpg_pk_decrypt (int algo, tgpg_mpi_t seckey, tgpg_mpi_t encdat,
                   char **r_plain, size_t *r_plainlen)
 {
-  int rc;
-  gcry_sexp_t s_plain, s_data, s_key;
-  const char *result;
-  size_t resultlen;
-
   *r_plain = NULL;
   *r_plainlen = 0;
 
-  if (algo == PK_ALGO_RSA)
-    {
-      rc = gcry_sexp_build (&s_data, NULL, "(enc-val(rsa(a%b)))",
-                            (int)encdat[0].valuelen, encdat[0].value);
-      if (rc)
-        return TGPG_INV_DATA;
-
-      rc = gcry_sexp_build (&s_key, NULL,
-			    "(private-key(rsa(n%b)(e%b)(d%b)(p%b)(q%b)(u%b)))",
-                            (int)seckey[0].valuelen, seckey[0].value,
-                            (int)seckey[1].valuelen, seckey[1].value,
-                            (int)seckey[2].valuelen, seckey[2].value,
-                            (int)seckey[3].valuelen, seckey[3].value,
-                            (int)seckey[4].valuelen, seckey[4].value,
-                            (int)seckey[5].valuelen, seckey[5].value);
-      if (rc)
-        {
-          gcry_sexp_release (s_data);
-          return TGPG_INV_DATA;
-        }
-    }
-  else
+  if (!pk_supported (algo, seckey))
     return TGPG_INV_ALGO;
-
-  rc = gcry_pk_decrypt (&s_plain, s_data, s_key);
-  gcry_sexp_release (s_data);
-  gcry_sexp_release (s_key);
-  if (rc)
-    return TGPG_CRYPT_ERR;
-
-  result = gcry_sexp_nth_data (s_plain, 0, &resultlen);
-  if (!result || !resultlen)
-    {
-      gcry_sexp_release (s_plain);
-      return TGPG_CRYPT_ERR;
-    }
-
-  *r_plain = xtrymalloc (resultlen);
-  if (!*r_plain)
-    {
-      gcry_sexp_release (s_plain);
-      return TGPG_SYSERROR;
-    }
-
-  memcpy (*r_plain, result, resultlen);
-  *r_plainlen = resultlen;
-  gcry_sexp_release (s_plain);
-  return rc;
+  return _tgpg_crypto->pk_decrypt (algo, seckey, encdat, r_plain, r_plainlen);
 }
 
 
 /* Run an encrypt operation on PLAIN of length PLAINLEN using the
    algorithm ALGO and key PUBKEY.  On success, the result is stored in
-   an allocated array R_ENCDAT with R_ENCLEN elements.  */
+   an allocated array R_ENCDAT with R_ENCLEN elements.  For ECDH PLAIN
+   is the ephemeral secret scalar; the result consists of the
+   ephemeral point and the shared point, in that order.  */
 int
 _tgpg_pk_encrypt (int algo, tgpg_mpi_t pubkey,
-                  char *plain, size_t plainlen,
+                  const char *plain, size_t plainlen,
                   tgpg_mpi_t *r_encdat, size_t *r_enclen)
 {
   int rc;
-  int i;
-  gcry_sexp_t s_plain, s_key, s_cipher, s_list;
+  tgpg_mpi_t encdat = NULL;
+  size_t enclen = 0;
+  size_t i;
 
-  switch (algo)
-    {
-    case PK_ALGO_RSA:
-      rc = gcry_sexp_build (&s_plain, NULL,
-                            "(data(flags)(value%b))",
-                            (int) plainlen, plain);
-      if (rc)
-        return TGPG_INV_DATA;
+  *r_encdat = NULL;
+  *r_enclen = 0;
 
-      rc = gcry_sexp_build (&s_key, NULL,
-			    "(public-key(rsa(n%b)(e%b)))",
-                            (int) pubkey[0].valuelen, pubkey[0].value,
-                            (int) pubkey[1].valuelen, pubkey[1].value);
-      if (rc)
-        {
-          gcry_sexp_release (s_plain);
-          return TGPG_INV_DATA;
-        }
-      break;
-
-    default:
-      return TGPG_INV_ALGO;
-    }
-
-  rc = gcry_pk_encrypt (&s_cipher, s_plain, s_key);
-  gcry_sexp_release (s_plain);
-  gcry_sexp_release (s_key);
+  if (!pk_supported (algo, pubkey))
+    return TGPG_INV_ALGO;
+  rc = _tgpg_crypto->pk_encrypt (algo, pubkey, plain, plainlen,
+                                 &encdat, &enclen);
   if (rc)
     {
-      rc = TGPG_CRYPT_ERR;
-      goto leave;
+      for (i = 0; encdat && i < enclen; i++)
+        xfree (encdat[i].value);
+      xfree (encdat);
+      return rc;
     }
 
-  *r_enclen = _tgpg_pk_get_nenc (algo);
-  *r_encdat = xtrymalloc (*r_enclen * sizeof **r_encdat);
-  if (r_encdat == NULL)
-    {
-      rc = TGPG_SYSERROR;
-      goto leave;
-    }
-
-  for (i = 0; i < *r_enclen; i++)
-    {
-      const char *keys = "ab";
-      tgpg_mpi_t r = &(*r_encdat)[i];
-
-      s_list = gcry_sexp_find_token (s_cipher, &keys[i], 1);
-
-      errno = 0;
-      r->value =
-        gcry_sexp_nth_buffer (s_list, 1, &r->valuelen);
-      if (r->value == NULL)
-        {
-          rc = errno != 0 ? TGPG_SYSERROR : TGPG_BUG;
-          goto leave;
-        }
-
-      r->nbits = r->valuelen << 3;
-      gcry_sexp_release (s_list);
-    }
-
- leave:
-  gcry_sexp_release (s_cipher);
-  return rc;
+  for (i = 0; i < enclen; i++)
+    encdat[i].nbits = mpi_nbits ((const unsigned char *) encdat[i].value,
+                                 encdat[i].valuelen);
+  *r_encdat = encdat;
+  *r_enclen = enclen;
+  return 0;
 }
 
 
@@ -237,7 +236,7 @@ _tgpg_pk_encrypt (int algo, tgpg_mpi_t pubkey,
 unsigned int
 _tgpg_cipher_blocklen (int algo)
 {
-  return gcry_cipher_get_algo_blklen (algo);
+  return _tgpg_crypto->cipher_blocklen (algo);
 }
 
 
@@ -245,96 +244,252 @@ _tgpg_cipher_blocklen (int algo)
 unsigned int
 _tgpg_cipher_keylen (int algo)
 {
-  return gcry_cipher_get_algo_keylen (algo);
+  return _tgpg_crypto->cipher_keylen (algo);
+}
+
+
+/* Return the name of the AES implementation the backend selected for
+   this CPU.  */
+const char *
+tgpg_cipher_kernel (void)
+{
+  return _tgpg_crypto->kernel ();
+}
+
+
+/* A cursor used to walk a list of segments as one stream.  */
+struct segcursor_s
+{
+  const struct segment_s *seg;  /* The current segment.  */
+  size_t nseg;                  /* Number of segments left.  */
+  size_t off;                   /* Offset into the current segment.  */
+};
+
+/* Return the number of bytes available at cursor C without crossing
+   a segment boundary and skip over exhausted segments.  */
+static size_t
+segcursor_avail (struct segcursor_s *c)
+{
+  while (c->nseg && c->off == c->seg->length)
+    {
+      c->seg++;
+      c->nseg--;
+      c->off = 0;
+    }
+  return c->nseg ? c->seg->length - c->off : 0;
+}
+
+
+/* Run the cipher HD over LENGTH bytes taken from the stream at IN
+   and write the result to the stream at OUT.  If HD is NULL the data
+   is only copied.  */
+static int
+cipher_stream (int do_encrypt, void *hd,
+               struct segcursor_s *out, struct segcursor_s *in,
+               size_t length)
+{
+  int rc = 0;
+  size_t n, m;
+
+  while (length && !rc)
+    {
+      n = segcursor_avail (in);
+      m = segcursor_avail (out);
+      if (!n || !m)
+        return TGPG_INV_DATA;
+      if (m < n)
+        n = m;
+      if (length < n)
+        n = length;
+
+      if (hd)
+        rc = _tgpg_crypto->cipher_crypt (hd, do_encrypt,
+                                         out->seg->data + out->off,
+                                         in->seg->data + in->off, n);
+      else
+        memcpy (out->seg->data + out->off, in->seg->data + in->off, n);
+      in->off += n;
+      out->off += n;
+      length -= n;
+    }
+  return rc;
+}
+
+
+/* Return a handle for ALGO and MODE at R_HD.  If CTX is not NULL, the
+   handle kept in CTX is used if it matches; otherwise a new handle is
+   opened and kept in CTX instead.  Opening a handle allocates and
+   initializes the backend context, which is a noticeable part of the
+   cost of processing a small message.  */
+static int
+cipher_get_handle (tgpg_t ctx, int algo, int mode, void **r_hd)
+{
+  int rc;
+
+  if (ctx && ctx->cipher.hd && ctx->cipher.backend == _tgpg_crypto
+      && ctx->cipher.algo == algo && ctx->cipher.mode == mode)
+    {
+      *r_hd = ctx->cipher.hd;
+      return 0;
+    }
+
+  rc = _tgpg_crypto->cipher_open (r_hd, algo, mode);
+  if (rc || !ctx)
+    return rc;
+
+  _tgpg_cipher_release (ctx);
+  ctx->cipher.hd = *r_hd;
+  ctx->cipher.backend = _tgpg_crypto;
+  ctx->cipher.algo = algo;
+  ctx->cipher.mode = mode;
+  return 0;
+}
+
+
+/* Replace the key and IV of the handle HD kept in CTX by zeros once a
+   message has been processed, so that the key schedule of the session
+   key does not stay in memory until the handle is used again.  If
+   that fails, the handle is closed instead.  */
+static void
+cipher_clear_key (tgpg_t ctx, void *hd, int do_encrypt,
+                  size_t keylen, size_t blocklen)
+{
+  static const unsigned char zeros[MAX_KEYLEN];
+
+  if (keylen > MAX_KEYLEN || blocklen > MAX_BLOCKLEN
+      || _tgpg_crypto->cipher_setup (hd, do_encrypt, zeros, keylen,
+                                     zeros, blocklen))
+    _tgpg_cipher_release (ctx);
+}
+
+
+/* Close the cipher handle kept in CTX.  */
+void
+_tgpg_cipher_release (tgpg_t ctx)
+{
+  if (ctx->cipher.hd)
+    ctx->cipher.backend->cipher_close (ctx->cipher.hd);
+  ctx->cipher.hd = NULL;
 }
 
 
 /* Core of the en- and decrypt functions.  With DO_ENCRYPT true an
-   encryption is done, otherwise it will decrypt.  */
+   encryption is done, otherwise it will decrypt.  The input is taken
+   from the INCNT segments at INV and the output is written to the
+   OUTCNT segments at OUTV.  The handle kept in CTX is reused if CTX
+   is not NULL; setting the key and the IV resets its state and the
+   key is cleared again when done.  */
 static int
-cipher_endecrypt (int do_encrypt,
+cipher_endecrypt (tgpg_t ctx, int do_encrypt,
                   int algo, enum cipher_modes mode,
                   const void *key, size_t keylen,
                   const void *iv, size_t ivlen,
                   char *prefix, size_t prefixlen,
-                  void *outbuf, size_t outbufsize,
-                  const void * inbuf, size_t inbuflen)
+                  const struct segment_s *outv, size_t outcnt,
+                  const struct segment_s *inv, size_t incnt)
 {
-  gpg_error_t err;
-  int flags = 0;
+  int rc;
   int pgp_cipher_init = 0;
-  gcry_cipher_hd_t hd;
+  int resync = 0;
+  void *hd;
   size_t bs = _tgpg_cipher_blocklen (algo);
+  struct segcursor_s in = { inv, incnt, 0 };
+  struct segcursor_s out = { outv, outcnt, 0 };
+  size_t i, inlen;
 
   switch (mode)
     {
-    case CIPHER_MODE_CBC: mode = GCRY_CIPHER_MODE_CBC; break;
-    case CIPHER_MODE_CFB: mode = GCRY_CIPHER_MODE_CFB; break;
+    case CIPHER_MODE_CBC:
+    case CIPHER_MODE_CFB:
+      break;
     case CIPHER_MODE_CFB_PGP:
-      flags |= GCRY_CIPHER_ENABLE_SYNC;
+      resync = 1;
       /* Fallthrough.  */
     case CIPHER_MODE_CFB_MDC:
-      mode = GCRY_CIPHER_MODE_CFB;
+      mode = CIPHER_MODE_CFB;
       pgp_cipher_init = 1;
-      if (prefixlen != bs + 2)
+      if (prefixlen != bs + 2 || bs > MAX_BLOCKLEN)
         return TGPG_BUG;
       break;
     default: return TGPG_BUG;
     }
 
-  err = gcry_cipher_open (&hd, algo, mode, flags);
-  if (err)
-    goto leave;
-  err = gcry_cipher_setkey (hd, key, keylen);
-  if (err)
-    goto leave;
-  err = gcry_cipher_setiv (hd, iv, ivlen);
-  if (err)
+  for (inlen = i = 0; i < incnt; i++)
+    inlen += inv[i].length;
+
+  rc = cipher_get_handle (ctx, algo, mode, &hd);
+  if (rc)
+    return rc;
+  rc = _tgpg_crypto->cipher_setup (hd, do_encrypt, key, keylen, iv, ivlen);
+  if (rc)
     goto leave;
 
-  /* Handle cipher initialization and re-synchronization.  */
+  /* Handle cipher initialization and re-synchronization.  The
+     encrypted prefix is collected in CPREFIX for the latter.  */
   if (pgp_cipher_init)
     {
+      unsigned char cprefix[MAX_BLOCKLEN + 2];
+      struct segment_s cseg = { (char *) cprefix, prefixlen };
+      struct segcursor_s ccur = { &cseg, 1, 0 };
+
       if (do_encrypt)
         {
           /* Check that the last two octets are repeated.  */
           if (prefix[bs-2] != prefix[bs] || prefix[bs-1] != prefix[bs+1])
             {
-              err = TGPG_BUG;
+              rc = TGPG_BUG;
               goto leave;
             }
 
-          err = gcry_cipher_encrypt (hd, outbuf, outbufsize,
-                                     prefix, prefixlen);
-          outbuf += prefixlen, outbufsize -= prefixlen;
+          rc = _tgpg_crypto->cipher_crypt (hd, 1, cprefix, prefix, prefixlen);
+          if (!rc)
+            rc = cipher_stream (1, NULL, &out, &ccur, prefixlen);
         }
       else
         {
-          err = gcry_cipher_decrypt (hd, prefix, prefixlen,
-                                     inbuf, prefixlen);
-          if (err)
+          if (inlen < prefixlen)
+            {
+              rc = TGPG_INV_DATA;
+              goto leave;
+            }
+          rc = cipher_stream (0, NULL, &ccur, &in, prefixlen);
+          if (!rc)
+            rc = _tgpg_crypto->cipher_crypt (hd, 0, prefix, cprefix,
+                                             prefixlen);
+          if (rc)
             goto leave;
-          inbuf += prefixlen, inbuflen -= prefixlen;
+          inlen -= prefixlen;
 
           /* The last two octets are repeated.  */
           if (prefix[bs-2] != prefix[bs] || prefix[bs-1] != prefix[bs+1])
-            err = TGPG_WRONG_KEY;
+            {
+              rc = TGPG_WRONG_KEY;
+              goto leave;
+            }
         }
-      if (err)
+      if (rc)
         goto leave;
 
-      err = gcry_cipher_sync (hd);
-      if (err)
-        goto leave;
+      /* Only the old mode without MDC re-synchronizes: the IV for the
+         data is the ciphertext of the prefix after the first two
+         bytes.  */
+      if (resync)
+        {
+          rc = _tgpg_crypto->cipher_setup (hd, do_encrypt, NULL, 0,
+                                           cprefix + 2, bs);
+          if (rc)
+            goto leave;
+        }
     }
 
-  err = \
-    (do_encrypt ? gcry_cipher_encrypt : gcry_cipher_decrypt)    \
-      (hd, outbuf, outbufsize, inbuf, inbuflen);
+  rc = cipher_stream (do_encrypt, hd, &out, &in, inlen);
 
  leave:
-  gcry_cipher_close (hd);
-  return maperr (err);
+  if (!ctx)
+    _tgpg_crypto->cipher_close (hd);
+  else
+    cipher_clear_key (ctx, hd, do_encrypt, keylen, bs);
+  return rc;
 }
 
 /* Decrypt the data at INBUF of length INBUFLEN and write them to the
@@ -343,16 +498,19 @@ cipher_endecrypt (int do_encrypt,
    describes the key and IV and IVLEN the IV.  Returns an error
    code.  */
 int
-_tgpg_cipher_decrypt (int algo, enum cipher_modes mode,
+_tgpg_cipher_decrypt (tgpg_t ctx, int algo, enum cipher_modes mode,
                       const void *key, size_t keylen,
                       const void *iv, size_t ivlen,
                       char *prefix, size_t prefixlen,
                       void *outbuf, size_t outbufsize,
                       const void * inbuf, size_t inbuflen)
 {
-  return cipher_endecrypt (0, algo, mode, key, keylen, iv, ivlen,
+  struct segment_s outseg = { outbuf, outbufsize };
+  struct segment_s inseg = { (char *) inbuf, inbuflen };
+
+  return cipher_endecrypt (ctx, 0, algo, mode, key, keylen, iv, ivlen,
                            prefix, prefixlen,
-                           outbuf, outbufsize, inbuf, inbuflen);
+                           &outseg, 1, &inseg, 1);
 }
 
 /* Encrypt the data at INBUF of length INBUFLEN and write them to the
@@ -361,16 +519,235 @@ _tgpg_cipher_decrypt (int algo, enum cipher_modes mode,
    describes the key and IV and IVLEN the IV.  Returns an error
    code.  */
 int
-_tgpg_cipher_encrypt (int algo, enum cipher_modes mode,
+_tgpg_cipher_encrypt (tgpg_t ctx, int algo, enum cipher_modes mode,
                       const void *key, size_t keylen,
                       const void *iv, size_t ivlen,
                       char *prefix, size_t prefixlen,
                       void *outbuf, size_t outbufsize,
                       const void *inbuf, size_t inbuflen)
 {
-  return cipher_endecrypt (1, algo, mode, key, keylen, iv, ivlen,
+  struct segment_s outseg = { outbuf, outbufsize };
+  struct segment_s inseg = { (char *) inbuf, inbuflen };
+
+  return cipher_endecrypt (ctx, 1, algo, mode, key, keylen, iv, ivlen,
                            prefix, prefixlen,
-                           outbuf, outbufsize, inbuf, inbuflen);
+                           &outseg, 1, &inseg, 1);
+}
+
+/* Same as _tgpg_cipher_decrypt but the input is taken from the INCNT
+   segments at INV and the output is written to the OUTCNT segments
+   at OUTV.  This is used for packet bodies with partial lengths.  */
+int
+_tgpg_cipher_decryptv (tgpg_t ctx, int algo, enum cipher_modes mode,
+                       const void *key, size_t keylen,
+                       const void *iv, size_t ivlen,
+                       char *prefix, size_t prefixlen,
+                       const struct segment_s *outv, size_t outcnt,
+                       const struct segment_s *inv, size_t incnt)
+{
+  return cipher_endecrypt (ctx, 0, algo, mode, key, keylen, iv, ivlen,
+                           prefix, prefixlen,
+                           outv, outcnt, inv, incnt);
+}
+
+/* Same as _tgpg_cipher_encrypt but the input is taken from the INCNT
+   segments at INV and the output is written to the OUTCNT segments
+   at OUTV.  This is used for packet bodies with partial lengths.  */
+int
+_tgpg_cipher_encryptv (tgpg_t ctx, int algo, enum cipher_modes mode,
+                       const void *key, size_t keylen,
+                       const void *iv, size_t ivlen,
+                       char *prefix, size_t prefixlen,
+                       const struct segment_s *outv, size_t outcnt,
+                       const struct segment_s *inv, size_t incnt)
+{
+  return cipher_endecrypt (ctx, 1, algo, mode, key, keylen, iv, ivlen,
+                           prefix, prefixlen,
+                           outv, outcnt, inv, incnt);
+}
+
+
+/* The ciphers which may be used to encrypt messages.  */
+static const int message_ciphers[] =
+  {
+    CIPHER_ALGO_AES, CIPHER_ALGO_AES192, CIPHER_ALGO_AES256, CIPHER_ALGO_CAST5
+  };
+
+/* Those supported by the backend, fastest first.  */
+static int cipher_ranking[sizeof message_ciphers / sizeof *message_ciphers];
+static size_t cipher_nranked;
+
+/* The amount of data used to measure a cipher and the number of
+   measurements of which the best one is taken.  */
+#define MEASURE_LENGTH 16384
+#define MEASURE_ROUNDS 3
+
+/* Return a monotonic time in nanoseconds.  */
+static unsigned long long
+now_ns (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+
+/* Rank the ciphers for messages by the time the selected backend
+   needs to encrypt and decrypt MEASURE_LENGTH bytes with each of
+   them.  Ciphers it does not support are left out.  Called by
+   tgpg_init.  */
+int
+_tgpg_cipher_rank (void)
+{
+  static const unsigned char key[MAX_KEYLEN];
+  static const unsigned char iv[MAX_BLOCKLEN];
+  unsigned long long times[sizeof cipher_ranking / sizeof *cipher_ranking];
+  unsigned long long t, best;
+  char *buffer;
+  size_t i, j, n;
+  int algo, round, rc;
+
+  buffer = xtrycalloc (1, MEASURE_LENGTH);
+  if (!buffer)
+    return TGPG_SYSERROR;
+
+  for (n = i = 0; i < sizeof message_ciphers / sizeof *message_ciphers; i++)
+    {
+      algo = message_ciphers[i];
+      best = ~0ULL;
+      rc = 0;
+      for (round = 0; round < MEASURE_ROUNDS && !rc; round++)
+        {
+          t = now_ns ();
+          rc = _tgpg_cipher_encrypt (NULL, algo, CIPHER_MODE_CFB,
+                                     key, _tgpg_cipher_keylen (algo),
+                                     iv, _tgpg_cipher_blocklen (algo),
+                                     NULL, 0, buffer, MEASURE_LENGTH,
+                                     buffer, MEASURE_LENGTH);
+          if (!rc)
+            rc = _tgpg_cipher_decrypt (NULL, algo, CIPHER_MODE_CFB,
+                                       key, _tgpg_cipher_keylen (algo),
+                                       iv, _tgpg_cipher_blocklen (algo),
+                                       NULL, 0, buffer, MEASURE_LENGTH,
+                                       buffer, MEASURE_LENGTH);
+          t = now_ns () - t;
+          if (t < best)
+            best = t;
+        }
+      if (rc)
+        continue;
+
+      for (j = n; j && times[j-1] > best; j--)
+        {
+          times[j] = times[j-1];
+          cipher_ranking[j] = cipher_ranking[j-1];
+        }
+      times[j] = best;
+      cipher_ranking[j] = algo;
+      n++;
+    }
+  cipher_nranked = n;
+
+  xfree (buffer);
+  return 0;
+}
+
+
+/* Return the fastest cipher for messages with a bit set in ALLOWED,
+   a mask of TGPG_CIPHER_BIT values.  If BLOCKLEN is not 0, only
+   ciphers with that block length are considered.  Returns 0 if none
+   of them is supported.  */
+int
+_tgpg_cipher_fastest (unsigned int allowed, size_t blocklen)
+{
+  size_t i;
+
+  for (i = 0; i < cipher_nranked; i++)
+    if ((allowed & TGPG_CIPHER_BIT (cipher_ranking[i]))
+        && (!blocklen || _tgpg_cipher_blocklen (cipher_ranking[i]) == blocklen))
+      return cipher_ranking[i];
+  return 0;
+}
+
+
+
+/* Return the nonce length in bytes of the OpenPGP AEAD algorithm
+   AEAD_ALGO or 0 if it is not supported.  */
+unsigned int
+_tgpg_cipher_aead_noncelen (int aead_algo)
+{
+  switch (aead_algo)
+    {
+    case AEAD_ALGO_EAX: return 16;
+    case AEAD_ALGO_OCB: return 15;
+    case AEAD_ALGO_GCM: return 12;
+    default: return 0;
+    }
+}
+
+
+/* Create a handle for the AEAD mode AEAD_ALGO of the cipher ALGO
+   using KEY of length KEYLEN.  The key is set up only once, so that
+   the handle can be used for many chunks.  On success the handle is
+   stored at R_HD; it needs to be released using
+   _tgpg_cipher_aead_close.  Returns TGPG_INV_ALGO if the backend does
+   not support the mode.  */
+int
+_tgpg_cipher_aead_open (void **r_hd, int algo, int aead_algo,
+                        const void *key, size_t keylen)
+{
+  return _tgpg_crypto->aead_open (r_hd, algo, aead_algo, key, keylen);
+}
+
+
+/* Release the AEAD handle HD.  Passing NULL is a nop.  */
+void
+_tgpg_cipher_aead_close (void *hd)
+{
+  if (hd)
+    _tgpg_crypto->aead_close (hd);
+}
+
+
+/* En- or decrypt (depending on DO_ENCRYPT) LENGTH bytes from IN to OUT
+   using the AEAD handle HD, the NONCE of length NONCELEN, and the
+   associated data ADATA of length ADATALEN.  When encrypting, the
+   authentication tag of AEAD_TAGLEN bytes is stored at TAG; when
+   decrypting, it is checked against TAG, and TGPG_MDC_FAILED is
+   returned if it does not match.  */
+int
+_tgpg_cipher_aead_crypt (void *hd, int do_encrypt,
+                         const void *nonce, size_t noncelen,
+                         const void *adata, size_t adatalen,
+                         void *out, const void *in, size_t length,
+                         void *tag)
+{
+  return _tgpg_crypto->aead_crypt (hd, do_encrypt, nonce, noncelen,
+                                   adata, adatalen, out, in, length, tag);
+}
+
+
+/* Wrap (if DO_WRAP is set) or unwrap the key of INLEN bytes at IN
+   using the AES key wrap of RFC 3394 with the key encryption key KEK
+   of KEKLEN bytes and the cipher ALGO.  The result is stored at OUT,
+   which must provide space for INLEN + 8 bytes when wrapping and
+   INLEN - 8 bytes when unwrapping.  TGPG_WRONG_KEY is returned if
+   the integrity check of an unwrapped key fails.  */
+int
+_tgpg_cipher_keywrap (int do_wrap, int algo, const void *kek, size_t keklen,
+                      void *out, const void *in, size_t inlen)
+{
+  if (inlen % 8 || inlen < (do_wrap ? 16 : 24))
+    return TGPG_INV_DATA;
+  return _tgpg_crypto->keywrap (do_wrap, algo, kek, keklen, out, in, inlen);
 }
 
 
@@ -390,7 +767,31 @@ void
 _tgpg_hash_buffer (int algo, unsigned char *digest, size_t digestlen,
                    const void *buffer, size_t length)
 {
-  gcry_md_hash_buffer (algo, digest, buffer, length);
+  struct segment_s seg = { (char *) buffer, length };
+
+  _tgpg_crypto->hash_buffers (algo, digest, &seg, 1);
+}
+
+
+/* Hash the data described by the IOVCNT segments at IOV using the
+   hash algorithm ALGO and put the result into DIGEST, which must
+   provide DIGESTLEN bytes.  Unlike a context from _tgpg_hash_open
+   this does not allocate anything; it is used for the MDC of each
+   message, which is short for most messages.  The MDCs of the
+   messages of a batch are computed one at a time by the worker
+   processing the message; there is no multi-buffer hashing.  At most
+   4 segments may be given.  */
+int
+_tgpg_hash_buffers (int algo, unsigned char *digest, size_t digestlen,
+                    const struct segment_s *iov, size_t iovcnt)
+{
+  size_t dlen = _tgpg_crypto->hash_dlen (algo);
+
+  if (!dlen)
+    return TGPG_INV_ALGO;
+  if (iovcnt > 4 || digestlen < dlen)
+    return TGPG_BUG;
+  return _tgpg_crypto->hash_buffers (algo, digest, iov, iovcnt);
 }
 
 
@@ -402,27 +803,26 @@ _tgpg_hash_buffer (int algo, unsigned char *digest, size_t digestlen,
 int
 _tgpg_hash_open (hash_t *rctx, int algo, unsigned int flags)
 {
-  gpg_error_t err;
-  gcry_md_hd_t hd;
+  int rc;
+  void *hd;
   hash_t ctx;
 
   *rctx = NULL;
 
-  err = gcry_md_open (&hd, algo,
-                      (flags & HASH_FLAG_SECURE)? GCRY_MD_FLAG_SECURE : 0);
-  if (err)
-    return maperr (err);
+  rc = _tgpg_crypto->hash_open (&hd, algo, !!(flags & HASH_FLAG_SECURE));
+  if (rc)
+    return rc;
   ctx = xtrymalloc (sizeof *ctx - 1 + HASH_BUFFERSIZE);
   if (!ctx)
     {
       int tmperr = errno;
-      gcry_md_close (hd);
+      _tgpg_crypto->hash_close (hd);
       errno = tmperr;
       return TGPG_SYSERROR;
     }
   ctx->handle = hd;
   ctx->secure = !!(flags & HASH_FLAG_SECURE);
-  ctx->digestlen = gcry_md_get_algo_dlen (algo);
+  ctx->digestlen = _tgpg_crypto->hash_dlen (algo);
   ctx->buffersize = HASH_BUFFERSIZE;
   ctx->bufferpos = 0;
 
@@ -437,9 +837,7 @@ _tgpg_hash_close (hash_t ctx)
 {
   if (ctx)
     {
-      gcry_md_hd_t hd = ctx->handle;
-
-      gcry_md_close (hd);
+      _tgpg_crypto->hash_close (ctx->handle);
       if (ctx->secure)
         wipememory (ctx->buffer, ctx->buffersize);
       xfree (ctx);
@@ -452,9 +850,7 @@ _tgpg_hash_close (hash_t ctx)
 void
 _tgpg_hash_reset (hash_t ctx)
 {
-  gcry_md_hd_t hd = ctx->handle;
-
-  gcry_md_reset (hd);
+  _tgpg_crypto->hash_reset (ctx->handle);
   ctx->bufferpos = 0;
 
 }
@@ -463,15 +859,13 @@ _tgpg_hash_reset (hash_t ctx)
 void
 _tgpg_hash_write (hash_t ctx, const void *buffer, size_t length)
 {
-  gcry_md_hd_t hd = ctx->handle;
-
   if (ctx->bufferpos)
     {
-      gcry_md_write (hd, ctx->buffer, ctx->bufferpos);
+      _tgpg_crypto->hash_write (ctx->handle, ctx->buffer, ctx->bufferpos);
       ctx->bufferpos = 0;
     }
   if (buffer && length)
-    gcry_md_write (hd, buffer, length);
+    _tgpg_crypto->hash_write (ctx->handle, buffer, length);
 }
 
 /* Finalize the hash digest and return it.  The returned value is
@@ -481,13 +875,123 @@ _tgpg_hash_write (hash_t ctx, const void *buffer, size_t length)
 const void *
 _tgpg_hash_read (hash_t ctx)
 {
-  gcry_md_hd_t hd = ctx->handle;
+  /* Flush the buffer.  */
+  _tgpg_hash_write (ctx, NULL, 0);
+  return _tgpg_crypto->hash_read (ctx->handle);
+}
 
-  return gcry_md_read (hd, 0);
+/* Derive LENGTH bytes into the caller provided buffer OUT from the
+   input keying material IKM of length IKMLEN using HKDF (RFC 5869)
+   with the hash algorithm ALGO, the SALT of length SALTLEN, and the
+   INFO of length INFOLEN.  */
+int
+_tgpg_hkdf (int algo, void *out, size_t length,
+            const void *ikm, size_t ikmlen,
+            const void *salt, size_t saltlen,
+            const void *info, size_t infolen)
+{
+  size_t dlen = _tgpg_crypto->hash_dlen (algo);
+
+  if (!dlen || dlen > 64 || length > 255 * dlen)
+    return TGPG_INV_VAL;
+  return _tgpg_crypto->hkdf (algo, out, length, ikm, ikmlen,
+                             salt, saltlen, info, infolen);
+}
+
+
+/* Random pools are filled by the strong RNG in blocks of
+   RANDOM_POOL_SIZE bytes, so that a message does not need a call to
+   the RNG for each of its session key and padding bytes.  Bytes are
+   wiped from the pool as they are handed out.  A pool filled before a
+   fork must not be used by both processes, thus a pool is discarded
+   if it was filled in another generation of processes.  */
+
+#ifdef HAVE_PTHREAD
+/* Incremented in the child after each fork.  */
+static volatile unsigned long fork_generation = 1;
+
+static void
+random_atfork_child (void)
+{
+  fork_generation++;
 }
-
+
+# define random_generation() (fork_generation)
+#else
+# define random_generation() ((unsigned long) getpid ())
+#endif
+
+
+/* Prepare the random pools.  This is called by tgpg_init.  */
+void
+_tgpg_random_init (void)
+{
+#ifdef HAVE_PTHREAD
+  static int initialized;
+
+  if (!initialized)
+    {
+      pthread_atfork (NULL, NULL, random_atfork_child);
+      initialized = 1;
+    }
+#endif
+}
+
+
+void
+_tgpg_randomize (tgpg_t ctx, unsigned char *buffer, size_t length)
+{
+  struct random_pool_s *pool = &ctx->random;
+  unsigned char *p;
+  size_t n;
+
+  if (pool->generation != random_generation ())
+    _tgpg_random_release (ctx);
+
+  /* Large requests are not worth buffering.  */
+  if (length > RANDOM_POOL_SIZE / 4)
+    {
+      _tgpg_crypto->randomize (buffer, length);
+      return;
+    }
+
+  while (length)
+    {
+      if (!pool->avail)
+        {
+          _tgpg_crypto->randomize (pool->buffer, RANDOM_POOL_SIZE);
+          pool->avail = RANDOM_POOL_SIZE;
+          pool->generation = random_generation ();
+        }
+      n = length < pool->avail ? length : pool->avail;
+      p = pool->buffer + RANDOM_POOL_SIZE - pool->avail;
+      memcpy (buffer, p, n);
+      wipememory (p, n);
+      pool->avail -= n;
+      buffer += n;
+      length -= n;
+    }
+}
+
+
 void
-_tgpg_randomize (unsigned char *buffer, size_t length)
+_tgpg_create_nonce (unsigned char *buffer, size_t length)
+{
+  _tgpg_crypto->create_nonce (buffer, length);
+}
+
+
+void
+_tgpg_random_release (tgpg_t ctx)
+{
+  wipememory (ctx->random.buffer, sizeof ctx->random.buffer);
+  ctx->random.avail = 0;
+  ctx->random.generation = 0;
+}
+
+
+unsigned long
+_tgpg_random_generation (void)
 {
-  gcry_randomize (buffer, length, GCRY_STRONG_RANDOM);
+  return random_generation ();
 }
@@ -21,6 +21,102 @@
 #ifndef CRYPTGLUE_H
 #define CRYPTGLUE_H
 
+/*  B a c k e n d s  */
+
+/* The primitives a crypto library provides to this layer.  The
+   OpenPGP specific parts (CFB re-synchronization, segment lists,
+   buffered hashing, the random pools) are implemented on top of them
+   in cryptglue.c.  Algorithms are given by their OpenPGP ids.  The
+   handles are owned by the backend which created them.  */
+struct crypto_backend_s
+{
+  const char *name;
+
+  /* Prepare the backend; called by tgpg_init.  */
+  int (*init) (void);
+
+  /* Return the name of the AES implementation used on this CPU.  */
+  const char *(*kernel) (void);
+
+  /* Public key operations on RSA and Curve25519 ECDH keys as
+     described for _tgpg_pk_decrypt and _tgpg_pk_encrypt.  The NBITS
+     of the encrypted values need not be set.  */
+  int (*pk_decrypt) (int algo, tgpg_mpi_t seckey, tgpg_mpi_t encdat,
+                     char **r_plain, size_t *r_plainlen);
+  int (*pk_encrypt) (int algo, tgpg_mpi_t pubkey,
+                     const char *plain, size_t plainlen,
+                     tgpg_mpi_t *r_encdat, size_t *r_enclen);
+
+  /* Block ciphers in CIPHER_MODE_CBC or CIPHER_MODE_CFB.  Passing
+     NULL for KEY to cipher_setup keeps the key and only sets the IV.
+     Both modes work on any length; CBC is only used with whole
+     blocks.  */
+  unsigned int (*cipher_blocklen) (int algo);
+  unsigned int (*cipher_keylen) (int algo);
+  int  (*cipher_open) (void **r_hd, int algo, int mode);
+  int  (*cipher_setup) (void *hd, int do_encrypt,
+                        const void *key, size_t keylen,
+                        const void *iv, size_t ivlen);
+  int  (*cipher_crypt) (void *hd, int do_encrypt,
+                        void *out, const void *in, size_t length);
+  void (*cipher_close) (void *hd);
+
+  /* AEAD and the AES key wrap, as described for the functions of the
+     same names below.  */
+  int  (*aead_open) (void **r_hd, int algo, int aead_algo,
+                     const void *key, size_t keylen);
+  void (*aead_close) (void *hd);
+  int  (*aead_crypt) (void *hd, int do_encrypt,
+                      const void *nonce, size_t noncelen,
+                      const void *adata, size_t adatalen,
+                      void *out, const void *in, size_t length,
+                      void *tag);
+  int  (*keywrap) (int do_wrap, int algo, const void *kek, size_t keklen,
+                   void *out, const void *in, size_t inlen);
+
+  /* Hash functions.  hash_dlen returns 0 for unsupported algorithms.
+     The digest returned by hash_read is valid until the next call
+     using HD.  */
+  unsigned int (*hash_dlen) (int algo);
+  int  (*hash_buffers) (int algo, unsigned char *digest,
+                        const struct segment_s *iov, size_t iovcnt);
+  int  (*hash_open) (void **r_hd, int algo, int secure);
+  void (*hash_close) (void *hd);
+  void (*hash_reset) (void *hd);
+  void (*hash_write) (void *hd, const void *buffer, size_t length);
+  const void *(*hash_read) (void *hd);
+  int  (*hkdf) (int algo, void *out, size_t length,
+                const void *ikm, size_t ikmlen,
+                const void *salt, size_t saltlen,
+                const void *info, size_t infolen);
+
+  /* Strong random bytes for keys and unpredictable bytes for
+     nonces.  */
+  void (*randomize) (unsigned char *buffer, size_t length);
+  void (*create_nonce) (unsigned char *buffer, size_t length);
+};
+
+/* The backend used by all functions of this layer; it is selected by
+   tgpg_init.  */
+extern const struct crypto_backend_s *_tgpg_crypto;
+
+extern const struct crypto_backend_s _tgpg_crypto_gcrypt;
+#ifdef HAVE_OPENSSL
+extern const struct crypto_backend_s _tgpg_crypto_openssl;
+#endif
+#ifdef HAVE_AFALG
+/* The AF_ALG backend only provides the block ciphers and takes the
+   other primitives from the backend at _TGPG_AFALG_BASE when it is
+   initialized.  */
+extern struct crypto_backend_s _tgpg_crypto_afalg;
+extern const struct crypto_backend_s *_tgpg_afalg_base;
+#endif
+
+/* Select and initialize the backend requested by the TGPG_FLAG_BACKEND
+   bits of FLAGS.  */
+int _tgpg_crypto_select (int flags);
+
+
 /* P u b k e y */
 
 /* The maximum nuber of parameters required in a public key encrypted
@@ -34,7 +130,7 @@ int _tgpg_pk_decrypt (int algo, tgpg_mpi_t seckey, tgpg_mpi_t encdat,
                       char **r_plain, size_t *r_plainlen);
 
 int _tgpg_pk_encrypt (int algo, tgpg_mpi_t pubkey,
-                      char *plain, size_t plainlen,
+                      const char *plain, size_t plainlen,
                       tgpg_mpi_t *r_encdat, size_t *r_enclen);
 
 
@@ -50,18 +146,53 @@ enum cipher_modes
 
 unsigned int _tgpg_cipher_blocklen (int algo);
 unsigned int _tgpg_cipher_keylen (int algo);
-int _tgpg_cipher_decrypt (int algo, enum cipher_modes mode,
+/* The cipher functions take the handle kept in CTX for reuse; CTX
+   may be NULL to use a new handle.  */
+int _tgpg_cipher_decrypt (tgpg_t ctx, int algo, enum cipher_modes mode,
                           const void *key, size_t keylen,
                           const void *iv, size_t ivlen,
                           char *prefix, size_t prefixlen,
                           void *outbuf, size_t outbufsize,
                           const void * inbuf, size_t inbuflen);
-int _tgpg_cipher_encrypt (int algo, enum cipher_modes mode,
+int _tgpg_cipher_encrypt (tgpg_t ctx, int algo, enum cipher_modes mode,
                           const void *key, size_t keylen,
                           const void *iv, size_t ivlen,
                           char *prefix, size_t prefixlen,
                           void *outbuf, size_t outbufsize,
                           const void *inbuf, size_t inbuflen);
+int _tgpg_cipher_decryptv (tgpg_t ctx, int algo, enum cipher_modes mode,
+                           const void *key, size_t keylen,
+                           const void *iv, size_t ivlen,
+                           char *prefix, size_t prefixlen,
+                           const struct segment_s *outv, size_t outcnt,
+                           const struct segment_s *inv, size_t incnt);
+int _tgpg_cipher_encryptv (tgpg_t ctx, int algo, enum cipher_modes mode,
+                           const void *key, size_t keylen,
+                           const void *iv, size_t ivlen,
+                           char *prefix, size_t prefixlen,
+                           const struct segment_s *outv, size_t outcnt,
+                           const struct segment_s *inv, size_t incnt);
+void _tgpg_cipher_release (tgpg_t ctx);
+
+int _tgpg_cipher_rank (void);
+int _tgpg_cipher_fastest (unsigned int allowed, size_t blocklen);
+
+/* The length of the authentication tag of all AEAD modes.  */
+#define AEAD_TAGLEN 16
+
+unsigned int _tgpg_cipher_aead_noncelen (int aead_algo);
+int _tgpg_cipher_aead_open (void **r_hd, int algo, int aead_algo,
+                            const void *key, size_t keylen);
+void _tgpg_cipher_aead_close (void *hd);
+int _tgpg_cipher_aead_crypt (void *hd, int do_encrypt,
+                             const void *nonce, size_t noncelen,
+                             const void *adata, size_t adatalen,
+                             void *out, const void *in, size_t length,
+                             void *tag);
+
+int _tgpg_cipher_keywrap (int do_wrap, int algo,
+                          const void *kek, size_t keklen,
+                          void *out, const void *in, size_t inlen);
 
 
 /*  H a s h  */
@@ -89,34 +220,61 @@ typedef struct hash_context_s *hash_t;
                 _tgpg_hash_write ( c_, NULL, 0 );       \
               c_->buffer[c_->bufferpos++] = (b);        \
             } while (0)
-/* Update the ash context CTX with L bytes from buffer B.  */
+/* Update the hash context CTX with L bytes from buffer B.  Data
+   which does not fit into the buffer is passed on directly.  */
 #define hash_putbuf(ctx,b,l)  \
             do {                                                   \
               hash_t c_ = (ctx);                                   \
-              const unsigned char *p_ = (const unsigned char*)(b); \
               size_t l_ = (l);                                     \
-              for ( ;l_; l_--, p_++)                               \
+              if ( l_ <= c_->buffersize - c_->bufferpos )          \
                 {                                                  \
-                  if ( c_->bufferpos == c_->buffersize )           \
-                    _tgpg_hash_write ( c_, NULL, 0 );              \
-                  c_->buffer[c_->bufferpos++] = *p_;               \
+                  memcpy (c_->buffer + c_->bufferpos, (b), l_);    \
+                  c_->bufferpos += l_;                             \
                 }                                                  \
+              else                                                 \
+                _tgpg_hash_write ( c_, (b), l_ );                  \
             } while (0)
 /* Return the length of the resulting digest of context CTX.  */
 #define hash_digestlen(ctx)  ((ctx)->digestlen)
 
 void _tgpg_hash_buffer (int algo, unsigned char *digest, size_t digestlen,
                         const void *buffer, size_t length);
+int  _tgpg_hash_buffers (int algo, unsigned char *digest, size_t digestlen,
+                         const struct segment_s *iov, size_t iovcnt);
 int  _tgpg_hash_open (hash_t *rctx, int algo, unsigned int flags);
 void _tgpg_hash_close (hash_t ctx);
 void _tgpg_hash_reset (hash_t ctx);
 void _tgpg_hash_write (hash_t ctx, const void *buffer, size_t length);
 const void *_tgpg_hash_read (hash_t ctx);
+
+int _tgpg_hkdf (int algo, void *out, size_t length,
+                const void *ikm, size_t ikmlen,
+                const void *salt, size_t saltlen,
+                const void *info, size_t infolen);
 
+/* S-expressions.  */
+
+int _tgpg_sexp_canon (const char *text, size_t length,
+                      unsigned char **r_sexp, size_t *r_len);
+
 /* Random data. */
 
+/* Prepare the random pools; called once by tgpg_init.  */
+void _tgpg_random_init (void);
+
 /* Fill BUFFER of given LENGTH with random data suitable for session
-   keys.  */
-void _tgpg_randomize (unsigned char *buffer, size_t length);
+   keys taken from the random pool of CTX.  */
+void _tgpg_randomize (tgpg_t ctx, unsigned char *buffer, size_t length);
+
+/* Fill BUFFER of given LENGTH with unpredictable data suitable for
+   nonces and other public values.  */
+void _tgpg_create_nonce (unsigned char *buffer, size_t length);
+
+/* Wipe the random pool of CTX.  */
+void _tgpg_random_release (tgpg_t ctx);
+
+/* Return a value identifying the current process; it changes in the
+   child after a fork.  */
+unsigned long _tgpg_random_generation (void);
 
 #endif /*CRYPTGLUE_H*/
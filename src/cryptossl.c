@@ -0,0 +1,991 @@
+/* cryptossl.c - Crypto backend using OpenSSL's libcrypto.
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <openssl/evp.h>
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#include <openssl/provider.h>
+
+#include "tgpgdefs.h"
+#include "cryptglue.h"
+
+/* The length of the X coordinate and of the secret scalar of
+   Curve25519.  */
+#define X25519_LEN 32
+
+#define DIM(v) (sizeof (v) / sizeof ((v)[0]))
+
+/* The kinds of cipher implementations fetched from the providers.  */
+enum cipher_kinds
+  {
+    KIND_CFB,
+    KIND_CBC,
+    KIND_WRAP,
+    KIND_GCM,
+    KIND_OCB,
+    N_KINDS
+  };
+
+/* The supported ciphers.  The implementations are fetched once by
+   osl_init, because fetching them implicitly for each operation
+   takes a lock and a lookup.  CAST5 is only available if the legacy
+   provider can be loaded.  EAX is not implemented by OpenSSL.  */
+static struct
+{
+  int algo;
+  unsigned int blocklen;
+  unsigned int keylen;
+  const char *names[N_KINDS];
+  EVP_CIPHER *cipher[N_KINDS];
+} ciphers[] =
+  {
+    { CIPHER_ALGO_3DES,    8, 24,
+      { "DES-EDE3-CFB", "DES-EDE3-CBC" } },
+    { CIPHER_ALGO_CAST5,   8, 16,
+      { "CAST5-CFB", "CAST5-CBC" } },
+    { CIPHER_ALGO_AES,    16, 16,
+      { "AES-128-CFB", "AES-128-CBC", "AES-128-WRAP",
+        "AES-128-GCM", "AES-128-OCB" } },
+    { CIPHER_ALGO_AES192, 16, 24,
+      { "AES-192-CFB", "AES-192-CBC", "AES-192-WRAP",
+        "AES-192-GCM", "AES-192-OCB" } },
+    { CIPHER_ALGO_AES256, 16, 32,
+      { "AES-256-CFB", "AES-256-CBC", "AES-256-WRAP",
+        "AES-256-GCM", "AES-256-OCB" } }
+  };
+
+/* The supported hash algorithms.  */
+static struct
+{
+  int algo;
+  const char *name;
+  EVP_MD *md;
+} digests[] =
+  {
+    { MD_ALGO_MD5,    "MD5" },
+    { MD_ALGO_SHA1,   "SHA1" },
+    { MD_ALGO_RMD160, "RIPEMD160" },
+    { MD_ALGO_SHA256, "SHA256" },
+    { MD_ALGO_SHA384, "SHA384" },
+    { MD_ALGO_SHA512, "SHA512" }
+  };
+
+static EVP_KDF *hkdf;
+
+
+/* Fetch the algorithm implementations.  The legacy provider is loaded
+   for CAST5 if it is available; loading a provider explicitly
+   disables the implicit loading of the default provider, thus that
+   one is loaded as well.  */
+static int
+osl_init (void)
+{
+  static int initialized;
+  size_t i, k;
+
+  if (initialized)
+    return 0;
+
+  if (OSSL_PROVIDER_try_load (NULL, "legacy", 1))
+    OSSL_PROVIDER_load (NULL, "default");
+  for (i = 0; i < DIM (ciphers); i++)
+    for (k = 0; k < N_KINDS; k++)
+      if (ciphers[i].names[k])
+        ciphers[i].cipher[k] = EVP_CIPHER_fetch (NULL, ciphers[i].names[k],
+                                                 NULL);
+  for (i = 0; i < DIM (digests); i++)
+    digests[i].md = EVP_MD_fetch (NULL, digests[i].name, NULL);
+  hkdf = EVP_KDF_fetch (NULL, "HKDF", NULL);
+  if (!hkdf)
+    return TGPG_NOT_IMPL;
+
+  initialized = 1;
+  return 0;
+}
+
+
+static const char *
+osl_kernel (void)
+{
+  return "openssl";
+}
+
+
+
+/*
+
+     P U B K E Y   F u n c t i o n s
+
+*/
+
+/* Return a new BIGNUM for the MPI A.  */
+static BIGNUM *
+mpi2bn (tgpg_mpi_t a)
+{
+  return BN_bin2bn ((const unsigned char *) a->value, a->valuelen, NULL);
+}
+
+
+/* Create an RSA key from the public parameters in KEY and, if SECRET
+   is set, the secret parameters as well.  OpenPGP uses p < q and
+   u = p^-1 mod q, whereas OpenSSL's coefficient is the inverse of its
+   second factor; thus the factors are passed in swapped order.  */
+static EVP_PKEY *
+rsa_key (tgpg_mpi_t key, int secret)
+{
+  EVP_PKEY *pkey = NULL;
+  EVP_PKEY_CTX *pctx = NULL;
+  OSSL_PARAM_BLD *bld = NULL;
+  OSSL_PARAM *params = NULL;
+  BN_CTX *bnctx = NULL;
+  BIGNUM *bn[8] = { NULL };
+  size_t i;
+
+  bld = OSSL_PARAM_BLD_new ();
+  if (!bld)
+    goto leave;
+  bn[0] = mpi2bn (&key[0]);
+  bn[1] = mpi2bn (&key[1]);
+  if (!bn[0] || !bn[1]
+      || !OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_N, bn[0])
+      || !OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_E, bn[1]))
+    goto leave;
+  if (secret)
+    {
+      /* d, q, p and u followed by d mod (q-1) and d mod (p-1).  */
+      bn[2] = BN_secure_new ();
+      bn[3] = BN_secure_new ();
+      bn[4] = BN_secure_new ();
+      bn[5] = BN_secure_new ();
+      bn[6] = BN_secure_new ();
+      bn[7] = BN_secure_new ();
+      bnctx = BN_CTX_secure_new ();
+      if (!bnctx)
+        goto leave;
+      for (i = 2; i < 8; i++)
+        if (!bn[i])
+          goto leave;
+      BN_set_flags (bn[2], BN_FLG_CONSTTIME);
+      if (!BN_bin2bn ((const unsigned char *) key[2].value,
+                      key[2].valuelen, bn[2])
+          || !BN_bin2bn ((const unsigned char *) key[4].value,
+                         key[4].valuelen, bn[3])
+          || !BN_bin2bn ((const unsigned char *) key[3].value,
+                         key[3].valuelen, bn[4])
+          || !BN_bin2bn ((const unsigned char *) key[5].value,
+                         key[5].valuelen, bn[5]))
+        goto leave;
+      if (!BN_sub (bn[6], bn[3], BN_value_one ())
+          || !BN_mod (bn[6], bn[2], bn[6], bnctx)
+          || !BN_sub (bn[7], bn[4], BN_value_one ())
+          || !BN_mod (bn[7], bn[2], bn[7], bnctx))
+        goto leave;
+      if (!OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_D, bn[2])
+          || !OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_FACTOR1, bn[3])
+          || !OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_FACTOR2, bn[4])
+          || !OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_EXPONENT1,
+                                      bn[6])
+          || !OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_EXPONENT2,
+                                      bn[7])
+          || !OSSL_PARAM_BLD_push_BN (bld, OSSL_PKEY_PARAM_RSA_COEFFICIENT1,
+                                      bn[5]))
+        goto leave;
+    }
+  params = OSSL_PARAM_BLD_to_param (bld);
+  pctx = EVP_PKEY_CTX_new_from_name (NULL, "RSA", NULL);
+  if (!params || !pctx || EVP_PKEY_fromdata_init (pctx) <= 0)
+    goto leave;
+  if (EVP_PKEY_fromdata (pctx, &pkey,
+                         secret? EVP_PKEY_KEYPAIR : EVP_PKEY_PUBLIC_KEY,
+                         params) <= 0)
+    pkey = NULL;
+
+ leave:
+  EVP_PKEY_CTX_free (pctx);
+  OSSL_PARAM_free (params);
+  OSSL_PARAM_BLD_free (bld);
+  BN_CTX_free (bnctx);
+  BN_free (bn[0]);
+  BN_free (bn[1]);
+  for (i = 2; i < 8; i++)
+    BN_clear_free (bn[i]);
+  return pkey;
+}
+
+
+/* Run the raw RSA operation (DO_ENCRYPT selects the public one) using
+   PKEY on the value at IN of INLEN bytes.  The result is stored
+   without leading zeros in a newly allocated buffer at R_OUT and its
+   length at R_OUTLEN.  */
+static int
+rsa_crypt (EVP_PKEY *pkey, int do_encrypt, const char *in, size_t inlen,
+           char **r_out, size_t *r_outlen)
+{
+  int rc = TGPG_CRYPT_ERR;
+  EVP_PKEY_CTX *pctx;
+  unsigned char *buffer = NULL;
+  unsigned char *out = NULL;
+  size_t nbytes = EVP_PKEY_get_size (pkey);
+  size_t outlen, skip;
+
+  pctx = EVP_PKEY_CTX_new_from_pkey (NULL, pkey, NULL);
+  if (!pctx)
+    return TGPG_CRYPT_ERR;
+
+  /* The raw operation takes input of the length of the modulus.  */
+  while (inlen && !*in)
+    {
+      in++;
+      inlen--;
+    }
+  if (inlen > nbytes)
+    {
+      rc = TGPG_INV_DATA;
+      goto leave;
+    }
+  buffer = xtrycalloc (1, nbytes);
+  out = xtrymalloc (nbytes);
+  if (!buffer || !out)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  memcpy (buffer + nbytes - inlen, in, inlen);
+
+  outlen = nbytes;
+  if (do_encrypt)
+    {
+      if (EVP_PKEY_encrypt_init (pctx) <= 0
+          || EVP_PKEY_CTX_set_rsa_padding (pctx, RSA_NO_PADDING) <= 0
+          || EVP_PKEY_encrypt (pctx, out, &outlen, buffer, nbytes) <= 0)
+        goto leave;
+    }
+  else
+    {
+      if (EVP_PKEY_decrypt_init (pctx) <= 0
+          || EVP_PKEY_CTX_set_rsa_padding (pctx, RSA_NO_PADDING) <= 0
+          || EVP_PKEY_decrypt (pctx, out, &outlen, buffer, nbytes) <= 0)
+        goto leave;
+    }
+
+  for (skip = 0; skip < outlen && !out[skip]; skip++)
+    ;
+  if (skip == outlen)
+    goto leave;
+  memmove (out, out + skip, outlen - skip);
+  *r_out = (char *) out;
+  *r_outlen = outlen - skip;
+  out = NULL;
+  rc = 0;
+
+ leave:
+  if (buffer)
+    {
+      wipememory (buffer, nbytes);
+      xfree (buffer);
+    }
+  if (out)
+    {
+      wipememory (out, nbytes);
+      xfree (out);
+    }
+  EVP_PKEY_CTX_free (pctx);
+  return rc;
+}
+
+
+/* Compute the X25519 function of the secret scalar SECRET in native
+   byte order and the point POINT, which is given in OpenPGP format
+   (0x40 || X).  POINT may be NULL for the base point.  The result is
+   stored in OpenPGP format at OUT.  */
+static int
+x25519 (const unsigned char *secret, tgpg_mpi_t point,
+        unsigned char out[1 + X25519_LEN])
+{
+  int rc = TGPG_CRYPT_ERR;
+  EVP_PKEY *priv, *peer = NULL;
+  EVP_PKEY_CTX *pctx = NULL;
+  size_t outlen = X25519_LEN;
+
+  priv = EVP_PKEY_new_raw_private_key (EVP_PKEY_X25519, NULL,
+                                       secret, X25519_LEN);
+  if (!priv)
+    return TGPG_CRYPT_ERR;
+
+  out[0] = 0x40;
+  if (!point)
+    {
+      if (EVP_PKEY_get_raw_public_key (priv, out + 1, &outlen) > 0)
+        rc = 0;
+      goto leave;
+    }
+
+  if (point->valuelen != 1 + X25519_LEN
+      || ((const unsigned char *) point->value)[0] != 0x40)
+    {
+      rc = TGPG_INV_DATA;
+      goto leave;
+    }
+  peer = EVP_PKEY_new_raw_public_key (EVP_PKEY_X25519, NULL,
+                                      (const unsigned char *) point->value + 1,
+                                      X25519_LEN);
+  pctx = EVP_PKEY_CTX_new_from_pkey (NULL, priv, NULL);
+  if (peer && pctx
+      && EVP_PKEY_derive_init (pctx) > 0
+      && EVP_PKEY_derive_set_peer (pctx, peer) > 0
+      && EVP_PKEY_derive (pctx, out + 1, &outlen) > 0
+      && outlen == X25519_LEN)
+    rc = 0;
+
+ leave:
+  EVP_PKEY_CTX_free (pctx);
+  EVP_PKEY_free (peer);
+  EVP_PKEY_free (priv);
+  return rc;
+}
+
+
+/* Return a newly allocated copy of the LENGTH bytes at BUFFER.  */
+static char *
+copy_buffer (const void *buffer, size_t length)
+{
+  char *p = xtrymalloc (length);
+
+  if (p)
+    memcpy (p, buffer, length);
+  return p;
+}
+
+
+static int
+osl_pk_decrypt (int algo, tgpg_mpi_t seckey, tgpg_mpi_t encdat,
+                char **r_plain, size_t *r_plainlen)
+{
+  int rc;
+  EVP_PKEY *pkey;
+  unsigned char d[X25519_LEN];
+  unsigned char shared[1 + X25519_LEN];
+  size_t i, n;
+
+  if (algo == PK_ALGO_RSA)
+    {
+      pkey = rsa_key (seckey, 1);
+      if (!pkey)
+        return TGPG_INV_DATA;
+      rc = rsa_crypt (pkey, 0, encdat[0].value, encdat[0].valuelen,
+                      r_plain, r_plainlen);
+      EVP_PKEY_free (pkey);
+      return rc;
+    }
+
+  /* OpenPGP stores the secret scalar of Curve25519 as a big endian
+     MPI; the native format is little endian.  */
+  n = seckey[3].valuelen;
+  if (!n || n > X25519_LEN)
+    return TGPG_INV_DATA;
+  memset (d, 0, sizeof d);
+  for (i = 0; i < n; i++)
+    d[i] = ((const unsigned char *) seckey[3].value)[n - 1 - i];
+
+  rc = x25519 (d, &encdat[0], shared);
+  wipememory (d, sizeof d);
+  if (!rc)
+    {
+      *r_plain = copy_buffer (shared, sizeof shared);
+      if (!*r_plain)
+        rc = TGPG_SYSERROR;
+      else
+        *r_plainlen = sizeof shared;
+    }
+  wipememory (shared, sizeof shared);
+  return rc;
+}
+
+
+static int
+osl_pk_encrypt (int algo, tgpg_mpi_t pubkey,
+                const char *plain, size_t plainlen,
+                tgpg_mpi_t *r_encdat, size_t *r_enclen)
+{
+  int rc;
+  EVP_PKEY *pkey;
+  tgpg_mpi_t encdat;
+  char *value = NULL;
+  unsigned char point[1 + X25519_LEN];
+
+  *r_enclen = _tgpg_pk_get_nenc (algo);
+  encdat = *r_encdat = xtrycalloc (*r_enclen, sizeof *encdat);
+  if (!encdat)
+    return TGPG_SYSERROR;
+
+  if (algo == PK_ALGO_RSA)
+    {
+      pkey = rsa_key (pubkey, 0);
+      if (!pkey)
+        return TGPG_INV_DATA;
+      rc = rsa_crypt (pkey, 1, plain, plainlen, &value, &encdat[0].valuelen);
+      EVP_PKEY_free (pkey);
+      encdat[0].value = value;
+      return rc;
+    }
+
+  /* PLAIN is the ephemeral secret; any 32 bytes will do.  */
+  if (plainlen != X25519_LEN)
+    return TGPG_INV_DATA;
+  rc = x25519 ((const unsigned char *) plain, NULL, point);
+  if (rc)
+    return rc;
+  encdat[0].value = copy_buffer (point, sizeof point);
+  encdat[0].valuelen = sizeof point;
+  rc = x25519 ((const unsigned char *) plain, &pubkey[1], point);
+  if (!rc)
+    {
+      encdat[1].value = copy_buffer (point, sizeof point);
+      encdat[1].valuelen = sizeof point;
+      if (!encdat[0].value || !encdat[1].value)
+        rc = TGPG_SYSERROR;
+    }
+  wipememory (point, sizeof point);
+  return rc;
+}
+
+
+
+/*
+
+     C I P H E R   F u n c t i o n s
+
+*/
+
+/* Return the entry of the table for the cipher ALGO or -1.  */
+static int
+cipher_index (int algo)
+{
+  int i;
+
+  for (i = 0; i < DIM (ciphers); i++)
+    if (ciphers[i].algo == algo)
+      return i;
+  return -1;
+}
+
+/* Return the implementation of KIND for the cipher ALGO or NULL.  */
+static const EVP_CIPHER *
+get_cipher (int algo, enum cipher_kinds kind)
+{
+  int i = cipher_index (algo);
+
+  return i < 0 ? NULL : ciphers[i].cipher[kind];
+}
+
+
+static unsigned int
+osl_cipher_blocklen (int algo)
+{
+  int i = cipher_index (algo);
+
+  return i < 0 ? 0 : ciphers[i].blocklen;
+}
+
+
+static unsigned int
+osl_cipher_keylen (int algo)
+{
+  int i = cipher_index (algo);
+
+  return i < 0 ? 0 : ciphers[i].keylen;
+}
+
+
+/* A cipher handle.  */
+struct cipher_hd_s
+{
+  EVP_CIPHER_CTX *ctx;
+  const EVP_CIPHER *cipher;
+  int mode;
+};
+
+
+static int
+osl_cipher_open (void **r_hd, int algo, int mode)
+{
+  struct cipher_hd_s *hd;
+  const EVP_CIPHER *cipher;
+
+  *r_hd = NULL;
+  switch (mode)
+    {
+    case CIPHER_MODE_CBC: cipher = get_cipher (algo, KIND_CBC); break;
+    case CIPHER_MODE_CFB: cipher = get_cipher (algo, KIND_CFB); break;
+    default: return TGPG_BUG;
+    }
+  if (!cipher)
+    return TGPG_INV_ALGO;
+
+  hd = xtrymalloc (sizeof *hd);
+  if (!hd)
+    return TGPG_SYSERROR;
+  hd->ctx = EVP_CIPHER_CTX_new ();
+  if (!hd->ctx)
+    {
+      xfree (hd);
+      return TGPG_CRYPT_ERR;
+    }
+  hd->cipher = cipher;
+  hd->mode = mode;
+  *r_hd = hd;
+  return 0;
+}
+
+
+static int
+osl_cipher_setup (void *opaque, int do_encrypt,
+                  const void *key, size_t keylen,
+                  const void *iv, size_t ivlen)
+{
+  struct cipher_hd_s *hd = opaque;
+
+  if (key && keylen != EVP_CIPHER_get_key_length (hd->cipher))
+    return TGPG_CRYPT_ERR;
+  if (ivlen != EVP_CIPHER_get_iv_length (hd->cipher))
+    return TGPG_CRYPT_ERR;
+
+  if (!EVP_CipherInit_ex (hd->ctx, key? hd->cipher : NULL, NULL,
+                          key, iv, do_encrypt))
+    return TGPG_CRYPT_ERR;
+  if (hd->mode == CIPHER_MODE_CBC)
+    EVP_CIPHER_CTX_set_padding (hd->ctx, 0);
+  return 0;
+}
+
+
+static int
+osl_cipher_crypt (void *opaque, int do_encrypt,
+                  void *out, const void *in, size_t length)
+{
+  struct cipher_hd_s *hd = opaque;
+  unsigned char *o = out;
+  const unsigned char *i = in;
+  int n, outl;
+
+  while (length)
+    {
+      n = length > INT_MAX / 2 ? INT_MAX / 2 : length;
+      if (!EVP_CipherUpdate (hd->ctx, o, &outl, i, n) || outl != n)
+        return TGPG_CRYPT_ERR;
+      o += n;
+      i += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+static void
+osl_cipher_close (void *opaque)
+{
+  struct cipher_hd_s *hd = opaque;
+
+  EVP_CIPHER_CTX_free (hd->ctx);
+  xfree (hd);
+}
+
+
+/* An AEAD handle.  OpenSSL's OCB needs the key to be set again when
+   switching between encryption and decryption, thus we keep it.  */
+struct aead_hd_s
+{
+  EVP_CIPHER_CTX *ctx;
+  int enc;                  /* The direction the key was set for.  */
+  size_t keylen;
+  unsigned char key[32];
+};
+
+
+static int
+osl_aead_open (void **r_hd, int algo, int aead_algo,
+               const void *key, size_t keylen)
+{
+  const EVP_CIPHER *cipher;
+  struct aead_hd_s *hd;
+
+  *r_hd = NULL;
+  switch (aead_algo)
+    {
+    case AEAD_ALGO_OCB: cipher = get_cipher (algo, KIND_OCB); break;
+    case AEAD_ALGO_GCM: cipher = get_cipher (algo, KIND_GCM); break;
+    default: return TGPG_INV_ALGO;
+    }
+  if (!cipher)
+    return TGPG_INV_ALGO;
+  if (keylen != EVP_CIPHER_get_key_length (cipher) || keylen > 32)
+    return TGPG_CRYPT_ERR;
+
+  hd = xtrymalloc (sizeof *hd);
+  if (!hd)
+    return TGPG_SYSERROR;
+  hd->ctx = EVP_CIPHER_CTX_new ();
+  if (!hd->ctx
+      || !EVP_CipherInit_ex (hd->ctx, cipher, NULL, NULL, NULL, 1)
+      || !EVP_CIPHER_CTX_ctrl (hd->ctx, EVP_CTRL_AEAD_SET_IVLEN,
+                               _tgpg_cipher_aead_noncelen (aead_algo), NULL)
+      || !EVP_CipherInit_ex (hd->ctx, NULL, NULL, key, NULL, 1))
+    {
+      EVP_CIPHER_CTX_free (hd->ctx);
+      xfree (hd);
+      return TGPG_CRYPT_ERR;
+    }
+  hd->enc = 1;
+  hd->keylen = keylen;
+  memcpy (hd->key, key, keylen);
+
+  *r_hd = hd;
+  return 0;
+}
+
+
+static void
+osl_aead_close (void *opaque)
+{
+  struct aead_hd_s *hd = opaque;
+
+  EVP_CIPHER_CTX_free (hd->ctx);
+  wipememory (hd->key, sizeof hd->key);
+  xfree (hd);
+}
+
+
+static int
+osl_aead_crypt (void *opaque, int do_encrypt,
+                const void *nonce, size_t noncelen,
+                const void *adata, size_t adatalen,
+                void *out, const void *in, size_t length,
+                void *tag)
+{
+  struct aead_hd_s *hd = opaque;
+  EVP_CIPHER_CTX *ctx = hd->ctx;
+  unsigned char *o = out;
+  const unsigned char *i = in;
+  int n, outl;
+
+  do_encrypt = !!do_encrypt;
+  if (noncelen != EVP_CIPHER_CTX_get_iv_length (ctx)
+      || !EVP_CipherInit_ex (ctx, NULL, NULL,
+                             do_encrypt == hd->enc ? NULL : hd->key,
+                             nonce, do_encrypt))
+    return TGPG_CRYPT_ERR;
+  hd->enc = do_encrypt;
+  if (!do_encrypt
+      && !EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAGLEN,
+                               tag))
+    return TGPG_CRYPT_ERR;
+  if (adatalen && !EVP_CipherUpdate (ctx, NULL, &outl, adata, adatalen))
+    return TGPG_CRYPT_ERR;
+
+  /* OCB may hold back a partial block until the final call.  */
+  while (length)
+    {
+      n = length > INT_MAX / 2 ? INT_MAX / 2 : length;
+      if (!EVP_CipherUpdate (ctx, o, &outl, i, n))
+        return TGPG_CRYPT_ERR;
+      o += outl;
+      i += n;
+      length -= n;
+    }
+  if (!EVP_CipherFinal_ex (ctx, o, &outl))
+    return do_encrypt? TGPG_CRYPT_ERR : TGPG_MDC_FAILED;
+
+  if (do_encrypt
+      && !EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAGLEN, tag))
+    return TGPG_CRYPT_ERR;
+  return 0;
+}
+
+
+static int
+osl_keywrap (int do_wrap, int algo, const void *kek, size_t keklen,
+             void *out, const void *in, size_t inlen)
+{
+  int rc = TGPG_CRYPT_ERR;
+  const EVP_CIPHER *cipher = get_cipher (algo, KIND_WRAP);
+  EVP_CIPHER_CTX *ctx;
+  int outl, finl;
+
+  if (!cipher)
+    return TGPG_INV_ALGO;
+  if (keklen != EVP_CIPHER_get_key_length (cipher))
+    return TGPG_CRYPT_ERR;
+
+  ctx = EVP_CIPHER_CTX_new ();
+  if (!ctx)
+    return TGPG_CRYPT_ERR;
+  EVP_CIPHER_CTX_set_flags (ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+  if (EVP_CipherInit_ex (ctx, cipher, NULL, kek, NULL, do_wrap))
+    {
+      if (EVP_CipherUpdate (ctx, out, &outl, in, inlen) > 0
+          && EVP_CipherFinal_ex (ctx, (unsigned char *) out + outl, &finl) > 0
+          && outl + finl == (do_wrap ? inlen + 8 : inlen - 8))
+        rc = 0;
+      else if (!do_wrap)
+        rc = TGPG_WRONG_KEY;
+    }
+  EVP_CIPHER_CTX_free (ctx);
+  return rc;
+}
+
+
+
+/*
+
+     H A S H   F u n c t i o n s
+
+*/
+
+/* Return the implementation of the hash ALGO or NULL.  */
+static const EVP_MD *
+get_md (int algo)
+{
+  size_t i;
+
+  for (i = 0; i < DIM (digests); i++)
+    if (digests[i].algo == algo)
+      return digests[i].md;
+  return NULL;
+}
+
+
+static unsigned int
+osl_hash_dlen (int algo)
+{
+  const EVP_MD *md = get_md (algo);
+
+  return md ? EVP_MD_get_size (md) : 0;
+}
+
+
+static int
+osl_hash_buffers (int algo, unsigned char *digest,
+                  const struct segment_s *iov, size_t iovcnt)
+{
+  const EVP_MD *md = get_md (algo);
+  EVP_MD_CTX *ctx;
+  int ok;
+
+  if (!md)
+    return TGPG_INV_ALGO;
+  ctx = EVP_MD_CTX_new ();
+  if (!ctx)
+    return TGPG_CRYPT_ERR;
+  ok = EVP_DigestInit_ex (ctx, md, NULL);
+  for (; ok && iovcnt; iov++, iovcnt--)
+    ok = EVP_DigestUpdate (ctx, iov->data, iov->length);
+  if (ok)
+    ok = EVP_DigestFinal_ex (ctx, digest, NULL);
+  EVP_MD_CTX_free (ctx);
+  return ok? 0 : TGPG_CRYPT_ERR;
+}
+
+
+/* A hash handle.  The digest is kept for hash_read, which may be
+   called more than once.  */
+struct hash_hd_s
+{
+  EVP_MD_CTX *ctx;
+  const EVP_MD *md;
+  int finalized;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+};
+
+
+static int
+osl_hash_open (void **r_hd, int algo, int secure)
+{
+  const EVP_MD *md = get_md (algo);
+  struct hash_hd_s *hd;
+
+  *r_hd = NULL;
+  if (!md)
+    return TGPG_INV_ALGO;
+  hd = xtrymalloc (sizeof *hd);
+  if (!hd)
+    return TGPG_SYSERROR;
+  hd->ctx = EVP_MD_CTX_new ();
+  if (!hd->ctx || !EVP_DigestInit_ex (hd->ctx, md, NULL))
+    {
+      EVP_MD_CTX_free (hd->ctx);
+      xfree (hd);
+      return TGPG_CRYPT_ERR;
+    }
+  hd->md = md;
+  hd->finalized = 0;
+  *r_hd = hd;
+  return 0;
+}
+
+
+static void
+osl_hash_close (void *opaque)
+{
+  struct hash_hd_s *hd = opaque;
+
+  EVP_MD_CTX_free (hd->ctx);
+  wipememory (hd->digest, sizeof hd->digest);
+  xfree (hd);
+}
+
+
+static void
+osl_hash_reset (void *opaque)
+{
+  struct hash_hd_s *hd = opaque;
+
+  EVP_DigestInit_ex (hd->ctx, hd->md, NULL);
+  hd->finalized = 0;
+}
+
+
+static void
+osl_hash_write (void *opaque, const void *buffer, size_t length)
+{
+  struct hash_hd_s *hd = opaque;
+
+  if (!hd->finalized)
+    EVP_DigestUpdate (hd->ctx, buffer, length);
+}
+
+
+static const void *
+osl_hash_read (void *opaque)
+{
+  struct hash_hd_s *hd = opaque;
+
+  if (!hd->finalized)
+    {
+      EVP_DigestFinal_ex (hd->ctx, hd->digest, NULL);
+      hd->finalized = 1;
+    }
+  return hd->digest;
+}
+
+
+static int
+osl_hkdf (int algo, void *out, size_t length,
+          const void *ikm, size_t ikmlen,
+          const void *salt, size_t saltlen,
+          const void *info, size_t infolen)
+{
+  const EVP_MD *md = get_md (algo);
+  EVP_KDF_CTX *kctx;
+  OSSL_PARAM params[5], *p = params;
+  int ok;
+
+  if (!md)
+    return TGPG_INV_VAL;
+  kctx = EVP_KDF_CTX_new (hkdf);
+  if (!kctx)
+    return TGPG_CRYPT_ERR;
+
+  *p++ = OSSL_PARAM_construct_utf8_string (OSSL_KDF_PARAM_DIGEST,
+                                           (char *) EVP_MD_get0_name (md), 0);
+  *p++ = OSSL_PARAM_construct_octet_string (OSSL_KDF_PARAM_KEY,
+                                            (void *) ikm, ikmlen);
+  /* An empty salt is the same as the default salt of zeros.  */
+  if (saltlen)
+    *p++ = OSSL_PARAM_construct_octet_string (OSSL_KDF_PARAM_SALT,
+                                              (void *) salt, saltlen);
+  *p++ = OSSL_PARAM_construct_octet_string (OSSL_KDF_PARAM_INFO,
+                                            (void *) info, infolen);
+  *p = OSSL_PARAM_construct_end ();
+
+  ok = EVP_KDF_derive (kctx, out, length, params);
+  EVP_KDF_CTX_free (kctx);
+  return ok > 0 ? 0 : TGPG_CRYPT_ERR;
+}
+
+
+
+/*
+
+     R A N D O M   F u n c t i o n s
+
+*/
+
+/* Like libgcrypt we terminate the process if the RNG fails; there is
+   no sensible way to continue without random.  */
+static void
+osl_randomize (unsigned char *buffer, size_t length)
+{
+  if (RAND_priv_bytes (buffer, length) != 1)
+    {
+      fprintf (stderr, "libtgpg: fatal error in the OpenSSL RNG\n");
+      abort ();
+    }
+}
+
+
+static void
+osl_create_nonce (unsigned char *buffer, size_t length)
+{
+  if (RAND_bytes (buffer, length) != 1)
+    {
+      fprintf (stderr, "libtgpg: fatal error in the OpenSSL RNG\n");
+      abort ();
+    }
+}
+
+
+const struct crypto_backend_s _tgpg_crypto_openssl =
+  {
+    "openssl",
+    osl_init,
+    osl_kernel,
+    osl_pk_decrypt,
+    osl_pk_encrypt,
+    osl_cipher_blocklen,
+    osl_cipher_keylen,
+    osl_cipher_open,
+    osl_cipher_setup,
+    osl_cipher_crypt,
+    osl_cipher_close,
+    osl_aead_open,
+    osl_aead_close,
+    osl_aead_crypt,
+    osl_keywrap,
+    osl_hash_dlen,
+    osl_hash_buffers,
+    osl_hash_open,
+    osl_hash_close,
+    osl_hash_reset,
+    osl_hash_write,
+    osl_hash_read,
+    osl_hkdf,
+    osl_randomize,
+    osl_create_nonce
+  };
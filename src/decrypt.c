@@ -30,51 +30,73 @@
 #include "keystore.h"
 #include "cryptglue.h"
 #include "pkcs1.h"
+#include "ecdh.h"
+#include "armor.h"
+#include "compress.h"
+#include "aead.h"
+#include "s2k.h"
+#include "parallel.h"
 
+/* Messages with at least this much plaintext are decrypted by
+   several threads if the context allows for it.  */
+#define PARALLEL_MIN    (1024 * 1024)
 
+/* The size of the ranges of plaintext decrypted by the threads.  With
+   an MDC, a range is hashed right after it has been decrypted, while
+   it is still in the L2 cache.  */
+#define PARALLEL_RANGE  (64 * 1024)
+
+/* The length of the SHA-1 hash in an MDC packet.  */
+#define MDC_HASH_LEN    20
+
+
+/* Decrypt the session key ENCDAT for the public key described by
+   KEYINFO using the secret key SECKEY.  On success the cipher
+   algorithm is stored at R_ALGO and a newly allocated session key at
+   R_SESKEY and its length at R_SESKEYLEN.  TGPG_WRONG_KEY is returned
+   if SECKEY does not fit.  */
 static int
-decrypt_session_key (keyinfo_t keyinfo, tgpg_mpi_t encdat,
-                     int *r_algo, char **r_seskey, size_t *r_seskeylen)
+unwrap_session_key (keyinfo_t keyinfo, tgpg_mpi_t seckey, tgpg_mpi_t encdat,
+                    int *r_algo, char **r_seskey, size_t *r_seskeylen)
 {
   int rc;
-  tgpg_mpi_t seckey;
   char *plain;
   size_t plainlen;
 
-  *r_seskey = NULL;
-  *r_seskeylen = 0;
-  *r_algo = 0;
-
-  rc = _tgpg_get_secret_key (keyinfo, &seckey);
-  if (rc)
-    {
-      fprintf (stderr, "DBG: error getting secret key: %s\n",
-               tgpg_strerror (rc));
-      return rc;
-    }
-
-  rc = _tgpg_pk_decrypt (keyinfo->pubkey_algo, seckey, encdat,
-                         &plain, &plainlen);
-  _tgpg_free_secret_key (seckey);
-  if (rc)
-    fprintf (stderr, "DBG: decrypting session key failed: %s\n",
-             tgpg_strerror (rc));
+  if (keyinfo->pubkey_algo == PK_ALGO_ECDH)
+    rc = _tgpg_ecdh_decrypt (seckey, encdat, &plain, &plainlen);
   else
+    rc = _tgpg_pk_decrypt (keyinfo->pubkey_algo, seckey, encdat,
+                           &plain, &plainlen);
+  if (!rc)
     {
       const char *body;
       size_t bodylen;
-      rc = _tgpg_eme_pkcs1_decode (plain, plainlen, &body, &bodylen);
+      size_t algolen = keyinfo->version == 6 ? 0 : 1;
+
+      /* The ECDH key wrap already removed its padding.  */
+      if (keyinfo->pubkey_algo == PK_ALGO_ECDH)
+        {
+          body = plain;
+          bodylen = plainlen;
+        }
+      else
+        rc = _tgpg_eme_pkcs1_decode (plain, plainlen, &body, &bodylen);
+      if (! rc && bodylen < algolen + 1 + 2)
+        rc = TGPG_WRONG_KEY;
       if (! rc)
         {
-          /* body -> <algobyte> <keybytes> <2bytes checksum> */
+          /* body -> <algobyte> <keybytes> <2bytes checksum>.  Version
+             6 packets omit the algorithm, which is given by the
+             encrypted data packet instead.  */
           int algo;
           size_t seskeylen;
           const char *seskey;
           unsigned short csum, csum2;
 
-          algo = ((unsigned char*)body)[0];
-          seskey = body + 1;
-          seskeylen = bodylen - 1 - 2;
+          algo = algolen ? ((unsigned char*)body)[0] : 0;
+          seskey = body + algolen;
+          seskeylen = bodylen - algolen - 2;
           csum = ((((unsigned char *)body)[bodylen-2] << 8)
                   | ((unsigned char *)body)[bodylen-1]);
           _tgpg_checksum (seskey, seskeylen, &csum2);
@@ -100,28 +122,649 @@ decrypt_session_key (keyinfo_t keyinfo, tgpg_mpi_t encdat,
   return rc;
 }
 
-/* Assume that CIPHER is a data object holding a complete encrypted
-   message.  Decrypt the message and store the result into PLAIN.
-   CTX is the usual context.  Returns 0 on success.  */
-int
-tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain)
+/* Decrypt the session key ENCDAT for the public key described by
+   KEYINFO.  An anonymous recipient may be any of our keys of the
+   same algorithm, so they are tried in turn until one of them yields
+   a session key with a valid checksum; only the final error is
+   reported.  On success the cipher algorithm is stored at R_ALGO and
+   a newly allocated session key at R_SESKEY and its length at
+   R_SESKEYLEN.  */
+static int
+decrypt_session_key (tgpg_t ctx, keyinfo_t keyinfo, tgpg_mpi_t encdat,
+                     int *r_algo, char **r_seskey, size_t *r_seskeylen)
+{
+  int rc, lastrc = 0;
+  unsigned int candidate;
+  tgpg_mpi_t seckey;
+  int anonymous = !keyinfo->keyid[0] && !keyinfo->keyid[1];
+
+  *r_seskey = NULL;
+  *r_seskeylen = 0;
+  *r_algo = 0;
+
+  for (candidate = 0; ; candidate++)
+    {
+      rc = _tgpg_get_secret_key (ctx, keyinfo, candidate, &seckey);
+      if (rc)
+        {
+          /* Report why the last key we tried did not fit.  */
+          if (rc == TGPG_NO_SECKEY && lastrc)
+            rc = lastrc;
+          fprintf (stderr, "DBG: error getting secret key: %s\n",
+                   tgpg_strerror (rc));
+          return rc;
+        }
+
+      rc = unwrap_session_key (keyinfo, seckey, encdat,
+                               r_algo, r_seskey, r_seskeylen);
+      _tgpg_free_secret_key (seckey);
+      if (!rc)
+        return 0;
+      if (!anonymous || rc == TGPG_SYSERROR)
+        {
+          fprintf (stderr, "DBG: decrypting session key failed: %s\n",
+                   tgpg_strerror (rc));
+          return rc;
+        }
+      lastrc = rc;
+    }
+}
+
+/* Derive the session key for the symmetric key encrypted session key
+   SI from the passphrase of CTX.  On success the cipher algorithm is
+   stored at R_ALGO and a newly allocated session key at R_SESKEY and
+   its length at R_SESKEYLEN.  */
+static int
+decrypt_symkey_session_key (tgpg_t ctx, symkeyinfo_t si,
+                            int *r_algo, char **r_seskey, size_t *r_seskeylen)
+{
+  int rc;
+  unsigned char key[32];
+  unsigned char plain[sizeof si->enckey];
+  size_t keylen, blocksize;
+  const char iv[16] = { 0 };
+  int algo;
+
+  *r_seskey = NULL;
+  *r_seskeylen = 0;
+  *r_algo = 0;
+
+  keylen = _tgpg_cipher_keylen (si->cipher_algo);
+  blocksize = _tgpg_cipher_blocklen (si->cipher_algo);
+  if (!keylen || keylen > sizeof key || !blocksize || blocksize > sizeof iv)
+    return TGPG_INV_ALGO;
+
+  rc = _tgpg_s2k_derive (ctx, si->s2k_hash, si->s2k_mode, si->s2k_salt,
+                         _tgpg_s2k_decode_count (si->s2k_count),
+                         key, keylen);
+  if (rc)
+    goto leave;
+
+  if (!si->enckeylen)
+    {
+      /* The derived key is the session key.  */
+      algo = si->cipher_algo;
+    }
+  else
+    {
+      /* The session key is encrypted using the derived key; it is
+         prefixed with its algorithm.  */
+      rc = _tgpg_cipher_decrypt (ctx, si->cipher_algo, CIPHER_MODE_CFB,
+                                 key, keylen, iv, blocksize, NULL, 0,
+                                 plain, si->enckeylen,
+                                 si->enckey, si->enckeylen);
+      if (rc)
+        goto leave;
+      algo = plain[0];
+      keylen = si->enckeylen - 1;
+      if (keylen != _tgpg_cipher_keylen (algo))
+        {
+          /* Most likely a wrong passphrase.  */
+          rc = TGPG_INV_PASS;
+          goto leave;
+        }
+      memcpy (key, plain + 1, keylen);
+    }
+
+  *r_seskey = xtrymalloc (keylen);
+  if (!*r_seskey)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  memcpy (*r_seskey, key, keylen);
+  *r_seskeylen = keylen;
+  *r_algo = algo;
+
+ leave:
+  wipememory (key, sizeof key);
+  wipememory (plain, sizeof plain);
+  return rc;
+}
+
+
+/* Decrypt the version 2 encrypted data packet body of LENGTH bytes
+   described by the NSEGS segments at SEGS using the session key
+   SESKEY of length SESKEYLEN.  On success a newly allocated buffer
+   with the plaintext is returned at R_BUFFER and its length at
+   R_BUFFERLEN.  */
+static int
+decrypt_aead (tgpg_t ctx, const char *seskey, size_t seskeylen,
+              const struct segment_s *segs, size_t nsegs, size_t length,
+              char **r_buffer, size_t *r_bufferlen)
+{
+  int rc;
+  struct aead_header_s hdr;
+  const char *body;
+  char *joined = NULL;
+  char *buffer = NULL;
+  char *p;
+  size_t i;
+
+  /* The chunks do not line up with partial length chunks; thus we
+     need the body in one piece.  */
+  if (nsegs == 1)
+    body = segs[0].data;
+  else
+    {
+      joined = xtrymalloc (length);
+      if (joined == NULL)
+        return TGPG_SYSERROR;
+      for (p = joined, i = 0; i < nsegs; i++)
+        {
+          memcpy (p, segs[i].data, segs[i].length);
+          p += segs[i].length;
+        }
+      body = joined;
+    }
+
+  rc = _tgpg_aead_parse_header (body, length, &hdr);
+  if (rc)
+    goto leave;
+  if (seskeylen != _tgpg_cipher_keylen (hdr.cipher_algo))
+    {
+      rc = TGPG_WRONG_KEY;
+      goto leave;
+    }
+
+  buffer = xtrymalloc (length);
+  if (buffer == NULL)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  rc = _tgpg_aead_decrypt (seskey, seskeylen, ctx->nthreads,
+                           buffer, r_bufferlen, body, length);
+  if (rc)
+    goto leave;
+
+  *r_buffer = buffer;
+  buffer = NULL;
+
+ leave:
+  xfree (buffer);
+  xfree (joined);
+  return rc;
+}
+
+/* A cursor to walk the segments of a packet body.  */
+struct segpos_s
+{
+  const struct segment_s *seg;  /* The current segment.  */
+  size_t nseg;                  /* Number of segments left.  */
+  size_t off;                   /* Offset into the current segment.  */
+};
+
+
+/* Describe the next LENGTH bytes at POS by segments stored at SLICE,
+   advance POS past them and return the number of segments used.  If
+   SLICE is NULL the segments are only counted.  */
+static size_t
+slice_segments (struct segpos_s *pos, size_t length,
+                struct segment_s *slice)
+{
+  size_t n, nslice = 0;
+
+  while (length && pos->nseg)
+    {
+      n = pos->seg->length - pos->off;
+      if (n > length)
+        n = length;
+      if (slice)
+        {
+          slice[nslice].data = pos->seg->data + pos->off;
+          slice[nslice].length = n;
+        }
+      nslice++;
+      length -= n;
+      pos->off += n;
+      if (pos->off == pos->seg->length)
+        {
+          pos->seg++;
+          pos->nseg--;
+          pos->off = 0;
+        }
+    }
+  return nslice;
+}
+
+
+/* Copy the LENGTH bytes described by the NSLICE segments at SLICE to
+   BUFFER.  */
+static void
+copy_segments (const struct segment_s *slice, size_t nslice,
+               char *buffer, size_t length)
+{
+  size_t n;
+
+  for (; length && nslice; slice++, nslice--)
+    {
+      n = slice->length < length ? slice->length : length;
+      memcpy (buffer, slice->data, n);
+      buffer += n;
+      length -= n;
+    }
+}
+
+
+/* The state of a parallel decryption.  The plaintext is split into
+   ranges which end at block boundaries of the ciphertext.  CFB
+   decryption of a block only depends on the key and the previous
+   ciphertext block, thus each range but the first one is decrypted on
+   its own using the preceding ciphertext block as IV.  The first range
+   starts with the prefix and is decrypted in the mode of the message,
+   which handles the re-synchronization of the old mode without MDC.  */
+struct cfbrun_s
+{
+  tgpg_t *ctxs;                 /* The context of each worker.  */
+  int algo;
+  enum cipher_modes mode;
+  const char *seskey;
+  size_t seskeylen;
+  size_t blocksize;
+  char *prefix;                 /* Receives the cipher prefix.  */
+  char *buffer;                 /* Receives the plaintext.  */
+  size_t bufferlen;
+  size_t shift;                 /* The first range is shorter by this.  */
+  size_t nranges;
+  struct segpos_s *starts;      /* Where the input of each range starts.  */
+  struct segment_s *slices;     /* MAXSLICE segments for each worker.  */
+  size_t maxslice;
+  workqueue_t queue;            /* Hands out the ranges.  */
+  int hash;                     /* Compute the hash of the MDC.  */
+  int have_digest;
+  unsigned char digest[MDC_HASH_LEN];
+};
+
+
+/* Return the plaintext offset of range IDX of RUN.  */
+static size_t
+range_start (struct cfbrun_s *run, size_t idx)
+{
+  size_t off;
+
+  if (!idx)
+    return 0;
+  off = idx * PARALLEL_RANGE - run->shift;
+  return off < run->bufferlen ? off : run->bufferlen;
+}
+
+
+/* Return the number of ciphertext bytes read for range IDX of RUN,
+   including the prefix or the IV.  */
+static size_t
+range_input (struct cfbrun_s *run, size_t idx)
+{
+  return (range_start (run, idx + 1) - range_start (run, idx)
+          + (idx ? run->blocksize : run->blocksize + 2));
+}
+
+
+/* Find the start of the input of each range and the largest number of
+   segments spanned by one range.  */
+static int
+find_ranges (struct cfbrun_s *run, const struct segment_s *segs,
+             size_t nsegs)
+{
+  struct segpos_s pos = { segs, nsegs, 0 };
+  struct segpos_s tmp;
+  size_t idx, n;
+
+  run->starts = xtrycalloc (run->nranges, sizeof *run->starts);
+  if (!run->starts)
+    return TGPG_SYSERROR;
+
+  run->maxslice = 0;
+  for (idx = 0; idx < run->nranges; idx++)
+    {
+      run->starts[idx] = pos;
+      tmp = pos;
+      n = slice_segments (&tmp, range_input (run, idx), NULL);
+      if (n > run->maxslice)
+        run->maxslice = n;
+      /* The input of the next range starts with the last block of
+         this range.  */
+      slice_segments (&pos, range_input (run, idx) - run->blocksize, NULL);
+    }
+  return 0;
+}
+
+
+/* Decrypt range IDX of RUN using the context of WORKER.  */
+static int
+decrypt_range (struct cfbrun_s *run, unsigned int worker, size_t idx)
+{
+  struct segpos_s pos = run->starts[idx];
+  struct segment_s *slice = run->slices + worker * run->maxslice;
+  struct segment_s outseg;
+  const char zero_iv[16] = { 0 };
+  char iv[16];
+  size_t nslice, start;
+
+  start = range_start (run, idx);
+  outseg.data = run->buffer + start;
+  outseg.length = range_start (run, idx + 1) - start;
+
+  if (!idx)
+    {
+      nslice = slice_segments (&pos, range_input (run, idx), slice);
+      return _tgpg_cipher_decryptv (run->ctxs[worker], run->algo, run->mode,
+                                    run->seskey, run->seskeylen,
+                                    zero_iv, run->blocksize,
+                                    run->prefix, run->blocksize + 2,
+                                    &outseg, 1, slice, nslice);
+    }
+
+  nslice = slice_segments (&pos, run->blocksize, slice);
+  copy_segments (slice, nslice, iv, run->blocksize);
+  nslice = slice_segments (&pos, outseg.length, slice);
+  return _tgpg_cipher_decryptv (run->ctxs[worker], run->algo,
+                                CIPHER_MODE_CFB,
+                                run->seskey, run->seskeylen,
+                                iv, run->blocksize, NULL, 0,
+                                &outseg, 1, slice, nslice);
+}
+
+
+/* Decrypt the next range of RUN which has not yet been handed out
+   using the context of WORKER.  Returns false if there is none.  */
+static int
+decrypt_next_range (struct cfbrun_s *run, unsigned int worker, int *r_rc)
+{
+  size_t idx;
+
+  if (!_tgpg_workqueue_claim (run->queue, &idx))
+    return 0;
+  *r_rc = decrypt_range (run, worker, idx);
+  _tgpg_workqueue_done (run->queue, idx, *r_rc);
+  return 1;
+}
+
+
+/* Hash the ranges of RUN in order as soon as they have been
+   decrypted.  While the next range is not yet handed out, it is
+   decrypted using the context of WORKER.  */
+static int
+hash_ranges (struct cfbrun_s *run, unsigned int worker)
+{
+  int rc = 0;
+  int state;
+  hash_t h;
+  size_t idx, start, end, hashend;
+
+  rc = _tgpg_hash_open (&h, MD_ALGO_SHA1, 0);
+  if (rc)
+    return rc;
+
+  /* The hash covers the prefix and the plaintext up to and including
+     the header of the MDC packet.  */
+  hashend = run->bufferlen - MDC_HASH_LEN;
+  for (idx = 0; idx < run->nranges && !rc; )
+    {
+      state = _tgpg_workqueue_wait (run->queue, idx);
+      if (state < 0)
+        break;  /* Decryption failed.  */
+      if (!state)
+        {
+          decrypt_next_range (run, worker, &rc);
+          continue;
+        }
+
+      if (!idx)
+        _tgpg_hash_write (h, run->prefix, run->blocksize + 2);
+      start = range_start (run, idx);
+      end = range_start (run, idx + 1);
+      if (end > hashend)
+        end = hashend;
+      if (start < end)
+        _tgpg_hash_write (h, run->buffer + start, end - start);
+      idx++;
+    }
+  if (idx == run->nranges)
+    {
+      memcpy (run->digest, _tgpg_hash_read (h), MDC_HASH_LEN);
+      run->have_digest = 1;
+    }
+
+  _tgpg_hash_close (h);
+  return rc;
+}
+
+
+/* The job run by each worker: the first job hashes the plaintext if
+   required and all jobs decrypt ranges until none are left.  */
+static int
+cfbrun_job (void *arg, unsigned int worker, size_t idx)
+{
+  struct cfbrun_s *run = arg;
+  int rc = 0;
+
+  if (!idx && run->hash)
+    return hash_ranges (run, worker);
+
+  while (!rc && decrypt_next_range (run, worker, &rc))
+    ;
+  return rc;
+}
+
+
+/* Decrypt the message described by the NSEGS segments at SEGS like
+   _tgpg_cipher_decryptv does, but use up to NWORKERS threads.  MDC
+   tells whether the message has an MDC, in which case its hash is
+   computed on the fly and stored at DIGEST; this avoids a second pass
+   over a large plaintext after it has been evicted from the caches.
+   The prefix is stored at PREFIX and the plaintext at BUFFER of
+   length BUFFERLEN.  */
+static int
+decrypt_parallel (tgpg_t ctx, unsigned int nworkers, int algo, int mdc,
+                  const char *seskey, size_t seskeylen,
+                  char *prefix, char *buffer, size_t bufferlen,
+                  const struct segment_s *segs, size_t nsegs,
+                  unsigned char *digest)
 {
   int rc;
-  size_t startoff;
-  size_t length;
+  struct cfbrun_s run;
+  unsigned int i;
+
+  memset (&run, 0, sizeof run);
+  run.algo = algo;
+  run.mode = mdc ? CIPHER_MODE_CFB_MDC : CIPHER_MODE_CFB_PGP;
+  run.seskey = seskey;
+  run.seskeylen = seskeylen;
+  run.blocksize = _tgpg_cipher_blocklen (algo);
+  run.prefix = prefix;
+  run.buffer = buffer;
+  run.bufferlen = bufferlen;
+  /* Without re-synchronization the prefix shifts the blocks by two
+     bytes.  */
+  run.shift = mdc ? 2 : 0;
+  run.nranges = (bufferlen + run.shift + PARALLEL_RANGE - 1) / PARALLEL_RANGE;
+  run.hash = mdc;
+
+  rc = find_ranges (&run, segs, nsegs);
+  if (rc)
+    goto leave;
+  run.slices = xtrycalloc (nworkers * run.maxslice, sizeof *run.slices);
+  run.ctxs = xtrycalloc (nworkers, sizeof *run.ctxs);
+  if (!run.slices || !run.ctxs)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  run.ctxs[0] = ctx;
+  for (i = 1; i < nworkers && !rc; i++)
+    rc = _tgpg_clone_context (ctx, &run.ctxs[i]);
+  if (!rc)
+    rc = _tgpg_workqueue_new (&run.queue, run.nranges);
+  if (rc)
+    goto leave;
+
+  rc = _tgpg_parallel_run (nworkers, nworkers, cfbrun_job, &run);
+  if (!rc && mdc && !run.have_digest)
+    rc = TGPG_BUG;
+  if (!rc && mdc)
+    memcpy (digest, run.digest, MDC_HASH_LEN);
+
+ leave:
+  _tgpg_workqueue_release (run.queue);
+  if (run.ctxs)
+    for (i = 1; i < nworkers; i++)
+      tgpg_release (run.ctxs[i]);
+  xfree (run.ctxs);
+  xfree (run.slices);
+  xfree (run.starts);
+  return rc;
+}
+
+
+/* A message being decrypted: its encrypted data and the information
+   needed to decrypt its session key.  */
+struct message_s
+{
+  int mdc;                      /* The version of the MDC packet.  */
+  struct segment_s *segs;       /* The encrypted data.  */
+  size_t nsegs;
+  struct keyinfo_s keyinfo;     /* The recipient to use, if any.  */
+  struct tgpg_mpi_s encdat[MAX_PK_NENC];
+  struct symkeyinfo_s symkey;   /* Used if the recipient is not ours.  */
+  struct pending_key_s *pending; /* The recipients whose keys are
+                                    still being fetched.  */
+  size_t npending;
+  tgpg_key_t provided_key;      /* The key returned by the provider.  */
+};
+
+
+/* Release the resources held by MSG, except for the key returned by
+   the key provider.  */
+static void
+release_message (struct message_s *msg)
+{
+  xfree (msg->segs);
+  xfree (msg->pending);
+  msg->segs = NULL;
+  msg->pending = NULL;
+  msg->npending = 0;
+}
+
+
+/* Parse the encrypted message CIPHER into MSG, which the caller needs
+   to release.  If CIPHER is ASCII armored, it is replaced by the
+   binary message.  If PARK is set and the keys of the message are
+   still being fetched by the key provider, the message is parsed
+   completely nevertheless, so that it can be resumed using
+   resume_message; TGPG_PENDING is returned in this case.  */
+static int
+parse_message (tgpg_t ctx, tgpg_data_t cipher, struct message_s *msg,
+               int park)
+{
+  int rc;
+
+  memset (msg, 0, sizeof *msg);
+  if (_tgpg_armor_type (cipher->image, cipher->length) == ARMOR_RADIX64)
+    {
+      rc = _tgpg_dearmor (cipher);
+      if (rc)
+        return rc;
+    }
+
+  rc = _tgpg_parse_encrypted_message (ctx, cipher, &msg->mdc,
+                                      &msg->segs, &msg->nsegs,
+                                      &msg->keyinfo, msg->encdat,
+                                      &msg->symkey,
+                                      park ? &msg->pending : NULL,
+                                      &msg->npending);
+  if (rc && rc != TGPG_PENDING)
+    msg->segs = NULL;  /* Not defined on error.  */
+  return rc;
+}
+
+
+/* Ask again for the keys of the recipients of the parked message MSG
+   whose keys were still being fetched.  Returns 0 if MSG can be
+   decrypted now, and TGPG_PENDING if its keys are still being
+   fetched.  If none of the keys could be fetched, the passphrase is
+   used if the message has a symmetric key encrypted session key.  */
+static int
+resume_message (tgpg_t ctx, struct message_s *msg)
+{
+  int rc;
+  int pending = 0;
+  size_t i;
+
+  for (i = 0; i < msg->npending; i++)
+    {
+      rc = _tgpg_have_secret_key (ctx, &msg->pending[i].keyinfo);
+      if (!rc)
+        {
+          msg->keyinfo = msg->pending[i].keyinfo;
+          memcpy (msg->encdat, msg->pending[i].encdat, sizeof msg->encdat);
+          break;
+        }
+      if (rc == TGPG_PENDING)
+        pending = 1;
+    }
+  if (i == msg->npending)
+    {
+      if (pending)
+        return TGPG_PENDING;
+      if (!msg->symkey.version)
+        return TGPG_NO_SECKEY;
+      msg->keyinfo.pubkey_algo = 0;
+    }
+
+  xfree (msg->pending);
+  msg->pending = NULL;
+  msg->npending = 0;
+  return 0;
+}
+
+
+/* Decrypt the message MSG parsed by parse_message and store the
+   result into PLAIN.  CTX is the usual context.  Returns 0 on
+   success.  */
+static int
+decrypt_message (tgpg_t ctx, struct message_s *msg, tgpg_data_t plain)
+{
+  int rc;
+  struct segment_s *segs = msg->segs;
+  size_t nsegs = msg->nsegs;
+  size_t i, length;
+  char *p;
 
   /* Asymmetric cipher parameters.  */
-  keyinfo_t keyinfo;
-  tgpg_mpi_t encdat;
+  keyinfo_t keyinfo = &msg->keyinfo;
 
   /* Block cipher parameters.  */
-  int mdc = 0;
+  int mdc = msg->mdc;
   int algo;
   char *seskey = NULL;
   size_t seskeylen;
   size_t blocksize = 8;
   const char iv[16] = { 0 };
   char prefix[18];
+  unsigned char digest[MDC_HASH_LEN];
+  int have_digest = 0;
+  unsigned int nworkers;
 
   /* The decrypted literal data packet.  */
   char *buffer = NULL;
@@ -129,27 +772,21 @@ tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain)
   tgpg_data_t plainpacket = NULL;
   tgpg_msg_type_t msgtype;
 
+  /* Compressed data.  */
+  int compress_algo;
+  struct segment_s *zsegs = NULL;
+  size_t nzsegs;
+  tgpg_data_t inflated = NULL;
+
   /* Plaintext data.  */
   unsigned char format;
   char filename[0xff + 1];
   time_t date;
-  size_t start;
+  struct segment_s *plainsegs = NULL;
+  size_t nplainsegs;
 
-  keyinfo = xtrycalloc (1, sizeof *keyinfo);
-  if (!keyinfo)
-    return TGPG_SYSERROR;
-  encdat = xtrycalloc (MAX_PK_NENC, sizeof *encdat);
-  if (!encdat)
-    {
-      xfree (keyinfo);
-      return TGPG_SYSERROR;
-    }
-
-  rc = _tgpg_parse_encrypted_message (cipher, &mdc,
-                                      &startoff, &length,
-                                      keyinfo, encdat);
-  if (rc)
-    goto leave;
+  for (length = i = 0; i < nsegs; i++)
+    length += segs[i].length;
 
   if (! mdc)
     {
@@ -163,36 +800,125 @@ tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain)
         }
     }
 
-  rc = decrypt_session_key (keyinfo, encdat, &algo, &seskey, &seskeylen);
+  /* Version 6 session keys go along with version 2 encrypted data
+     packets only.  We support version 4 symmetric key encrypted
+     session keys only, which do not go along with them.  */
+  if (keyinfo->pubkey_algo
+      ? (keyinfo->version == 6) != (mdc == 2)
+      : mdc == 2)
+    {
+      rc = TGPG_INV_MSG;
+      goto leave;
+    }
+
+  if (keyinfo->pubkey_algo)
+    rc = decrypt_session_key (ctx, keyinfo, msg->encdat,
+                              &algo, &seskey, &seskeylen);
+  else
+    rc = decrypt_symkey_session_key (ctx, &msg->symkey,
+                                     &algo, &seskey, &seskeylen);
   if (rc)
     goto leave;
 
-  blocksize = _tgpg_cipher_blocklen (algo);
-
-  /* Allocate buffer for the plaintext.  */
-  bufferlen = length - blocksize - 2;
-  buffer = xtrymalloc (bufferlen);
-  if (buffer == NULL)
+  if (mdc == 2)
     {
-      rc = TGPG_SYSERROR;
-      goto leave;
+      rc = decrypt_aead (ctx, seskey, seskeylen, segs, nsegs, length,
+                         &buffer, &bufferlen);
+      if (rc)
+        goto leave;
     }
+  else
+    {
+      blocksize = _tgpg_cipher_blocklen (algo);
+      if (!blocksize || blocksize + 2 > sizeof prefix)
+        {
+          rc = TGPG_INV_ALGO;
+          goto leave;
+        }
+      if (length <= blocksize + 2)
+        {
+          rc = TGPG_INV_MSG;
+          goto leave;
+        }
+
+      /* Allocate buffer for the plaintext.  */
+      bufferlen = length - blocksize - 2;
+      buffer = xtrymalloc (bufferlen);
+      if (buffer == NULL)
+        {
+          rc = TGPG_SYSERROR;
+          goto leave;
+        }
 
-  /* Decrypt body.  */
-  rc = _tgpg_cipher_decrypt (algo,
-                             ! mdc ? CIPHER_MODE_CFB_PGP : CIPHER_MODE_CFB_MDC,
-                             seskey, seskeylen,
-                             iv, blocksize,
-                             prefix, sizeof prefix,
-                             buffer, bufferlen,
-                             &cipher->image[startoff], length);
+      /* Decrypt body.  Large messages are split into ranges which
+         are decrypted and, with an MDC, hashed in parallel if we may
+         use several threads.  */
+      nworkers = _tgpg_parallel_workers (ctx->nthreads,
+                                         bufferlen / PARALLEL_RANGE);
+      if (bufferlen >= PARALLEL_MIN && nworkers > 1)
+        {
+          rc = decrypt_parallel (ctx, nworkers, algo, mdc, seskey, seskeylen,
+                                 prefix, buffer, bufferlen,
+                                 segs, nsegs, digest);
+          have_digest = mdc && !rc;
+        }
+      else
+        {
+          struct segment_s outseg = { buffer, bufferlen };
+
+          rc = _tgpg_cipher_decryptv (ctx, algo,
+                                      ! mdc ? CIPHER_MODE_CFB_PGP
+                                      : CIPHER_MODE_CFB_MDC,
+                                      seskey, seskeylen,
+                                      iv, blocksize,
+                                      prefix, blocksize + 2,
+                                      &outseg, 1,
+                                      segs, nsegs);
+        }
+      /* For symmetric encryption the quick check of the prefix is
+         all we have to detect a wrong passphrase.  */
+      if (rc == TGPG_WRONG_KEY && !keyinfo->pubkey_algo)
+        rc = TGPG_INV_PASS;
+      if (rc)
+        goto leave;
+    }
+
+  /* Put it in a container so that we can parse it.  The buffer is
+     not copied; it is released below.  */
+  rc = tgpg_data_new_from_mem (&plainpacket, buffer, bufferlen, 0);
   if (rc)
     goto leave;
 
-  /* Put it in a container so that we can parse it.  */
-  rc = tgpg_data_new_from_mem (&plainpacket, buffer, bufferlen, 1);
+  /* Check and strip the MDC packet before looking at the packets.  */
+  if (mdc == 1)
+    {
+      rc = _tgpg_check_mdc (plainpacket, prefix, blocksize + 2,
+                            have_digest ? digest : NULL);
+      if (rc)
+        goto leave;
+    }
+
+  /* Inflate the literal data packet if it has been compressed.  */
+  rc = _tgpg_parse_compressed_message (plainpacket, &compress_algo,
+                                       &zsegs, &nzsegs);
   if (rc)
     goto leave;
+  if (compress_algo)
+    {
+      rc = tgpg_data_new (&inflated);
+      if (rc)
+        goto leave;
+      rc = _tgpg_decompress (compress_algo, zsegs, nzsegs, ctx->max_ratio,
+                             inflated);
+      if (rc)
+        goto leave;
+
+      tgpg_data_release (plainpacket);
+      plainpacket = inflated;
+      inflated = NULL;
+      xfree (buffer);
+      buffer = NULL;
+    }
 
   rc = tgpg_identify (plainpacket, &msgtype);
   if (rc)
@@ -206,15 +932,16 @@ tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain)
 
   /* Finally, parse the decrypted data...  */
   rc = _tgpg_parse_plaintext_message (plainpacket,
-                                      mdc,
-                                      prefix, sizeof prefix,
                                       &format,
                                       filename,
                                       &date,
-                                      &start,
-                                      &length);
+                                      &plainsegs,
+                                      &nplainsegs);
   if (rc)
     goto leave;
+
+  for (length = i = 0; i < nplainsegs; i++)
+    length += plainsegs[i].length;
   fprintf (stderr, "DBG: format %c, filename %s, length %zd, date %s",
            format, filename, length, ctime (&date));
 
@@ -223,7 +950,11 @@ tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain)
   if (rc)
     goto leave;
 
-  memcpy (plain->buffer, &plainpacket->buffer[start], length);
+  for (p = plain->buffer, i = 0; i < nplainsegs; i++)
+    {
+      memcpy (p, plainsegs[i].data, plainsegs[i].length);
+      p += plainsegs[i].length;
+    }
 
  leave:
   if (seskey)
@@ -231,11 +962,177 @@ tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain)
       wipememory (seskey, seskeylen);
       xfree (seskey);
     }
+  tgpg_data_release (inflated);
   tgpg_data_release (plainpacket);
+  xfree (plainsegs);
   xfree (buffer);
-  xfree (encdat);
-  xfree (keyinfo);
+  xfree (zsegs);
   return rc;
 }
 
 
+/* Assume that CIPHER is a data object holding a complete encrypted
+   message.  Decrypt the message and store the result into PLAIN.
+   CTX is the usual context.  If CIPHER is ASCII armored, it is
+   replaced by the binary message.  Returns 0 on success.  */
+int
+tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain)
+{
+  int rc;
+  struct message_s msg;
+
+  rc = parse_message (ctx, cipher, &msg, 0);
+  if (!rc)
+    rc = decrypt_message (ctx, &msg, plain);
+  release_message (&msg);
+  _tgpg_release_provided_key (ctx);
+  return rc;
+}
+
+
+/* The state of tgpg_decrypt_batch shared by the workers.  */
+struct batch_s
+{
+  tgpg_t *ctxs;                 /* The context of each worker.  */
+  struct message_s *msgs;
+  tgpg_data_t *plains;
+  int *results;
+  size_t *ready;                /* The messages to decrypt in a run.  */
+};
+
+
+/* Decrypt the IDX-th of the messages ready in the batch ARG.  */
+static int
+batch_job (void *arg, unsigned int worker, size_t idx)
+{
+  struct batch_s *batch = arg;
+  tgpg_t ctx = batch->ctxs[worker];
+  size_t i = batch->ready[idx];
+
+  ctx->provided_key = batch->msgs[i].provided_key;
+  batch->results[i] = decrypt_message (ctx, &batch->msgs[i],
+                                       batch->plains[i]);
+  ctx->provided_key = NULL;
+  return 0;
+}
+
+
+/* Move the key which the key provider of CTX returned for MSG to
+   MSG, so that the next message does not replace it.  */
+static void
+take_provided_key (tgpg_t ctx, struct message_s *msg)
+{
+  msg->provided_key = ctx->provided_key;
+  ctx->provided_key = NULL;
+}
+
+
+/* Decrypt the N messages in CIPHERS into PLAINS and store the error
+   codes at RESULTS.  All messages are parsed first, in the calling
+   thread, which is the only one asking the key provider.  Those
+   whose keys are at hand are then decrypted by the workers while the
+   others are parked along with their parsed session key packets.
+   After each run the key provider is asked again for the keys of
+   the parked messages; the ones which became available are decrypted
+   in the next run.  We return as soon as a run did not make any
+   parked message ready, so that we never block on the provider.  */
+int
+tgpg_decrypt_batch (tgpg_t ctx, tgpg_data_t *ciphers, tgpg_data_t *plains,
+                    int *results, size_t n)
+{
+  struct batch_s batch;
+  unsigned int nworkers, nthreads, i;
+  size_t idx, nready, npending;
+  int rc = 0;
+
+  memset (&batch, 0, sizeof batch);
+  nworkers = _tgpg_parallel_workers (ctx->nthreads, n);
+  batch.ctxs = xtrycalloc (nworkers, sizeof *batch.ctxs);
+  batch.msgs = xtrycalloc (n ? n : 1, sizeof *batch.msgs);
+  batch.ready = xtrycalloc (n ? n : 1, sizeof *batch.ready);
+  if (!batch.ctxs || !batch.msgs || !batch.ready)
+    {
+      rc = TGPG_SYSERROR;
+      for (idx = 0; idx < n; idx++)
+        results[idx] = rc;
+      goto leave;
+    }
+  batch.plains = plains;
+  batch.results = results;
+
+  /* The first worker uses CTX itself.  The others need the
+     passphrase for symmetrically encrypted messages.  */
+  batch.ctxs[0] = ctx;
+  for (i = 1; i < nworkers && !rc; i++)
+    {
+      rc = _tgpg_clone_context (ctx, &batch.ctxs[i]);
+      if (!rc && ctx->passphrase)
+        rc = tgpg_set_passphrase (batch.ctxs[i], ctx->passphrase);
+    }
+  if (rc)
+    {
+      for (idx = 0; idx < n; idx++)
+        results[idx] = rc;
+      goto leave;
+    }
+
+  for (nready = npending = idx = 0; idx < n; idx++)
+    {
+      results[idx] = parse_message (ctx, ciphers[idx], &batch.msgs[idx], 1);
+      take_provided_key (ctx, &batch.msgs[idx]);
+      if (!results[idx])
+        batch.ready[nready++] = idx;
+      else if (results[idx] == TGPG_PENDING)
+        npending++;
+    }
+
+  while (nready)
+    {
+      /* The threads are used for the messages instead of the chunks
+         of AEAD encrypted messages.  */
+      nthreads = ctx->nthreads;
+      if (nworkers > 1)
+        ctx->nthreads = 1;
+      rc = _tgpg_parallel_run (nworkers, nready, batch_job, &batch);
+      ctx->nthreads = nthreads;
+      if (rc)
+        goto leave;
+
+      for (idx = 0; idx < nready; idx++)
+        {
+          ctx->provided_key = batch.msgs[batch.ready[idx]].provided_key;
+          batch.msgs[batch.ready[idx]].provided_key = NULL;
+          _tgpg_release_provided_key (ctx);
+        }
+
+      /* The provider may have fetched some of the keys of the parked
+         messages in the meantime.  */
+      for (nready = npending = idx = 0; idx < n; idx++)
+        if (results[idx] == TGPG_PENDING)
+          {
+            results[idx] = resume_message (ctx, &batch.msgs[idx]);
+            take_provided_key (ctx, &batch.msgs[idx]);
+            if (!results[idx])
+              batch.ready[nready++] = idx;
+            else if (results[idx] == TGPG_PENDING)
+              npending++;
+          }
+    }
+  rc = npending ? TGPG_PENDING : 0;
+
+ leave:
+  if (batch.msgs)
+    for (idx = 0; idx < n; idx++)
+      {
+        ctx->provided_key = batch.msgs[idx].provided_key;
+        _tgpg_release_provided_key (ctx);
+        release_message (&batch.msgs[idx]);
+      }
+  if (batch.ctxs)
+    for (i = 1; i < nworkers; i++)
+      tgpg_release (batch.ctxs[i]);
+  xfree (batch.ctxs);
+  xfree (batch.msgs);
+  xfree (batch.ready);
+  return rc;
+}
@@ -0,0 +1,277 @@
+/* ecdh.c - OpenPGP ECDH key wrapping.
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tgpgdefs.h"
+#include "cryptglue.h"
+#include "ecdh.h"
+
+/* ECDH keys are described by these MPIs:
+
+     0  the curve OID without the length byte,
+     1  the public point Q,
+     2  the KDF parameters: 3, 1, the hash and the cipher algorithm,
+     3  the secret scalar D (only in secret keys),
+     4  the v4 fingerprint of the key.
+
+   Only Curve25519 is supported; its points are stored with a prefix
+   byte of 0x40 followed by the 32 bytes of the X coordinate.  */
+#define ECDH_OID      0
+#define ECDH_Q        1
+#define ECDH_KDF      2
+#define ECDH_FPR      4
+
+/* The length of the X coordinate of a Curve25519 point.  */
+#define X25519_LEN    32
+
+/* The length of a v4 fingerprint.  */
+#define FPR_LEN       20
+
+/* The wrapped session key is padded to a multiple of this.  */
+#define WRAP_BLOCK    8
+
+
+/* Derive the key encryption key from the shared point SHARED of
+   SHAREDLEN bytes and the parameters of KEY as described in RFC 6637
+   section 7.  The key is stored at KEK and its cipher algorithm at
+   R_ALGO; its length is given by that algorithm.  */
+static int
+derive_kek (tgpg_mpi_t key, const char *shared, size_t sharedlen,
+            unsigned char *kek, int *r_algo)
+{
+  static const char counter[4] = { 0, 0, 0, 1 };
+  static const char sender[] = "Anonymous Sender    ";
+  const unsigned char *kdf = (const unsigned char *) key[ECDH_KDF].value;
+  unsigned char param[1 + 16 + 1 + 4 + sizeof sender - 1 + FPR_LEN];
+  unsigned char digest[64];
+  struct segment_s iov[3];
+  size_t n, keklen;
+  int rc;
+
+  *r_algo = 0;
+  if (sharedlen != 1 + X25519_LEN || shared[0] != 0x40)
+    return TGPG_INV_DATA;
+  if (key[ECDH_OID].valuelen > 16
+      || key[ECDH_FPR].valuelen != FPR_LEN
+      || key[ECDH_KDF].valuelen != 4 || kdf[0] != 3 || kdf[1] != 1)
+    return TGPG_INV_VAL;
+  if (kdf[2] != MD_ALGO_SHA256 && kdf[2] != MD_ALGO_SHA384
+      && kdf[2] != MD_ALGO_SHA512)
+    return TGPG_INV_ALGO;
+  if (kdf[3] != CIPHER_ALGO_AES && kdf[3] != CIPHER_ALGO_AES192
+      && kdf[3] != CIPHER_ALGO_AES256)
+    return TGPG_INV_ALGO;
+
+  /* Param = OID length || OID || algorithm || KDF parameters
+             || "Anonymous Sender    " || fingerprint  */
+  n = 0;
+  param[n++] = key[ECDH_OID].valuelen;
+  memcpy (param + n, key[ECDH_OID].value, key[ECDH_OID].valuelen);
+  n += key[ECDH_OID].valuelen;
+  param[n++] = PK_ALGO_ECDH;
+  memcpy (param + n, kdf, 4);
+  n += 4;
+  memcpy (param + n, sender, sizeof sender - 1);
+  n += sizeof sender - 1;
+  memcpy (param + n, key[ECDH_FPR].value, FPR_LEN);
+  n += FPR_LEN;
+
+  /* KEK = Hash (00 00 00 01 || X || Param), truncated to the key
+     length of the cipher.  */
+  iov[0].data = (char *) counter;
+  iov[0].length = sizeof counter;
+  iov[1].data = (char *) shared + 1;
+  iov[1].length = X25519_LEN;
+  iov[2].data = (char *) param;
+  iov[2].length = n;
+  rc = _tgpg_hash_buffers (kdf[2], digest, sizeof digest, iov, 3);
+  if (!rc)
+    {
+      keklen = _tgpg_cipher_keylen (kdf[3]);
+      assert (keklen <= 32);
+      memcpy (kek, digest, keklen);
+      *r_algo = kdf[3];
+    }
+  wipememory (digest, sizeof digest);
+  return rc;
+}
+
+
+/* Decrypt the session key wrapped in ENCDAT for the ECDH key SECKEY.
+   On success the unpadded session key block is stored as a newly
+   allocated buffer at R_PLAIN and its length at R_PLAINLEN.  */
+int
+_tgpg_ecdh_decrypt (tgpg_mpi_t seckey, tgpg_mpi_t encdat,
+                    char **r_plain, size_t *r_plainlen)
+{
+  int rc;
+  char *shared = NULL;
+  size_t sharedlen;
+  unsigned char kek[32];
+  int kekalgo;
+  char *plain = NULL;
+  size_t plainlen, pad, i;
+
+  *r_plain = NULL;
+  *r_plainlen = 0;
+
+  if (encdat[1].valuelen < 3 * WRAP_BLOCK
+      || encdat[1].valuelen % WRAP_BLOCK)
+    return TGPG_INV_DATA;
+
+  rc = _tgpg_pk_decrypt (PK_ALGO_ECDH, seckey, encdat, &shared, &sharedlen);
+  if (rc)
+    return rc;
+  rc = derive_kek (seckey, shared, sharedlen, kek, &kekalgo);
+  wipememory (shared, sharedlen);
+  xfree (shared);
+  if (rc)
+    goto leave;
+
+  plainlen = encdat[1].valuelen - WRAP_BLOCK;
+  plain = xtrymalloc (plainlen);
+  if (!plain)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  rc = _tgpg_cipher_keywrap (0, kekalgo, kek, _tgpg_cipher_keylen (kekalgo),
+                             plain, encdat[1].value, encdat[1].valuelen);
+  if (rc)
+    goto leave;
+
+  /* Strip the PKCS#5 padding.  */
+  pad = ((unsigned char *) plain)[plainlen - 1];
+  if (!pad || pad > WRAP_BLOCK)
+    {
+      rc = TGPG_WRONG_KEY;
+      goto leave;
+    }
+  for (i = plainlen - pad; i < plainlen; i++)
+    if (((unsigned char *) plain)[i] != pad)
+      {
+        rc = TGPG_WRONG_KEY;
+        goto leave;
+      }
+
+  *r_plain = plain;
+  *r_plainlen = plainlen - pad;
+  plain = NULL;
+
+ leave:
+  if (plain)
+    {
+      wipememory (plain, plainlen);
+      xfree (plain);
+    }
+  wipememory (kek, sizeof kek);
+  return rc;
+}
+
+
+/* Wrap the session key block PLAIN of PLAINLEN bytes for the ECDH
+   key PUBKEY.  The ephemeral key is taken from the random pool of
+   CTX.  On success, the result is stored in an allocated array
+   R_ENCDAT with R_ENCLEN elements.  */
+int
+_tgpg_ecdh_encrypt (tgpg_t ctx, tgpg_mpi_t pubkey,
+                    const char *plain, size_t plainlen,
+                    tgpg_mpi_t *r_encdat, size_t *r_enclen)
+{
+  int rc;
+  unsigned char k[X25519_LEN];
+  unsigned char kek[32];
+  int kekalgo;
+  tgpg_mpi_t encdat = NULL;
+  size_t enclen = 0;
+  char *padded = NULL;
+  char *wrapped = NULL;
+  size_t paddedlen, pad, i;
+
+  *r_encdat = NULL;
+  *r_enclen = 0;
+
+  /* The ephemeral secret.  The backend takes care of clamping.  */
+  _tgpg_randomize (ctx, k, sizeof k);
+  rc = _tgpg_pk_encrypt (PK_ALGO_ECDH, pubkey, (char *) k, sizeof k,
+                         &encdat, &enclen);
+  wipememory (k, sizeof k);
+  if (rc)
+    return rc;
+
+  rc = derive_kek (pubkey, encdat[1].value, encdat[1].valuelen,
+                   kek, &kekalgo);
+  if (rc)
+    goto leave;
+
+  /* Pad using PKCS#5 and wrap.  */
+  pad = WRAP_BLOCK - plainlen % WRAP_BLOCK;
+  paddedlen = plainlen + pad;
+  padded = xtrymalloc (paddedlen);
+  wrapped = xtrymalloc (paddedlen + WRAP_BLOCK);
+  if (!padded || !wrapped)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  memcpy (padded, plain, plainlen);
+  for (i = plainlen; i < paddedlen; i++)
+    padded[i] = pad;
+  rc = _tgpg_cipher_keywrap (1, kekalgo, kek, _tgpg_cipher_keylen (kekalgo),
+                             wrapped, padded, paddedlen);
+  if (rc)
+    goto leave;
+
+  /* Replace the shared point by the wrapped key.  */
+  wipememory (encdat[1].value, encdat[1].valuelen);
+  xfree (encdat[1].value);
+  encdat[1].value = wrapped;
+  encdat[1].valuelen = paddedlen + WRAP_BLOCK;
+  encdat[1].nbits = encdat[1].valuelen << 3;
+  wrapped = NULL;
+
+  *r_encdat = encdat;
+  *r_enclen = enclen;
+  encdat = NULL;
+
+ leave:
+  if (encdat)
+    {
+      for (i = 0; i < enclen; i++)
+        {
+          wipememory (encdat[i].value, encdat[i].valuelen);
+          xfree (encdat[i].value);
+        }
+      xfree (encdat);
+    }
+  if (padded)
+    {
+      wipememory (padded, paddedlen);
+      xfree (padded);
+    }
+  xfree (wrapped);
+  wipememory (kek, sizeof kek);
+  return rc;
+}
@@ -0,0 +1,38 @@
+/* ecdh.h - OpenPGP ECDH key wrapping.
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#ifndef ECDH_H
+#define ECDH_H
+
+/* Decrypt the session key wrapped in ENCDAT for the ECDH key SECKEY.
+   On success the unpadded session key block is stored as a newly
+   allocated buffer at R_PLAIN and its length at R_PLAINLEN.  */
+int _tgpg_ecdh_decrypt (tgpg_mpi_t seckey, tgpg_mpi_t encdat,
+                        char **r_plain, size_t *r_plainlen);
+
+/* Wrap the session key block PLAIN of PLAINLEN bytes for the ECDH
+   key PUBKEY.  The ephemeral key is taken from the random pool of
+   CTX.  On success, the result is stored in an allocated array
+   R_ENCDAT with R_ENCLEN elements.  */
+int _tgpg_ecdh_encrypt (tgpg_t ctx, tgpg_mpi_t pubkey,
+                        const char *plain, size_t plainlen,
+                        tgpg_mpi_t *r_encdat, size_t *r_enclen);
+
+#endif /*ECDH_H*/
@@ -23,17 +23,150 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stddef.h>
 #include <assert.h>
 
 #include "tgpgdefs.h"
 #include "cryptglue.h"
 #include "keystore.h"
 #include "pkcs1.h"
+#include "ecdh.h"
 #include "pktwriter.h"
+#include "armor.h"
+#include "aead.h"
+#include "parallel.h"
+#include "envelope.h"
+
+/* Generate a session key for the cipher ALGO and encrypt it for KEY
+   into a public key encrypted session key packet of VERSION, which is
+   6 for AEAD and 3 otherwise.  The random bytes are taken from CTX.
+   On success the new envelope is stored at R_ENV.  */
+int
+_tgpg_make_envelope (tgpg_t ctx, tgpg_key_t key, int algo, int version,
+                     struct envelope_s **r_env)
+{
+  int rc;
+  size_t i;
+  unsigned char *p;
+  struct envelope_s *env;
+
+  /* Asymmetric cipher parameters.  */
+  struct keyinfo_s keyinfo =
+    {
+      { key->keyid_low, key->keyid_high },
+      key->algo,
+      version
+    };
+  tgpg_mpi_t encdat = NULL;
+  size_t enclen = 0;
+  size_t packetlen;
+  /* The v4 fingerprint of an ECDH key is its fifth value.  The
+     recipient of a v6 packet for other keys remains anonymous.  */
+  const char *fpr = (key->algo == PK_ALGO_ECDH && key->mpis[4].valuelen == 20
+                     ? key->mpis[4].value : NULL);
+
+  /* A buffer holding the PKCS1 encoded session key.  The algorithm
+     is omitted for AEAD as it is given by the encrypted data.  ECDH
+     wraps the session key without PKCS1 encoding.  */
+  char *buffer = NULL;
+  char *seskey;
+  size_t seskeylen = _tgpg_cipher_keylen (algo);
+  unsigned short csum;
+  size_t padding = key->algo == PK_ALGO_ECDH ? 0 : 10;
+  size_t bufferlen =
+    padding
+    + (version == 6 ? 0 : 1) /* algorithm */
+    + seskeylen
+    + 2 /* checksum */;
+
+  *r_env = NULL;
+  if (!seskeylen || seskeylen > sizeof env->seskey)
+    return TGPG_INV_ALGO;
+
+  /* Allocate a buffer for the session key and PKCS1 encoding.  */
+  buffer = xtrymalloc (bufferlen);
+  if (buffer == NULL)
+    return TGPG_SYSERROR;
+  p = (unsigned char *) buffer;
+
+  /* Prepend encoding.  */
+  if (padding)
+    {
+      rc = _tgpg_eme_pkcs1_encode (ctx, buffer, padding);
+      if (rc)
+        goto leave;
+      p += padding;
+    }
+
+  /* The cipher.  */
+  if (version != 6)
+    write_u8 (&p, algo);
+
+  /* The session key.  */
+  seskey = (char *) p;
+  p += seskeylen;
+
+  /* Generate session key.  */
+  _tgpg_randomize (ctx, (unsigned char *) seskey, seskeylen);
+
+  /* The checksum.  */
+  _tgpg_checksum (seskey, seskeylen, &csum);
+  write_u16 (&p, csum);
+
+  assert ((char *) p - buffer == bufferlen);
+
+  /* Encrypt the session key.  */
+  if (key->algo == PK_ALGO_ECDH)
+    rc = _tgpg_ecdh_encrypt (ctx, key->mpis, buffer, bufferlen,
+                             &encdat, &enclen);
+  else
+    rc = _tgpg_pk_encrypt (key->algo, key->mpis,
+                           buffer, bufferlen,
+                           &encdat, &enclen);
+  if (rc)
+    goto leave;
+
+  /* The Public-Key Encrypted Session Key Packet.  */
+  packetlen = _tgpg_write_pubkey_enc_packet (NULL, &keyinfo, fpr,
+                                             encdat, enclen);
+  env = xtrymalloc (offsetof (struct envelope_s, packet) + packetlen);
+  if (env == NULL)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  env->next = NULL;
+  env->algo = algo;
+  env->version = version;
+  env->seskeylen = seskeylen;
+  memcpy (env->seskey, seskey, seskeylen);
+  env->packetlen = packetlen;
+  p = env->packet;
+  _tgpg_write_pubkey_enc_packet (&p, &keyinfo, fpr, encdat, enclen);
+  assert (p - env->packet == packetlen);
+  *r_env = env;
+
+ leave:
+  for (i = 0; i < enclen; i++)
+    {
+      wipememory (encdat[i].value, encdat[i].valuelen);
+      xfree (encdat[i].value);
+    }
+  xfree (encdat);
+  /* This buffer contains the seskey.  */
+  wipememory (buffer, bufferlen);
+  xfree (buffer);
+  return rc;
+}
+
 
 /* Assume that PLAIN is a data object holding a complete plaintext
    message.  Encrypt the message using KEY and store the result into
-   CIPHER.  CTX is the usual context.  Returns 0 on success.  */
+   CIPHER.  CTX is the usual context; if armored output has been
+   requested, CIPHER receives an ASCII armored message, and if an AEAD
+   algorithm has been set, the message is encrypted using a version 2
+   integrity protected data packet.  The session key is taken from the
+   envelope pool of CTX if one is ready.  Returns 0 on success.  */
 int
 tgpg_encrypt (tgpg_t ctx, tgpg_data_t plain,
 	      tgpg_key_t key, tgpg_data_t cipher)
@@ -43,43 +176,54 @@ tgpg_encrypt (tgpg_t ctx, tgpg_data_t plain,
   size_t length;
   unsigned char *p;
 
-  /* Asymmetric cipher parameters.  */
-  struct keyinfo_s keyinfo =
-    {
-      { key->keyid_low, key->keyid_high },
-      key->algo
-    };
-  tgpg_mpi_t encdat = NULL;
-  size_t enclen;
+  /* The session key and the packet carrying it.  */
+  struct envelope_s *env = NULL;
+  int version = ctx->aead_algo ? 6 : 3;
 
   /* Block cipher parameters.  */
-  int algo = CIPHER_ALGO_AES256;
-  char *seskey;
-  size_t seskeylen = _tgpg_cipher_keylen (algo);
+  int algo = tgpg_get_cipher (ctx);
   size_t blocksize = _tgpg_cipher_blocklen (algo);
   const char iv[16] = { 0 };
   char prefix[18] = { 0 };
   int mdc = ! (_tgpg_flags & TGPG_FLAG_DISABLE_MDC);
 
+  /* AEAD parameters.  */
+  struct aead_header_s aead;
+  char *aeadbuf = NULL;
+
   /* The literal data packet.  */
   tgpg_data_t plainpacket = NULL;
 
-  /* A buffer holding the PKCS1 encoded session key.  */
-  char *buffer = NULL;
-  unsigned short csum;
-  size_t padding = 10;
-  size_t bufferlen =
-    padding
-    + 1 /* algorithm */
-    + seskeylen
-    + 2 /* checksum */;
+  /* The segments of the encrypted data packet.  */
+  struct segment_s *segs = NULL;
+  size_t nsegs;
+  struct segment_s inseg;
+  size_t bodylen;
 
-  /* Generate cipher initialization data.  */
-  _tgpg_randomize ((unsigned char *) prefix, blocksize);
+  if (!algo)
+    return TGPG_INV_ALGO;
 
-  /* Session key quick check, repeat the last two octets.  */
-  prefix[blocksize] = prefix[blocksize-2];
-  prefix[blocksize+1] = prefix[blocksize-1];
+  if (ctx->aead_algo)
+    {
+      /* The chunks are authenticated, so there is no MDC.  */
+      mdc = 0;
+      aead.cipher_algo = algo;
+      aead.aead_algo = ctx->aead_algo;
+      aead.chunkbits = ctx->chunkbits;
+      _tgpg_create_nonce (aead.salt, AEAD_SALT_LEN);
+    }
+  else
+    {
+      /* Generate cipher initialization data.  The prefix is
+         encrypted along with the data and acts as an IV; it only
+         needs to be unpredictable, not secret, thus a nonce is
+         sufficient.  */
+      _tgpg_create_nonce ((unsigned char *) prefix, blocksize);
+
+      /* Session key quick check, repeat the last two octets.  */
+      prefix[blocksize] = prefix[blocksize-2];
+      prefix[blocksize+1] = prefix[blocksize-1];
+    }
 
   /* Firstly, build the literal data packet.  */
   rc = tgpg_data_new (&plainpacket);
@@ -89,6 +233,8 @@ tgpg_encrypt (tgpg_t ctx, tgpg_data_t plain,
   rc = _tgpg_encode_plaintext_message (plainpacket,
                                        mdc,
                                        prefix, blocksize+2,
+                                       ctx->compress_algo,
+                                       ctx->compress_level,
 				       'b',
 				       "",
 				       0,
@@ -97,51 +243,37 @@ tgpg_encrypt (tgpg_t ctx, tgpg_data_t plain,
   if (rc)
     goto leave;
 
-  /* Allocate a buffer for the session key and PKCS1 encoding.  */
-  buffer = p = xtrymalloc (bufferlen);
-  if (buffer == NULL)
+  /* Allocate the segments for the body of the encrypted data packet
+     (which includes the MDC version).  */
+  if (ctx->aead_algo)
+    bodylen = _tgpg_aead_length (&aead, plainpacket->length);
+  else
+    bodylen = blocksize + 2 + plainpacket->length;
+  segs = xtrycalloc (_tgpg_count_segments (bodylen + 1), sizeof *segs);
+  if (segs == NULL)
     {
       rc = TGPG_SYSERROR;
       goto leave;
     }
 
-  /* Prepend encoding.  */
-  rc = _tgpg_eme_pkcs1_encode (p, padding);
-  if (rc)
-    goto leave;
-  p += padding;
-
-  /* The cipher.  */
-  write_u8 (&p, algo);
-
-  /* The session key.  */
-  seskey = (char *) p;
-  p += seskeylen;
-
-  /* Generate session key.  */
-  _tgpg_randomize ((unsigned char *) seskey, seskeylen);
-
-  /* The checksum.  */
-  _tgpg_checksum (seskey, seskeylen, &csum);
-  write_u16 (&p, csum);
-
-  assert ((char *) p - buffer == bufferlen);
-
-  /* Encrypt the session key.  */
-  rc = _tgpg_pk_encrypt (key->algo, key->mpis,
-			 buffer, bufferlen,
-			 &encdat, &enclen);
-  if (rc)
-    goto leave;
+  /* Get the session key and encrypt it, unless the pool has done
+     that already.  */
+  env = _tgpg_envelope_take (ctx, key, algo, version);
+  if (!env)
+    {
+      rc = _tgpg_make_envelope (ctx, key, algo, version, &env);
+      if (rc)
+        goto leave;
+    }
 
   /* Compute the length of the cipher message, and resize the buffer
      accordingly.  */
   length =
     /* The pubkey packet,  */
-    + _tgpg_write_pubkey_enc_packet (NULL, &keyinfo, encdat, enclen)
+    + env->packetlen
     /* and the encrypted data packet.  */
-    + _tgpg_write_sym_enc_packet (NULL, mdc,
-                                  blocksize + 2 + plainpacket->length);
+    + _tgpg_write_sym_enc_packet (NULL, ctx->aead_algo ? 2 : mdc, bodylen,
+                                  NULL, NULL);
 
   rc = tgpg_data_resize (cipher, length);
   if (rc)
@@ -151,43 +283,137 @@ tgpg_encrypt (tgpg_t ctx, tgpg_data_t plain,
 #define WRITTEN	(p - (unsigned char *) cipher->buffer)
 
   /* The Public-Key Encrypted Session Key Packet.  */
-  _tgpg_write_pubkey_enc_packet (&p, &keyinfo, encdat, enclen);
-  for (i = 0; i < enclen; i++)
-    {
-      wipememory (encdat[i].value, encdat[i].valuelen);
-      xfree (encdat[i].value);
-    }
-  xfree (encdat);
-  encdat = NULL;
+  memcpy (p, env->packet, env->packetlen);
+  p += env->packetlen;
 
   /* The Symmetrically Encrypted Data Packet.  */
-  _tgpg_write_sym_enc_packet (&p, mdc, blocksize + 2 + plainpacket->length);
+  _tgpg_write_sym_enc_packet (&p, ctx->aead_algo ? 2 : mdc, bodylen,
+                              segs, &nsegs);
 
   /* Encrypt body.  */
-  rc = _tgpg_cipher_encrypt (algo,
-                             ! mdc ? CIPHER_MODE_CFB_PGP : CIPHER_MODE_CFB_MDC,
-                             seskey, seskeylen,
-                             iv, blocksize,
-                             prefix, blocksize+2,
-                             p,
-                             cipher->length - WRITTEN,
-                             plainpacket->buffer, plainpacket->length);
-  if (rc)
-    goto leave;
+  if (ctx->aead_algo)
+    {
+      /* The chunks do not line up with partial length chunks; thus
+         a large body is encrypted into a temporary buffer first.  */
+      if (nsegs > 1)
+        {
+          aeadbuf = xtrymalloc (bodylen);
+          if (aeadbuf == NULL)
+            {
+              rc = TGPG_SYSERROR;
+              goto leave;
+            }
+        }
+      rc = _tgpg_aead_encrypt (&aead, env->seskey, env->seskeylen,
+                               ctx->nthreads,
+                               aeadbuf ? aeadbuf : segs[0].data,
+                               plainpacket->buffer, plainpacket->length);
+      if (rc)
+        goto leave;
+      if (aeadbuf)
+        for (p = (unsigned char *) aeadbuf, i = 0; i < nsegs; i++)
+          {
+            memcpy (segs[i].data, p, segs[i].length);
+            p += segs[i].length;
+          }
+    }
+  else
+    {
+      inseg.data = plainpacket->buffer;
+      inseg.length = plainpacket->length;
+      rc = _tgpg_cipher_encryptv (ctx, algo,
+                                  ! mdc ? CIPHER_MODE_CFB_PGP
+                                  : CIPHER_MODE_CFB_MDC,
+                                  env->seskey, env->seskeylen,
+                                  iv, blocksize,
+                                  prefix, blocksize+2,
+                                  segs, nsegs,
+                                  &inseg, 1);
+      if (rc)
+        goto leave;
+    }
 
-  p += plainpacket->length + blocksize + 2;
+  p = (unsigned char *) segs[nsegs - 1].data + segs[nsegs - 1].length;
   assert (WRITTEN == length);
 #undef WRITTEN
 
+  if (ctx->armor)
+    rc = _tgpg_enarmor (cipher, "MESSAGE");
+
  leave:
-  if (buffer != NULL)
+  _tgpg_envelope_release (env);
+  xfree (aeadbuf);
+  xfree (segs);
+  tgpg_data_release (plainpacket);
+  return rc;
+}
+
+
+/* The arguments of encrypt_job.  */
+struct encrypt_parm_s
+{
+  tgpg_t *ctxs;                 /* The context of each worker.  */
+  tgpg_data_t *plains;
+  tgpg_key_t key;
+  tgpg_data_t *ciphers;
+  int *results;
+};
+
+
+/* Encrypt the message with index IDX.  Errors are recorded in the
+   results, so that the other messages are still encrypted.  */
+static int
+encrypt_job (void *arg, unsigned int worker, size_t idx)
+{
+  struct encrypt_parm_s *parm = arg;
+
+  parm->results[idx] = tgpg_encrypt (parm->ctxs[worker], parm->plains[idx],
+                                     parm->key, parm->ciphers[idx]);
+  return 0;
+}
+
+
+/* Encrypt the N messages in PLAINS for KEY and store the results into
+   the corresponding CIPHERS and the error codes into RESULTS.  CFB
+   encryption of one message is strictly sequential, thus the messages
+   are spread over up to the number of threads set for CTX, each using
+   a context with the settings of CTX.  Returns 0 if the batch has
+   been processed.  */
+int
+tgpg_encrypt_batch (tgpg_t ctx, tgpg_data_t *plains, tgpg_key_t key,
+                    tgpg_data_t *ciphers, int *results, size_t n)
+{
+  struct encrypt_parm_s parm;
+  unsigned int nworkers, nthreads, i;
+  int rc = 0;
+
+  nworkers = _tgpg_parallel_workers (ctx->nthreads, n);
+  parm.ctxs = xtrycalloc (nworkers, sizeof *parm.ctxs);
+  if (!parm.ctxs)
+    return TGPG_SYSERROR;
+  parm.plains = plains;
+  parm.key = key;
+  parm.ciphers = ciphers;
+  parm.results = results;
+
+  /* The first worker uses CTX itself.  */
+  parm.ctxs[0] = ctx;
+  for (i = 1; i < nworkers && !rc; i++)
+    rc = _tgpg_clone_context (ctx, &parm.ctxs[i]);
+
+  if (!rc)
     {
-      /* This buffer contains the seskey.  */
-      wipememory (buffer, bufferlen);
-      xfree (buffer);
+      /* The threads are used for the messages instead of the chunks
+         of AEAD encrypted messages.  */
+      nthreads = ctx->nthreads;
+      if (nworkers > 1)
+        ctx->nthreads = 1;
+      rc = _tgpg_parallel_run (nworkers, n, encrypt_job, &parm);
+      ctx->nthreads = nthreads;
     }
 
-  tgpg_data_release (plainpacket);
-  assert (encdat == NULL);
+  for (i = 1; i < nworkers; i++)
+    tgpg_release (parm.ctxs[i]);
+  xfree (parm.ctxs);
   return rc;
 }
@@ -0,0 +1,373 @@
+/* envelope.c - Precomputed session key envelopes
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+/* Encrypting a message for a public key requires a fresh session key
+   and a public key operation, which for RSA costs far more than the
+   symmetric encryption of a small message.  An envelope pool keeps a
+   number of session keys, each with its public key encrypted session
+   key packet, ready for each recipient key.  They are produced by a
+   background thread, so that tgpg_encrypt only needs to take one and
+   do the symmetric work.  An envelope is only used once.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "tgpgdefs.h"
+#include "cryptglue.h"
+#include "envelope.h"
+
+/* The maximum number of envelopes kept ready per key.  */
+#define MAX_DEPTH 1024
+
+
+/* Wipe the session key of ENV and release it.  Passing NULL is
+   allowed.  */
+void
+_tgpg_envelope_release (struct envelope_s *env)
+{
+  if (!env)
+    return;
+  wipememory (env->seskey, sizeof env->seskey);
+  xfree (env);
+}
+
+
+#ifdef HAVE_PTHREAD
+/* The envelopes ready for one key.  */
+struct envelope_queue_s
+{
+  struct envelope_queue_s *next;
+  tgpg_key_t key;
+  int algo;                     /* The cipher and packet version of */
+  int version;                  /* the envelopes.  */
+  unsigned int depth;           /* The number of envelopes to keep.  */
+  unsigned int count;           /* The number of envelopes ready.  */
+  struct envelope_s *envelopes;
+  int rc;                       /* The error of the last attempt to
+                                   produce an envelope.  */
+};
+
+/* The envelope pool of a context.  The queues are protected by LOCK;
+   the producer thread waits on COND for a queue to become short.  */
+struct envelope_pool_s
+{
+  tgpg_t owner;                 /* The context which created the pool.  */
+  unsigned long generation;     /* The process which created it.  */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int stop;                     /* Tell the producer to terminate.  */
+  tgpg_t ctx;                   /* The context used by the producer.  */
+  struct envelope_queue_s *queues;
+};
+
+
+/* Release all envelopes of Q.  */
+static void
+drain_queue (struct envelope_queue_s *q)
+{
+  struct envelope_s *env;
+
+  while ((env = q->envelopes))
+    {
+      q->envelopes = env->next;
+      _tgpg_envelope_release (env);
+    }
+  q->count = 0;
+}
+
+
+/* Release the queues of POOL and the memory of POOL.  The producer
+   must not be running.  */
+static void
+free_pool (struct envelope_pool_s *pool)
+{
+  struct envelope_queue_s *q;
+
+  while ((q = pool->queues))
+    {
+      pool->queues = q->next;
+      drain_queue (q);
+      xfree (q);
+    }
+  tgpg_release (pool->ctx);
+  xfree (pool);
+}
+
+
+/* Keep the queues of POOL filled.  */
+static void *
+producer_main (void *opaque)
+{
+  struct envelope_pool_s *pool = opaque;
+  struct envelope_queue_s *q;
+  struct envelope_s *env;
+  tgpg_key_t key;
+  int algo, version;
+  int rc;
+
+  pthread_mutex_lock (&pool->lock);
+  while (!pool->stop)
+    {
+      for (q = pool->queues; q; q = q->next)
+        if (!q->rc && q->count < q->depth)
+          break;
+      if (!q)
+        {
+          pthread_cond_wait (&pool->cond, &pool->lock);
+          continue;
+        }
+      key = q->key;
+      algo = q->algo;
+      version = q->version;
+
+      /* The public key operation is done without holding the lock.  */
+      pthread_mutex_unlock (&pool->lock);
+      rc = _tgpg_make_envelope (pool->ctx, key, algo, version, &env);
+      pthread_mutex_lock (&pool->lock);
+
+      /* The queue may have been changed or removed meanwhile.  */
+      for (q = pool->queues; q; q = q->next)
+        if (q->key == key)
+          break;
+      if (q && (q->algo != algo || q->version != version))
+        q = NULL;
+      if (rc)
+        {
+          if (q)
+            q->rc = rc;
+        }
+      else if (q && q->count < q->depth)
+        {
+          env->next = q->envelopes;
+          q->envelopes = env;
+          q->count++;
+        }
+      else
+        _tgpg_envelope_release (env);
+    }
+  pthread_mutex_unlock (&pool->lock);
+  return NULL;
+}
+
+
+/* Return the envelope pool used by CTX or NULL.  A pool created
+   before a fork belongs to the parent; the child wipes its envelopes
+   and forgets about it without touching its lock and thread.  */
+static struct envelope_pool_s *
+get_pool (tgpg_t ctx)
+{
+  struct envelope_pool_s *pool = ctx->envelopes;
+
+  if (pool && pool->generation != _tgpg_random_generation ())
+    {
+      if (pool->owner == ctx)
+        {
+          free_pool (pool);
+          ctx->envelopes = NULL;
+        }
+      return NULL;
+    }
+  return pool;
+}
+
+
+/* Create the envelope pool of CTX.  */
+static int
+new_pool (tgpg_t ctx)
+{
+  struct envelope_pool_s *pool;
+  int rc;
+
+  pool = xtrycalloc (1, sizeof *pool);
+  if (!pool)
+    return TGPG_SYSERROR;
+  rc = tgpg_new (&pool->ctx);
+  if (rc)
+    {
+      xfree (pool);
+      return rc;
+    }
+  pool->owner = ctx;
+  pool->generation = _tgpg_random_generation ();
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->cond, NULL);
+  if (pthread_create (&pool->thread, NULL, producer_main, pool))
+    {
+      pthread_cond_destroy (&pool->cond);
+      pthread_mutex_destroy (&pool->lock);
+      free_pool (pool);
+      return TGPG_SYSERROR;
+    }
+  ctx->envelopes = pool;
+  return 0;
+}
+#endif /*HAVE_PTHREAD*/
+
+
+/* Keep DEPTH envelopes ready for messages encrypted with the context
+   CTX to KEY.  The envelopes are produced by a background thread
+   for the cipher and AEAD settings CTX has at the time of the call.
+   A DEPTH of 0 stops producing envelopes for KEY.  Returns 0 on
+   success.  */
+int
+tgpg_set_envelope_pool (tgpg_t ctx, tgpg_key_t key, unsigned int depth)
+{
+#ifdef HAVE_PTHREAD
+  struct envelope_pool_s *pool;
+  struct envelope_queue_s *q, **qp;
+  int algo, version;
+  int rc;
+
+  if (!key || depth > MAX_DEPTH)
+    return TGPG_INV_VAL;
+  algo = tgpg_get_cipher (ctx);
+  if (!algo)
+    return TGPG_INV_ALGO;
+  version = ctx->aead_algo ? 6 : 3;
+
+  pool = get_pool (ctx);
+  if (!pool)
+    {
+      if (!depth)
+        return 0;
+      rc = new_pool (ctx);
+      if (rc)
+        return rc;
+      pool = ctx->envelopes;
+    }
+
+  rc = 0;
+  pthread_mutex_lock (&pool->lock);
+  for (qp = &pool->queues; (q = *qp); qp = &q->next)
+    if (q->key == key)
+      break;
+  if (!depth)
+    {
+      if (q)
+        {
+          *qp = q->next;
+          drain_queue (q);
+          xfree (q);
+        }
+    }
+  else
+    {
+      if (!q)
+        {
+          q = xtrycalloc (1, sizeof *q);
+          if (!q)
+            {
+              rc = TGPG_SYSERROR;
+              goto leave;
+            }
+          q->key = key;
+          q->algo = algo;
+          q->version = version;
+          q->next = pool->queues;
+          pool->queues = q;
+        }
+      else if (q->algo != algo || q->version != version || depth < q->count)
+        {
+          drain_queue (q);
+          q->algo = algo;
+          q->version = version;
+        }
+      q->depth = depth;
+      q->rc = 0;
+      pthread_cond_signal (&pool->cond);
+    }
+
+ leave:
+  pthread_mutex_unlock (&pool->lock);
+  return rc;
+#else
+  return depth ? TGPG_NOT_IMPL : 0;
+#endif
+}
+
+
+/* Take an envelope for KEY with the cipher ALGO and the packet
+   VERSION from the pool of CTX.  Returns NULL if none is ready.  */
+struct envelope_s *
+_tgpg_envelope_take (tgpg_t ctx, tgpg_key_t key, int algo, int version)
+{
+#ifdef HAVE_PTHREAD
+  struct envelope_pool_s *pool = get_pool (ctx);
+  struct envelope_queue_s *q;
+  struct envelope_s *env = NULL;
+
+  if (!pool)
+    return NULL;
+
+  pthread_mutex_lock (&pool->lock);
+  for (q = pool->queues; q; q = q->next)
+    if (q->key == key)
+      break;
+  if (q && q->algo == algo && q->version == version)
+    {
+      env = q->envelopes;
+      if (env)
+        {
+          q->envelopes = env->next;
+          q->count--;
+          env->next = NULL;
+        }
+      /* Try again after an error; the caller falls back to producing
+         an envelope itself and reports a persistent error.  */
+      q->rc = 0;
+      pthread_cond_signal (&pool->cond);
+    }
+  pthread_mutex_unlock (&pool->lock);
+  return env;
+#else
+  return NULL;
+#endif
+}
+
+
+/* Stop the producer of the envelope pool of CTX and release the
+   pool.  Contexts sharing the pool of another context leave it
+   alone.  */
+void
+_tgpg_envelope_pool_release (tgpg_t ctx)
+{
+#ifdef HAVE_PTHREAD
+  struct envelope_pool_s *pool = get_pool (ctx);
+
+  if (!pool || pool->owner != ctx)
+    return;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->stop = 1;
+  pthread_cond_signal (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+  pthread_join (pool->thread, NULL);
+  pthread_cond_destroy (&pool->cond);
+  pthread_mutex_destroy (&pool->lock);
+  free_pool (pool);
+  ctx->envelopes = NULL;
+#endif
+}
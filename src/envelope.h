@@ -0,0 +1,48 @@
+/* envelope.h - Precomputed session key envelopes
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+/* A session key together with the public key encrypted session key
+   packet carrying it to one recipient.  */
+struct envelope_s
+{
+  struct envelope_s *next;
+  int algo;                     /* The cipher of the session key.  */
+  int version;                  /* The version of the packet.  */
+  size_t seskeylen;
+  unsigned char seskey[32];
+  size_t packetlen;
+  unsigned char packet[1];      /* The packet, including its header.  */
+};
+
+/*-- encrypt.c --*/
+int _tgpg_make_envelope (tgpg_t ctx, tgpg_key_t key, int algo, int version,
+                         struct envelope_s **r_env);
+
+/*-- envelope.c --*/
+void _tgpg_envelope_release (struct envelope_s *env);
+struct envelope_s *_tgpg_envelope_take (tgpg_t ctx, tgpg_key_t key,
+                                        int algo, int version);
+void _tgpg_envelope_pool_release (tgpg_t ctx);
+
+#endif /*ENVELOPE_H*/
@@ -0,0 +1,89 @@
+/* keyfile.h - Formats of keystores created by tgpg-keystore
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#ifndef KEYFILE_H
+#define KEYFILE_H
+
+/* A binary keystore file is created by tgpg-keystore --binary and
+   mapped into memory by tgpg_map_keystore, which uses it in place.
+   It consists of a header, an index of the keys sorted by key ID and
+   the values of the MPIs, each starting at a multiple of
+   KEYFILE_ALIGN.  All numbers are stored in the byte order of the
+   host which created the file, as indicated by the BOM field.
+   Offsets are counted from the start of the file.  This header is
+   shared with the tool and may thus only depend on the C library.  */
+
+#include <stdint.h>
+
+#define KEYFILE_MAGIC   "TGPGKEYS"
+#define KEYFILE_VERSION 1
+#define KEYFILE_BOM     0x01020304
+#define KEYFILE_ALIGN   16
+#define KEYFILE_NMPIS   6
+
+struct keyfile_header_s
+{
+  char magic[8];                /* KEYFILE_MAGIC without the Nul.  */
+  uint32_t version;             /* KEYFILE_VERSION.  */
+  uint32_t bom;                 /* KEYFILE_BOM.  */
+  uint32_t nkeys;               /* The number of index entries.  */
+  uint32_t reserved;
+};
+
+struct keyfile_mpi_s
+{
+  uint32_t offset;              /* The offset of the value.  */
+  uint32_t length;              /* The length of the value in bytes.  */
+  uint32_t nbits;               /* The length of the MPI in bits.  */
+};
+
+/* The index entries directly follow the header.  */
+struct keyfile_entry_s
+{
+  uint32_t keyid_high;
+  uint32_t keyid_low;
+  uint32_t algo;                /* The OpenPGP public key algorithm.  */
+  uint32_t reserved;
+  struct keyfile_mpi_s mpis[KEYFILE_NMPIS];
+};
+
+
+/* Keystores compiled by tgpg-keystore --perfect-hash store each key in
+   the slot given by a minimal perfect hash of its key ID.  The key with
+   the ID HIGH, LOW is found in the bucket
+     b = keyfile_hash (HIGH, LOW, 0) % NBUCKETS
+   and stored in the slot
+     keyfile_hash (HIGH, LOW, DISP[b]) % NKEYS
+   where DISP is the displacement table computed by the tool.  */
+static inline uint32_t
+keyfile_hash (uint32_t high, uint32_t low, uint32_t seed)
+{
+  uint32_t h = seed * 0x9e3779b9;
+
+  h ^= low;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h ^= high;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+#endif /*KEYFILE_H*/
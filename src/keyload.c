@@ -0,0 +1,754 @@
+/* keyload.c - Load secret keys at runtime
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "tgpgdefs.h"
+#include "cryptglue.h"
+#include "keystore.h"
+#include "parallel.h"
+#include "protect.h"
+#include "keyfile.h"
+
+/* The suffix of key files.  */
+#define KEY_SUFFIX ".key"
+
+/* The length of a key ID in hex notation.  */
+#define KEYID_HEXLEN 16
+
+/* The default number of keys held by the key cache.  */
+#define KEY_CACHE_DEFAULT 1024
+
+
+/* The state of loading one key file.  */
+struct key_job_s
+{
+  char *fname;              /* The name of the file.  */
+  struct tgpg_key_s key;    /* The key.  */
+  unsigned char *buffer;    /* The unprotected key holding the MPIs.  */
+  size_t buflen;
+  int err;                  /* The result of loading the key.  */
+  unsigned long usec;       /* The time spent loading the key.  */
+};
+
+/* The arguments of load_key_job.  */
+struct load_parm_s
+{
+  const char *passphrase;
+  struct key_job_s *jobs;
+};
+
+
+/* Return the number of microseconds elapsed since START.  */
+static unsigned long
+elapsed_usec (const struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return ((now.tv_sec - start->tv_sec) * 1000000UL
+          + now.tv_usec - start->tv_usec);
+}
+
+
+/* Parse the key ID from the file name NAME which is expected to be of
+   the form KEYID.key and store it in KEY.  Returns true on success.  */
+static int
+parse_keyid (const char *name, struct tgpg_key_s *key)
+{
+  char buf[KEYID_HEXLEN / 2 + 1];
+  char *endp;
+
+  if (strlen (name) != KEYID_HEXLEN + strlen (KEY_SUFFIX)
+      || strcmp (name + KEYID_HEXLEN, KEY_SUFFIX)
+      || strspn (name, "0123456789abcdefABCDEF") != KEYID_HEXLEN)
+    return 0;
+
+  memcpy (buf, name, KEYID_HEXLEN / 2);
+  buf[KEYID_HEXLEN / 2] = 0;
+  key->keyid_high = strtoul (buf, &endp, 16);
+  memcpy (buf, name + KEYID_HEXLEN / 2, KEYID_HEXLEN / 2);
+  key->keyid_low = strtoul (buf, &endp, 16);
+  return 1;
+}
+
+
+/* Read the file FNAME into an allocated buffer and store it at
+   R_BUFFER and its length at R_LENGTH.  */
+static int
+read_key_file (const char *fname, char **r_buffer, size_t *r_length)
+{
+  FILE *fp;
+  char *buffer;
+  long length;
+  int rc = 0;
+
+  *r_buffer = NULL;
+  *r_length = 0;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return TGPG_SYSERROR;
+  if (fseek (fp, 0, SEEK_END) || (length = ftell (fp)) < 0
+      || fseek (fp, 0, SEEK_SET))
+    {
+      fclose (fp);
+      return TGPG_SYSERROR;
+    }
+  if (!length)
+    {
+      fclose (fp);
+      return TGPG_NO_DATA;
+    }
+
+  buffer = xtrymalloc (length);
+  if (!buffer)
+    rc = TGPG_SYSERROR;
+  else if (fread (buffer, length, 1, fp) != 1)
+    {
+      rc = ferror (fp) ? TGPG_SYSERROR : TGPG_INV_DATA;
+      wipememory (buffer, length);
+      xfree (buffer);
+    }
+  else
+    {
+      *r_buffer = buffer;
+      *r_length = length;
+    }
+  fclose (fp);
+  return rc;
+}
+
+
+/* Return the key stored in BUFFER of LENGTH bytes in canonical format
+   at R_SEXP and its length at R_LEN.  BUFFER either holds a canonical
+   S-expression or uses the extended private key format of gpg-agent,
+   which stores the key in advanced format as the value of the "Key:"
+   item.  Continuation lines of values start with white space.  */
+static int
+extract_key (const char *buffer, size_t length,
+             unsigned char **r_sexp, size_t *r_len)
+{
+  const char *p, *eol, *end;
+  char *text;
+  size_t textlen = 0;
+  int in_key = 0;
+  int rc;
+
+  *r_sexp = NULL;
+  *r_len = 0;
+
+  if (*buffer == '(')
+    {
+      if (!_tgpg_canonsexp_len ((const unsigned char *) buffer, length))
+        return TGPG_INV_DATA;
+      *r_sexp = xtrymalloc (length);
+      if (!*r_sexp)
+        return TGPG_SYSERROR;
+      memcpy (*r_sexp, buffer, length);
+      *r_len = length;
+      return 0;
+    }
+
+  text = xtrymalloc (length);
+  if (!text)
+    return TGPG_SYSERROR;
+
+  end = buffer + length;
+  for (p = buffer; p < end; p = eol + 1)
+    {
+      eol = memchr (p, '\n', end - p);
+      if (!eol)
+        eol = end;
+      if (in_key && (*p == ' ' || *p == '\t'))
+        ;
+      else if (in_key)
+        break;
+      else if (eol - p >= 4 && !strncasecmp (p, "Key:", 4))
+        {
+          in_key = 1;
+          p += 4;
+        }
+      else
+        continue;
+
+      memcpy (text + textlen, p, eol - p);
+      textlen += eol - p;
+    }
+
+  rc = in_key ? _tgpg_sexp_canon (text, textlen, r_sexp, r_len)
+              : TGPG_NO_DATA;
+  wipememory (text, length);
+  xfree (text);
+  return rc;
+}
+
+
+/* Read the key file FNAME, unprotect it using PASSPHRASE and parse
+   it into KEY.  On success the unprotected key is returned in an
+   allocated buffer at R_BUFFER and its length at R_BUFLEN; the MPIs
+   of KEY point into this buffer.  */
+static int
+load_key_file (const char *fname, const char *passphrase,
+               unsigned char **r_buffer, size_t *r_buflen,
+               struct tgpg_key_s *key)
+{
+  char *buffer;
+  size_t length;
+  unsigned char *sexp = NULL;
+  size_t sexplen;
+  int rc;
+
+  *r_buffer = NULL;
+  *r_buflen = 0;
+
+  rc = read_key_file (fname, &buffer, &length);
+  if (rc)
+    return rc;
+  rc = extract_key (buffer, length, &sexp, &sexplen);
+  wipememory (buffer, length);
+  xfree (buffer);
+  if (rc)
+    return rc;
+
+  if (_tgpg_is_protected (sexp) == TGPG_NO_DATA)
+    {
+      if (!passphrase)
+        rc = TGPG_NO_PASS;
+      else
+        rc = _tgpg_unprotect (sexp, passphrase, r_buffer, r_buflen);
+      wipememory (sexp, sexplen);
+      xfree (sexp);
+      if (rc)
+        return rc;
+    }
+  else
+    {
+      *r_buffer = sexp;
+      *r_buflen = sexplen;
+    }
+
+  rc = _tgpg_parse_private_key (*r_buffer, *r_buflen, key);
+  if (rc)
+    {
+      wipememory (*r_buffer, *r_buflen);
+      xfree (*r_buffer);
+      *r_buffer = NULL;
+    }
+  return rc;
+}
+
+
+/* Load and unprotect the key of the job with index IDX.  Errors are
+   recorded in the job, so that the other keys are still loaded.  */
+static int
+load_key_job (void *arg, unsigned int worker, size_t idx)
+{
+  struct load_parm_s *parm = arg;
+  struct key_job_s *job = &parm->jobs[idx];
+  struct timeval start;
+
+  gettimeofday (&start, NULL);
+  job->err = load_key_file (job->fname, parm->passphrase,
+                            &job->buffer, &job->buflen, &job->key);
+  job->usec = elapsed_usec (&start);
+  return 0;
+}
+
+
+/* Compare two jobs by their file names.  */
+static int
+compare_jobs (const void *a, const void *b)
+{
+  return strcmp (((const struct key_job_s *) a)->fname,
+                 ((const struct key_job_s *) b)->fname);
+}
+
+
+/* Load all secret keys from the files named KEYID.key in the
+   directory DIRNAME, unprotect them using PASSPHRASE using up to
+   NTHREADS threads and add them to the keystore.  */
+int
+tgpg_load_keys (const char *dirname, const char *passphrase,
+                unsigned int nthreads, tgpg_load_cb_t cb, void *opaque)
+{
+  int rc = 0;
+  DIR *dir;
+  struct dirent *de;
+  struct key_job_s *jobs = NULL, *tmp;
+  size_t njobs = 0, size = 0, idx;
+  struct load_parm_s parm;
+  struct timeval start;
+  struct tgpg_key_s key;
+
+  gettimeofday (&start, NULL);
+
+  dir = opendir (dirname);
+  if (!dir)
+    return TGPG_SYSERROR;
+
+  while ((de = readdir (dir)))
+    {
+      if (!parse_keyid (de->d_name, &key))
+        continue;
+
+      if (njobs == size)
+        {
+          size = size ? 2 * size : 64;
+          tmp = xtryrealloc (jobs, size * sizeof *jobs);
+          if (!tmp)
+            {
+              rc = TGPG_SYSERROR;
+              break;
+            }
+          jobs = tmp;
+        }
+
+      memset (&jobs[njobs], 0, sizeof *jobs);
+      jobs[njobs].key = key;
+      jobs[njobs].fname = xtrymalloc (strlen (dirname) + 1
+                                      + strlen (de->d_name) + 1);
+      if (!jobs[njobs].fname)
+        {
+          rc = TGPG_SYSERROR;
+          break;
+        }
+      sprintf (jobs[njobs].fname, "%s/%s", dirname, de->d_name);
+      njobs++;
+    }
+  closedir (dir);
+  if (rc)
+    goto leave;
+
+  /* Register the keys in a well defined order.  */
+  if (njobs)
+    qsort (jobs, njobs, sizeof *jobs, compare_jobs);
+
+  parm.passphrase = passphrase;
+  parm.jobs = jobs;
+  rc = _tgpg_parallel_run (_tgpg_parallel_workers (nthreads, njobs),
+                           njobs, load_key_job, &parm);
+  if (rc)
+    goto leave;
+
+  for (idx = 0; idx < njobs; idx++)
+    {
+      if (!jobs[idx].err)
+        {
+          jobs[idx].err = _tgpg_register_key (&jobs[idx].key,
+                                              jobs[idx].buffer);
+          if (!jobs[idx].err)
+            jobs[idx].buffer = NULL;
+        }
+      if (jobs[idx].err && !rc)
+        rc = jobs[idx].err;
+      if (cb)
+        cb (opaque, jobs[idx].fname, jobs[idx].err, jobs[idx].usec);
+    }
+
+ leave:
+  for (idx = 0; idx < njobs; idx++)
+    {
+      xfree (jobs[idx].fname);
+      if (jobs[idx].buffer)
+        {
+          wipememory (jobs[idx].buffer, jobs[idx].buflen);
+          xfree (jobs[idx].buffer);
+        }
+    }
+  xfree (jobs);
+  if (cb)
+    cb (opaque, NULL, rc, elapsed_usec (&start));
+  return rc;
+}
+
+
+
+/* The key cache loads keys from the files named KEYID.key in
+   CACHE_DIR when they are first needed.  It keeps up to CACHE_CAPACITY
+   prepared keys and evicts the least recently used one to make room,
+   so that the memory used tracks the working set rather than the
+   number of keys on disk.  */
+
+/* A key in the cache.  SEXP holds the canonical S-expression of the
+   key as passed to the crypto backend; the MPIs of KEY point into
+   it.  */
+struct cache_entry_s
+{
+  struct cache_entry_s *next_hash;  /* The next entry of the bucket.  */
+  struct cache_entry_s *prev;       /* The more recently used entry.  */
+  struct cache_entry_s *next;       /* The less recently used entry.  */
+  struct tgpg_key_s key;
+  size_t sexplen;
+  unsigned char sexp[1];
+};
+
+static char *cache_dir;
+static char *cache_passphrase;
+static unsigned int cache_capacity;
+static unsigned int cache_used;
+static struct cache_entry_s **cache_buckets;
+static unsigned int cache_nbuckets;     /* A power of two.  */
+static struct cache_entry_s *cache_head; /* The most recently used.  */
+static struct cache_entry_s *cache_tail; /* The least recently used.  */
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+static unsigned long cache_evictions;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+# define LOCK_CACHE()   pthread_mutex_lock (&cache_lock)
+# define UNLOCK_CACHE() pthread_mutex_unlock (&cache_lock)
+#else
+# define LOCK_CACHE()   do { } while (0)
+# define UNLOCK_CACHE() do { } while (0)
+#endif
+
+
+/* Return the hash chain for the key ID HIGH, LOW.  */
+static struct cache_entry_s **
+cache_bucket (unsigned long high, unsigned long low)
+{
+  return &cache_buckets[keyfile_hash (high, low, 0) & (cache_nbuckets - 1)];
+}
+
+
+/* Move ENTRY to the front of the LRU list.  IS_NEW is set if ENTRY
+   is not yet in the list.  */
+static void
+cache_touch (struct cache_entry_s *entry, int is_new)
+{
+  if (!is_new)
+    {
+      if (entry == cache_head)
+        return;
+      entry->prev->next = entry->next;
+      if (entry->next)
+        entry->next->prev = entry->prev;
+      else
+        cache_tail = entry->prev;
+    }
+
+  entry->prev = NULL;
+  entry->next = cache_head;
+  if (cache_head)
+    cache_head->prev = entry;
+  cache_head = entry;
+  if (!cache_tail)
+    cache_tail = entry;
+}
+
+
+/* Remove ENTRY from the cache and release it.  */
+static void
+cache_remove (struct cache_entry_s *entry)
+{
+  struct cache_entry_s **p;
+
+  for (p = cache_bucket (entry->key.keyid_high, entry->key.keyid_low);
+       *p != entry; p = &(*p)->next_hash)
+    ;
+  *p = entry->next_hash;
+
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache_head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache_tail = entry->prev;
+
+  cache_used--;
+  wipememory (entry->sexp, entry->sexplen);
+  xfree (entry);
+}
+
+
+/* Create a cache entry for the RSA key KEY, whose MPIs are copied
+   into the canonical S-expression of the entry.  */
+static struct cache_entry_s *
+cache_make_entry (const struct tgpg_key_s *key)
+{
+  static const char parmlist[] = "nedpqu";
+  struct cache_entry_s *entry;
+  size_t size;
+  char *p;
+  int i;
+
+  size = sizeof "(11:private-key(3:rsa))";
+  for (i = 0; i < 6; i++)
+    size += sizeof "(1:n:)" + 20 + key->mpis[i].valuelen;
+
+  entry = xtrymalloc (offsetof (struct cache_entry_s, sexp) + size);
+  if (!entry)
+    return NULL;
+  entry->key = *key;
+
+  p = (char *) entry->sexp;
+  p += sprintf (p, "(11:private-key(3:rsa");
+  for (i = 0; i < 6; i++)
+    {
+      p += sprintf (p, "(1:%c%u:", parmlist[i],
+                    (unsigned int) key->mpis[i].valuelen);
+      memcpy (p, key->mpis[i].value, key->mpis[i].valuelen);
+      entry->key.mpis[i].value = p;
+      p += key->mpis[i].valuelen;
+      *p++ = ')';
+    }
+  *p++ = ')';
+  *p++ = ')';
+  entry->sexplen = p - (char *) entry->sexp;
+  return entry;
+}
+
+
+/* Load the key identified by KI from the cache directory and return
+   a new cache entry for it at R_ENTRY.  Only RSA keys are cached; a
+   key of another algorithm is treated as missing.  */
+static int
+cache_load (keyinfo_t ki, struct cache_entry_s **r_entry)
+{
+  char *fname;
+  unsigned char *buffer;
+  size_t buflen;
+  struct tgpg_key_s key;
+  int rc;
+
+  *r_entry = NULL;
+
+  fname = xtrymalloc (strlen (cache_dir) + 1 + KEYID_HEXLEN
+                      + strlen (KEY_SUFFIX) + 1);
+  if (!fname)
+    return TGPG_SYSERROR;
+
+  /* Key IDs are usually printed in upper case but we also accept
+     lower case file names, as does tgpg_load_keys.  */
+  sprintf (fname, "%s/%08lX%08lX" KEY_SUFFIX, cache_dir,
+           (unsigned long) ki->keyid[1], (unsigned long) ki->keyid[0]);
+  memset (&key, 0, sizeof key);
+  rc = load_key_file (fname, cache_passphrase, &buffer, &buflen, &key);
+  if (rc == TGPG_SYSERROR && errno == ENOENT)
+    {
+      sprintf (fname, "%s/%08lx%08lx" KEY_SUFFIX, cache_dir,
+               (unsigned long) ki->keyid[1], (unsigned long) ki->keyid[0]);
+      rc = load_key_file (fname, cache_passphrase, &buffer, &buflen, &key);
+    }
+  if (rc == TGPG_SYSERROR && errno == ENOENT)
+    rc = TGPG_NO_SECKEY;
+  xfree (fname);
+  if (rc)
+    return rc;
+
+  key.keyid_high = ki->keyid[1];
+  key.keyid_low = ki->keyid[0];
+  if (key.algo != PK_ALGO_RSA)
+    rc = TGPG_NO_SECKEY;
+  else
+    {
+      *r_entry = cache_make_entry (&key);
+      if (!*r_entry)
+        rc = TGPG_SYSERROR;
+    }
+  wipememory (buffer, buflen);
+  xfree (buffer);
+  return rc;
+}
+
+
+/* Store a copy of the key of ENTRY at R_SECKEY in the format returned
+   by _tgpg_get_secret_key.  The S-expression is copied along with
+   the MPIs, so that the entry may be evicted while the copy is in
+   use.  */
+static int
+cache_copy_key (const struct cache_entry_s *entry, tgpg_mpi_t *r_seckey)
+{
+  tgpg_mpi_t mpis;
+  char *sexp;
+  int i;
+
+  mpis = xtrymalloc (7 * sizeof *mpis + entry->sexplen);
+  if (!mpis)
+    return TGPG_SYSERROR;
+  sexp = (char *) (mpis + 7);
+  memcpy (sexp, entry->sexp, entry->sexplen);
+  for (i = 0; i < 6; i++)
+    {
+      mpis[i] = entry->key.mpis[i];
+      mpis[i].value = sexp + (entry->key.mpis[i].value
+                              - (const char *) entry->sexp);
+    }
+  mpis[6].nbits = 0;
+  mpis[6].valuelen = entry->sexplen;
+  mpis[6].value = sexp;
+  *r_seckey = mpis;
+  return 0;
+}
+
+
+/* Look up the key identified by KI in the key cache and load it if
+   it is not cached yet.  Each lookup counts as a hit or a miss.  If
+   R_SECKEY is NULL, this just checks for the key.  Otherwise a copy
+   of the key is stored at R_SECKEY.  Only RSA keys are cached.
+   Anonymous recipients are not supported because we can't search
+   the directory for them.  */
+int
+_tgpg_cache_lookup (keyinfo_t ki, tgpg_mpi_t *r_seckey)
+{
+  struct cache_entry_s *entry, *loaded;
+  int rc = 0;
+
+  if (!cache_dir || (!ki->keyid[0] && !ki->keyid[1])
+      || ki->pubkey_algo != PK_ALGO_RSA)
+    return TGPG_NO_SECKEY;
+
+  LOCK_CACHE ();
+  for (entry = *cache_bucket (ki->keyid[1], ki->keyid[0]); entry;
+       entry = entry->next_hash)
+    if (entry->key.keyid_high == ki->keyid[1]
+        && entry->key.keyid_low == ki->keyid[0])
+      break;
+  if (entry)
+    cache_hits++;
+  else
+    cache_misses++;
+
+  if (!entry)
+    {
+      /* Do not hold the lock while unprotecting the key, which may
+         take a long time.  Another thread may load the same key in
+         the meantime; in this case its entry is used.  */
+      UNLOCK_CACHE ();
+      rc = cache_load (ki, &loaded);
+      if (rc)
+        return rc;
+      LOCK_CACHE ();
+      for (entry = *cache_bucket (ki->keyid[1], ki->keyid[0]); entry;
+           entry = entry->next_hash)
+        if (entry->key.keyid_high == ki->keyid[1]
+            && entry->key.keyid_low == ki->keyid[0])
+          break;
+      if (entry)
+        {
+          wipememory (loaded->sexp, loaded->sexplen);
+          xfree (loaded);
+        }
+      else
+        {
+          while (cache_used >= cache_capacity)
+            {
+              cache_remove (cache_tail);
+              cache_evictions++;
+            }
+          entry = loaded;
+          entry->next_hash = *cache_bucket (ki->keyid[1], ki->keyid[0]);
+          *cache_bucket (ki->keyid[1], ki->keyid[0]) = entry;
+          cache_touch (entry, 1);
+          cache_used++;
+        }
+    }
+  else
+    cache_touch (entry, 0);
+
+  if (r_seckey)
+    rc = cache_copy_key (entry, r_seckey);
+  UNLOCK_CACHE ();
+  return rc;
+}
+
+
+/* Release all keys and the settings of the key cache.  */
+static void
+cache_clear (void)
+{
+  while (cache_head)
+    cache_remove (cache_head);
+  xfree (cache_buckets);
+  cache_buckets = NULL;
+  cache_nbuckets = 0;
+  xfree (cache_dir);
+  cache_dir = NULL;
+  if (cache_passphrase)
+    {
+      wipememory (cache_passphrase, strlen (cache_passphrase));
+      xfree (cache_passphrase);
+      cache_passphrase = NULL;
+    }
+}
+
+
+/* Load secret keys from the directory DIRNAME when they are needed
+   and keep up to CAPACITY of them in memory.  */
+int
+tgpg_set_key_cache (const char *dirname, const char *passphrase,
+                    unsigned int capacity)
+{
+  unsigned int nbuckets;
+
+  cache_clear ();
+  cache_hits = cache_misses = cache_evictions = 0;
+  if (!dirname)
+    return 0;
+
+  cache_capacity = capacity ? capacity : KEY_CACHE_DEFAULT;
+  for (nbuckets = 1; nbuckets < cache_capacity && nbuckets < (1u << 31);
+       nbuckets <<= 1)
+    ;
+
+  cache_buckets = xtrycalloc (nbuckets, sizeof *cache_buckets);
+  cache_dir = xtrymalloc (strlen (dirname) + 1);
+  cache_passphrase = passphrase ? xtrymalloc (strlen (passphrase) + 1) : NULL;
+  if (!cache_buckets || !cache_dir || (passphrase && !cache_passphrase))
+    {
+      xfree (cache_passphrase);
+      cache_passphrase = NULL;
+      cache_clear ();
+      return TGPG_SYSERROR;
+    }
+  cache_nbuckets = nbuckets;
+  strcpy (cache_dir, dirname);
+  if (passphrase)
+    strcpy (cache_passphrase, passphrase);
+  return 0;
+}
+
+
+/* Store the statistics of the key cache at R_STATS.  */
+void
+tgpg_get_key_cache_stats (struct tgpg_key_cache_stats_s *r_stats)
+{
+  LOCK_CACHE ();
+  r_stats->hits = cache_hits;
+  r_stats->misses = cache_misses;
+  r_stats->evictions = cache_evictions;
+  r_stats->used = cache_used;
+  r_stats->capacity = cache_dir ? cache_capacity : 0;
+  UNLOCK_CACHE ();
+}
@@ -23,63 +23,448 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "tgpgdefs.h"
 #include "keystore.h"
+#include "keyfile.h"
 
 const struct tgpg_key_s *seckey_table = { { /* sentinel */ 0 } };
 
+/* Return true if KI does not identify a key.  This is the case for
+   anonymous recipients.  */
+static int
+is_wildcard (keyinfo_t ki)
+{
+  return !ki->keyid[0] && !ki->keyid[1];
+}
+
+
+/* Keys registered at runtime, e.g. by tgpg_load_keys.  The MPIs of
+   each key point into its BUFFER.  */
+struct dynkey_s
+{
+  struct tgpg_key_s key;
+  unsigned char *buffer;
+};
+static struct dynkey_s *dynkeys;
+static size_t dynkeys_used;
+static size_t dynkeys_size;
+
+
+/* Return true if *N is zero, i.e. the wanted one of the candidate
+   keys has been reached; otherwise count it down.  */
+static int
+next_candidate (unsigned int *n)
+{
+  if (!*n)
+    return 1;
+  --*n;
+  return 0;
+}
+
+
+/* Return true if KEY matches the public key identified by KI.  */
+static int
+key_matches (const struct tgpg_key_s *key, keyinfo_t ki)
+{
+  return (key->algo == ki->pubkey_algo
+          && (is_wildcard (ki)
+              || (key->keyid_low == ki->keyid[0]
+                  && key->keyid_high == ki->keyid[1])));
+}
+
+
+/* The compiled keystore set by tgpg_set_keytable.  */
+static tgpg_keytable_t keytable;
+
+
+/* Look up the key matching KI in the compiled keystore, skipping *N
+   matching keys, which are counted down.  Returns the key or NULL if
+   it was not found.  */
+static const struct tgpg_compiled_key_s *
+keytable_find (keyinfo_t ki, unsigned int *n)
+{
+  const struct tgpg_compiled_key_s *key;
+  uint32_t b;
+  unsigned int idx;
+
+  if (!keytable || !keytable->nkeys)
+    return NULL;
+
+  if (is_wildcard (ki))
+    {
+      for (idx = 0; idx < keytable->nkeys; idx++)
+        if (keytable->keys[idx].key.algo == ki->pubkey_algo
+            && next_candidate (n))
+          return &keytable->keys[idx];
+      return NULL;
+    }
+
+  b = keyfile_hash (ki->keyid[1], ki->keyid[0], 0) % keytable->nbuckets;
+  key = &keytable->keys[keyfile_hash (ki->keyid[1], ki->keyid[0],
+                                      keytable->disp[b])
+                        % keytable->nkeys];
+  return key_matches (&key->key, ki) && next_candidate (n) ? key : NULL;
+}
+
+
+/* Use the compiled keystore TABLE.  */
+void
+tgpg_set_keytable (tgpg_keytable_t table)
+{
+  keytable = table;
+}
+
+
+/* The binary keystore set by tgpg_map_keystore.  */
+static const unsigned char *keyfile;
+static size_t keyfile_len;
+#ifndef HAVE_MMAP
+/* The copy of the binary keystore read into memory, through which
+   it is wiped when released.  */
+static unsigned char *keyfile_copy;
+#endif
+
+
+/* Look up the key matching KI in the binary keystore, skipping *N
+   matching keys, which are counted down, and store it in R_KEY.
+   Returns true if the key was found.  */
+static int
+keyfile_find (keyinfo_t ki, unsigned int *n, struct tgpg_key_s *r_key)
+{
+  const struct keyfile_header_s *hdr;
+  const struct keyfile_entry_s *index, *entry = NULL;
+  size_t lo, hi, mid;
+  int i;
+
+  if (!keyfile)
+    return 0;
+  hdr = (const struct keyfile_header_s *) keyfile;
+  index = (const struct keyfile_entry_s *) (hdr + 1);
+
+  if (is_wildcard (ki))
+    {
+      for (mid = 0; mid < hdr->nkeys; mid++)
+        if (index[mid].algo == ki->pubkey_algo && next_candidate (n))
+          {
+            entry = &index[mid];
+            break;
+          }
+    }
+  else
+    {
+      /* The index is sorted by key ID.  */
+      lo = 0;
+      hi = hdr->nkeys;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (index[mid].keyid_high < ki->keyid[1]
+              || (index[mid].keyid_high == ki->keyid[1]
+                  && index[mid].keyid_low < ki->keyid[0]))
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      if (lo < hdr->nkeys
+          && index[lo].keyid_high == ki->keyid[1]
+          && index[lo].keyid_low == ki->keyid[0])
+        entry = &index[lo];
+      if (entry && (entry->algo != ki->pubkey_algo || !next_candidate (n)))
+        entry = NULL;
+    }
+  if (!entry)
+    return 0;
+
+  /* The MPIs are only checked here, so that mapping a keystore does
+     not depend on its size.  */
+  memset (r_key, 0, sizeof *r_key);
+  r_key->algo = entry->algo;
+  r_key->keyid_high = entry->keyid_high;
+  r_key->keyid_low = entry->keyid_low;
+  for (i = 0; i < KEYFILE_NMPIS; i++)
+    {
+      if (entry->mpis[i].offset > keyfile_len
+          || entry->mpis[i].length > keyfile_len - entry->mpis[i].offset)
+        return 0;
+      r_key->mpis[i].nbits = entry->mpis[i].nbits;
+      r_key->mpis[i].valuelen = entry->mpis[i].length;
+      r_key->mpis[i].value = (const char *) keyfile + entry->mpis[i].offset;
+    }
+  return 1;
+}
+
+
+/* Store the secret key matching KI at R_KEY.  Returns true if we have
+   the key.  The canonical S-expression of R_KEY is only set for
+   compiled keys.  The static table takes precedence over the
+   compiled keystore, the binary keystore and the keys registered at
+   runtime, in this order.  An anonymous recipient matches all keys of
+   its algorithm; *N is the number of matching keys to skip and is
+   counted down for each of them.  */
+static int
+find_key (keyinfo_t ki, unsigned int *n, struct tgpg_compiled_key_s *r_key)
+{
+  const struct tgpg_compiled_key_s *compiled;
+  size_t idx;
+
+  r_key->sexp = NULL;
+  r_key->sexplen = 0;
+  for (idx = 0; seckey_table && seckey_table[idx].algo; idx++)
+    if (key_matches (&seckey_table[idx], ki) && next_candidate (n))
+      {
+        r_key->key = seckey_table[idx];
+        return 1;
+      }
+  compiled = keytable_find (ki, n);
+  if (compiled)
+    {
+      *r_key = *compiled;
+      return 1;
+    }
+  if (keyfile_find (ki, n, &r_key->key))
+    return 1;
+  for (idx = 0; idx < dynkeys_used; idx++)
+    if (key_matches (&dynkeys[idx].key, ki) && next_candidate (n))
+      {
+        r_key->key = dynkeys[idx].key;
+        return 1;
+      }
+  return 0;
+}
+
+
+/* Release the binary keystore.  */
+static void
+keyfile_release (void)
+{
+  if (!keyfile)
+    return;
+#ifdef HAVE_MMAP
+  munmap ((void *) keyfile, keyfile_len);
+#else
+  wipememory (keyfile_copy, keyfile_len);
+  xfree (keyfile_copy);
+  keyfile_copy = NULL;
+#endif
+  keyfile = NULL;
+  keyfile_len = 0;
+}
+
+
+/* Use the binary keystore FNAME created by tgpg-keystore --binary.
+   The file is mapped read-only and used in place.  */
+int
+tgpg_map_keystore (const char *fname)
+{
+  int fd;
+  struct stat st;
+  unsigned char *image;
+  const struct keyfile_header_s *hdr;
+  int rc = 0;
+
+  keyfile_release ();
+  if (!fname)
+    return 0;
+
+  fd = open (fname, O_RDONLY);
+  if (fd == -1)
+    return TGPG_SYSERROR;
+  if (fstat (fd, &st))
+    {
+      close (fd);
+      return TGPG_SYSERROR;
+    }
+  if (st.st_size < sizeof *hdr || st.st_size > (uint32_t)-1)
+    {
+      close (fd);
+      return TGPG_INV_DATA;
+    }
+
+#ifdef HAVE_MMAP
+  image = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED)
+    rc = TGPG_SYSERROR;
+#else
+  image = xtrymalloc (st.st_size);
+  if (!image)
+    rc = TGPG_SYSERROR;
+  else if (read (fd, image, st.st_size) != st.st_size)
+    {
+      xfree (image);
+      rc = TGPG_SYSERROR;
+    }
+#endif
+  close (fd);
+  if (rc)
+    return rc;
+#ifndef HAVE_MMAP
+  keyfile_copy = image;
+#endif
+  keyfile = image;
+  keyfile_len = st.st_size;
+
+  hdr = (const struct keyfile_header_s *) image;
+  if (memcmp (hdr->magic, KEYFILE_MAGIC, sizeof hdr->magic)
+      || hdr->bom != KEYFILE_BOM)
+    rc = TGPG_INV_DATA;
+  else if (hdr->version != KEYFILE_VERSION)
+    rc = TGPG_NOT_IMPL;
+  else if (hdr->nkeys > ((keyfile_len - sizeof *hdr)
+                         / sizeof (struct keyfile_entry_s)))
+    rc = TGPG_INV_DATA;
+  if (rc)
+    keyfile_release ();
+  return rc;
+}
+
+
+/* Add KEY to the keys registered at runtime.  BUFFER holds the values
+   of the MPIs of KEY; on success it is owned by the keystore.  This
+   function may not be called while other threads use the keystore.  */
+int
+_tgpg_register_key (const struct tgpg_key_s *key, unsigned char *buffer)
+{
+  struct dynkey_s *tmp;
+  size_t n;
+
+  if (dynkeys_used == dynkeys_size)
+    {
+      n = dynkeys_size ? 2 * dynkeys_size : 16;
+      tmp = xtryrealloc (dynkeys, n * sizeof *tmp);
+      if (!tmp)
+        return TGPG_SYSERROR;
+      dynkeys = tmp;
+      dynkeys_size = n;
+    }
+  dynkeys[dynkeys_used].key = *key;
+  dynkeys[dynkeys_used].buffer = buffer;
+  dynkeys_used++;
+  return 0;
+}
+
+
+/* Use LOOKUP and RELEASE to obtain the secret keys which are not in
+   any keystore when decrypting with CTX.  */
+void
+tgpg_set_key_provider (tgpg_t ctx, tgpg_key_lookup_cb_t lookup,
+                       tgpg_key_release_cb_t release, void *opaque)
+{
+  _tgpg_release_provided_key (ctx);
+  ctx->key_lookup = lookup;
+  ctx->key_release = release;
+  ctx->key_opaque = opaque;
+}
+
+
+/* Release the key returned by the key provider of CTX, if any.  */
+void
+_tgpg_release_provided_key (tgpg_t ctx)
+{
+  if (!ctx->provided_key)
+    return;
+  if (ctx->key_release)
+    ctx->key_release (ctx->key_opaque, ctx->provided_key);
+  ctx->provided_key = NULL;
+}
+
+
 /* Return success (0) if we have the secret key matching the public
-   key identified by KI. */
+   key identified by KI.  An anonymous recipient matches any key of
+   the same algorithm.  If the key is neither in any keystore nor in
+   the key cache, the key provider of CTX is asked for it; the key it
+   returns is kept in CTX until _tgpg_release_provided_key is called.
+   Returns TGPG_PENDING if the provider is still fetching the key.  */
 int
-_tgpg_have_secret_key (keyinfo_t ki)
+_tgpg_have_secret_key (tgpg_t ctx, keyinfo_t ki)
 {
-  int idx;
+  struct tgpg_compiled_key_s key;
+  tgpg_key_t provided;
+  unsigned int n = 0;
+  int rc;
 
   fprintf (stderr, "DBG: Looking for keyid %04lx%04lx (algo %d)\n",
            ki->keyid[1], ki->keyid[0], ki->pubkey_algo);
 
-  for (idx = 0; seckey_table[idx].algo; idx++)
-    if (seckey_table[idx].algo == ki->pubkey_algo
-        && seckey_table[idx].keyid_low == ki->keyid[0]
-        && seckey_table[idx].keyid_high == ki->keyid[1])
-      return 0;
+  if (find_key (ki, &n, &key))
+    return 0;
+  if (!_tgpg_cache_lookup (ki, NULL))
+    return 0;
 
+  if (!ctx->key_lookup)
+    return TGPG_NO_SECKEY;
 
-  return TGPG_NO_SECKEY;
+  provided = NULL;
+  rc = ctx->key_lookup (ctx->key_opaque, ki->pubkey_algo,
+                        ki->keyid[1], ki->keyid[0], &provided);
+  if (rc)
+    return rc == TGPG_PENDING ? TGPG_PENDING : TGPG_NO_SECKEY;
+  if (!provided)
+    return TGPG_NO_SECKEY;
+  if (!key_matches (provided, ki))
+    {
+      if (ctx->key_release)
+        ctx->key_release (ctx->key_opaque, provided);
+      return TGPG_NO_SECKEY;
+    }
+
+  _tgpg_release_provided_key (ctx);
+  ctx->provided_key = provided;
+  return 0;
 }
 
 
-/* Return the secret key matching KI at R_SECKEY.  The caller needs to
-   release the secret key later using _tgpg_free_secret_key.  */
+/* Return the secret key matching KI at R_SECKEY.  Besides the
+   keystores the key cache and the key returned by the key provider of
+   CTX are considered.  An anonymous recipient matches every key of
+   its algorithm; CANDIDATE selects which of them is returned, so that
+   the caller can try them in turn until TGPG_NO_SECKEY is returned.
+   The caller needs to release the secret key later using
+   _tgpg_free_secret_key.  */
 int
-_tgpg_get_secret_key (keyinfo_t ki, tgpg_mpi_t *r_seckey)
+_tgpg_get_secret_key (tgpg_t ctx, keyinfo_t ki, unsigned int candidate,
+                      tgpg_mpi_t *r_seckey)
 {
-  int idx, i;
+  struct tgpg_compiled_key_s key;
+  int i, rc;
   tgpg_mpi_t mpis;
 
-  fprintf (stderr, "DBG: get-secret_key for keyid %04lx%04lx (algo %d)\n",
-           ki->keyid[1], ki->keyid[0], ki->pubkey_algo);
+  if (!candidate)
+    fprintf (stderr, "DBG: get-secret_key for keyid %04lx%04lx (algo %d)\n",
+             ki->keyid[1], ki->keyid[0], ki->pubkey_algo);
 
-  for (idx = 0; seckey_table[idx].algo; idx++)
-    if (seckey_table[idx].algo == ki->pubkey_algo
-        && seckey_table[idx].keyid_low == ki->keyid[0]
-        && seckey_table[idx].keyid_high == ki->keyid[1])
-      break;
-  if (!seckey_table[idx].algo)
-    return TGPG_NO_SECKEY;
+  if (!find_key (ki, &candidate, &key))
+    {
+      /* The key cache holds at most one key for KI.  */
+      rc = candidate ? TGPG_NO_SECKEY : _tgpg_cache_lookup (ki, r_seckey);
+      if (rc != TGPG_NO_SECKEY)
+        return rc;
+      if (candidate || !ctx->provided_key
+          || !key_matches (ctx->provided_key, ki))
+        return TGPG_NO_SECKEY;
+      key.key = *ctx->provided_key;
+    }
 
-  if (seckey_table[idx].algo == PK_ALGO_RSA)
+  if (key.key.algo == PK_ALGO_RSA || key.key.algo == PK_ALGO_ECDH)
     {
       mpis = xtrycalloc (6+1, sizeof *mpis);
       if (!mpis)
         return TGPG_SYSERROR;
       for (i=0; i < 6; i++)
         {
-          mpis[i].nbits    = seckey_table[idx].mpis[i].nbits;
-          mpis[i].valuelen = seckey_table[idx].mpis[i].valuelen;
-          mpis[i].value    = seckey_table[idx].mpis[i].value;
+          mpis[i].nbits    = key.key.mpis[i].nbits;
+          mpis[i].valuelen = key.key.mpis[i].valuelen;
+          mpis[i].value    = key.key.mpis[i].value;
         }
+      mpis[6].valuelen = key.sexplen;
+      mpis[6].value    = key.sexp;
       *r_seckey = mpis;
     }
   else
@@ -93,5 +478,8 @@ _tgpg_get_secret_key (keyinfo_t ki, tgpg_mpi_t *r_seckey)
 void
 _tgpg_free_secret_key (tgpg_mpi_t seckey)
 {
+  /* Keys from the key cache carry a copy of their S-expression.  */
+  if (seckey && seckey[6].value == (const char *) (seckey + 7))
+    wipememory (seckey + 7, seckey[6].valuelen);
   xfree (seckey);
 }
@@ -27,9 +27,17 @@
 /* XXX: Rename this.  */
 const struct tgpg_key_s *seckey_table;
 
-int _tgpg_have_secret_key (keyinfo_t ki);
-int _tgpg_get_secret_key (keyinfo_t ki, tgpg_mpi_t *r_seckey);
+int _tgpg_have_secret_key (tgpg_t ctx, keyinfo_t ki);
+/* The array of MPIs returned by _tgpg_get_secret_key has one more
+   element than the key has parameters.  For compiled keys its VALUE
+   and VALUELEN describe the canonical S-expression of the key;
+   otherwise they are zero.  */
+int _tgpg_get_secret_key (tgpg_t ctx, keyinfo_t ki, unsigned int candidate,
+                          tgpg_mpi_t *r_seckey);
 void _tgpg_free_secret_key (tgpg_mpi_t seckey);
+void _tgpg_release_provided_key (tgpg_t ctx);
+int _tgpg_register_key (const struct tgpg_key_s *key, unsigned char *buffer);
+int _tgpg_cache_lookup (keyinfo_t ki, tgpg_mpi_t *r_seckey);
 
 
 #endif /*KEYSTORE_H*/
@@ -0,0 +1,302 @@
+/* parallel.c - Simple parallel job runner
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "tgpgdefs.h"
+#include "parallel.h"
+
+/* We never start more than this number of workers.  */
+#define MAX_WORKERS 64
+
+
+/* Return the number of workers to use for NJOBS jobs if the user
+   requested REQUESTED workers.  A request of 0 means one worker per
+   online CPU.  */
+unsigned int
+_tgpg_parallel_workers (unsigned int requested, size_t njobs)
+{
+  unsigned int n = requested;
+
+#if defined HAVE_PTHREAD && defined _SC_NPROCESSORS_ONLN
+  if (!n)
+    {
+      long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+
+      n = ncpu > 0 ? ncpu : 1;
+    }
+#else
+  n = 1;
+#endif
+  if (n > MAX_WORKERS)
+    n = MAX_WORKERS;
+  if (n > njobs)
+    n = njobs;
+  return n ? n : 1;
+}
+
+
+#ifdef HAVE_PTHREAD
+/* The state shared by all workers of one run.  */
+struct run_s
+{
+  pthread_mutex_t lock;
+  size_t next;                  /* The next job to hand out.  */
+  size_t njobs;
+  int rc;                       /* The first error encountered.  */
+  parallel_job_t job;
+  void *arg;
+};
+
+/* The argument passed to a worker thread.  */
+struct worker_s
+{
+  struct run_s *run;
+  unsigned int no;
+};
+
+
+/* Run jobs until all have been handed out or one has failed.  */
+static void *
+worker_main (void *opaque)
+{
+  struct worker_s *w = opaque;
+  struct run_s *run = w->run;
+  size_t idx;
+  int rc;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&run->lock);
+      if (run->rc || run->next == run->njobs)
+        {
+          pthread_mutex_unlock (&run->lock);
+          break;
+        }
+      idx = run->next++;
+      pthread_mutex_unlock (&run->lock);
+
+      rc = run->job (run->arg, w->no, idx);
+      if (rc)
+        {
+          pthread_mutex_lock (&run->lock);
+          if (!run->rc)
+            run->rc = rc;
+          pthread_mutex_unlock (&run->lock);
+        }
+    }
+  return NULL;
+}
+#endif /*HAVE_PTHREAD*/
+
+
+/* Call JOB for each job number from 0 to NJOBS - 1 using NWORKERS
+   workers, one of them being the calling thread.  JOB receives ARG,
+   the number of the worker (less than NWORKERS) running it, and the
+   job number.  Jobs are handed out in order, but may complete in any
+   order.  As soon as a job fails no further jobs are started, and
+   the error of the first failed job is returned.  */
+int
+_tgpg_parallel_run (unsigned int nworkers, size_t njobs,
+                    parallel_job_t job, void *arg)
+{
+#ifdef HAVE_PTHREAD
+  struct run_s run;
+  struct worker_s workers[MAX_WORKERS];
+  pthread_t threads[MAX_WORKERS];
+  unsigned int i, nthreads;
+#endif
+  size_t idx;
+  int rc;
+
+#ifdef HAVE_PTHREAD
+  if (nworkers > MAX_WORKERS)
+    nworkers = MAX_WORKERS;
+  if (nworkers > 1 && njobs > 1)
+    {
+      if (pthread_mutex_init (&run.lock, NULL))
+        return TGPG_SYSERROR;
+      run.next = 0;
+      run.njobs = njobs;
+      run.rc = 0;
+      run.job = job;
+      run.arg = arg;
+
+      for (i = 0; i < nworkers; i++)
+        {
+          workers[i].run = &run;
+          workers[i].no = i;
+        }
+
+      /* Start the additional workers.  If we fail to create a thread,
+         we simply make do with fewer.  */
+      for (nthreads = 1; nthreads < nworkers; nthreads++)
+        if (pthread_create (&threads[nthreads], NULL,
+                            worker_main, &workers[nthreads]))
+          break;
+
+      worker_main (&workers[0]);
+      for (i = 1; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+
+      pthread_mutex_destroy (&run.lock);
+      return run.rc;
+    }
+#endif /*HAVE_PTHREAD*/
+
+  for (idx = 0; idx < njobs; idx++)
+    {
+      rc = job (arg, 0, idx);
+      if (rc)
+        return rc;
+    }
+  return 0;
+}
+
+
+/* The state of a work queue.  */
+struct workqueue_s
+{
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+  size_t nitems;
+  size_t next;                  /* The next item to hand out.  */
+  int rc;                       /* The first error encountered.  */
+  unsigned char done[1];        /* Actually NITEMS flags.  */
+};
+
+
+/* Create a new queue of NITEMS work items and store it at R_QUEUE.  */
+int
+_tgpg_workqueue_new (workqueue_t *r_queue, size_t nitems)
+{
+  workqueue_t q;
+
+  *r_queue = NULL;
+  q = xtrycalloc (1, sizeof *q + nitems);
+  if (!q)
+    return TGPG_SYSERROR;
+#ifdef HAVE_PTHREAD
+  if (pthread_mutex_init (&q->lock, NULL))
+    {
+      xfree (q);
+      return TGPG_SYSERROR;
+    }
+  if (pthread_cond_init (&q->cond, NULL))
+    {
+      pthread_mutex_destroy (&q->lock);
+      xfree (q);
+      return TGPG_SYSERROR;
+    }
+#endif
+  q->nitems = nitems;
+  *r_queue = q;
+  return 0;
+}
+
+
+/* Release the work queue QUEUE.  Passing NULL is a nop.  */
+void
+_tgpg_workqueue_release (workqueue_t queue)
+{
+  if (!queue)
+    return;
+#ifdef HAVE_PTHREAD
+  pthread_cond_destroy (&queue->cond);
+  pthread_mutex_destroy (&queue->lock);
+#endif
+  xfree (queue);
+}
+
+
+#ifdef HAVE_PTHREAD
+# define LOCK_QUEUE(q)   pthread_mutex_lock (&(q)->lock)
+# define UNLOCK_QUEUE(q) pthread_mutex_unlock (&(q)->lock)
+#else
+# define LOCK_QUEUE(q)   do { } while (0)
+# define UNLOCK_QUEUE(q) do { } while (0)
+#endif
+
+
+/* Hand out the next item of QUEUE.  Returns true and stores the index
+   of the item at R_IDX, or returns false if all items have been
+   handed out or an item failed.  */
+int
+_tgpg_workqueue_claim (workqueue_t queue, size_t *r_idx)
+{
+  int any;
+
+  LOCK_QUEUE (queue);
+  any = !queue->rc && queue->next < queue->nitems;
+  if (any)
+    *r_idx = queue->next++;
+  UNLOCK_QUEUE (queue);
+  return any;
+}
+
+
+/* Mark the item IDX of QUEUE as done.  A non-zero RC marks it as
+   failed, which stops handing out further items.  */
+void
+_tgpg_workqueue_done (workqueue_t queue, size_t idx, int rc)
+{
+  LOCK_QUEUE (queue);
+  if (rc && !queue->rc)
+    queue->rc = rc;
+  queue->done[idx] = 1;
+#ifdef HAVE_PTHREAD
+  pthread_cond_broadcast (&queue->cond);
+#endif
+  UNLOCK_QUEUE (queue);
+}
+
+
+/* Return 1 if the item IDX of QUEUE is done, -1 if any item failed,
+   or 0 if item IDX has not yet been handed out.  If it has been
+   handed out but is not yet done, wait for it.  The caller should
+   claim an item itself if 0 is returned, thus this never waits for
+   an item no worker is processing.  */
+int
+_tgpg_workqueue_wait (workqueue_t queue, size_t idx)
+{
+  int state;
+
+  LOCK_QUEUE (queue);
+#ifdef HAVE_PTHREAD
+  while (!queue->rc && !queue->done[idx] && idx < queue->next)
+    pthread_cond_wait (&queue->cond, &queue->lock);
+#endif
+  if (queue->rc)
+    state = -1;
+  else
+    state = queue->done[idx];
+  UNLOCK_QUEUE (queue);
+  return state;
+}
@@ -0,0 +1,42 @@
+/* parallel.h - Simple parallel job runner
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/* A job run by _tgpg_parallel_run.  */
+typedef int (*parallel_job_t) (void *arg, unsigned int worker, size_t idx);
+
+unsigned int _tgpg_parallel_workers (unsigned int requested, size_t njobs);
+int _tgpg_parallel_run (unsigned int nworkers, size_t njobs,
+                        parallel_job_t job, void *arg);
+
+/* A queue of work items which are handed out to the jobs of a run in
+   order and whose completion may be awaited in order.  */
+typedef struct workqueue_s *workqueue_t;
+
+int _tgpg_workqueue_new (workqueue_t *r_queue, size_t nitems);
+void _tgpg_workqueue_release (workqueue_t queue);
+int _tgpg_workqueue_claim (workqueue_t queue, size_t *r_idx);
+void _tgpg_workqueue_done (workqueue_t queue, size_t idx, int rc);
+int _tgpg_workqueue_wait (workqueue_t queue, size_t idx);
+
+#endif /*PARALLEL_H*/
@@ -35,9 +35,10 @@
    functions EME-PKCS1-v1_5 described in RFC4880.  As data is merely
    appended in this encoding, this function is not concerned with the
    body itself.  The to-be-prepended data is written to EM which must
-   be at least 10 bytes long.  */
+   be at least 10 bytes long.  The random padding is taken from the
+   random pool of CTX.  */
 int
-_tgpg_eme_pkcs1_encode (char *em, size_t emlen)
+_tgpg_eme_pkcs1_encode (tgpg_t ctx, char *em, size_t emlen)
 {
   size_t i, padding;
 
@@ -49,10 +50,10 @@ _tgpg_eme_pkcs1_encode (char *em, size_t emlen)
   *em++ = 2;
 
   /* Generate a padding of non-zero octets.  */
-  _tgpg_randomize ((unsigned char *) em, padding);
+  _tgpg_randomize (ctx, (unsigned char *) em, padding);
   for (i = 0; i < padding; i++)
     while (em[i] == 0)
-      _tgpg_randomize ((unsigned char *) &em[i], 1);
+      _tgpg_randomize (ctx, (unsigned char *) &em[i], 1);
 
   em[padding] = 0;
 
@@ -25,9 +25,10 @@
    functions EME-PKCS1-v1_5 described in RFC4880.  As data is merely
    appended in this encoding, this function is not concerned with the
    body itself.  The to-be-prepended data is written to EM which must
-   be at least 11 bytes long.  */
+   be at least 11 bytes long.  The random padding is taken from the
+   random pool of CTX.  */
 int
-_tgpg_eme_pkcs1_encode (char *em, size_t emlen);
+_tgpg_eme_pkcs1_encode (tgpg_t ctx, char *em, size_t emlen);
 
 /* Decode the message EM of length EMLEN as specified in OpenPGPs
    version of the PKCS#1 functions EME-PKCS1-v1_5 described in
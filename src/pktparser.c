@@ -32,6 +32,10 @@
 #include "keystore.h"
 #include "pktparser.h"
 
+/* The length of a modification detection code packet including its
+   two header octets.  */
+#define MDC_PACKET_LEN 22
+
 /* Convert the 1 byte unsigned value a BUFFER and return the value.  */
 #define get_u8(buffer)  (*(const unsigned char*)(buffer))
 
@@ -93,6 +97,78 @@ get_mpi (char const **buffer, size_t *buflen, tgpg_mpi_t mpi)
 }
 
 
+/* Parse the body of a packet using partial length encoding.  BUF
+   points right behind the first length octet C, LEN gives the number
+   of remaining bytes in the buffer.  On success the total length of
+   the body is stored at R_PKTLEN, the number of segments at R_NSEGS
+   and the number of bytes consumed (including all length octets
+   following the first one) at R_CONSUMED.  If SEGS is not NULL, it
+   must provide space for the number of segments as returned by a
+   previous call and is filled with the segments.  */
+static int
+parse_partial_body (const char *buf, size_t len, int c,
+                    struct segment_s *segs, size_t *r_nsegs,
+                    size_t *r_pktlen, size_t *r_consumed)
+{
+  const char *bufstart = buf;
+  size_t chunklen, pktlen = 0, nsegs = 0;
+  int partial = 1;
+
+  chunklen = (size_t) 1 << (c & 0x1f);
+  /* OpenPGP requires that the first chunk is at least 512 octets
+     long.  We depend on this to parse the fixed part of the packet
+     from the first segment.  */
+  if (chunklen < 512)
+    return TGPG_INV_PKT;
+
+  for (;;)
+    {
+      if (chunklen > len)
+        return TGPG_INV_PKT;
+      if (segs)
+        {
+          segs[nsegs].data = (char *) buf;
+          segs[nsegs].length = chunklen;
+        }
+      nsegs++;
+      pktlen += chunklen;
+      buf += chunklen; len -= chunklen;
+
+      if (!partial)
+        break;
+
+      /* Get the length of the next chunk.  */
+      if (!len)
+        return TGPG_INV_PKT;
+      c = get_u8 (buf++); len--;
+      if (c < 192)
+        chunklen = c, partial = 0;
+      else if (c < 224)
+        {
+          if (!len)
+            return TGPG_INV_PKT;
+          chunklen = (c - 192) * 256 + get_u8 (buf++) + 192; len--;
+          partial = 0;
+        }
+      else if (c == 255)
+        {
+          if (len < 4)
+            return TGPG_INV_PKT;
+          chunklen = get_u32 (buf);
+          buf += 4; len -= 4;
+          partial = 0;
+        }
+      else
+        chunklen = (size_t) 1 << (c & 0x1f);
+    }
+
+  *r_nsegs = nsegs;
+  *r_pktlen = pktlen;
+  *r_consumed = buf - bufstart;
+  return 0;
+}
+
+
 /* The core packet header parser.  An OpenPGP packet is assumed at the
    address pointed to by BUFPTR which is of a maximum length as stored
    at BUFLEN.  Return the header information of that packet and
@@ -108,16 +184,28 @@ get_mpi (char const **buffer, size_t *buflen, tgpg_mpi_t mpi)
    R_PKTTYPE = Receives the type of the packet.
    R_NTOTAL  = Receives the total number of bytes in this packet including
                the header.
+   R_SEGS    = If not NULL, receives an allocated list describing the
+               segments of the content.
+   R_NSEGS   = Receives the number of segments.
+
+   Note that the content of packets using partial length encoding is
+   not contiguous.  In this case R_DATA points to the first segment
+   which is at least 512 bytes long, and the entire content can only
+   be accessed using the segments.  The caller needs to release
+   R_SEGS.
 */
 static int
 next_packet (char const **bufptr, size_t *buflen,
              char const **r_data, size_t *r_datalen, int *r_pkttype,
-             size_t *r_ntotal)
+             size_t *r_ntotal, struct segment_s **r_segs, size_t *r_nsegs)
 {
+  int rc;
   const char *buf, *bufstart;
   size_t len;
   int c, ctb, pkttype;
-  unsigned long pktlen;
+  size_t pktlen;
+  int partial = 0;
+  size_t nsegs = 1, consumed = 0;
 
   bufstart = buf = *bufptr;
   len = *buflen;
@@ -164,8 +252,11 @@ next_packet (char const **bufptr, size_t *buflen,
               return TGPG_INV_PKT; /* Partial length encoding not allowed.  */
             }
 
-          /* FIXME:  We need to support it.  */
-          return TGPG_NOT_IMPL;
+          rc = parse_partial_body (buf, len, c, NULL,
+                                   &nsegs, &pktlen, &consumed);
+          if (rc)
+            return rc;
+          partial = c;
         }
     }
   else /* Old style CTB.  */
@@ -177,8 +268,10 @@ next_packet (char const **bufptr, size_t *buflen,
       lenbytes = ((ctb&3)==3)? 0 : (1<<(ctb & 3));
       if (!lenbytes) /* No length bytes as used by old comressed packets.  */
         {
-          /* FIXME: we need to implement it.  */
-          return TGPG_NOT_IMPL;
+          /* The packet extends to the end of the buffer.  Note that
+             a trailing MDC packet needs to be removed by the caller
+             beforehand.  */
+          pktlen = len;
         }
       if (len < lenbytes)
         return TGPG_INV_PKT; /* Not enough length bytes.  */
@@ -189,20 +282,39 @@ next_packet (char const **bufptr, size_t *buflen,
 	}
     }
 
+  if (!partial)
+    consumed = pktlen;
+
   /* Some basic sanity checks.  */
   if ( pkttype < 1 || pkttype > 110
-       || pktlen == 0xffffffff
-       || pktlen > len )
+       || (!partial && pktlen == 0xffffffff)
+       || consumed > len )
     return TGPG_INV_PKT;
 
+  if (r_segs)
+    {
+      *r_segs = xtrycalloc (nsegs, sizeof **r_segs);
+      if (!*r_segs)
+        return TGPG_SYSERROR;
+      if (partial)
+        parse_partial_body (buf, len, partial, *r_segs,
+                            &nsegs, &pktlen, &consumed);
+      else
+        {
+          (*r_segs)[0].data = (char *) buf;
+          (*r_segs)[0].length = pktlen;
+        }
+      *r_nsegs = nsegs;
+    }
+
   /* Return information. */
   *r_data = buf;
   *r_datalen = pktlen;
   *r_pkttype = pkttype;
-  *r_ntotal = (buf - bufstart) + pktlen;
+  *r_ntotal = (buf - bufstart) + consumed;
 
-  *bufptr = buf + pktlen;
-  *buflen = len - pktlen;
+  *bufptr = buf + consumed;
+  *buflen = len - consumed;
 
   if (!*buflen)
     *bufptr = NULL;  /* No more packets. */
@@ -230,7 +342,8 @@ _tgpg_identify_message (bufdesc_t msg, tgpg_msg_type_t *r_type)
   any_packets = 0;
   while (image)
     {
-      rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n);
+      rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n,
+                        NULL, NULL);
       if (rc)
         return rc;
 
@@ -245,11 +358,6 @@ _tgpg_identify_message (bufdesc_t msg, tgpg_msg_type_t *r_type)
           return TGPG_NOT_IMPL;
 
         case PKT_SYMKEY_ENC:
-          /* We do not yet support symmetrical encryption, thus we
-             need to skip these packets and hope for public key
-             encrypted packets.  */
-          break;
-
         case PKT_PUBKEY_ENC:
           /* This looks like an encrypted message.  */
           *r_type = TGPG_MSG_ENCRYPTED;
@@ -293,29 +401,75 @@ _tgpg_identify_message (bufdesc_t msg, tgpg_msg_type_t *r_type)
 /* Parse a public key encrypted packet.  KI will receive the
    information about the key and the array ENCDAT the actual values
    with the encrypted key.  The caller needs to allocate ENCDAT with
-   at least MAX_PK_NENC.  On error the values returned are not
-   defined.  */
+   at least MAX_PK_NENC.  An anonymous recipient is returned as key ID
+   0.  On error the values returned are not defined.  */
 static int
 parse_pubkey_enc_packet (const char *data, size_t datalen,
                          keyinfo_t ki, tgpg_mpi_t encdat)
 {
   int rc, nenc, idx;
+  size_t n;
 
-  if (datalen < 10)
+  if (datalen < 3)
     return TGPG_INV_PKT;
 
-  if (*data != 2 && *data != 3)
-    return TGPG_INV_PKT;  /* We require packet version 2 or 3.  */
-  ki->keyid[1] = get_u32 (data+1);
-  ki->keyid[0] = get_u32 (data+5);
-  ki->pubkey_algo = get_u8 (data+9);
-  data += 10; datalen -= 10;
+  ki->version = get_u8 (data);
+  if (ki->version == 6)
+    {
+      /* The recipient is given by the key version and the
+         fingerprint, or is empty.  */
+      n = get_u8 (data+1);
+      if (datalen < 3 + n)
+        return TGPG_INV_PKT;
+      if (!n)
+        ki->keyid[1] = ki->keyid[0] = 0;
+      else if (n == 21 && get_u8 (data+2) == 4)
+        {
+          /* The key ID is the low order 64 bits of a v4 fingerprint.  */
+          ki->keyid[1] = get_u32 (data+2+1+12);
+          ki->keyid[0] = get_u32 (data+2+1+16);
+        }
+      else if (n == 33 && get_u8 (data+2) == 6)
+        {
+          /* The key ID is the high order 64 bits of a v6 fingerprint.  */
+          ki->keyid[1] = get_u32 (data+2+1);
+          ki->keyid[0] = get_u32 (data+2+1+4);
+        }
+      else
+        return TGPG_INV_PKT;
+      ki->pubkey_algo = get_u8 (data+2+n);
+      data += 3 + n; datalen -= 3 + n;
+    }
+  else if (ki->version == 2 || ki->version == 3)
+    {
+      if (datalen < 10)
+        return TGPG_INV_PKT;
+      ki->keyid[1] = get_u32 (data+1);
+      ki->keyid[0] = get_u32 (data+5);
+      ki->pubkey_algo = get_u8 (data+9);
+      data += 10; datalen -= 10;
+    }
+  else
+    return TGPG_INV_PKT;  /* We require packet version 2, 3 or 6.  */
   nenc = _tgpg_pk_get_nenc (ki->pubkey_algo);
   assert (nenc <= MAX_PK_NENC);
   if (!nenc)
     return TGPG_INV_ALGO;
   for (idx=0; idx < nenc; idx++)
     {
+      if (ki->pubkey_algo == PK_ALGO_ECDH && idx == 1)
+        {
+          /* The wrapped session key of ECDH is not an MPI but a
+             string with a one octet length.  */
+          if (datalen < 1 || datalen < 1 + get_u8 (data))
+            return TGPG_INV_PKT;
+          encdat[idx].valuelen = get_u8 (data);
+          encdat[idx].nbits = encdat[idx].valuelen << 3;
+          encdat[idx].value = data + 1;
+          datalen -= 1 + encdat[idx].valuelen;
+          data += 1 + encdat[idx].valuelen;
+          continue;
+        }
       rc = get_mpi (&data, &datalen, encdat + idx);
       if (rc)
         return rc;
@@ -326,41 +480,113 @@ parse_pubkey_enc_packet (const char *data, size_t datalen,
 }
 
 
+/* Parse a symmetric key encrypted session key packet into SI.  Only
+   version 4 packets are supported; for other versions SI->VERSION is
+   set to 0 so that the packet is ignored.  On error the values
+   returned are not defined.  */
+static int
+parse_symkey_enc_packet (const char *data, size_t datalen, symkeyinfo_t si)
+{
+  size_t n;
+
+  memset (si, 0, sizeof *si);
+  if (datalen < 4)
+    return TGPG_INV_PKT;
+  if (get_u8 (data) != 4)
+    return 0;
+
+  si->cipher_algo = get_u8 (data+1);
+  si->s2k_mode = get_u8 (data+2);
+  si->s2k_hash = get_u8 (data+3);
+  data += 4; datalen -= 4;
+
+  switch (si->s2k_mode)
+    {
+    case 0: n = 0; break;   /* Simple.  */
+    case 1: n = 8; break;   /* Salted.  */
+    case 3: n = 9; break;   /* Iterated and salted.  */
+    default:
+      return 0;             /* Unknown or GNU extension.  */
+    }
+  if (datalen < n)
+    return TGPG_INV_PKT;
+  if (n)
+    memcpy (si->s2k_salt, data, 8);
+  if (n == 9)
+    si->s2k_count = get_u8 (data+8);
+  data += n; datalen -= n;
+
+  if (datalen > sizeof si->enckey)
+    return TGPG_INV_PKT;
+  memcpy (si->enckey, data, datalen);
+  si->enckeylen = datalen;
+
+  si->version = 4;
+  return 0;
+}
+
+
 /* Given an encrypted message, parse it and return the key information
    required to actually decrypt it.  To achieve this the function will
-   callback to the keystorage to see whether a secret key exists.  On
+   callback to the keystorage to see whether a secret key exists in
+   CTX.  If the key provider of CTX is still fetching the only keys we
+   could use, TGPG_PENDING is returned.  If there is none, the first
+   symmetric key encrypted session key is returned at R_SYMKEY instead
+   and the algorithm of R_KEYINFO is set to 0.  On
    success the key information is returned as well as a pointer to the
-   begin of the encrypted message data.  It may modify the original
-   message to remove partial length encoding and compact it to one
-   large packet.  On success the function returns an offset to the
-   begin of the actual encrypted data packet at R_START (right after
-   the MDC header), its length at R_LENGTH, the MDC algorithm at R_MDC
-   (0 for no MDC) and the information required to decrypt the message
-   at R_KEYINFO and R_ENCDAT.  The caller must provide these
+   begin of the encrypted message data.  On success the function
+   returns a list of segments describing the actual encrypted data
+   (right after the MDC header) at R_SEGS and the number of segments
+   at R_NSEGS, the version of the integrity protected packet at R_MDC
+   (0 for no MDC, 2 for AEAD encrypted data) and the
+   information required to decrypt the message at R_KEYINFO and
+   R_ENCDAT.  The segments are used instead of compacting bodies
+   using partial length encoding.  The caller must provide these
    structures and allocate space for at least MAX_PK_ENC items for
-   R_ENCDAT.  The return values are not defined on error.  */
+   R_ENCDAT, and needs to release R_SEGS.  The return values are not
+   defined on error.
+
+   If R_PENDING is not NULL, TGPG_PENDING is returned only after the
+   whole message has been parsed: the segments and the symmetric key
+   encrypted session key are returned as on success, and the
+   recipients whose keys are being fetched are stored in a newly
+   allocated array at R_PENDING and their number at R_NPENDING, so
+   that the message can be resumed using them.  The caller needs to
+   release R_PENDING as well.  */
 int
-_tgpg_parse_encrypted_message (bufdesc_t msg, int *r_mdc,
-                               size_t *r_start, size_t *r_length,
-                               keyinfo_t r_keyinfo, tgpg_mpi_t r_encdat )
+_tgpg_parse_encrypted_message (tgpg_t ctx, bufdesc_t msg, int *r_mdc,
+                               struct segment_s **r_segs, size_t *r_nsegs,
+                               keyinfo_t r_keyinfo, tgpg_mpi_t r_encdat,
+                               symkeyinfo_t r_symkey,
+                               struct pending_key_s **r_pending,
+                               size_t *r_npending)
 {
   int rc;
-  const char *image, *data;
-  size_t imagelen, datalen, n;
+  const char *image, *data, *pktstart;
+  size_t imagelen, datalen, n, pktlen;
   int pkttype;
   int any_packets = 0;
   int any_enc_seen = 0;
   int got_key = 0;
+  int pending = 0;
+  struct segment_s *segs;
+  size_t nsegs;
+  struct pending_key_s *keys = NULL, *tmp;
+  size_t nkeys = 0;
 
   image = msg->image;
   imagelen = msg->length;
   *r_mdc = 0;
+  r_symkey->version = 0;
 
   while (image)
     {
-      rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n);
+      pktstart = image;
+      pktlen = imagelen;
+      rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n,
+                        NULL, NULL);
       if (rc)
-        return rc;
+        goto leave;
 
       if (!any_packets && pkttype == PKT_MARKER)
         continue; /* We ignore leading marker packets.  */
@@ -369,10 +595,15 @@ _tgpg_parse_encrypted_message (bufdesc_t msg, int *r_mdc,
       switch (pkttype)
         {
         case PKT_SYMKEY_ENC:
-          /* We do not yet support symmetrical encryption, thus we
-             need to skip these packets to and hope for public key
-             encrypted packets.  */
+          /* Remember the first one we can use in case we have none
+             of the secret keys.  */
           any_enc_seen = 1;
+          if (!r_symkey->version)
+            {
+              rc = parse_symkey_enc_packet (data, datalen, r_symkey);
+              if (rc)
+                goto leave;
+            }
           break;
 
         case PKT_PUBKEY_ENC:
@@ -383,139 +614,279 @@ _tgpg_parse_encrypted_message (bufdesc_t msg, int *r_mdc,
               rc = parse_pubkey_enc_packet (data, datalen,
                                             r_keyinfo, r_encdat);
               if (rc)
-                return rc;
-              if (!_tgpg_have_secret_key (r_keyinfo))
+                goto leave;
+              rc = _tgpg_have_secret_key (ctx, r_keyinfo);
+              if (!rc)
                 got_key = 1;
+              else if (rc == TGPG_PENDING)
+                {
+                  pending = 1;
+                  if (r_pending)
+                    {
+                      tmp = xtryrealloc (keys, (nkeys + 1) * sizeof *keys);
+                      if (!tmp)
+                        {
+                          rc = TGPG_SYSERROR;
+                          goto leave;
+                        }
+                      keys = tmp;
+                      keys[nkeys].keyinfo = *r_keyinfo;
+                      memcpy (keys[nkeys].encdat, r_encdat,
+                              sizeof keys[nkeys].encdat);
+                      nkeys++;
+                    }
+                }
             }
           break;
 
         case PKT_ENCRYPTED_MDC:
-          *r_mdc = *(unsigned char *) data;
-          data += 1, datalen -= 1;
-          /* Fallthrough.  */
-
         case PKT_ENCRYPTED:
-          /* We are right at the start of the encrypted stuff.  Make
-             sure that it is only one packet and remove any partial
-             headers. */
+          /* We are right at the start of the encrypted stuff.  */
           if (!any_enc_seen)
-            return TGPG_NOT_IMPL; /* Old style symmetric message. */
-          if (!got_key)
+            {
+              rc = TGPG_NOT_IMPL; /* Old style symmetric message. */
+              goto leave;
+            }
+          if (!got_key && pending && !r_pending)
+            return TGPG_PENDING;
+          if (!got_key && !pending && !r_symkey->version)
             return TGPG_NO_SECKEY;
-          /* TODO: compresss partial headers. */
+          if (!got_key)
+            r_keyinfo->pubkey_algo = 0;
+          if (pkttype == PKT_ENCRYPTED_MDC && !datalen)
+            {
+              rc = TGPG_INV_PKT;
+              goto leave;
+            }
 
-          *r_start = data - msg->image;
-          *r_length = datalen;
+          /* Parse the packet again to get the segments.  */
+          image = pktstart;
+          imagelen = pktlen;
+          rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n,
+                            &segs, &nsegs);
+          if (rc)
+            goto leave;
+
+          if (pkttype == PKT_ENCRYPTED_MDC)
+            {
+              /* The version is stored in the first segment.  */
+              *r_mdc = *(unsigned char *) data;
+              if (*r_mdc != 1 && *r_mdc != 2)
+                {
+                  xfree (segs);
+                  rc = TGPG_INV_PKT;
+                  goto leave;
+                }
+              segs[0].data += 1;
+              segs[0].length -= 1;
+            }
 
+          *r_segs = segs;
+          *r_nsegs = nsegs;
+          if (!got_key && pending)
+            {
+              *r_pending = keys;
+              *r_npending = nkeys;
+              return TGPG_PENDING;
+            }
+          xfree (keys);
           return 0;
 
         default:
           /* We don't expect any other packets. */
-          return TGPG_UNEXP_PKT;
+          rc = TGPG_UNEXP_PKT;
+          goto leave;
         }
     }
 
-  return any_enc_seen? TGPG_INV_MSG : TGPG_NO_DATA;
+  rc = any_enc_seen? TGPG_INV_MSG : TGPG_NO_DATA;
+
+ leave:
+  xfree (keys);
+  return rc;
+}
+
+/* Check the integrity of the decrypted message MSG, which must end in
+   a modification detection code packet.  PREFIX of length PREFIXLEN
+   must be the cipher initialization data.  The hash covers the prefix
+   and the message up to and including the header of the MDC packet.
+   If DIGEST is not NULL, it is that hash as already computed by the
+   caller.  On success the MDC packet is removed from MSG, so that the
+   message can be parsed without knowing about it.  */
+int
+_tgpg_check_mdc (bufdesc_t msg, const char *prefix, size_t prefixlen,
+                 const unsigned char *digest)
+{
+  int rc;
+  const char *mdcpkt;
+  unsigned char hash[MDC_PACKET_LEN - 2];
+  struct segment_s iov[2];
+
+  if (msg->length < MDC_PACKET_LEN)
+    return TGPG_INV_MSG;
+  mdcpkt = msg->image + msg->length - MDC_PACKET_LEN;
+  if (get_u8 (&mdcpkt[0]) != (0xc0 | PKT_MDC)
+      || get_u8 (&mdcpkt[1]) != MDC_PACKET_LEN - 2)
+    return TGPG_INV_MSG;
+
+  if (!digest)
+    {
+      iov[0].data = (char *) prefix;
+      iov[0].length = prefixlen;
+      iov[1].data = (char *) msg->image;
+      iov[1].length = &mdcpkt[2] - msg->image;
+      rc = _tgpg_hash_buffers (MD_ALGO_SHA1, hash, sizeof hash, iov, 2);
+      if (rc)
+        return rc;
+      digest = hash;
+    }
+
+  if (memcmp (&mdcpkt[2], digest, sizeof hash))
+    return TGPG_MDC_FAILED;
+
+  msg->length -= MDC_PACKET_LEN;
+  return 0;
+}
+
+
+/* Check whether the message MSG consists of a compressed data packet.
+   If so, the compression algorithm is stored at R_ALGO and a list of
+   segments describing the compressed data at R_SEGS with the number
+   of segments at R_NSEGS.  The caller needs to release R_SEGS.  If
+   MSG does not start with a compressed data packet, 0 is stored at
+   R_ALGO.  */
+int
+_tgpg_parse_compressed_message (bufdesc_t msg, int *r_algo,
+                                struct segment_s **r_segs, size_t *r_nsegs)
+{
+  int rc;
+  const char *image, *data;
+  size_t imagelen, datalen, n;
+  int pkttype;
+  struct segment_s *segs;
+  size_t nsegs;
+
+  *r_algo = 0;
+
+  image = msg->image;
+  imagelen = msg->length;
+  rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n,
+                    &segs, &nsegs);
+  if (rc)
+    return rc;
+  if (pkttype != PKT_COMPRESSED)
+    {
+      xfree (segs);
+      return 0;
+    }
+
+  /* The first octet gives the algorithm.  A compressed data packet
+     must not be followed by other packets.  */
+  if (!datalen || image)
+    {
+      xfree (segs);
+      return !datalen ? TGPG_INV_PKT : TGPG_UNEXP_PKT;
+    }
+  *r_algo = get_u8 (data);
+  segs[0].data++;
+  segs[0].length--;
+
+  *r_segs = segs;
+  *r_nsegs = nsegs;
+  return 0;
 }
 
+
 /* Given an plaintext message, parse it and return any payload and
-   metadata associated with it.  If MDC is non-zero, it specifies the
-   version of the integrity protocol.  PREFIX of length PREFIXLEN must
-   be the cipher initialization data.  On success the function returns
-   the format in R_FORMAT, the original filename in R_FILENAME (which
-   must hold at least 256 bytes and will be zero-terminated), a date
-   in R_DATE, an offset to the begin of the actual plaintext data
-   packet at R_START, and its length at R_LENGTH.  The return values
-   are not defined on error.  */
+   metadata associated with it.  A trailing MDC packet must have been
+   checked and removed using _tgpg_check_mdc.  On success the
+   function returns the format in R_FORMAT, the original filename in
+   R_FILENAME (which must hold at least 256 bytes and will be
+   zero-terminated), a date in R_DATE, and a list of segments
+   describing the actual plaintext data at R_SEGS with the number of
+   segments at R_NSEGS.  The caller needs to release R_SEGS.  The
+   return values are not defined on error.  */
 int
 _tgpg_parse_plaintext_message (bufdesc_t msg,
-                               int mdc,
-                               const char *prefix,
-                               size_t prefixlen,
                                unsigned char *r_format,
                                char *r_filename,
                                time_t *r_date,
-                               size_t *r_start,
-                               size_t *r_length)
+                               struct segment_s **r_segs,
+                               size_t *r_nsegs)
 {
   int rc;
   const char *image, *data;
   size_t imagelen, datalen, n;
   int pkttype;
   int plaintext_seen = 0;
-  int mdc_seen = 0;
-  hash_t h;
+  struct segment_s *segs = NULL, *pktsegs = NULL;
+  size_t nsegs = 0, npktsegs;
 
   image = msg->image;
   imagelen = msg->length;
 
   while (image)
     {
-      rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n);
+      rc = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n,
+                        &pktsegs, &npktsegs);
       if (rc)
-        return rc;
+        goto leave;
 
       switch (pkttype)
         {
         case PKT_PLAINTEXT:
-          if (plaintext_seen || mdc_seen)
-            return TGPG_UNEXP_PKT;
+          if (plaintext_seen)
+            {
+              rc = TGPG_UNEXP_PKT;
+              goto leave;
+            }
           plaintext_seen = 1;
+          segs = pktsegs;
+          nsegs = npktsegs;
+          pktsegs = NULL;
 
           {
             size_t len;
 
+            /* The header is always stored in the first segment.  */
+            if (segs[0].length < 6
+                || (len = get_u8 (&data[1])) + 6 > segs[0].length)
+              {
+                rc = TGPG_INV_PKT;
+                goto leave;
+              }
+
             *r_format = data[0];
-            len = get_u8 (&data[1]);
 
             memcpy (r_filename, &data[2], len);
             r_filename[len] = 0;
 
             *r_date = get_u32 (&data[2 + len]);
-            *r_start = &data[2 + len + 4] - msg->image;
-            *r_length = datalen - (2 + len + 4);
+            segs[0].data += 2 + len + 4;
+            segs[0].length -= 2 + len + 4;
           }
           break;
 
-        case PKT_MDC:
-          if (! plaintext_seen || mdc_seen)
-            return TGPG_UNEXP_PKT;
-
-          switch (mdc)
-            {
-            case 1:
-              if (datalen != 20)
-                return TGPG_INV_PKT;
-              break;
-
-              rc = _tgpg_hash_open (&h, MD_ALGO_SHA1, 0);
-              if (rc)
-                return rc;
-
-              _tgpg_hash_write (h, prefix, prefixlen);
-              _tgpg_hash_write (h, msg->image, &data[2] - msg->image);
-
-              if (memcmp (&data[2], _tgpg_hash_read (h), 20) != 0)
-                {
-                  _tgpg_hash_close (h);
-                  return TGPG_MDC_FAILED;
-                }
-              _tgpg_hash_close (h);
-              break;
-
-            case 0:
-            default:
-              return TGPG_UNEXP_PKT;
-            }
-
-          mdc_seen = 1;
-          break;
-
         default:
           /* We don't expect any other packets. */
-          return TGPG_UNEXP_PKT;
+          rc = TGPG_UNEXP_PKT;
+          goto leave;
         }
+
+      xfree (pktsegs);
+      pktsegs = NULL;
+    }
+
+  if (plaintext_seen)
+    {
+      *r_segs = segs;
+      *r_nsegs = nsegs;
+      return TGPG_NO_ERROR;
     }
+  rc = TGPG_INV_MSG;
 
-  return plaintext_seen && (! mdc || mdc_seen) ? TGPG_NO_ERROR : TGPG_INV_MSG;
+ leave:
+  xfree (pktsegs);
+  xfree (segs);
+  return rc;
 }
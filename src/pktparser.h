@@ -21,19 +21,37 @@
 #ifndef PKTPARSER_H
 #define PKTPARSER_H
 
+#include "cryptglue.h"
+
+/* A recipient of a message whose secret key the key provider is
+   still fetching.  The values of ENCDAT point into the message.  */
+struct pending_key_s
+{
+  struct keyinfo_s keyinfo;
+  struct tgpg_mpi_s encdat[MAX_PK_NENC];
+};
+
 int _tgpg_identify_message (bufdesc_t msg, tgpg_msg_type_t *r_type);
 
-int _tgpg_parse_encrypted_message (bufdesc_t msg, int *r_mdc,
-                                   size_t *r_start, size_t *r_length,
-                                   keyinfo_t r_keyinfo, tgpg_mpi_t r_encdat);
+int _tgpg_parse_encrypted_message (tgpg_t ctx, bufdesc_t msg, int *r_mdc,
+                                   struct segment_s **r_segs,
+                                   size_t *r_nsegs,
+                                   keyinfo_t r_keyinfo, tgpg_mpi_t r_encdat,
+                                   symkeyinfo_t r_symkey,
+                                   struct pending_key_s **r_pending,
+                                   size_t *r_npending);
+
+int _tgpg_check_mdc (bufdesc_t msg, const char *prefix, size_t prefixlen,
+                     const unsigned char *digest);
+
+int _tgpg_parse_compressed_message (bufdesc_t msg, int *r_algo,
+                                    struct segment_s **r_segs,
+                                    size_t *r_nsegs);
 
 int _tgpg_parse_plaintext_message (bufdesc_t msg,
-				   int mdc,
-				   const char *prefix,
-				   size_t prefixlen,
 				   unsigned char *r_format,
 				   char *r_filename,
 				   time_t *r_date,
-				   size_t *r_start,
-				   size_t *r_length);
+				   struct segment_s **r_segs,
+				   size_t *r_nsegs);
 #endif /*PKTPARSER_H*/
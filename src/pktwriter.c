@@ -31,8 +31,44 @@
 #include "cryptglue.h"
 #include "keystore.h"
 #include "pktwriter.h"
+#include "compress.h"
+
+/* Bodies of at least this length can't be described by a definite
+   length and are split into partial length chunks.  Note that
+   0xffffffff itself is rejected by our parser.  */
+#define MAX_DEFINITE_LENGTH	0xffffffff
+
+/* The size of a partial body chunk, expressed as power of two.  We
+   use 1 GiB chunks as the largest size allowed by OpenPGP.  */
+#define PARTIAL_CHUNK_EXP	30
+
+/* With TGPG_FLAG_SMALL_PARTIAL, bodies of 512 bytes and more are
+   split into chunks of 512 bytes, the smallest size allowed for the
+   first chunk, so that partial lengths are used with small messages
+   as well.  */
+#define SMALL_CHUNK_EXP		9
+
+/* Return the exponent of the partial body chunk size in use.  */
+static unsigned int
+chunk_exp (void)
+{
+  return (_tgpg_flags & TGPG_FLAG_SMALL_PARTIAL) ? SMALL_CHUNK_EXP
+                                                 : PARTIAL_CHUNK_EXP;
+}
+
+#define PARTIAL_CHUNK_SIZE	((size_t) 1 << chunk_exp ())
 
-/* Return the size of a new-style CTB with the given LENGTH.  */
+/* Return the length from which on bodies are split into partial
+   length chunks.  */
+static size_t
+max_definite_length (void)
+{
+  return (_tgpg_flags & TGPG_FLAG_SMALL_PARTIAL) ? PARTIAL_CHUNK_SIZE
+                                                 : MAX_DEFINITE_LENGTH;
+}
+
+/* Return the size of a new-style CTB with the given definite
+   LENGTH.  */
 static size_t __attribute ((const))
 header_size (size_t length)
 {
@@ -40,51 +76,163 @@ header_size (size_t length)
     return 2;
   if (length < 8384)
     return 3;
-  return 5;
+  return 6;
 }
 
-/* Write an OpenPGP packet header with the given TAG and LENGTH to *P,
-   and advance *P accordingly.  Return the size of the header.  If P
-   is NULL, no data is actually written.  */
+/* Return the number of partial length chunks preceding the final
+   chunk of a body of the given LENGTH.  */
 static size_t
-write_header (unsigned char **p, unsigned char tag, size_t length)
+partial_chunks (size_t length)
 {
-  assert (tag < 1<<6 || ! "invalid tag");
+  if (length < max_definite_length ())
+    return 0;
+  return (length - max_definite_length ()) / PARTIAL_CHUNK_SIZE + 1;
+}
 
-  if (p == NULL)
-    return header_size (length);
+/* Return the number of header bytes required to frame a body of the
+   given LENGTH.  This includes the length octets of all partial
+   chunks.  */
+static size_t
+frame_size (size_t length)
+{
+  size_t n = partial_chunks (length);
 
-  /* Write packet tag.  */
-  write_u8 (p, 0x80	/* always one */
-	    | 0x40	/* new-style packet */
-	    | tag);
+  return n + header_size (length - n * PARTIAL_CHUNK_SIZE);
+}
+
+/* Return the number of segments a body of the given LENGTH is split
+   into.  */
+size_t
+_tgpg_count_segments (size_t length)
+{
+  return partial_chunks (length) + 1;
+}
+
+/* Write the definite LENGTH as new-style length octets to *P, and
+   advance *P accordingly.  */
+static void
+write_length (unsigned char **p, size_t length)
+{
+  size_t l;
+
+  assert (length < MAX_DEFINITE_LENGTH);
 
-  /* Write length.  */
   switch (header_size (length))
     {
     case 2:
       write_u8 (p, length);
       break;
 
-    case 3:;
-      size_t l = length - 192;
+    case 3:
+      l = length - 192;
       write_u8 (p, ((l >> 8) & 0xff) + 192);
       write_u8 (p, ((l >> 0) & 0xff));
       break;
 
-    case 5:
-    write_u32 (p, length);
+    case 6:
+      write_u8 (p, 0xff);
+      write_u32 (p, length);
+      break;
     }
+}
+
+/* Write an OpenPGP packet header with the given TAG and LENGTH to *P,
+   and advance *P to the begin of the body.  Return the number of
+   header bytes.  If P is NULL, no data is actually written.
+
+   Bodies which do not fit into a definite length are split into
+   partial length chunks; the length octets of all chunks are written
+   right away, so that the caller needs to write the body into the
+   gaps.  The location of the gaps is returned at SEGS which must
+   provide space for _tgpg_count_segments (LENGTH) items.  SEGS may
+   be NULL for bodies with a definite length.  */
+static size_t
+write_header (unsigned char **p, unsigned char tag, size_t length,
+              struct segment_s *segs)
+{
+  size_t i, n;
+  unsigned char *q;
+
+  assert (tag < 1<<6 || ! "invalid tag");
+
+  if (p == NULL)
+    return frame_size (length);
 
-  return header_size (length);
+  n = partial_chunks (length);
+  assert (segs || ! n);
+
+  /* Write packet tag.  */
+  write_u8 (p, 0x80	/* always one */
+	    | 0x40	/* new-style packet */
+	    | tag);
+
+  /* Write the length octets of all partial chunks.  */
+  q = *p;
+  for (i = 0; i < n; i++)
+    {
+      write_u8 (&q, 0xe0 | chunk_exp ());
+      segs[i].data = (char *) q;
+      segs[i].length = PARTIAL_CHUNK_SIZE;
+      q += PARTIAL_CHUNK_SIZE;
+    }
+
+  /* Write the length of the final chunk.  */
+  write_length (&q, length - n * PARTIAL_CHUNK_SIZE);
+  if (segs)
+    {
+      segs[n].data = (char *) q;
+      segs[n].length = length - n * PARTIAL_CHUNK_SIZE;
+    }
+
+  /* Advance to the begin of the body.  */
+  *p = n ? (unsigned char *) segs[0].data : q;
+
+  return frame_size (length);
+}
+
+/* Copy LENGTH bytes from BUFFER into the body described by the NSEGS
+   segments at SEGS.  The first OFFSET bytes of the body are
+   skipped.  */
+static void
+write_segments (const struct segment_s *segs, size_t nsegs, size_t offset,
+                const char *buffer, size_t length)
+{
+  size_t n;
+
+  for (; nsegs && length; segs++, nsegs--)
+    {
+      if (offset >= segs->length)
+        {
+          offset -= segs->length;
+          continue;
+        }
+      n = segs->length - offset;
+      if (n > length)
+        n = length;
+      memcpy (segs->data + offset, buffer, n);
+      buffer += n;
+      length -= n;
+      offset = 0;
+    }
+  assert (! length);
 }
 
+/* True if the I-th value of the encrypted session key described by
+   KI is the wrapped key of ECDH.  */
+#define ECDH_WRAPPED(ki,i) ((ki)->pubkey_algo == PK_ALGO_ECDH && (i) == 1)
+
+/* The length of a v4 fingerprint.  */
+#define V4_FPR_LEN 20
+
 /* Write an OpenPGP public key encrypted packet to *P, and advance *P
    accordingly.  Return the size of the packet.  If P is NULL, no data
-   is actually written.  */
+   is actually written.  A version 6 packet is written if requested
+   by KI; it names the recipient by the v4 fingerprint FPR of the key
+   (20 bytes), and the recipient is anonymous if FPR is NULL, as the
+   fingerprint of RSA keys is not known to us.  */
 size_t
 _tgpg_write_pubkey_enc_packet (unsigned char **p,
-			       keyinfo_t ki,
+			       keyinfo_t ki, const char *fpr,
                                tgpg_mpi_t encdat, size_t enclen)
 {
   int i;
@@ -94,29 +242,60 @@ _tgpg_write_pubkey_enc_packet (unsigned char **p,
   assert (enclen || ! "invalid algorithm");
   assert (enclen <= MAX_PK_NENC);
 
-  length = 10 /* version, keyid and algorithm */;
+  if (ki->version == 6)
+    length = 3 /* version, recipient length and algorithm */
+      + (fpr ? 1 + V4_FPR_LEN : 0) /* key version and fingerprint */;
+  else
+    length = 10 /* version, keyid and algorithm */;
   for (i = 0; i < enclen; i++)
-    length += 2 /* length */ + encdat[i].valuelen /* value */;
+    length += (ECDH_WRAPPED (ki, i) ? 1 : 2) /* length */
+      + encdat[i].valuelen /* value */;
 
   if (p == NULL)
     return length + header_size (length);
 
-  write_header (p, PKT_PUBKEY_ENC, length);
+  write_header (p, PKT_PUBKEY_ENC, length, NULL);
   start = *p;
 
-  /* The packet version.  */
-  write_u8 (p, 3);
+  if (ki->version == 6)
+    {
+      /* The packet version and the recipient, if known.  */
+      write_u8 (p, 6);
+      if (fpr)
+        {
+          write_u8 (p, 1 + V4_FPR_LEN);
+          write_u8 (p, 4);
+          memcpy (*p, fpr, V4_FPR_LEN);
+          *p += V4_FPR_LEN;
+        }
+      else
+        write_u8 (p, 0);
+    }
+  else
+    {
+      /* The packet version.  */
+      write_u8 (p, 3);
 
-  /* The keyid.  */
-  write_u32 (p, ki->keyid[1]);
-  write_u32 (p, ki->keyid[0]);
+      /* The keyid.  */
+      write_u32 (p, ki->keyid[1]);
+      write_u32 (p, ki->keyid[0]);
+    }
 
   /* The asymmetric encryption algorithm.  */
   write_u8 (p, ki->pubkey_algo);
 
   /* The encrypted session key.  */
   for (i = 0; i < enclen; i++)
-    write_mpi (p, &encdat[i]);
+    if (ECDH_WRAPPED (ki, i))
+      {
+        /* The wrapped session key of ECDH is a string with a one
+           octet length.  */
+        write_u8 (p, encdat[i].valuelen);
+        memcpy (*p, encdat[i].value, encdat[i].valuelen);
+        *p += encdat[i].valuelen;
+      }
+    else
+      write_mpi (p, &encdat[i]);
 
   assert (*p - start == length);
   return length + header_size (length);
@@ -126,10 +305,14 @@ _tgpg_write_pubkey_enc_packet (unsigned char **p,
    *P accordingly.  If MDC is non-zero, write an integrity protected
    packet of the given version.  As the body is merely appended to
    this header, this function is not concerned with the body itself.
-   Return the size of the packet.  If P is NULL, no data is actually
-   written.  */
+   The body of LENGTH bytes needs to be written to the segments
+   returned at SEGS, which must provide space for
+   _tgpg_count_segments (LENGTH + 1) items.  Return the size of the
+   packet or 0 for an invalid MDC version.  If P is NULL, no data is
+   actually written.  */
 size_t
-_tgpg_write_sym_enc_packet (unsigned char **p, int mdc, size_t length)
+_tgpg_write_sym_enc_packet (unsigned char **p, int mdc, size_t length,
+                            struct segment_s *segs, size_t *r_nsegs)
 {
   size_t mdc_length, packet_length;
 
@@ -139,26 +322,194 @@ _tgpg_write_sym_enc_packet (unsigned char **p, int mdc, size_t length)
       mdc_length = 0;
       break;
     case 1:
+    case 2:
       mdc_length = 1;
       break;
     default:
-      return TGPG_BUG;
+      return 0;
     }
 
   packet_length = write_header (p, ! mdc ? PKT_ENCRYPTED : PKT_ENCRYPTED_MDC,
-                                length + mdc_length)
+                                length + mdc_length, segs)
     + length + mdc_length;
 
-  if (p && mdc)
-    write_u8 (p, mdc);
+  if (p)
+    {
+      *r_nsegs = _tgpg_count_segments (length + mdc_length);
+      if (mdc)
+        {
+          /* The version is stored in the first segment.  */
+          write_u8 (p, mdc);
+          segs[0].data += 1;
+          segs[0].length -= 1;
+        }
+    }
 
   return packet_length;
 }
 
 
+/* Return the length of the fields preceding the literal data in a
+   literal data packet with the given FILENAME.  */
+static size_t
+literal_header_length (const char *filename)
+{
+  return
+    + 2 /* format and filename length */
+    + strlen (filename)
+    + 4 /* the date */;
+}
+
+/* Write the header of a literal data packet with the given FORMAT,
+   FILENAME and DATE for a payload of LENGTH bytes to *P and advance
+   *P to the begin of the payload.  SEGS is passed to write_header.  */
+static void
+write_literal_header (unsigned char **p, unsigned char format,
+                      const char *filename, time_t date, size_t length,
+                      struct segment_s *segs)
+{
+  write_header (p, PKT_PLAINTEXT,
+                literal_header_length (filename) + length, segs);
+
+  /* The format.  */
+  write_u8 (p, format);
+
+  /* The filename, with its length prepended to it encoded as a single
+     octet.  */
+  write_u8 (p, strlen (filename));
+  memcpy (*p, filename, strlen (filename));
+  *p += strlen (filename);
+
+  /* The date.  */
+  write_u32 (p, (uint32_t) date);
+}
+
+/* Write a literal data packet with the given FORMAT, FILENAME, DATE,
+   and containing the literal data PAYLOAD of given LENGTH to the
+   start of MSG, which is resized to hold the packet and EXTRA
+   additional bytes.  The size of the packet is stored at R_LENGTH.  */
+static int
+write_literal_packet (bufdesc_t msg, size_t extra,
+                      unsigned char format, const char *filename,
+                      time_t date, const char *payload, size_t length,
+                      size_t *r_length)
+{
+  int rc;
+  unsigned char *p;
+  size_t header_length;
+  struct segment_s *segs;
+  size_t nsegs;
+
+  header_length = literal_header_length (filename);
+  *r_length = frame_size (header_length + length) + header_length + length;
+  rc = tgpg_data_resize (msg, *r_length + extra);
+  if (rc)
+    return rc;
+
+  nsegs = _tgpg_count_segments (header_length + length);
+  segs = xtrycalloc (nsegs, sizeof *segs);
+  if (segs == NULL)
+    return TGPG_SYSERROR;
+
+  /* Note that the first segment is always large enough to hold the
+     entire header.  */
+  p = (unsigned char *) msg->buffer;
+  write_literal_header (&p, format, filename, date, length, segs);
+
+  /* The literal data.  */
+  write_segments (segs, nsegs, header_length, payload, length);
+  xfree (segs);
+
+  return 0;
+}
+
+
+/* Write a compressed data packet using the compression algorithm
+   ALGO and LEVEL and containing the NSEGS segments at SEGS, which
+   hold a literal data packet of LITLEN bytes, to the start of MSG,
+   which is resized to hold the packet and EXTRA additional bytes.
+   The data is compressed straight into MSG after leaving room for
+   the header.  The size of the packet is stored at R_LENGTH, which
+   is set to 0 if compressing did not pay.  */
+static int
+write_compressed_packet (bufdesc_t msg, size_t extra, int algo, int level,
+                         const struct segment_s *segs, size_t nsegs,
+                         size_t litlen, size_t *r_length)
+{
+  int rc;
+  unsigned char *p;
+  struct segment_s *bodysegs;
+  size_t nbodysegs;
+  size_t length, hdrlen;
+  char *compressed;
+  /* Room for the largest definite length header and the algorithm.  */
+  const size_t room = 6 + 1;
+
+  *r_length = 0;
+  rc = _tgpg_compress (algo, level, segs, nsegs, room, msg);
+  if (rc)
+    return rc;
+
+  /* Store the data uncompressed if compressing did not pay.  */
+  length = 1 + msg->length - room;
+  if (length == 1 || length >= litlen)
+    return 0;
+
+  if (!partial_chunks (length))
+    {
+      /* Write the header right in front of the algorithm and move
+         the body down if the header turns out to be shorter.  This
+         only happens for bodies of less than 8384 bytes.  */
+      hdrlen = header_size (length);
+      if (hdrlen < room - 1)
+        memmove (msg->buffer + hdrlen + 1, msg->buffer + room,
+                 length - 1);
+      p = (unsigned char *) msg->buffer;
+      write_header (&p, PKT_COMPRESSED, length, NULL);
+      write_u8 (&p, algo);
+      *r_length = hdrlen + length;
+      return tgpg_data_resize (msg, *r_length + extra);
+    }
+
+  /* A body split into partial length chunks is framed in a buffer
+     of its own.  */
+  compressed = msg->buffer;
+  msg->buffer = NULL;
+  msg->image = "";
+  msg->length = 0;
+  msg->allocated = 0;
+
+  *r_length = frame_size (length) + length;
+  rc = tgpg_data_resize (msg, *r_length + extra);
+  if (rc)
+    goto leave;
+
+  nbodysegs = _tgpg_count_segments (length);
+  bodysegs = xtrycalloc (nbodysegs, sizeof *bodysegs);
+  if (bodysegs == NULL)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+
+  p = (unsigned char *) msg->buffer;
+  write_header (&p, PKT_COMPRESSED, length, bodysegs);
+  write_u8 (&p, algo);
+  write_segments (bodysegs, nbodysegs, 1, compressed + room, length - 1);
+  xfree (bodysegs);
+
+ leave:
+  xfree (compressed);
+  return rc;
+}
+
+
 /* Construct a plaintext message in MSG, with the given FORMAT,
    FILENAME (which must not be larger than 0xff bytes), DATE, and
-   containing the literal data PAYLOAD of given LENGTH.  If MDC is
+   containing the literal data PAYLOAD of given LENGTH.  If
+   COMPRESS_ALGO is not zero, the literal data packet is wrapped into
+   a compressed data packet using that algorithm and COMPRESS_LEVEL,
+   unless the data turns out to be incompressible.  If MDC is
    non-zero, create a Modification Detection Code Packet of the given
    version.  In that case, PREFIX of length PREFIXLEN must be the
    block cipher initialization data.  */
@@ -167,6 +518,8 @@ _tgpg_encode_plaintext_message (bufdesc_t msg,
                                 int mdc,
                                 const char *prefix,
                                 size_t prefixlen,
+                                int compress_algo,
+                                int compress_level,
 				unsigned char format,
 				const char *filename,
 				time_t date,
@@ -175,8 +528,11 @@ _tgpg_encode_plaintext_message (bufdesc_t msg,
 {
   int rc;
   unsigned char *p;
-  size_t header_length;
-  size_t mdc_length;
+  size_t mdc_length, extra, pktlen;
+  size_t header_length, litlen;
+  unsigned char header[6 + 2 + 0xff + 4];
+  struct segment_s segs[2];
+  tgpg_data_t literal = NULL;
 
   if (strlen (filename) > 0xff)
     return TGPG_INV_VAL;
@@ -194,57 +550,70 @@ _tgpg_encode_plaintext_message (bufdesc_t msg,
     default:
       return TGPG_BUG;
     }
+  extra = mdc ? header_size (mdc_length) + mdc_length : 0;
 
-  header_length =
-    + 2 /* format and filename length */
-    + strlen (filename)
-    + 4 /* the date */;
+  pktlen = 0;
+  if (compress_algo)
+    {
+      /* The literal data packet is compressed as a whole.  Unless
+         its body is split into partial length chunks, it is passed
+         to the compressor as its header followed by the payload, so
+         that it does not need to be built in memory.  */
+      header_length = literal_header_length (filename);
+      litlen = (frame_size (header_length + length)
+                + header_length + length);
+      if (!partial_chunks (header_length + length))
+        {
+          p = header;
+          write_literal_header (&p, format, filename, date, length, NULL);
+          segs[0].data = (char *) header;
+          segs[0].length = p - header;
+          segs[1].data = (char *) payload;
+          segs[1].length = length;
+          rc = write_compressed_packet (msg, extra, compress_algo,
+                                        compress_level, segs, 2, litlen,
+                                        &pktlen);
+        }
+      else
+        {
+          rc = tgpg_data_new (&literal);
+          if (!rc)
+            rc = write_literal_packet (literal, 0, format, filename, date,
+                                       payload, length, &litlen);
+          if (!rc)
+            {
+              segs[0].data = literal->buffer;
+              segs[0].length = litlen;
+              rc = write_compressed_packet (msg, extra, compress_algo,
+                                            compress_level, segs, 1,
+                                            litlen, &pktlen);
+            }
+        }
+      if (rc)
+        goto leave;
+    }
 
-  rc = tgpg_data_resize (msg,
-			 + header_size (header_length
-                                        + length)
-			 + header_length
-			 + length
-                         + (mdc ? (header_size (mdc_length)
-                                + mdc_length)
-                            : 0));
+  if (!pktlen)
+    rc = write_literal_packet (msg, extra, format, filename, date,
+                               payload, length, &pktlen);
   if (rc)
-    return rc;
-
-  p = (unsigned char *) msg->buffer;
-  write_header (&p, PKT_PLAINTEXT, header_length + length);
-
-  /* The format.  */
-  write_u8 (&p, format);
-
-  /* The filename, with its length prepended to it encoded as a single
-     octet.  */
-  write_u8 (&p, strlen (filename));
-  memcpy (p, filename, strlen (filename));
-  p += strlen (filename);
-
-  /* The date.  */
-  write_u32 (&p, (uint32_t) date);
-
-  /* The literal data.  */
-  memcpy (p, payload, length);
-  p += length;
+    goto leave;
+  p = (unsigned char *) msg->buffer + pktlen;
 
   switch (mdc)
     {
-      hash_t h;
+      struct segment_s iov[2];
     case 1:
-      rc = _tgpg_hash_open (&h, MD_ALGO_SHA1, 0);
-      if (rc)
-        return rc;
-
-      write_header (&p, PKT_MDC, hash_digestlen (h));
+      write_header (&p, PKT_MDC, mdc_length, NULL);
 
-      _tgpg_hash_write (h, prefix, prefixlen);
-      _tgpg_hash_write (h, msg->image, p - (unsigned char *) msg->image);
-      memcpy ((char *) p, _tgpg_hash_read (h), hash_digestlen (h));
-      _tgpg_hash_close (h);
+      iov[0].data = (char *) prefix;
+      iov[0].length = prefixlen;
+      iov[1].data = (char *) msg->image;
+      iov[1].length = p - (unsigned char *) msg->image;
+      rc = _tgpg_hash_buffers (MD_ALGO_SHA1, p, mdc_length, iov, 2);
     }
 
-  return TGPG_NO_ERROR;
+ leave:
+  tgpg_data_release (literal);
+  return rc;
 }
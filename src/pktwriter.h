@@ -63,24 +63,39 @@ write_mpi (unsigned char **p, tgpg_mpi_t mpi)
 
 /* Write an OpenPGP public key encrypted packet to *P, and advance *P
    accordingly.  Return the size of the packet.  If P is NULL, no data
-   is actually written.  */
+   is actually written.  A version 6 packet is written if requested
+   by KI; it names the recipient by the v4 fingerprint FPR of the key
+   (20 bytes), and the recipient is anonymous if FPR is NULL, as the
+   fingerprint of RSA keys is not known to us.  */
 size_t
 _tgpg_write_pubkey_enc_packet (unsigned char **p,
-			       keyinfo_t ki,
+			       keyinfo_t ki, const char *fpr,
 			       tgpg_mpi_t encdat, size_t enclen);
 
 /* Write an OpenPGP symmetrically encrypted packet to *P, and advance
    *P accordingly.  If MDC is non-zero, write an integrity protected
    packet of the given version.  As the body is merely appended to
    this header, this function is not concerned with the body itself.
-   Return the size of the packet.  If P is NULL, no data is actually
-   written.  */
+   The body of LENGTH bytes needs to be written to the segments
+   returned at SEGS, which must provide space for
+   _tgpg_count_segments (LENGTH + 1) items.  Return the size of the
+   packet or 0 for an invalid MDC version.  If P is NULL, no data is
+   actually written.  */
 size_t
-_tgpg_write_sym_enc_packet (unsigned char **p, int mdc, size_t length);
+_tgpg_write_sym_enc_packet (unsigned char **p, int mdc, size_t length,
+                            struct segment_s *segs, size_t *r_nsegs);
+
+/* Return the number of segments a packet body of the given LENGTH is
+   split into.  Bodies too large for a definite length are written
+   using partial length chunks.  */
+size_t _tgpg_count_segments (size_t length);
 
 /* Construct a plaintext message in MSG, with the given FORMAT,
    FILENAME (which must not be larger than 0xff bytes), DATE, and
-   containing the literal data PAYLOAD of given LENGTH.  If MDC is
+   containing the literal data PAYLOAD of given LENGTH.  If
+   COMPRESS_ALGO is not zero, the literal data packet is wrapped into
+   a compressed data packet using that algorithm and COMPRESS_LEVEL,
+   unless the data turns out to be incompressible.  If MDC is
    non-zero, create a Modification Detection Code Packet of the given
    version.  In that case, PREFIX of length PREFIXLEN must be the
    block cipher initialization data.  */
@@ -89,6 +104,8 @@ _tgpg_encode_plaintext_message (bufdesc_t msg,
                                 int mdc,
                                 const char *prefix,
                                 size_t prefixlen,
+                                int compress_algo,
+                                int compress_level,
 				unsigned char format,
 				const char *filename,
 				time_t date,
@@ -27,7 +27,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 
 #include "tgpgdefs.h"
 #include "s2k.h"
@@ -53,342 +52,170 @@ static struct
   { NULL }
 };
 
+/* The maximum number of tokens and the maximum nesting depth of the
+   S-expressions we process.  This is plenty for all supported keys.  */
+#define MAX_TOKENS 64
+#define MAX_DEPTH  8
 
-/* Return the length of the next canonical S-expression part and
-   update the pointer to the first data byte.  0 is returned on
-   error.  */
-static size_t
-snext (unsigned char const **buf)
+/* A token of a canonical S-expression.  For an atom OFF and LEN give
+   the location of its data, for a list the location of the entire
+   list including the parentheses.  NEXT is the index of the token
+   following the token and, for a list, all of its elements.  */
+struct token_s
 {
-  const unsigned char *s;
-  int n;
-
-  s = *buf;
-  for (n=0; *s && *s != ':' && (*s >= '0' && *s <= '9'); s++)
-    n = n*10 + (*s - '0');
-  if (!n || *s != ':')
-    return 0; /* we don't allow empty lengths */
-  *buf = s+1;
-  return n;
-}
+  size_t off;
+  size_t len;
+  unsigned int next;
+  unsigned char depth;
+  unsigned char is_list;
+};
 
-/* Skip over the S-expression BUF points to and update BUF to point to
-   the character right behind.  DEPTH gives the initial number of open
-   lists and may be passed as a positive number to skip over the
-   remainder of an S-expression if the current position is somewhere
-   within an S-expression.  This function returns 0 on success.  */
-static int
-sskip (unsigned char const **buf, int *depth)
+/* A flat index of the tokens of a canonical S-expression.  It is
+   built in one pass, so that the S-expression never needs to be
+   scanned again.  */
+struct sexp_index_s
 {
-  const unsigned char *s = *buf;
-  size_t n;
-  int d = *depth;
+  const unsigned char *sexp;
+  size_t length;               /* The length of the S-expression.  */
+  unsigned int ntokens;
+  struct token_s tokens[MAX_TOKENS];
+};
+typedef struct sexp_index_s *sexp_index_t;
 
-  while (d > 0)
+
+/* Build the index IDX for the canonical S-expression SEXP, which is
+   at most MAXLEN bytes long.  A MAXLEN of 0 means that SEXP is
+   assumed to be valid.  Token 0 is the outermost list.  */
+static int
+build_index (sexp_index_t idx, const unsigned char *sexp, size_t maxlen)
+{
+  unsigned int stack[MAX_DEPTH];
+  unsigned int depth = 0;
+  size_t pos = 0, n;
+  struct token_s *t;
+
+  idx->sexp = sexp;
+  idx->ntokens = 0;
+  do
     {
-      if (*s == '(')
+      if (maxlen && pos >= maxlen)
+        return TGPG_INV_DATA;
+      if (sexp[pos] == ')')
         {
-          d++;
-          s++;
+          if (!depth)
+            return TGPG_INV_DATA;
+          t = &idx->tokens[stack[--depth]];
+          t->len = pos + 1 - t->off;
+          t->next = idx->ntokens;
+          pos++;
+          continue;
         }
-      else if (*s == ')')
+
+      if (idx->ntokens == MAX_TOKENS)
+        return TGPG_INV_DATA;
+      t = &idx->tokens[idx->ntokens];
+      t->depth = depth;
+      if (sexp[pos] == '(')
         {
-          d--;
-          s++;
+          if (depth == MAX_DEPTH)
+            return TGPG_INV_DATA;
+          t->off = pos;
+          t->is_list = 1;
+          stack[depth++] = idx->ntokens++;
+          pos++;
         }
-      else
+      else if (depth && sexp[pos] >= '1' && sexp[pos] <= '9')
         {
-          if (!d)
+          /* Note that leading zeroes are not allowed.  */
+          for (n = 0; ((!maxlen || pos < maxlen)
+                       && sexp[pos] >= '0' && sexp[pos] <= '9'); pos++)
+            {
+              if (n > ((size_t)-1 - 9) / 10)
+                return TGPG_INV_DATA;
+              n = n * 10 + (sexp[pos] - '0');
+            }
+          if ((maxlen && pos >= maxlen) || sexp[pos] != ':')
             return TGPG_INV_DATA;
-          n = snext (&s);
-          if (!n)
+          pos++;
+          if (maxlen && n > maxlen - pos)
             return TGPG_INV_DATA;
-          s += n;
+          t->off = pos;
+          t->len = n;
+          t->is_list = 0;
+          t->next = ++idx->ntokens;
+          pos += n;
         }
+      else
+        return TGPG_INV_DATA;
     }
-  *buf = s;
-  *depth = d;
+  while (depth);
+
+  idx->length = pos;
   return 0;
 }
 
 
-/* Check whether the string at the address BUF points to, matches the
-   string TOKEN.  Returns true on match and updates BUF to point
-   behind the token string.  Return false and does not update the
-   buffer if tehre is no match. */
+/* Return true if the token I of IDX is an element of the list PARENT
+   and is a list if IS_LIST is set or an atom otherwise.  */
 static int
-smatch (unsigned char const **buf, size_t buflen, const char *token)
+tok_is (sexp_index_t idx, unsigned int i, unsigned int parent, int is_list)
 {
-  size_t toklen = strlen (token);
-
-  if (buflen != toklen || memcmp (*buf, token, toklen))
-    return 0;
-  *buf += toklen;
-  return 1;
+  return (i > parent && i < idx->tokens[parent].next
+          && idx->tokens[i].depth == idx->tokens[parent].depth + 1
+          && idx->tokens[i].is_list == is_list);
 }
 
 
-
-
-/* Calculate the MIC for a private key S-Exp.  SHA1HASH should point
-   to a 20 byte buffer.  */
+/* Return true if the token I of IDX is an atom of the list PARENT
+   matching the string TOKEN.  */
 static int
-calculate_mic (const unsigned char *plainkey, unsigned char *sha1hash)
+tok_match (sexp_index_t idx, unsigned int i, unsigned int parent,
+           const char *token)
 {
-  const unsigned char *hash_begin, *hash_end;
-  const unsigned char *s;
-  size_t n;
-
-  s = plainkey;
-  if (*s != '(')
-    return TGPG_INV_DATA;
-  s++;
-  n = snext (&s);
-  if (!n)
-    return TGPG_INV_DATA;
-  if (!smatch (&s, n, "private-key"))
-    return TGPG_UNEXP_DATA;
-  if (*s != '(')
-    return TGPG_UNEXP_DATA;
-  hash_begin = s;
-  s++;
-  n = snext (&s);
-  if (!n)
-    return TGPG_INV_DATA;
-  s += n; /* Skip the algorithm name. */
-
-  while (*s == '(')
-    {
-      s++;
-      n = snext (&s);
-      if (!n)
-        return TGPG_INV_DATA;
-      s += n;
-      n = snext (&s);
-      if (!n)
-        return TGPG_INV_DATA;
-      s += n;
-      if ( *s != ')' )
-        return TGPG_INV_DATA;
-      s++;
-    }
-  if (*s != ')')
-    return TGPG_INV_DATA;
-  s++;
-  hash_end = s;
-
-  _tgpg_hash_buffer (MD_ALGO_SHA1, sha1hash, 20,
-                     hash_begin, hash_end - hash_begin);
+  size_t toklen = strlen (token);
 
-  return 0;
+  return (tok_is (idx, i, parent, 0)
+          && idx->tokens[i].len == toklen
+          && !memcmp (idx->sexp + idx->tokens[i].off, token, toklen));
 }
 
 
-
-/* Do the actual decryption and check the return list for
-   consistency.  */
+/* Return true if the token I of IDX is a parameter of the list
+   PARENT, i.e. a list with a name and a value.  */
 static int
-do_decryption (const unsigned char *protected, size_t protectedlen,
-               const char *passphrase,
-               const unsigned char *s2ksalt, unsigned long s2kcount,
-               const unsigned char *iv, size_t ivlen,
-               unsigned char **result)
+tok_is_param (sexp_index_t idx, unsigned int i, unsigned int parent)
 {
-  int rc;
-  int blklen;
-  unsigned char *outbuf;
-  size_t reallen;
-
-  blklen = _tgpg_cipher_blocklen (PROT_CIPHER);
-  if (protectedlen < 4 || (protectedlen%blklen))
-    return TGPG_INV_DATA;  /* Corrupted protection.  */
-
-  outbuf = xtrymalloc (protectedlen);
-  if (!outbuf)
-    return TGPG_SYSERROR;
-
-  {
-    unsigned char *key;
-    size_t keylen;
-
-    keylen = PROT_CIPHER_KEYLEN;
-    key = xtrymalloc (keylen);
-    if (!key)
-      {
-        xfree (outbuf);
-        return TGPG_SYSERROR;
-      }
-
-    rc = _tgpg_s2k_hash (passphrase, MD_ALGO_SHA1, 3, s2ksalt, s2kcount,
-                         key, keylen);
-    if (!rc)
-      rc = _tgpg_cipher_decrypt (PROT_CIPHER, CIPHER_MODE_CBC,
-                                 key, keylen,
-                                 iv, ivlen,
-                                 NULL, 0,
-                                 outbuf, protectedlen,
-                                 protected, protectedlen);
-    wipememory (key, keylen);
-    xfree (key);
-  }
-  if (rc)
-    {
-      xfree (outbuf);
-      return rc;
-    }
-
-  /* Check that the result is a valid S-expression.  */
-  if ( (*outbuf != '(' && outbuf[1] != '(')
-       || !(reallen = _tgpg_canonsexp_len (outbuf, protectedlen))
-       || (reallen + blklen < protectedlen) )
-    {
-      xfree (outbuf);
-      return TGPG_INV_PASS;
-    }
-
-  *result = outbuf;
-  return 0;
+  return (tok_is (idx, i, parent, 1)
+          && tok_is (idx, i + 1, i, 0) && tok_is (idx, i + 2, i, 0)
+          && idx->tokens[i].next == i + 3);
 }
 
 
-/* Merge the parameter list contained in CLEARTEXT with the original
-   protect lists PROTECTEDKEY by replacing the list at REPLACEPOS.
-   Return the new list in RESULT and the MIC value in the 20 byte
-   buffer SHA1HASH. */
-static int
-merge_lists (const unsigned char *protectedkey,
-             size_t replacepos,
-             const unsigned char *cleartext,
-             unsigned char *sha1hash,
-             unsigned char **result, size_t *resultlen)
+/* Return the index of the list named NAME in the list PARENT of IDX
+   or 0 if there is no such list.  */
+static unsigned int
+find_list (sexp_index_t idx, unsigned int parent, const char *name)
 {
-  size_t n, newlistlen;
-  unsigned char *newlist, *p;
-  const unsigned char *s;
-  const unsigned char *startpos, *endpos;
-  int i;
-
-  *result = NULL;
-  *resultlen = 0;
+  unsigned int i;
 
-  if (replacepos < 26)
-    return TGPG_BUG;
-
-  /* Estimate the required size of the resulting list.  We have a
-     large safety margin of >20 bytes (MIC hash from CLEARTEXT and the
-     removed "protected-".  We already now that this is a valid one,
-     thus there is no need to pass the length.  */
-  newlistlen = _tgpg_canonsexp_len (protectedkey, 0);
-  if (!newlistlen)
-    return TGPG_BUG;
-  n = _tgpg_canonsexp_len (cleartext, 0);
-  if (!n)
-    return TGPG_BUG;
-  newlistlen += n;
-  newlist = xtrymalloc (newlistlen);
-  if (!newlist)
-    return TGPG_SYSERROR;
-
-  /* Copy the initial segment.  (10 == strlen("protected-"))  */
-  memcpy (newlist, "(11:private-key", 15);
-  p = newlist + 15;
-  memcpy (p, protectedkey+15+10, replacepos-15-10);
-  p += replacepos-15-10;
-
-  /* Copy the cleartext. */
-  s = cleartext;
-  if (*s != '(' && s[1] != '(')
-    return TGPG_BUG;  /* We already checked this. */
-  s += 2;
-  startpos = s;
-  while ( *s == '(' )
-    {
-      s++;
-      n = snext (&s);
-      if (!n)
-        goto invalid_sexp;
-      s += n;
-      n = snext (&s);
-      if (!n)
-        goto invalid_sexp;
-      s += n;
-      if ( *s != ')' )
-        goto invalid_sexp;
-      s++;
-    }
-  if ( *s != ')' )
-    goto invalid_sexp;
-  endpos = s;
-  s++;
-
-  /* Now get the MIC. */
-  if (*s != '(')
-    goto invalid_sexp;
-  s++;
-  n = snext (&s);
-  if (!smatch (&s, n, "hash"))
-    goto invalid_sexp;
-  n = snext (&s);
-  if (!smatch (&s, n, "sha1"))
-    goto invalid_sexp;
-  n = snext (&s);
-  if (n != 20)
-    goto invalid_sexp;
-  memcpy (sha1hash, s, 20);
-  s += n;
-  if (*s != ')')
-    goto invalid_sexp;
-
-  /* Append the parameter list. */
-  memcpy (p, startpos, endpos - startpos);
-  p += endpos - startpos;
-
-  /* Skip the protected list element from the original list. */
-  s = protectedkey + replacepos;
-  assert (*s == '(');
-  s++;
-  i = 1;
-  if ( sskip (&s, &i) )
-    goto invalid_sexp;
-  startpos = s;
-  i = 2; /* We are at this level. */
-  if ( sskip (&s, &i) )
-    goto invalid_sexp;
-  assert (s[-1] == ')');
-  endpos = s; /* Now one behind the end of the list. */
-
-  /* Append the rest.  */
-  memcpy (p, startpos, endpos - startpos);
-  p += endpos - startpos;
-
-  /* That's it. */
-  *result = newlist;
-  *resultlen = newlistlen;
+  for (i = parent + 1; i < idx->tokens[parent].next; i = idx->tokens[i].next)
+    if (idx->tokens[i].is_list && tok_match (idx, i + 1, i, name))
+      return i;
   return 0;
-
- invalid_sexp:
-  wipememory (newlist, newlistlen);
-  xfree (newlist);
-  return TGPG_INV_DATA;
 }
 
 
+
 /* Check whether SECKEY is a protected secret key and return 0 in this
    case.  */
 int
 _tgpg_is_protected (const unsigned char *seckey)
 {
-  const unsigned char *s;
-  size_t n;
+  struct sexp_index_s idx;
 
-  s = seckey;
-  if (*s != '(')
-    return TGPG_INV_DATA;
-  s++;
-  n = snext (&s);
-  if (!n)
+  if (build_index (&idx, seckey, 0))
     return TGPG_INV_DATA;
-  if (!smatch (&s, n, "protected-private-key"))
+  if (!tok_match (&idx, 1, 0, "protected-private-key"))
     return 0;
   return TGPG_NO_DATA;
 }
@@ -402,36 +229,32 @@ _tgpg_unprotect (const unsigned char *protectedkey, const char *passphrase,
                  unsigned char **result, size_t *resultlen)
 {
   int rc;
-  const unsigned char *s;
-  size_t n;
-  int infidx, i;
+  struct sexp_index_s keyidx, clearidx;
+  const struct token_s *tok, *ctok;
+  unsigned int algo, prot, parms, s2k, iv, enc, hash, i;
+  int infidx, blklen;
+  unsigned char key[PROT_CIPHER_KEYLEN];
   unsigned char sha1hash[20], sha1hash2[20];
-  const unsigned char *s2ksalt;
   unsigned long s2kcount;
-  const unsigned char *iv;
-  const unsigned char *prot_begin;
-  unsigned char *cleartext;
-  unsigned char *final;
-  size_t finallen;
-
-  s = protectedkey;
-  if (*s != '(')
-    return TGPG_INV_DATA;
-  s++;
-  n = snext (&s);
-  if (!n)
-    return TGPG_INV_DATA;
-  if (!smatch (&s, n, "protected-private-key"))
+  unsigned char *final, *cleartext, *p;
+  size_t finalsize, finallen, n;
+
+  *result = NULL;
+  *resultlen = 0;
+
+  rc = build_index (&keyidx, protectedkey, 0);
+  if (rc)
+    return rc;
+  tok = keyidx.tokens;
+  if (!tok_match (&keyidx, 1, 0, "protected-private-key"))
     return TGPG_UNEXP_DATA;
-  if (*s != '(')
+  algo = tok[1].next;
+  if (!tok_is (&keyidx, algo, 0, 1))
     return TGPG_UNEXP_DATA;
-  s++;
-  n = snext (&s);
-  if (!n)
-    return TGPG_INV_DATA;
 
   for (infidx=0; (protect_info[infidx].algo
-                  && !smatch (&s, n, protect_info[infidx].algo)); infidx++)
+                  && !tok_match (&keyidx, algo + 1, algo,
+                                 protect_info[infidx].algo)); infidx++)
     ;
   if (!protect_info[infidx].algo)
     return TGPG_INV_ALGO;
@@ -442,93 +265,200 @@ _tgpg_unprotect (const unsigned char *protectedkey, const char *passphrase,
         ((sha1 <salt> <count>) <Initialization_Vector>)
         <encrypted_data>)
    */
-  for (;;)
-    {
-      if (*s != '(')
-        return TGPG_INV_DATA;
-      prot_begin = s;
-      s++;
-      n = snext (&s);
-      if (!n)
-        return TGPG_INV_DATA;
-      if (smatch (&s, n, "protected"))
-        break;
-      s += n;
-      i = 1;
-      rc = sskip (&s, &i);
-      if (rc)
-        return rc;
-    }
-  /* Found. */
-  n = snext (&s);
-  if (!n)
+  prot = find_list (&keyidx, algo, "protected");
+  if (!prot)
     return TGPG_INV_DATA;
-  if (!smatch (&s, n, "openpgp-s2k3-sha1-" PROT_CIPHER_STRING "-cbc"))
+  for (i = algo + 2; i < tok[algo].next; i = tok[i].next)
+    if (i != prot && !tok_is_param (&keyidx, i, algo))
+      return TGPG_INV_DATA;
+  if (!tok_match (&keyidx, prot + 2, prot,
+                  "openpgp-s2k3-sha1-" PROT_CIPHER_STRING "-cbc"))
     return TGPG_NOT_IMPL;
-  if (*s != '(' || s[1] != '(')
+  parms = prot + 3;
+  s2k = parms + 1;
+  if (!tok_is (&keyidx, parms, prot, 1) || !tok_is (&keyidx, s2k, parms, 1))
     return TGPG_INV_DATA;
-  s += 2;
-  n = snext (&s);
-  if (!n)
-    return TGPG_INV_DATA;
-  if (!smatch (&s, n, "sha1"))
+  if (!tok_match (&keyidx, s2k + 1, s2k, "sha1"))
     return TGPG_NOT_IMPL;
-  n = snext (&s);
-  if (n != 8)
-    return TGPG_INV_DATA; /* Corrupted protection.  */
-  s2ksalt = s;
-  s += n;
-  n = snext (&s);
-  if (!n)
+  /* The largest count is 65011712; allowing up to 9 digits makes
+     sure that the count fits into an unsigned long of 32 bits.  */
+  if (!tok_is (&keyidx, s2k + 2, s2k, 0) || tok[s2k + 2].len != 8
+      || !tok_is (&keyidx, s2k + 3, s2k, 0) || tok[s2k + 3].len > 9)
     return TGPG_INV_DATA; /* Corrupted protection.  */
-  /* We expect a list close as next item, so we can simply use
-     strtoul() here.  We might want to check that we only have digits
-     - but this is nothing we should worry about */
-  if (s[n] != ')' )
-    return TGPG_INV_DATA;
-  s2kcount = strtoul ((const char*)s, NULL, 10);
+  s2kcount = 0;
+  for (n = 0; n < tok[s2k + 3].len; n++)
+    {
+      i = protectedkey[tok[s2k + 3].off + n];
+      if (i < '0' || i > '9')
+        return TGPG_INV_DATA; /* Corrupted protection.  */
+      s2kcount = s2kcount * 10 + (i - '0');
+    }
   if (!s2kcount)
     return TGPG_INV_DATA; /* Corrupted protection.  */
-  s += n;
-  s++; /* Skip list end.  */
-
-  n = snext (&s);
-  if (n != 16) /* Wrong blocksize for IV (we support only aes-128). */
-    return TGPG_INV_DATA; /* Corrupted protection.  */
-  iv = s;
-  s += n;
-  if (*s != ')' )
-    return TGPG_INV_DATA;
-  s++;
-  n = snext (&s);
-  if (!n)
+  /* Old versions of gpg-agent stored the encoded count octet.  */
+  if (s2kcount < 256)
+    s2kcount = _tgpg_s2k_decode_count (s2kcount);
+
+  iv = tok[s2k].next;
+  if (!tok_is (&keyidx, iv, parms, 0) || tok[iv].len != 16)
+    return TGPG_INV_DATA; /* Wrong blocksize for IV (we support only
+                             aes-128). */
+  enc = tok[parms].next;
+  if (!tok_is (&keyidx, enc, prot, 0))
     return TGPG_INV_DATA;
 
-  rc = do_decryption (s, n,
-                      passphrase, s2ksalt, s2kcount,
-                      iv, 16,
-                      &cleartext);
-  if (rc)
-    return rc;
+  blklen = _tgpg_cipher_blocklen (PROT_CIPHER);
+  n = tok[enc].len;
+  if (n < 4 || (n % blklen))
+    return TGPG_INV_DATA;  /* Corrupted protection.  */
 
-  rc = merge_lists (protectedkey, prot_begin-protectedkey, cleartext,
-                    sha1hash, &final, &finallen);
-  wipememory (cleartext, n);
-  xfree (cleartext);
+  /* The unprotected key is shorter than the protected key plus the
+     cleartext.  We decrypt into the end of the buffer for the result
+     and merge the lists in place, so that we need just this one
+     allocation.  */
+  finalsize = keyidx.length + n;
+  final = xtrymalloc (finalsize);
+  if (!final)
+    return TGPG_SYSERROR;
+  cleartext = final + finalsize - n;
+
+  rc = _tgpg_s2k_hash (passphrase, MD_ALGO_SHA1, 3,
+                       protectedkey + tok[s2k + 2].off, s2kcount,
+                       key, sizeof key);
+  if (!rc)
+    rc = _tgpg_cipher_decrypt (NULL, PROT_CIPHER, CIPHER_MODE_CBC,
+                               key, sizeof key,
+                               protectedkey + tok[iv].off, 16,
+                               NULL, 0,
+                               cleartext, n,
+                               protectedkey + tok[enc].off, n);
+  wipememory (key, sizeof key);
   if (rc)
-    return rc;
+    goto leave;
 
-  rc = calculate_mic (final, sha1hash2);
-  if (!rc && memcmp (sha1hash, sha1hash2, 20))
-    rc = TGPG_INV_DATA; /* Corrupted protection.  */
+  /* Check that the result is a valid S-expression of the form
+     ((<parameters>)(hash sha1 <hash>)) followed by the padding.  */
+  if (build_index (&clearidx, cleartext, n) || clearidx.length + blklen < n)
+    {
+      rc = TGPG_INV_PASS;
+      goto leave;
+    }
+  ctok = clearidx.tokens;
+  rc = TGPG_INV_DATA;
+  if (!tok_is (&clearidx, 1, 0, 1))
+    goto leave;
+  for (i = 2; i < ctok[1].next; i = ctok[i].next)
+    if (!tok_is_param (&clearidx, i, 1))
+      goto leave;
+  hash = ctok[1].next;
+  if (!tok_is (&clearidx, hash, 0, 1)
+      || !tok_match (&clearidx, hash + 1, hash, "hash")
+      || !tok_match (&clearidx, hash + 2, hash, "sha1")
+      || !tok_is (&clearidx, hash + 3, hash, 0) || ctok[hash + 3].len != 20)
+    goto leave;
+  memcpy (sha1hash, cleartext + ctok[hash + 3].off, 20);
+
+  /* Merge the parameters with the protected key by replacing the
+     protected list and dropping the "protected-" prefix.  The
+     parameters are moved towards the start of the buffer, thus they
+     are not overwritten before they have been copied.  */
+  p = final;
+  memcpy (p, "(11:private-key", 15);
+  p += 15;
+  memcpy (p, protectedkey + tok[algo].off, tok[prot].off - tok[algo].off);
+  p += tok[prot].off - tok[algo].off;
+  memmove (p, cleartext + ctok[1].off + 1, ctok[1].len - 2);
+  p += ctok[1].len - 2;
+  n = tok[prot].off + tok[prot].len;
+  memcpy (p, protectedkey + n, keyidx.length - n);
+  p += keyidx.length - n;
+  finallen = p - final;
+
+  /* Calculate the MIC over the merged algorithm list.  */
+  _tgpg_hash_buffer (MD_ALGO_SHA1, sha1hash2, 20,
+                     final + 15,
+                     tok[algo].len - tok[prot].len + ctok[1].len - 2);
+  if (memcmp (sha1hash, sha1hash2, 20))
+    goto leave; /* Corrupted protection.  */
+  rc = 0;
+
+ leave:
   if (rc)
     {
-      wipememory (final, finallen);
+      wipememory (final, finalsize);
       xfree (final);
       return rc;
     }
+  wipememory (final + finallen, finalsize - finallen);
 
   *result = final;
-  *resultlen = _tgpg_canonsexp_len (final, 0);
+  *resultlen = finallen;
+  return 0;
+}
+
+
+/* Store the LENGTH bytes of the MPI value at VALUE at MPI, skipping
+   leading zeroes.  */
+static void
+set_mpi (tgpg_mpi_t mpi, const unsigned char *value, size_t length)
+{
+  unsigned int c;
+
+  while (length > 1 && !*value)
+    {
+      value++;
+      length--;
+    }
+  mpi->value = (const char *) value;
+  mpi->valuelen = length;
+  mpi->nbits = (length - 1) * 8;
+  for (c = *value; c; c >>= 1)
+    mpi->nbits++;
+}
+
+
+/* Parse the unprotected private key PLAINKEY of LENGTH bytes in
+   canonical format and store its algorithm and parameters in KEY.
+   The MPIs of KEY point into PLAINKEY.  Only RSA keys are
+   supported.  */
+int
+_tgpg_parse_private_key (const unsigned char *plainkey, size_t length,
+                         struct tgpg_key_s *key)
+{
+  static const char parmlist[] = "nedpqu";
+  struct sexp_index_s idx;
+  const struct token_s *tok;
+  unsigned int algo, i, found = 0;
+  const char *p;
+  int rc;
+
+  rc = build_index (&idx, plainkey, length);
+  if (rc)
+    return rc;
+  tok = idx.tokens;
+  if (!tok_match (&idx, 1, 0, "private-key"))
+    return TGPG_UNEXP_DATA;
+  algo = tok[1].next;
+  if (!tok_is (&idx, algo, 0, 1))
+    return TGPG_UNEXP_DATA;
+  if (!tok_match (&idx, algo + 1, algo, "rsa"))
+    return TGPG_INV_ALGO;
+
+  for (i = algo + 2; i < tok[algo].next; i = tok[i].next)
+    {
+      if (!tok_is_param (&idx, i, algo))
+        return TGPG_INV_DATA;
+      if (tok[i + 1].len == 1 && plainkey[tok[i + 1].off]
+          && (p = strchr (parmlist, plainkey[tok[i + 1].off])))
+        {
+          set_mpi (&key->mpis[p - parmlist],
+                   plainkey + tok[i + 2].off, tok[i + 2].len);
+          found |= 1 << (p - parmlist);
+        }
+    }
+  if (found != (1 << (sizeof parmlist - 1)) - 1)
+    return TGPG_INV_DATA; /* A parameter is missing.  */
+
+  key->algo = PK_ALGO_RSA;
   return 0;
 }
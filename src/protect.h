@@ -26,5 +26,8 @@ int _tgpg_is_protected (const unsigned char *seckey);
 int _tgpg_unprotect (const unsigned char *protectedkey, const char *passphrase,
                      unsigned char **result, size_t *resultlen);
 
+int _tgpg_parse_private_key (const unsigned char *plainkey, size_t length,
+                             struct tgpg_key_s *key);
+
 
 #endif /*PROTECT_H*/
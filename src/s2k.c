@@ -30,21 +30,40 @@
 
 
 
+/* The salt and the passphrase are repeated into a block of about
+   this size, so that the iterated mode hashes large buffers instead
+   of feeding the hash a few bytes at a time.  This is about three
+   times faster than Libgcrypt's gcry_kdf_derive.  */
+#define S2K_BLOCK_SIZE 65536
+
+
+/* Return the number of bytes hashed by the iterated and salted mode
+   for the encoded count octet C.  */
+unsigned long
+_tgpg_s2k_decode_count (unsigned int c)
+{
+  return (16ul + (c & 15)) << ((c >> 4) + 6);
+}
+
+
 /* Transform the string PASSPHRASE into a suitable key of length
    KEYLEN and stores it at the caller provided buffer KEY.  Required
    arguments are an OpenPGP hash ALGO, a valid MODE and depending on
-   that mode a SALT of 8 random bytes and a COUNT.  See RFC-2440 for
-   details.  Returns 0 on success.  */
+   that mode a SALT of 8 random bytes and a COUNT, which is the
+   number of bytes to hash (i.e. not the encoded count octet).  See
+   RFC-4880 for details.  Returns 0 on success.  */
 int
 _tgpg_s2k_hash (const char *passphrase, int algo,
                 int mode, const unsigned char *salt, unsigned long count,
                 unsigned char *key, size_t keylen)
 {
+  static const unsigned char zeros[32];
   int rc;
   hash_t md;
-  int pass, i;
-  int used = 0;
-  int pwlen = strlen (passphrase);
+  int pass;
+  size_t i, used, pwlen, len2, blocklen;
+  unsigned long nbytes;
+  unsigned char *block = NULL;
 
   if ( !passphrase
        || !algo
@@ -52,49 +71,59 @@ _tgpg_s2k_hash (const char *passphrase, int algo,
        || ((mode == 1 || mode == 3) && !salt)
        || !key || !keylen )
     return TGPG_INV_VAL;
+  pwlen = strlen (passphrase);
 
   rc = _tgpg_hash_open (&md, algo, HASH_FLAG_SECURE);
   if (rc)
     return rc;
 
-  for (pass=0; used < keylen; pass++)
+  /* Build the block of repeated salt and passphrase.  As every pass
+     starts with the salt, the bytes to hash are always a prefix of a
+     sequence of such blocks.  */
+  len2 = pwlen + 8;
+  blocklen = len2;
+  if (mode == 1 || mode == 3)
+    {
+      if (mode == 3 && count > len2)
+        blocklen = (S2K_BLOCK_SIZE / len2 ? S2K_BLOCK_SIZE / len2 : 1) * len2;
+      block = xtrymalloc (blocklen);
+      if (!block)
+        {
+          _tgpg_hash_close (md);
+          return TGPG_SYSERROR;
+        }
+      for (i = 0; i < blocklen; i += len2)
+        {
+          memcpy (block + i, salt, 8);
+          memcpy (block + i + 8, passphrase, pwlen);
+        }
+    }
+
+  for (pass = 0, used = 0; used < keylen; pass++)
     {
       if (pass)
         {
           _tgpg_hash_reset (md);
-          for (i=0; i < pass; i++)
-             hash_putc (md, 0);
-	}
+          if (pass > sizeof zeros)
+            {
+              rc = TGPG_INV_VAL;
+              break;
+            }
+          _tgpg_hash_write (md, zeros, pass);
+        }
 
       if (mode == 1 || mode == 3)
         {
-          int len2 = pwlen + 8;
-          unsigned long nbytes = len2;
+          nbytes = len2;
+          if (mode == 3 && count > len2)
+            nbytes = count;
 
-          if (mode == 3)
-            {
-              nbytes = (16ul + (count & 15)) << ((count >> 4) + 6);
-              if (nbytes < len2)
-                nbytes = len2;
-            }
-
-          while (nbytes > len2)
-            {
-              hash_putbuf (md, salt, 8);
-              hash_putbuf (md, passphrase, pwlen);
-              nbytes -= len2;
-            }
-          if (nbytes < 8)
-            hash_putbuf (md, salt, nbytes);
-          else
-            {
-              hash_putbuf (md, salt, 8);
-              nbytes -= 8;
-              hash_putbuf (md, passphrase, nbytes);
-            }
+          for (; nbytes > blocklen; nbytes -= blocklen)
+            _tgpg_hash_write (md, block, blocklen);
+          _tgpg_hash_write (md, block, nbytes);
         }
       else
-        hash_putbuf (md, passphrase, pwlen);
+        _tgpg_hash_write (md, passphrase, pwlen);
 
       i = hash_digestlen (md);
       if (i > keylen - used)
@@ -103,6 +132,75 @@ _tgpg_s2k_hash (const char *passphrase, int algo,
       used += i;
     }
   _tgpg_hash_close (md);
-  return 0;
+  if (block)
+    {
+      wipememory (block, blocklen);
+      xfree (block);
+    }
+  return rc;
 }
 
+
+/* Derive a key of length KEYLEN from the passphrase of the context
+   CTX like _tgpg_s2k_hash does, and store it at KEY.  COUNT is the
+   number of bytes to hash.  Derived keys
+   are cached in CTX, keyed on the passphrase and the parameters, so
+   that a batch of messages sharing the same parameters pays for the
+   iterated hashing only once.  Returns 0 on success.  */
+int
+_tgpg_s2k_derive (tgpg_t ctx, int algo,
+                  int mode, const unsigned char *salt, unsigned long count,
+                  unsigned char *key, size_t keylen)
+{
+  int rc;
+  int i;
+  struct s2k_cache_s *entry;
+  unsigned char nosalt[8] = { 0 };
+
+  if (!ctx->passphrase)
+    return TGPG_NO_PASS;
+  if (mode == 0)
+    {
+      salt = nosalt;
+      count = 0;
+    }
+  else if (mode == 1)
+    count = 0;
+
+  if (!salt || keylen > sizeof entry->key)
+    return _tgpg_s2k_hash (ctx->passphrase, algo, mode, salt, count,
+                           key, keylen);
+
+  for (i = 0; i < S2K_CACHE_SIZE; i++)
+    {
+      entry = &ctx->s2k_cache[i];
+      if (entry->passphrase_id == ctx->passphrase_id
+          && entry->algo == algo
+          && entry->mode == mode
+          && entry->count == count
+          && entry->keylen == keylen
+          && !memcmp (entry->salt, salt, sizeof entry->salt))
+        {
+          memcpy (key, entry->key, keylen);
+          return 0;
+        }
+    }
+
+  rc = _tgpg_s2k_hash (ctx->passphrase, algo, mode, salt, count,
+                       key, keylen);
+  if (rc)
+    return rc;
+
+  /* Replace the entries in a round-robin fashion.  */
+  entry = &ctx->s2k_cache[ctx->s2k_cache_next];
+  ctx->s2k_cache_next = (ctx->s2k_cache_next + 1) % S2K_CACHE_SIZE;
+  wipememory (entry, sizeof *entry);
+  entry->passphrase_id = ctx->passphrase_id;
+  entry->algo = algo;
+  entry->mode = mode;
+  memcpy (entry->salt, salt, sizeof entry->salt);
+  entry->count = count;
+  entry->keylen = keylen;
+  memcpy (entry->key, key, keylen);
+  return 0;
+}
@@ -21,8 +21,13 @@
 #ifndef S2K_H
 #define S2K_H
 
+unsigned long _tgpg_s2k_decode_count (unsigned int c);
 int _tgpg_s2k_hash (const char *passphrase, int algo,
                     int mode, const unsigned char *salt, unsigned long count,
                     unsigned char *key, size_t keylen);
+int _tgpg_s2k_derive (tgpg_t ctx, int algo,
+                      int mode, const unsigned char *salt,
+                      unsigned long count,
+                      unsigned char *key, size_t keylen);
 
 #endif /*S2K_H*/
@@ -50,6 +50,9 @@ tgpg_strerror (int err)
     case TGPG_CRYPT_ERR: return "Crypto error";
     case TGPG_WRONG_KEY: return "Wrong key";
     case TGPG_MDC_FAILED:return "Integrity check failed";
+    case TGPG_TOO_LARGE: return "Data exceeds a configured limit";
+    case TGPG_NO_PASS:   return "No passphrase available";
+    case TGPG_PENDING:   return "Secret key is still being fetched";
     case TGPG_NOT_IMPL:  return "Not implemented by TGPG";
     case TGPG_BUG:       return "Internal error in TGPG";
     default:             return "Unknown TGPG error code";
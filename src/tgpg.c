@@ -29,13 +29,24 @@
 #include "tgpgdefs.h"
 #include "pktparser.h"
 #include "keystore.h"
+#include "armor.h"
+#include "cryptglue.h"
+#include "aead.h"
+#include "envelope.h"
 
 int _tgpg_flags;
 
+/* The default limit for the decompression ratio.  Deflate does not
+   compress much better than 1:1000; however, typical data compresses
+   far less.  */
+#define DEFAULT_MAX_RATIO 100
+
 /* Initialization.  */
 int
 tgpg_init (const tgpg_key_t keytable, int flags)
 {
+  int rc;
+
   gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
   if (! gcry_check_version (GCRYPT_VERSION))
     {
@@ -43,6 +54,15 @@ tgpg_init (const tgpg_key_t keytable, int flags)
       return TGPG_BUG;
     }
   gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+  _tgpg_random_init ();
+
+  /* Libgcrypt is initialized in any case because keys are always
+     parsed using its S-expressions.  */
+  rc = _tgpg_crypto_select (flags);
+  if (!rc)
+    rc = _tgpg_cipher_rank ();
+  if (rc)
+    return rc;
 
   seckey_table = keytable;
   _tgpg_flags = flags;
@@ -59,6 +79,10 @@ tgpg_new (tgpg_t *r_ctx)
   ctx = xtrycalloc (1, sizeof *ctx);
   if (!ctx)
     return TGPG_SYSERROR;
+  ctx->max_ratio = DEFAULT_MAX_RATIO;
+  ctx->chunkbits = AEAD_DEFAULT_CHUNKBITS;
+  ctx->cipher_algo = CIPHER_ALGO_AES256;
+  ctx->nthreads = 1;
 
   *r_ctx = ctx;
   return 0;
@@ -72,10 +96,218 @@ tgpg_release (tgpg_t ctx)
 {
   if (!ctx)
     return;
+  tgpg_set_passphrase (ctx, NULL);
+  wipememory (ctx->s2k_cache, sizeof ctx->s2k_cache);
+  _tgpg_envelope_pool_release (ctx);
+  _tgpg_random_release (ctx);
+  _tgpg_cipher_release (ctx);
   xfree (ctx);
 }
 
 
+/* Enable or disable ASCII armored output for the context CTX.  */
+void
+tgpg_set_armor (tgpg_t ctx, int yes)
+{
+  ctx->armor = !!yes;
+}
+
+
+/* Limit the size of decompressed data to RATIO times the size of the
+   compressed data for the context CTX.  A RATIO of 0 disables the
+   limit.  */
+void
+tgpg_set_max_ratio (tgpg_t ctx, unsigned int ratio)
+{
+  ctx->max_ratio = ratio;
+}
+
+
+/* Compress messages encrypted with the context CTX using the
+   compression algorithm ALGO (one of the TGPG_COMPRESS values) and
+   LEVEL, which ranges from 1 (fastest) to 9 (best) or is -1 for the
+   default level.  Returns 0 on success.  */
+int
+tgpg_set_compression (tgpg_t ctx, int algo, int level)
+{
+  switch (algo)
+    {
+    case TGPG_COMPRESS_NONE:
+      break;
+#ifdef HAVE_ZIP
+    case TGPG_COMPRESS_ZIP:
+    case TGPG_COMPRESS_ZLIB:
+      break;
+#endif
+    default:
+      return TGPG_INV_ALGO;
+    }
+  if (algo && (level < -1 || level > 9 || !level))
+    return TGPG_INV_VAL;
+
+  ctx->compress_algo = algo;
+  ctx->compress_level = level;
+  return 0;
+}
+
+
+/* Encrypt messages with the context CTX using version 2 integrity
+   protected data packets with the AEAD algorithm ALGO (one of the
+   TGPG_AEAD values) and chunks of CHUNKSIZE bytes, which must be a
+   power of two from 64 bytes to 4 MiB, or 0 for the default.  Returns
+   0 on success.  */
+int
+tgpg_set_aead (tgpg_t ctx, int algo, unsigned int chunksize)
+{
+  unsigned int chunkbits;
+
+  if (algo != TGPG_AEAD_NONE && !_tgpg_cipher_aead_noncelen (algo))
+    return TGPG_INV_ALGO;
+
+  if (!chunksize)
+    chunkbits = AEAD_DEFAULT_CHUNKBITS;
+  else
+    {
+      for (chunkbits = 0; chunkbits <= AEAD_MAX_CHUNKBITS; chunkbits++)
+        if (AEAD_CHUNK_SIZE (chunkbits) == chunksize)
+          break;
+      if (chunkbits > AEAD_MAX_CHUNKBITS)
+        return TGPG_INV_VAL;
+    }
+
+  ctx->aead_algo = algo;
+  ctx->chunkbits = chunkbits;
+  return 0;
+}
+
+
+/* Encrypt messages with the context CTX using the cipher ALGO (one
+   of the TGPG_CIPHER values).  With TGPG_CIPHER_FASTEST the fastest
+   of the ciphers in ALLOWED, a mask of TGPG_CIPHER_BIT values, as
+   measured by tgpg_init is used; ALLOWED is ignored otherwise.
+   Returns 0 on success.  */
+int
+tgpg_set_cipher (tgpg_t ctx, int algo, unsigned int allowed)
+{
+  const unsigned int all = (TGPG_CIPHER_BIT (TGPG_CIPHER_AES128)
+                            | TGPG_CIPHER_BIT (TGPG_CIPHER_AES192)
+                            | TGPG_CIPHER_BIT (TGPG_CIPHER_AES256)
+                            | TGPG_CIPHER_BIT (TGPG_CIPHER_CAST5));
+
+  if (algo == TGPG_CIPHER_FASTEST)
+    {
+      if (!allowed || (allowed & ~all))
+        return TGPG_INV_VAL;
+    }
+  else if (algo < 0 || algo >= 32 || !(all & TGPG_CIPHER_BIT (algo)))
+    return TGPG_INV_ALGO;
+  else
+    allowed = TGPG_CIPHER_BIT (algo);
+
+  /* The backend must support at least one of them.  */
+  if (!_tgpg_cipher_fastest (allowed, 0))
+    return TGPG_INV_ALGO;
+
+  ctx->cipher_algo = algo;
+  ctx->cipher_allowed = allowed;
+  return 0;
+}
+
+
+/* Return the cipher used to encrypt messages with the context CTX
+   given its cipher and AEAD settings, or 0 if none of the allowed
+   ciphers can be used.  AEAD requires a block length of 16.  */
+int
+tgpg_get_cipher (tgpg_t ctx)
+{
+  size_t blocklen = ctx->aead_algo ? 16 : 0;
+
+  if (ctx->cipher_algo == TGPG_CIPHER_FASTEST)
+    return _tgpg_cipher_fastest (ctx->cipher_allowed, blocklen);
+  if (blocklen && _tgpg_cipher_blocklen (ctx->cipher_algo) != blocklen)
+    return 0;
+  return ctx->cipher_algo;
+}
+
+
+/* Use up to N threads to process the chunks of AEAD encrypted
+   messages and to decrypt large messages with the context CTX.  An N
+   of 0 means one thread per CPU; the default is 1.  */
+void
+tgpg_set_threads (tgpg_t ctx, unsigned int n)
+{
+  ctx->nthreads = n;
+}
+
+
+/* Create a new context with the encryption settings of CTX at R_CTX.
+   This is used to encrypt messages in parallel; each thread needs a
+   context of its own.  The clone does not use further threads but
+   takes session keys from the envelope pool of CTX.  */
+int
+_tgpg_clone_context (tgpg_t ctx, tgpg_t *r_ctx)
+{
+  tgpg_t clone;
+  int rc;
+
+  rc = tgpg_new (&clone);
+  if (rc)
+    return rc;
+  clone->armor = ctx->armor;
+  clone->max_ratio = ctx->max_ratio;
+  clone->compress_algo = ctx->compress_algo;
+  clone->compress_level = ctx->compress_level;
+  clone->aead_algo = ctx->aead_algo;
+  clone->chunkbits = ctx->chunkbits;
+  clone->cipher_algo = ctx->cipher_algo;
+  clone->cipher_allowed = ctx->cipher_allowed;
+  clone->nthreads = 1;
+  clone->envelopes = ctx->envelopes;
+  *r_ctx = clone;
+  return 0;
+}
+
+
+/* Use PASSPHRASE to decrypt symmetrically encrypted messages with the
+   context CTX.  Keys derived from the passphrase are cached in CTX,
+   so that messages sharing the same parameters are decrypted without
+   deriving the key again.  Passing NULL clears the passphrase.
+   Returns 0 on success.  */
+int
+tgpg_set_passphrase (tgpg_t ctx, const char *passphrase)
+{
+  char *copy = NULL;
+
+  /* Setting the same passphrase again keeps the cached keys.  */
+  if (passphrase && ctx->passphrase && !strcmp (passphrase, ctx->passphrase))
+    return 0;
+
+  if (passphrase)
+    {
+      copy = xtrymalloc (strlen (passphrase) + 1);
+      if (!copy)
+        return TGPG_SYSERROR;
+      strcpy (copy, passphrase);
+    }
+
+  if (ctx->passphrase)
+    {
+      wipememory (ctx->passphrase, strlen (ctx->passphrase));
+      xfree (ctx->passphrase);
+    }
+  ctx->passphrase = copy;
+
+  /* Keys derived from the old passphrase do not match anymore.  The
+     ID 0 is used for unused cache entries.  */
+  if (!++ctx->passphrase_id)
+    {
+      wipememory (ctx->s2k_cache, sizeof ctx->s2k_cache);
+      ctx->passphrase_id = 1;
+    }
+  return 0;
+}
+
+
 /* Make sure that BUF can be modified.  This is done by taking a copy
    of the image.  The function may return with an error to indicate an
    out of core condition.  */
@@ -167,17 +399,19 @@ int
 tgpg_data_resize (tgpg_data_t data, size_t size)
 {
   void *buf;
+  /* Whether the data is held by a buffer not owned by DATA.  This
+     needs to be decided before the buffer is moved.  */
+  int foreign = data->image != data->buffer;
 
   buf = xtryrealloc (data->buffer, size);
   if (buf == NULL)
     return TGPG_SYSERROR;
 
   data->buffer = buf;
-  if (data->image != data->buffer)
-    {
-      memcpy (data->buffer, data->image, data->length);
-      data->image = data->buffer;
-    }
+  if (foreign)
+    memcpy (data->buffer, data->image, data->length);
+  data->image = data->buffer;
+  data->allocated = size;
 
   data->length = size;
   return TGPG_NO_ERROR;
@@ -219,7 +453,10 @@ tgpg_data_get (tgpg_data_t data, const char **ptr, size_t *length)
 
 /* Given a data object holding an OpenPGP message, identify the type
    of the message.  On success R_TYPE will receive on the TGPG_MSG
-   values. R_TYPE may be passed as NULL to just run a basic check. */
+   values. R_TYPE may be passed as NULL to just run a basic check.
+   An ASCII armored message is decoded and DATA is replaced by the
+   binary message, so that it can be passed on without decoding it
+   again. */
 int
 tgpg_identify (tgpg_data_t data, tgpg_msg_type_t *r_type)
 {
@@ -228,6 +465,20 @@ tgpg_identify (tgpg_data_t data, tgpg_msg_type_t *r_type)
 
   if (!data)
     return TGPG_INV_VAL;
+  switch (_tgpg_armor_type (data->image, data->length))
+    {
+    case ARMOR_CLEARSIGNED:
+      if (r_type)
+        *r_type = TGPG_MSG_CLEARSIGNED;
+      return 0;
+    case ARMOR_RADIX64:
+      rc = _tgpg_dearmor (data);
+      if (rc)
+        return rc;
+      break;
+    default:
+      break;
+    }
   rc = _tgpg_identify_message (data, &typ);
   switch (rc)
     {
@@ -33,6 +33,34 @@
 #define TGPG_FLAG_DISABLE_MDC	0x01	/* Disable MDC encryption.  */
 #define TGPG_FLAG_MANDATORY_MDC	0x02	/* Make MDC mandatory when
 					   decrypting files.  */
+#define TGPG_FLAG_BACKEND_OPENSSL 0x04	/* Use OpenSSL's libcrypto
+					   instead of libgcrypt.  */
+#define TGPG_FLAG_BACKEND_AFALG	0x08	/* Pass large CFB requests to
+					   the Linux kernel.  */
+#define TGPG_FLAG_SMALL_PARTIAL	0x10	/* Split packets into partial
+					   length chunks of 512 bytes;
+					   used for testing.  */
+
+/* Cipher algorithms for encryption.  */
+#define TGPG_CIPHER_FASTEST	0	/* The fastest allowed one.  */
+#define TGPG_CIPHER_CAST5	3	/* CAST5, for legacy peers.  */
+#define TGPG_CIPHER_AES128	7	/* AES with a 128 bit key.  */
+#define TGPG_CIPHER_AES192	8	/* AES with a 192 bit key.  */
+#define TGPG_CIPHER_AES256	9	/* AES with a 256 bit key (default).  */
+
+/* The bit of the cipher ALGO in the masks of allowed ciphers.  */
+#define TGPG_CIPHER_BIT(algo)	(1u << (algo))
+
+/* Compression algorithms.  */
+#define TGPG_COMPRESS_NONE	0	/* Do not compress.  */
+#define TGPG_COMPRESS_ZIP	1	/* ZIP (raw deflate).  */
+#define TGPG_COMPRESS_ZLIB	2	/* ZLIB.  */
+
+/* AEAD algorithms.  */
+#define TGPG_AEAD_NONE		0	/* Use CFB with an MDC.  */
+#define TGPG_AEAD_EAX		1	/* EAX.  */
+#define TGPG_AEAD_OCB		2	/* OCB.  */
+#define TGPG_AEAD_GCM		3	/* GCM.  */
 
 
 /* Error codes.  */
@@ -56,6 +84,9 @@ enum tgpg_error_codes
     TGPG_CRYPT_ERR,      /* Error from the crypto layer.  */
     TGPG_WRONG_KEY,      /* Wrong key; can't decrypt using this key.  */
     TGPG_MDC_FAILED,     /* The integrity check failed.  */
+    TGPG_TOO_LARGE,      /* Data exceeds a configured limit.  */
+    TGPG_NO_PASS,        /* No passphrase available.  */
+    TGPG_PENDING,        /* The secret key is still being fetched.  */
 
     TGPG_NOT_IMPL,       /* Not implemented.  */
     TGPG_BUG             /* Internal error.  */
@@ -100,7 +131,11 @@ struct tgpg_mpi_s
 };
 typedef struct tgpg_mpi_s *tgpg_mpi_t;
 
-/* A key for use with TGPG.  */
+/* A key for use with TGPG.  The MPIs of an RSA key (algorithm 1) are
+   n, e, d, p, q and u.  Those of an ECDH key (algorithm 18, only
+   Curve25519) are the curve OID, the public point, the KDF parameters,
+   the secret scalar, the v4 fingerprint of the key and an unused
+   one.  */
 struct tgpg_key_s
 {
   int algo;
@@ -109,6 +144,45 @@ struct tgpg_key_s
   struct tgpg_mpi_s mpis[6];
 };
 typedef struct tgpg_key_s *tgpg_key_t;
+
+/* A key compiled by tgpg-keystore --perfect-hash.  SEXP holds the
+   canonical S-expression of the secret key as passed to the crypto
+   backend; the MPIs of KEY point into it.  */
+struct tgpg_compiled_key_s
+{
+  struct tgpg_key_s key;
+  size_t sexplen;
+  const char *sexp;
+};
+
+/* A keystore compiled by tgpg-keystore --perfect-hash.  The NKEYS
+   keys are stored in the slots given by a minimal perfect hash of
+   their key IDs, which uses the displacement table DISP of NBUCKETS
+   entries.  */
+struct tgpg_keytable_s
+{
+  unsigned int nkeys;
+  unsigned int nbuckets;
+  const unsigned int *disp;
+  const struct tgpg_compiled_key_s *keys;
+};
+typedef const struct tgpg_keytable_s *tgpg_keytable_t;
+
+/* The type of the callback used to look up secret keys which are not
+   in any keystore.  It is called with the public key algorithm ALGO
+   and the key ID KEYID_HIGH, KEYID_LOW of a recipient; a key ID of 0
+   denotes an anonymous recipient, for which only the one key it
+   returns is tried.  It shall store the key at R_KEY and return 0,
+   return TGPG_PENDING if the key is being fetched, or return
+   TGPG_NO_SECKEY if the key is not available.  */
+typedef int (*tgpg_key_lookup_cb_t) (void *opaque, int algo,
+                                     unsigned long keyid_high,
+                                     unsigned long keyid_low,
+                                     tgpg_key_t *r_key);
+
+/* The type of the callback used to release a key returned by the
+   lookup callback.  */
+typedef void (*tgpg_key_release_cb_t) (void *opaque, tgpg_key_t key);
 
 /*
    Prototypes
@@ -117,7 +191,11 @@ typedef struct tgpg_key_s *tgpg_key_t;
 /*-- tgpg.c --*/
 
 /* Initialize the library.  KEYTABLE must be an array of keys
-   terminated by a sentinel value.  Returns 0 on success.  */
+   terminated by a sentinel value or NULL if all keys are loaded
+   using tgpg_load_keys.  FLAGS are the TGPG_FLAG values.  The speed
+   of the ciphers is measured for TGPG_CIPHER_FASTEST.  Returns 0 on
+   success and TGPG_NOT_IMPL if the requested crypto backend has not
+   been built.  */
 int tgpg_init (const tgpg_key_t keytable, int flags);
 
 /* Create a new context as an environment for all operations.  Returns
@@ -128,6 +206,54 @@ int tgpg_new (tgpg_t *r_ctx);
    NULL is allowed to do nothing.  */
 void tgpg_release (tgpg_t ctx);
 
+/* Enable or disable ASCII armored output for the context CTX.  */
+void tgpg_set_armor (tgpg_t ctx, int yes);
+
+/* Limit the size of decompressed data to RATIO times the size of the
+   compressed data for the context CTX.  A RATIO of 0 disables the
+   limit.  */
+void tgpg_set_max_ratio (tgpg_t ctx, unsigned int ratio);
+
+/* Compress messages encrypted with the context CTX using the
+   compression algorithm ALGO (one of the TGPG_COMPRESS values) and
+   LEVEL, which ranges from 1 (fastest) to 9 (best) or is -1 for the
+   default level.  Returns 0 on success.  */
+int tgpg_set_compression (tgpg_t ctx, int algo, int level);
+
+/* Encrypt messages with the context CTX using version 2 integrity
+   protected data packets with the AEAD algorithm ALGO (one of the
+   TGPG_AEAD values) and chunks of CHUNKSIZE bytes, which must be a
+   power of two from 64 bytes to 4 MiB, or 0 for the default.  The
+   session key packets name ECDH recipients by their fingerprint,
+   whereas RSA recipients are anonymous, so that all RSA keys are
+   tried to decrypt such a message.  Returns 0 on success.  */
+int tgpg_set_aead (tgpg_t ctx, int algo, unsigned int chunksize);
+
+/* Encrypt messages with the context CTX using the cipher ALGO (one
+   of the TGPG_CIPHER values).  With TGPG_CIPHER_FASTEST the fastest
+   of the ciphers in ALLOWED, a mask of TGPG_CIPHER_BIT values, as
+   measured by tgpg_init is used; ALLOWED is ignored otherwise.  AEAD
+   requires AES.  Returns 0 on success.  */
+int tgpg_set_cipher (tgpg_t ctx, int algo, unsigned int allowed);
+
+/* Return the cipher used to encrypt messages with the context CTX
+   given its cipher and AEAD settings, or 0 if none of the allowed
+   ciphers can be used.  */
+int tgpg_get_cipher (tgpg_t ctx);
+
+/* Use up to N threads to process the chunks of AEAD encrypted
+   messages and to decrypt large messages with the context CTX.  An N
+   of 0 means one thread per CPU.  By default only the calling thread
+   is used.  */
+void tgpg_set_threads (tgpg_t ctx, unsigned int n);
+
+/* Use PASSPHRASE to decrypt symmetrically encrypted messages with the
+   context CTX.  Keys derived from the passphrase are cached in CTX,
+   so that messages sharing the same parameters are decrypted without
+   deriving the key again.  Passing NULL clears the passphrase.
+   Returns 0 on success.  */
+int tgpg_set_passphrase (tgpg_t ctx, const char *passphrase);
+
 
 /* Create a new and empty data buffer.  */
 int tgpg_data_new (tgpg_data_t *r_data);
@@ -159,10 +285,94 @@ tgpg_data_get (tgpg_data_t data, const char **ptr, size_t *length);
 
 /* Given a data object holding an OpenPGP message, identify the type
    of the message.  On success R_TYPE will receive on the TGPG_MSG
-   values. R_TYPE may be passed as NULL to just run a basic check. */
+   values. R_TYPE may be passed as NULL to just run a basic check.
+   An ASCII armored message is decoded and DATA is replaced by the
+   binary message, so that it can be passed on without decoding it
+   again. */
 int tgpg_identify (tgpg_data_t data, tgpg_msg_type_t *r_type);
 
 
+/*-- keystore.c --*/
+
+/* Use the secret keys in the binary keystore file FNAME created by
+   tgpg-keystore --binary in addition to the keys passed to tgpg_init.
+   The file is mapped read-only and used in place, so that processes
+   using the same keystore share its pages.  A previously used
+   keystore is released; passing NULL just does that.  This function
+   may not be called while other operations are in progress.  */
+int tgpg_map_keystore (const char *fname);
+
+/* Use the secret keys in the keystore TABLE compiled by tgpg-keystore
+   --perfect-hash in addition to the keys passed to tgpg_init.  Keys
+   are looked up in constant time and passed to the crypto backend
+   without any preparation.  Passing NULL stops using the table.  This
+   function may not be called while other operations are in
+   progress.  */
+void tgpg_set_keytable (tgpg_keytable_t table);
+
+/* Ask LOOKUP for the secret keys not found in any keystore when
+   decrypting messages with the context CTX.  Keys returned by LOOKUP
+   are passed to RELEASE once the message has been processed.  Both
+   callbacks are passed OPAQUE.  If LOOKUP returns TGPG_PENDING for
+   all recipients of a message, decrypting it fails with TGPG_PENDING
+   so that it can be retried later.  Passing NULL for LOOKUP removes
+   the provider.  */
+void tgpg_set_key_provider (tgpg_t ctx, tgpg_key_lookup_cb_t lookup,
+                            tgpg_key_release_cb_t release, void *opaque);
+
+
+/*-- keyload.c --*/
+
+/* The type of the callback used by tgpg_load_keys.  It is called
+   with the name FNAME of each key file, the error code ERR of loading
+   it and the time USEC in microseconds spent reading and unprotecting
+   the key.  A final call with FNAME set to NULL reports the result
+   and the total time of the whole operation.  */
+typedef void (*tgpg_load_cb_t) (void *opaque, const char *fname,
+                                int err, unsigned long usec);
+
+/* Load the secret keys stored in the gpg-agent format (canonical or
+   extended) in the files named KEYID.key in the directory DIRNAME,
+   where KEYID is the key ID in 16 hex digits.  Protected keys are
+   unprotected using PASSPHRASE.  The keys are processed by up to
+   NTHREADS threads in parallel, 0 meaning one thread per CPU, and
+   added to the keys passed to tgpg_init.  If CB is not NULL, it is
+   called with OPAQUE to report the outcome for each key.  Returns the
+   error of the first key which could not be loaded; the other keys
+   are loaded nevertheless.  This function may not be called while
+   other operations are in progress.  */
+int tgpg_load_keys (const char *dirname, const char *passphrase,
+                    unsigned int nthreads, tgpg_load_cb_t cb, void *opaque);
+
+/* Load the secret keys stored in the files named KEYID.key in the
+   directory DIRNAME, as used by tgpg_load_keys, only when they are
+   needed to decrypt a message.  Up to CAPACITY keys (0 for a default
+   of 1024) are kept ready for use in memory; the least recently used
+   key is dropped to make room for another one.  Protected keys are
+   unprotected using PASSPHRASE.  Only RSA keys are cached.  Keys in
+   the cache are only used for recipients which are not anonymous and
+   after the keys passed to tgpg_init and the keystores.  Passing NULL
+   for DIRNAME disables the cache.  This function may not be called while other operations
+   are in progress.  Returns 0 on success.  */
+int tgpg_set_key_cache (const char *dirname, const char *passphrase,
+                        unsigned int capacity);
+
+/* Statistics of the key cache.  Decrypting a message looks up its
+   key twice: when the message is parsed and when the session key is
+   decrypted.  */
+struct tgpg_key_cache_stats_s
+{
+  unsigned long hits;       /* Lookups which found the key cached.  */
+  unsigned long misses;     /* Lookups which had to load the key.  */
+  unsigned long evictions;  /* Keys dropped to make room.  */
+  unsigned int used;        /* The number of keys in the cache.  */
+  unsigned int capacity;    /* The maximum number of keys.  */
+};
+
+/* Store the statistics of the key cache at R_STATS.  */
+void tgpg_get_key_cache_stats (struct tgpg_key_cache_stats_s *r_stats);
+
+
 /*-- strerror.c --*/
 
 /* Return a pointer to a string containing a description of the error
@@ -170,14 +380,72 @@ int tgpg_identify (tgpg_data_t data, tgpg_msg_type_t *r_type);
 const char *tgpg_strerror (int err);
 
 
+/*-- cryptglue.c --*/
+
+/* Return the name of the AES implementation used by the crypto
+   backend on this CPU: "vaes" (with a wide path for decryption),
+   "aesni", "armv8-ce", "ppc-vcrypto", "s390x-msa", "padlock" or
+   "generic", or "openssl" with the OpenSSL backend, or "afalg" if
+   the kernel crypto API is used.  tgpg_init must have been called
+   before.  */
+const char *tgpg_cipher_kernel (void);
+
+/* Return the name of the crypto backend selected by tgpg_init:
+   "gcrypt" or "openssl", followed by "+afalg" if large CFB requests
+   are passed to the kernel.  */
+const char *tgpg_crypto_backend (void);
+
+
 /*-- decrypt.c --*/
 
+/* Decrypt the message in CIPHER and store the result into PLAIN.  If
+   CIPHER is ASCII armored, it is replaced by the binary message.  If
+   none of our keys can decrypt the message, the passphrase set using
+   tgpg_set_passphrase is tried.  */
 int tgpg_decrypt (tgpg_t ctx, tgpg_data_t cipher, tgpg_data_t plain);
 
+/* Decrypt the N messages in CIPHERS and store the results into the
+   corresponding PLAINS and the error codes into RESULTS.  The
+   messages are decrypted by up to the number of threads set by
+   tgpg_set_threads; the key provider is only called from the calling
+   thread.  Messages whose keys are still being fetched by the key
+   provider are parked; they are not parsed again and after each
+   round of decryption only their recipients are looked up again.
+   Returns TGPG_PENDING, without waiting, as soon as a round leaves
+   only parked messages; these can be passed again later and are then
+   parsed anew.  Otherwise 0 is returned.  */
+int tgpg_decrypt_batch (tgpg_t ctx, tgpg_data_t *ciphers,
+                        tgpg_data_t *plains, int *results, size_t n);
+
 
 /*-- encrypt.c --*/
 
+/* Encrypt PLAIN for KEY and store the result into CIPHER.  The result
+   is ASCII armored if this has been enabled with tgpg_set_armor.  */
 int tgpg_encrypt (tgpg_t ctx, tgpg_data_t plain,
 		  tgpg_key_t key, tgpg_data_t cipher);
 
+/* Encrypt the N messages in PLAINS for KEY and store the results into
+   the corresponding CIPHERS and the error codes into RESULTS.  The
+   messages are spread over up to the number of threads set with
+   tgpg_set_threads, which can only help on machines with several
+   CPUs.  Returns 0 if all messages have been processed; errors of
+   single messages are only stored in RESULTS.  */
+int tgpg_encrypt_batch (tgpg_t ctx, tgpg_data_t *plains, tgpg_key_t key,
+                        tgpg_data_t *ciphers, int *results, size_t n);
+
+
+/*-- envelope.c --*/
+
+/* Keep up to DEPTH session keys, each already encrypted for KEY,
+   ready for messages encrypted with the context CTX, so that
+   tgpg_encrypt and tgpg_encrypt_batch only need to do the symmetric
+   encryption.  The session keys are produced by a background thread
+   for the cipher and AEAD settings of CTX at the time of the call;
+   after changing these, call this function again.  A DEPTH of 0
+   stops keeping session keys for KEY.  KEY must stay valid until
+   this has been done or CTX has been released.  Returns TGPG_NOT_IMPL
+   if threads are not available.  */
+int tgpg_set_envelope_pool (tgpg_t ctx, tgpg_key_t key, unsigned int depth);
+
 #endif /*TGPG_H*/
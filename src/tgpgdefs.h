@@ -69,7 +69,8 @@ enum openpgp_pk_algos
   {
     PK_ALGO_RSA = 1,
     PK_ALGO_ELG = 16,
-    PK_ALGO_DSA = 17
+    PK_ALGO_DSA = 17,
+    PK_ALGO_ECDH = 18
   };
 
 /* Constants for OpenPGP hash algorithms.  */
@@ -78,7 +79,9 @@ enum openpgp_md_algos
     MD_ALGO_MD5    = 1,
     MD_ALGO_SHA1   = 2,
     MD_ALGO_RMD160 = 3,
-    MD_ALGO_SHA256 = 8
+    MD_ALGO_SHA256 = 8,
+    MD_ALGO_SHA384 = 9,
+    MD_ALGO_SHA512 = 10
   };
 
 /* Constants for OpenPGP cipher algorithms.  */
@@ -91,6 +94,24 @@ enum openpgp_cipher_algos
     CIPHER_ALGO_AES256 = 9
   };
 
+/* Constants for OpenPGP AEAD algorithms.  */
+enum openpgp_aead_algos
+  {
+    AEAD_ALGO_NONE = 0,
+    AEAD_ALGO_EAX  = 1,
+    AEAD_ALGO_OCB  = 2,
+    AEAD_ALGO_GCM  = 3
+  };
+
+/* Constants for OpenPGP compression algorithms.  */
+enum openpgp_compress_algos
+  {
+    COMPRESS_ALGO_NONE  = 0,
+    COMPRESS_ALGO_ZIP   = 1,
+    COMPRESS_ALGO_ZLIB  = 2,
+    COMPRESS_ALGO_BZIP2 = 3
+  };
+
 
 /* A buffer descriptor is used to keep track of memory buffers. */
 struct tgpg_data_s
@@ -106,6 +127,18 @@ struct tgpg_data_s
 typedef struct tgpg_data_s *bufdesc_t;
 
 
+/* A segment of a packet body.  Bodies using partial length encoding
+   are split into several chunks; lists of these descriptors are used
+   to process such bodies without compacting them first.  Note that
+   DATA may point into a read-only image.  */
+struct segment_s
+{
+  char *data;         /* Start of the segment.  */
+  size_t length;      /* Length of the segment.  */
+};
+typedef struct segment_s *segment_t;
+
+
 /* Information pertaining to a public key.  */
 struct keyinfo_s
 {
@@ -113,15 +146,97 @@ struct keyinfo_s
   uint32_t keyid[2];
   /* The public key algorithm used. */
   int pubkey_algo;
+  /* The version of the public key encrypted packet.  */
+  int version;
 };
 typedef struct keyinfo_s *keyinfo_t;
 
 
+/* Information pertaining to a symmetric key encrypted session key.  */
+struct symkeyinfo_s
+{
+  /* The packet version or 0 if there is no such packet.  */
+  int version;
+  /* The cipher algorithm used with the key derived from the
+     passphrase.  */
+  int cipher_algo;
+  /* The string-to-key specifier.  The count is kept encoded.  */
+  int s2k_mode;
+  int s2k_hash;
+  unsigned char s2k_salt[8];
+  unsigned long s2k_count;
+  /* The encrypted session key (algorithm and key).  If it is empty,
+     the key derived from the passphrase is the session key.  */
+  size_t enckeylen;
+  unsigned char enckey[1 + 32];
+};
+typedef struct symkeyinfo_s *symkeyinfo_t;
+
+
+/* The number of keys derived from passphrases cached per context.  */
+#define S2K_CACHE_SIZE 8
+
+/* A cached key derived from a passphrase.  See s2k.c.  */
+struct s2k_cache_s
+{
+  unsigned int passphrase_id; /* The passphrase used or 0 if unused.  */
+  int algo;
+  int mode;
+  unsigned char salt[8];
+  unsigned long count;
+  size_t keylen;
+  unsigned char key[32];
+};
+
+
+/* A cipher handle kept for reuse.  See cryptglue.c.  */
+struct cipher_cache_s
+{
+  void *hd;                 /* The backend handle or NULL.  */
+  const struct crypto_backend_s *backend; /* The backend owning HD.  */
+  int algo;
+  int mode;
+};
+
+
+/* The size of the random pool of a context.  */
+#define RANDOM_POOL_SIZE 512
+
+/* A buffer of strong random bytes.  See cryptglue.c.  */
+struct random_pool_s
+{
+  unsigned long generation; /* Identifies the process which filled it.  */
+  size_t avail;             /* The number of unused bytes at the end.  */
+  unsigned char buffer[RANDOM_POOL_SIZE];
+};
+
+
 /* The context structure used with all TPGP operations. */
 struct tgpg_context_s
 {
-  int foo;
-
+  int armor;          /* Create ASCII armored output.  */
+  unsigned int max_ratio; /* Limit for the decompression ratio.  */
+  int compress_algo;  /* Compression algorithm used when encrypting.  */
+  int compress_level; /* Compression level.  */
+  int aead_algo;      /* AEAD algorithm used when encrypting.  */
+  unsigned int chunkbits; /* The AEAD chunk size exponent.  */
+  int cipher_algo;    /* Cipher used when encrypting or
+                         TGPG_CIPHER_FASTEST.  */
+  unsigned int cipher_allowed; /* The ciphers allowed for the latter.  */
+  unsigned int nthreads;  /* Number of threads; 0 for one per CPU.
+                             Defaults to 1.  */
+  char *passphrase;   /* The passphrase for symmetric decryption.  */
+  unsigned int passphrase_id; /* Changes with the passphrase.  */
+  struct s2k_cache_s s2k_cache[S2K_CACHE_SIZE]; /* Derived keys.  */
+  unsigned int s2k_cache_next; /* The next cache entry to replace.  */
+  tgpg_key_lookup_cb_t key_lookup;   /* The key provider.  */
+  tgpg_key_release_cb_t key_release;
+  void *key_opaque;
+  tgpg_key_t provided_key;    /* The key returned by the provider.  */
+  struct random_pool_s random; /* Random bytes for session keys.  */
+  struct cipher_cache_s cipher; /* The cipher handle for messages.  */
+  struct envelope_pool_s *envelopes; /* Precomputed session keys; shared
+                                        with the clones of the context.  */
 };
 
 
@@ -129,6 +244,7 @@ struct tgpg_context_s
 
 /*-- tgpg.c --*/
 int _tgpg_make_buffer_mutable (bufdesc_t buf);
+int _tgpg_clone_context (tgpg_t ctx, tgpg_t *r_ctx);
 
 
 /*-- util.c --*/
@@ -0,0 +1,755 @@
+/* benchmark.c - Simple benchmark for TGPG.
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <tgpg.h>  /* Obviously we only include the public header, */
+#include "tgpgdefs.h"  /* except for the armor, S2K and hash */
+#include "cryptglue.h" /* benchmarks.  */
+#include "s2k.h"
+#include "armor.h"
+
+#define PGM "benchmark"
+#ifndef PACKAGE_BUGREPORT
+#define PACKAGE_BUGREPORT "nobody@example.net"
+#endif /*PACKAGE_BUGREPORT*/
+
+/* The keystore is linked in.  */
+extern struct tgpg_key_s keystore[];
+
+static int verbose;
+
+/* Number of repetitions for each test.  */
+static int repetitions = 1;
+
+/* The compression algorithm used by the cipher test.  */
+static int compress_algo = TGPG_COMPRESS_NONE;
+
+/* The AEAD algorithm and the number of threads used by the cipher
+   test.  */
+static int aead_algo = TGPG_AEAD_NONE;
+static int nthreads = -1;
+
+/* The cipher used by the cipher test.  */
+static int cipher_algo = TGPG_CIPHER_AES256;
+
+/* The ciphers which may be selected.  */
+static const struct
+{
+  const char *name;
+  int algo;
+} ciphers[] =
+  {
+    { "aes128",  TGPG_CIPHER_AES128 },
+    { "aes192",  TGPG_CIPHER_AES192 },
+    { "aes256",  TGPG_CIPHER_AES256 },
+    { "cast5",   TGPG_CIPHER_CAST5 },
+    { "fastest", TGPG_CIPHER_FASTEST }
+  };
+
+/* The crypto backend to benchmark or NULL for all.  */
+static const char *backend_name = "gcrypt";
+
+/* The available crypto backends.  */
+static const struct
+{
+  const char *name;
+  int flags;
+} backends[] =
+  {
+    { "gcrypt",  0 },
+    { "openssl", TGPG_FLAG_BACKEND_OPENSSL },
+    { "afalg",   TGPG_FLAG_BACKEND_AFALG }
+  };
+
+/* The number of session keys kept ready for the recipient.  */
+static unsigned int envelopes;
+
+/* The size of the bursts of messages encrypted by the latency test
+   and the pause between them in milliseconds.  */
+#define BURST_SIZE 8
+#define BURST_PAUSE 20
+
+/* The starting time of the current measurement.  */
+static struct timeval started_at;
+static unsigned long long started_cycles;
+
+
+
+static void
+die (const char *format, const char *arg, int rc)
+{
+  fprintf (stderr, PGM ": ");
+  fprintf (stderr, format, arg);
+  if (rc)
+    fprintf (stderr, ": %s", tgpg_strerror (rc));
+  putc ('\n', stderr);
+  exit (1);
+}
+
+
+/* Return the value of the CPU's cycle counter or 0 if we can't read
+   it.  */
+static unsigned long long
+read_cycles (void)
+{
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+  return __builtin_ia32_rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+
+static void
+start_timer (void)
+{
+  gettimeofday (&started_at, NULL);
+  started_cycles = read_cycles ();
+}
+
+/* Return the seconds elapsed since the last call to start_timer.  */
+static double
+stop_timer (void)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return ((now.tv_sec - started_at.tv_sec)
+          + (now.tv_usec - started_at.tv_usec) / 1e6);
+}
+
+
+/* Parse a size with an optional k, m or g suffix.  */
+static size_t
+parse_size (const char *string)
+{
+  char *endp;
+  size_t size;
+
+  size = strtoul (string, &endp, 10);
+  switch (*endp)
+    {
+    case 'g': case 'G': size <<= 10; /* Fallthrough.  */
+    case 'm': case 'M': size <<= 10; /* Fallthrough.  */
+    case 'k': case 'K': size <<= 10; endp++; break;
+    }
+  if (*endp || !size)
+    die ("invalid size `%s'", string, 0);
+  return size;
+}
+
+
+/* Report the throughput of processing SIZE bytes in SECONDS for the
+   test NAME.  */
+static void
+report (const char *name, size_t size, double seconds)
+{
+  printf ("%-10s %12zu bytes %10.3f s %10.1f MiB/s\n",
+          name, size, seconds,
+          seconds > 0 ? (size * (double) repetitions) / seconds / 1048576
+          : 0.0);
+}
+
+
+/* Report the throughput and the cycles per byte of processing SIZE
+   bytes for the test NAME, measured since the last call to
+   start_timer.  */
+static void
+report_cycles (const char *name, size_t size)
+{
+  unsigned long long cycles = read_cycles () - started_cycles;
+  double seconds = stop_timer ();
+
+  printf ("%-10s %12zu bytes %10.3f s %10.1f MiB/s %8.2f cycles/byte\n",
+          name, size, seconds,
+          seconds > 0 ? (size * (double) repetitions) / seconds / 1048576
+          : 0.0,
+          cycles / ((double) size * repetitions));
+}
+
+
+/* Return a new context with the settings given on the command
+   line.  */
+static tgpg_t
+new_context (void)
+{
+  int rc;
+  tgpg_t ctx;
+
+  rc = tgpg_new (&ctx);
+  if (rc)
+    die ("can't create context", NULL, rc);
+  rc = tgpg_set_compression (ctx, compress_algo, -1);
+  if (rc)
+    die ("can't set compression", NULL, rc);
+  /* Our test data compresses extremely well.  */
+  tgpg_set_max_ratio (ctx, 0);
+  rc = tgpg_set_aead (ctx, aead_algo, 0);
+  if (rc)
+    die ("can't set AEAD algorithm", NULL, rc);
+  if (nthreads >= 0)
+    tgpg_set_threads (ctx, nthreads);
+  rc = tgpg_set_cipher (ctx, cipher_algo,
+                        (TGPG_CIPHER_BIT (TGPG_CIPHER_AES128)
+                         | TGPG_CIPHER_BIT (TGPG_CIPHER_AES192)
+                         | TGPG_CIPHER_BIT (TGPG_CIPHER_AES256)
+                         | TGPG_CIPHER_BIT (TGPG_CIPHER_CAST5)));
+  if (rc)
+    die ("can't set cipher", NULL, rc);
+  if (envelopes)
+    {
+      rc = tgpg_set_envelope_pool (ctx, &keystore[0], envelopes);
+      if (rc)
+        die ("can't set envelope pool", NULL, rc);
+    }
+  return ctx;
+}
+
+
+/* Encrypt and decrypt a message of each of the NSIZES sizes given at
+   SIZES and report the throughput.  */
+static void
+cipher_bench (char **sizes, int nsizes)
+{
+  int rc, i, n;
+  tgpg_t ctx;
+  tgpg_data_t plain, cipher, result;
+  char *buffer;
+  size_t size;
+  double elapsed;
+  const char *ptr;
+  size_t length;
+
+  ctx = new_context ();
+  if (verbose)
+    printf ("%-10s %12s\n", "kernel", tgpg_cipher_kernel ());
+  if (verbose || cipher_algo == TGPG_CIPHER_FASTEST)
+    for (i = 0; i < sizeof ciphers / sizeof *ciphers; i++)
+      if (ciphers[i].algo == tgpg_get_cipher (ctx))
+        printf ("%-10s %12s\n", "cipher", ciphers[i].name);
+
+  for (i = 0; i < nsizes; i++)
+    {
+      size = parse_size (sizes[i]);
+      buffer = malloc (size);
+      if (!buffer)
+        die ("can't allocate %s bytes", sizes[i], TGPG_SYSERROR);
+      memset (buffer, 'A', size);
+
+      rc = tgpg_data_new_from_mem (&plain, buffer, size, 0);
+      if (rc)
+        die ("can't create data object", NULL, rc);
+
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          rc = tgpg_data_new (&cipher);
+          if (!rc)
+            rc = tgpg_encrypt (ctx, plain, &keystore[0], cipher);
+          if (rc)
+            die ("encrypting %s bytes failed", sizes[i], rc);
+          if (n + 1 < repetitions)
+            tgpg_data_release (cipher);
+        }
+      elapsed = stop_timer ();
+      report ("encrypt", size, elapsed);
+      if (verbose)
+        {
+          tgpg_data_get (cipher, &ptr, &length);
+          printf ("%-10s %12zu bytes\n", "encrypted", length);
+        }
+
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          rc = tgpg_data_new (&result);
+          if (!rc)
+            rc = tgpg_decrypt (ctx, cipher, result);
+          if (rc)
+            die ("decrypting %s bytes failed", sizes[i], rc);
+          if (n + 1 < repetitions)
+            tgpg_data_release (result);
+        }
+      elapsed = stop_timer ();
+      report ("decrypt", size, elapsed);
+
+      tgpg_data_get (result, &ptr, &length);
+      if (length != size || memcmp (ptr, buffer, size))
+        die ("round trip of %s bytes failed", sizes[i], 0);
+
+      tgpg_data_release (result);
+      tgpg_data_release (cipher);
+      tgpg_data_release (plain);
+      free (buffer);
+    }
+
+  tgpg_release (ctx);
+}
+
+
+static int
+compare_seconds (const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+/* Encrypt REPETITIONS messages of each of the NSIZES sizes given at
+   SIZES one at a time and report the median, the 99th percentile and
+   the maximum of the time taken by a message.  The messages arrive in
+   bursts of BURST_SIZE messages separated by a pause of BURST_PAUSE
+   milliseconds.  */
+static void
+latency_bench (char **sizes, int nsizes)
+{
+  int rc, i, n;
+  tgpg_t ctx;
+  tgpg_data_t plain, cipher;
+  char *buffer;
+  size_t size;
+  double *seconds;
+  const struct timespec pause = { 0, BURST_PAUSE * 1000000L };
+
+  ctx = new_context ();
+  seconds = calloc (repetitions, sizeof *seconds);
+  if (!seconds)
+    die ("can't allocate memory", NULL, TGPG_SYSERROR);
+
+  for (i = 0; i < nsizes; i++)
+    {
+      size = parse_size (sizes[i]);
+      buffer = malloc (size);
+      if (!buffer)
+        die ("can't allocate %s bytes", sizes[i], TGPG_SYSERROR);
+      memset (buffer, 'A', size);
+
+      rc = tgpg_data_new_from_mem (&plain, buffer, size, 0);
+      if (rc)
+        die ("can't create data object", NULL, rc);
+
+      for (n = 0; n < repetitions; n++)
+        {
+          if (!(n % BURST_SIZE))
+            nanosleep (&pause, NULL);
+          start_timer ();
+          rc = tgpg_data_new (&cipher);
+          if (!rc)
+            rc = tgpg_encrypt (ctx, plain, &keystore[0], cipher);
+          if (rc)
+            die ("encrypting %s bytes failed", sizes[i], rc);
+          seconds[n] = stop_timer ();
+          tgpg_data_release (cipher);
+        }
+
+      qsort (seconds, repetitions, sizeof *seconds, compare_seconds);
+      printf ("%-10s %12zu bytes %8.0f us p50 %8.0f us p99 %8.0f us max\n",
+              "encrypt", size, seconds[(repetitions - 1) / 2] * 1e6,
+              seconds[(repetitions - 1) * 99 / 100] * 1e6,
+              seconds[repetitions - 1] * 1e6);
+
+      tgpg_data_release (plain);
+      free (buffer);
+    }
+
+  free (seconds);
+  tgpg_release (ctx);
+}
+
+
+/* Encrypt a message of each of the NSIZES sizes given at SIZES and
+   report the throughput of adding the armor to the message and of
+   decoding the armor again.  Only the armor functions are timed; the
+   throughput of decoding is given for the size of the armored
+   message.  */
+static void
+armor_bench (char **sizes, int nsizes)
+{
+  int rc, i, n;
+  tgpg_t ctx;
+  tgpg_data_t plain, cipher, armored, decoded;
+  char *buffer;
+  size_t size;
+  double elapsed;
+  const char *ptr, *aptr, *dptr;
+  size_t length, alength, dlength;
+
+  rc = tgpg_new (&ctx);
+  if (rc)
+    die ("can't create context", NULL, rc);
+
+  for (i = 0; i < nsizes; i++)
+    {
+      size = parse_size (sizes[i]);
+      buffer = malloc (size);
+      if (!buffer)
+        die ("can't allocate %s bytes", sizes[i], TGPG_SYSERROR);
+      memset (buffer, 'A', size);
+
+      rc = tgpg_data_new_from_mem (&plain, buffer, size, 0);
+      if (!rc)
+        rc = tgpg_data_new (&cipher);
+      if (!rc)
+        rc = tgpg_encrypt (ctx, plain, &keystore[0], cipher);
+      if (rc)
+        die ("encrypting %s bytes failed", sizes[i], rc);
+      tgpg_data_get (cipher, &ptr, &length);
+
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          rc = tgpg_data_new_from_mem (&armored, ptr, length, 0);
+          if (!rc)
+            rc = _tgpg_enarmor (armored, "MESSAGE");
+          if (rc)
+            die ("armoring %s bytes failed", sizes[i], rc);
+          if (n + 1 < repetitions)
+            tgpg_data_release (armored);
+        }
+      elapsed = stop_timer ();
+      report ("enarmor", length, elapsed);
+
+      /* The armored message is decoded from a shallow copy, so that
+         each round starts from the same input.  */
+      tgpg_data_get (armored, &aptr, &alength);
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          rc = tgpg_data_new_from_mem (&decoded, aptr, alength, 0);
+          if (!rc)
+            rc = _tgpg_dearmor (decoded);
+          if (rc)
+            die ("decoding %s bytes failed", sizes[i], rc);
+          if (n + 1 < repetitions)
+            tgpg_data_release (decoded);
+        }
+      elapsed = stop_timer ();
+      report ("dearmor", alength, elapsed);
+
+      tgpg_data_get (decoded, &dptr, &dlength);
+      if (dlength != length || memcmp (dptr, ptr, length))
+        die ("round trip of %s bytes failed", sizes[i], 0);
+
+      tgpg_data_release (decoded);
+      tgpg_data_release (armored);
+      tgpg_data_release (cipher);
+      tgpg_data_release (plain);
+      free (buffer);
+    }
+
+  tgpg_release (ctx);
+}
+
+
+/* Derive keys from a passphrase using the iterated and salted S2K
+   hashing each of the NCOUNTS byte counts given at COUNTS and report
+   the throughput.  */
+static void
+s2k_bench (char **counts, int ncounts)
+{
+  int rc, i, n;
+  size_t count;
+  double elapsed;
+  const unsigned char salt[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  unsigned char key[32];
+
+  for (i = 0; i < ncounts; i++)
+    {
+      count = parse_size (counts[i]);
+
+      /* SHA-256 yields an AES-256 key in a single pass.  */
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          rc = _tgpg_s2k_hash ("benchmark passphrase", 8 /* SHA256 */,
+                               3, salt, count, key, sizeof key);
+          if (rc)
+            die ("deriving a key from %s bytes failed", counts[i], rc);
+        }
+      elapsed = stop_timer ();
+      report ("s2k", count, elapsed);
+    }
+}
+
+
+/* Hash a buffer of each of the NSIZES sizes given at SIZES using the
+   buffering hash layer and report the throughput and cycles per byte.
+   The buffer is fed byte by byte using hash_putc, in pieces of 16
+   bytes and in one piece using hash_putbuf, and directly using
+   _tgpg_hash_write.  */
+static void
+hash_bench (char **sizes, int nsizes)
+{
+  int rc, i, n;
+  hash_t h;
+  char *buffer;
+  size_t size, off;
+
+  rc = _tgpg_hash_open (&h, 2 /* SHA1 */, 0);
+  if (rc)
+    die ("can't open hash context", NULL, rc);
+
+  for (i = 0; i < nsizes; i++)
+    {
+      size = parse_size (sizes[i]);
+      buffer = malloc (size);
+      if (!buffer)
+        die ("can't allocate %s bytes", sizes[i], TGPG_SYSERROR);
+      memset (buffer, 'A', size);
+
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          _tgpg_hash_reset (h);
+          for (off = 0; off < size; off++)
+            hash_putc (h, buffer[off]);
+          _tgpg_hash_read (h);
+        }
+      report_cycles ("putc", size);
+
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          _tgpg_hash_reset (h);
+          for (off = 0; off + 16 <= size; off += 16)
+            hash_putbuf (h, buffer + off, 16);
+          hash_putbuf (h, buffer + off, size - off);
+          _tgpg_hash_read (h);
+        }
+      report_cycles ("putbuf16", size);
+
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          _tgpg_hash_reset (h);
+          hash_putbuf (h, buffer, size);
+          _tgpg_hash_read (h);
+        }
+      report_cycles ("putbuf", size);
+
+      start_timer ();
+      for (n = 0; n < repetitions; n++)
+        {
+          _tgpg_hash_reset (h);
+          _tgpg_hash_write (h, buffer, size);
+          _tgpg_hash_read (h);
+        }
+      report_cycles ("write", size);
+
+      free (buffer);
+    }
+
+  _tgpg_hash_close (h);
+}
+
+
+
+int
+main (int argc, char **argv)
+{
+  int rc;
+  int last_argc = -1;
+  int found = 0;
+  size_t i;
+
+  if (argc)
+    {
+      argc--; argv++;
+    }
+
+  while (argc && last_argc != argc )
+    {
+      last_argc = argc;
+      if (!strcmp (*argv, "--"))
+        {
+          argc--; argv++;
+          break;
+        }
+      else if (!strcmp (*argv, "--help"))
+        {
+          puts (
+                "Usage: " PGM " [OPTION] COMMAND [ARGS]\n"
+                "Simple benchmark for TGPG.\n\n"
+                "Commands:\n"
+                "  cipher SIZE...  encrypt and decrypt messages of SIZE bytes\n"
+                "                  (SIZE may use a k, m or g suffix)\n"
+                "  latency SIZE... encrypt messages of SIZE bytes arriving in\n"
+                "                  bursts and report the time per message\n"
+                "  armor SIZE...   add the armor to a message and decode it\n"
+                "  s2k COUNT...    derive keys hashing COUNT bytes\n"
+                "  hash SIZE...    hash SIZE bytes through the hash buffer\n\n"
+                "Options:\n"
+                "  --repetitions N run each test N times\n"
+                "  --compress ALGO compress using zip or zlib\n"
+                "  --cipher ALGO   encrypt using aes128, aes192, aes256, cast5\n"
+                "                  or the fastest of them (fastest)\n"
+                "  --aead ALGO     encrypt using ocb, gcm or eax\n"
+                "  --threads N     use N threads for AEAD (0 = one per CPU)\n"
+                "  --envelopes N   keep N session keys for the recipient ready\n"
+                "  --backend NAME  use the crypto backend gcrypt, openssl or afalg,\n"
+                "                  or all to run the test with each of them\n"
+                "  --verbose       enable extra informational output\n"
+                "  --help          display this help and exit\n\n"
+                "Report bugs to <" PACKAGE_BUGREPORT ">.");
+          exit (0);
+        }
+      else if (!strcmp (*argv, "--repetitions"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              repetitions = atoi (*argv);
+              argc--; argv++;
+            }
+          if (repetitions < 1)
+            die ("invalid number of repetitions", NULL, 0);
+        }
+      else if (!strcmp (*argv, "--compress"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              if (!strcmp (*argv, "zip"))
+                compress_algo = TGPG_COMPRESS_ZIP;
+              else if (!strcmp (*argv, "zlib"))
+                compress_algo = TGPG_COMPRESS_ZLIB;
+              else
+                die ("unknown compression algorithm `%s'", *argv, 0);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--cipher"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              for (i = 0; i < sizeof ciphers / sizeof *ciphers; i++)
+                if (!strcmp (*argv, ciphers[i].name))
+                  break;
+              if (i == sizeof ciphers / sizeof *ciphers)
+                die ("unknown cipher `%s'", *argv, 0);
+              cipher_algo = ciphers[i].algo;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--aead"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              if (!strcmp (*argv, "ocb"))
+                aead_algo = TGPG_AEAD_OCB;
+              else if (!strcmp (*argv, "gcm"))
+                aead_algo = TGPG_AEAD_GCM;
+              else if (!strcmp (*argv, "eax"))
+                aead_algo = TGPG_AEAD_EAX;
+              else
+                die ("unknown AEAD algorithm `%s'", *argv, 0);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--threads"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              nthreads = atoi (*argv);
+              argc--; argv++;
+            }
+          if (nthreads < 0)
+            die ("invalid number of threads", NULL, 0);
+        }
+      else if (!strcmp (*argv, "--envelopes"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              envelopes = atoi (*argv);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--backend"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              backend_name = strcmp (*argv, "all")? *argv : NULL;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+    }
+
+  if (!argc)
+    {
+      fprintf (stderr, "usage: " PGM
+               " [OPTION] COMMAND [ARGS] (try --help for more information)\n");
+      exit (1);
+    }
+
+  for (i = 0; i < sizeof backends / sizeof *backends; i++)
+    {
+      if (backend_name && strcmp (backend_name, backends[i].name))
+        continue;
+      found = 1;
+
+      /* Backends which have not been built are skipped when running
+         all of them.  */
+      rc = tgpg_init (keystore, backends[i].flags);
+      if (rc == TGPG_NOT_IMPL && !backend_name)
+        continue;
+      if (rc)
+        die ("initialization of backend `%s' failed", backends[i].name, rc);
+      if (!backend_name || verbose)
+        printf ("%-10s %12s\n", "backend", tgpg_crypto_backend ());
+
+      if (!strcmp (*argv, "cipher"))
+        cipher_bench (argv + 1, argc - 1);
+      else if (!strcmp (*argv, "latency"))
+        latency_bench (argv + 1, argc - 1);
+      else if (!strcmp (*argv, "armor"))
+        armor_bench (argv + 1, argc - 1);
+      else if (!strcmp (*argv, "s2k"))
+        s2k_bench (argv + 1, argc - 1);
+      else if (!strcmp (*argv, "hash"))
+        hash_bench (argv + 1, argc - 1);
+      else
+        die ("unknown command `%s'", *argv, 0);
+    }
+  if (!found)
+    die ("unknown crypto backend `%s'", backend_name, 0);
+
+  return 0;
+}
@@ -24,14 +24,98 @@ do
     chksum="$(sha1sum < $1)"
     test "$chksum" = "$(${TGPG} $1.gpg | sha1sum)" && ok || fail
     test "$chksum" = "$(${TGPG} --mandatory-mdc $1.gpg | sha1sum)" && fail || ok
+    # The plaintext packet of test2 exceeds 1 MiB, thus it is decrypted
+    # in ranges, which need the resynchronization of the old CFB mode.
+    test "$chksum" = "$(${TGPG} --threads 2 $1.gpg | sha1sum)" && ok || fail
     test "$chksum" = "$(${TGPG} --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --key-dir keydir --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --key-cache keydir --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --keystore keystore.bin --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --keytable --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --key-provider --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.gpg.pipe | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc --threads 2 $1.gpg.pipe | sha1sum)" && ok || fail
+    # The plaintext of test2 exceeds 1 MiB, thus its MDC is computed
+    # while the ranges of the partial length body are decrypted and
+    # only compared by _tgpg_check_mdc.
+    test "$chksum" = "$(${TGPG} --mandatory-mdc --threads 4 $1.gpg.pipe | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.gpg.asc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.gpg.zip | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.gpg.zlib | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --passphrase tgpg $1.gpg.sym | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --passphrase wrong $1.gpg.sym | sha1sum)" && fail || ok
+    test "$chksum" = "$(${TGPG} --passphrase tgpg $1.gpg.symesk | sha1sum)" && ok || fail
     test "$chksum" = "$(${TGPG} $1.tgpg | sha1sum)" && ok || fail
     test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.mdc | sha1sum)" && ok || fail
     test "$chksum" = "$(${GPG2} $1.tgpg | sha1sum)" && ok || fail
     test "$chksum" = "$(${GPG2} $1.tgpg.mdc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.zip | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.zlib | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.zip | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.zlib | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.asc | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.partial | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc --threads 2 $1.tgpg.partial | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.partial | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.batch | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.batch | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.envelope | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.envelope | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.ocb | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.gcm | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc --threads 2 $1.tgpg.gcm | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc --threads 1 $1.tgpg.eax | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.anon | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --keystore keystore.bin --mandatory-mdc $1.tgpg.anon | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --keytable --mandatory-mdc $1.tgpg.anon | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --key-dir keydir --mandatory-mdc $1.tgpg.ocb | sha1sum)" && ok || fail
+    # The key cache can't serve anonymous recipients.
+    test "$chksum" = "$(${TGPG} --key-cache keydir --mandatory-mdc $1.tgpg.ocb | sha1sum)" && fail || ok
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.gpg.ecdh | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --keystore keystore.bin --mandatory-mdc $1.gpg.ecdh | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --keytable --mandatory-mdc $1.gpg.ecdh | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.ecdh | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.ecdh | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.cast5 | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.cast5 | sha1sum)" && ok || fail
+    test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.fastest | sha1sum)" && ok || fail
+    test "$chksum" = "$(${GPG2} $1.tgpg.fastest | sha1sum)" && ok || fail
+    if [ "$OPENSSL_TESTS" ]
+    then
+        TGPGO="${TGPG} --backend openssl"
+        test "$chksum" = "$(${TGPGO} $1.gpg | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGO} --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGO} --passphrase tgpg $1.gpg.sym | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGO} --key-dir keydir --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGO} --mandatory-mdc $1.tgpg.ocb | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGO} --mandatory-mdc $1.tgpg.gcm | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGO} --mandatory-mdc $1.gpg.ecdh | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.openssl | sha1sum)" && ok || fail
+        test "$chksum" = "$(${GPG2} $1.tgpg.openssl | sha1sum)" && ok || fail
+    fi
+    if [ "$AFALG_TESTS" ]
+    then
+        TGPGA="${TGPG} --backend afalg"
+        test "$chksum" = "$(${TGPGA} $1.gpg | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGA} --mandatory-mdc $1.gpg.mdc | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGA} --mandatory-mdc --threads 2 $1.gpg.pipe | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPGA} --passphrase tgpg $1.gpg.sym | sha1sum)" && ok || fail
+        test "$chksum" = "$(${TGPG} --mandatory-mdc $1.tgpg.afalg | sha1sum)" && ok || fail
+        test "$chksum" = "$(${GPG2} $1.tgpg.afalg | sha1sum)" && ok || fail
+    fi
     shift
 done
 
+# Decrypt messages for three keys with room for two of them in the key
+# cache.  The least recently used key is evicted, thus the key for
+# test0.gpg.mdc, which is used every other time, is only loaded once.
+# Each message looks up its key twice; the second lookup is a hit.
+test "tgpgtest: key cache: 10 hits, 4 misses, 2 evictions, 2 of 2 keys" = \
+     "$(${TGPG} --verbose --key-cache keydir --cache-size 2 \
+          test0.gpg.mdc test0.gpg.ann test0.gpg.mdc test0.gpg.bob \
+          test0.gpg.mdc test0.gpg.ann test0.gpg.mdc 2>&1 >/dev/null \
+          | grep 'key cache:')" && ok || fail
+
 echo "$tests executed, $failed failed."
 
 exit $failed
@@ -0,0 +1,168 @@
+/* t-s2k.c - Known answer tests for the OpenPGP string-to-key function
+   Copyright (C) 2015 g10 Code GmbH
+
+   This file is part of TGPG.
+
+   TGPG is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   TPGP is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+   MA 02110-1301, USA.  */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tgpg.h>  /* The S2K function is internal, thus we need */
+#include "s2k.h"   /* its header as well.  */
+
+#define PGM "t-s2k"
+
+/* The length of the long passphrase, which exceeds the block of
+   repeated salt and passphrase hashed at once by _tgpg_s2k_hash.  */
+#define LONG_PASSPHRASE_LEN 70000
+
+/* The test vectors were computed with Python's hashlib following
+   RFC-4880, section 3.7.1.  A PASSPHRASE of NULL denotes the long
+   passphrase.  */
+static const struct
+{
+  int algo;
+  int mode;
+  const char *passphrase;
+  unsigned long count;
+  size_t keylen;
+  const char *key;
+} tests[] =
+  {
+    /* Simple S2K, also with a second pass for a longer key.  */
+    { 2 /* SHA1 */, 0, "tgpg", 0, 16,
+      "de5270fb7e7dec982c28a2e95df91df2" },
+    { 2 /* SHA1 */, 0, "tgpg", 0, 32,
+      "de5270fb7e7dec982c28a2e95df91df2"
+      "462d77047147c146ee0839f404d079eb" },
+    /* Salted S2K.  */
+    { 8 /* SHA256 */, 1, "tgpg", 0, 32,
+      "cabf64abcb1c99ed105088b5e0e24b19"
+      "f7840f36071d1d9273357a03715a01fa" },
+    { 2 /* SHA1 */, 1, "tgpg", 0, 24,
+      "c893cca509f25169ff39d71211fa8920f01ee648c952daff" },
+    /* Iterated and salted S2K.  The salt and passphrase do not fit
+       evenly into a block of 64 KiB.  */
+    { 8 /* SHA256 */, 3, "tgpg", 65536, 32,
+      "e21aea689ca683d0a66c97b088d647db"
+      "57f68dc28159999770edbfe128f2edb7" },
+    /* An odd count, which ends in the middle of the passphrase.  */
+    { 8 /* SHA256 */, 3, "tgpg", 100003, 32,
+      "1792218fb302ed8e758c932ffbe72c53"
+      "77868a2a77381597441b3ea17fb86ccb" },
+    /* A count below the length of salt and passphrase, which are
+       hashed once nevertheless.  */
+    { 2 /* SHA1 */, 3, "tgpg", 5, 20,
+      "c893cca509f25169ff39d71211fa8920f01ee648" },
+    /* The salt and passphrase fill the block exactly.  */
+    { 8 /* SHA256 */, 3, "12345678", 196624, 32,
+      "03442e2828c3f1b301f52249997fc8ca"
+      "a3fe51985571330297e09c2f3de69ec9" },
+    /* A passphrase longer than the block.  */
+    { 8 /* SHA256 */, 3, NULL, 300001, 32,
+      "1a31d9b9cd2db1c410486f0cbf5c702a"
+      "1444db6f5929af49324fae0d7496a341" },
+    /* The largest count, with a second pass.  */
+    { 2 /* SHA1 */, 3, "tgpg", 65011712, 32,
+      "f56bb360e7fc36c6554edcd5624a3f71"
+      "a83348599bbef8701ad3555d6b4dbe40" }
+  };
+
+/* Encoded count octets and the number of bytes they denote.  */
+static const struct
+{
+  unsigned int c;
+  unsigned long count;
+} counts[] =
+  {
+    { 0x00, 1024 },
+    { 0x60, 65536 },
+    { 0x96, 720896 },
+    { 0xff, 65011712 }
+  };
+
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned char salt[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  unsigned char key[32];
+  char hex[2 * sizeof key + 1];
+  char *longpass;
+  const char *passphrase;
+  int i, rc;
+  size_t n;
+  int failed = 0;
+
+  rc = tgpg_init (NULL, 0);
+  if (rc)
+    {
+      fprintf (stderr, PGM": initialization failed: %s\n",
+               tgpg_strerror (rc));
+      return 1;
+    }
+
+  for (i = 0; i < sizeof counts / sizeof *counts; i++)
+    if (_tgpg_s2k_decode_count (counts[i].c) != counts[i].count)
+      {
+        fprintf (stderr, PGM": count octet 0x%02x decoded to %lu\n",
+                 counts[i].c, _tgpg_s2k_decode_count (counts[i].c));
+        failed++;
+      }
+
+  longpass = malloc (LONG_PASSPHRASE_LEN + 1);
+  if (!longpass)
+    {
+      fprintf (stderr, PGM": out of core\n");
+      return 1;
+    }
+  for (n = 0; n < LONG_PASSPHRASE_LEN; n++)
+    longpass[n] = 'a' + n % 26;
+  longpass[n] = 0;
+
+  for (i = 0; i < sizeof tests / sizeof *tests; i++)
+    {
+      passphrase = tests[i].passphrase ? tests[i].passphrase : longpass;
+      rc = _tgpg_s2k_hash (passphrase, tests[i].algo, tests[i].mode,
+                           tests[i].mode ? salt : NULL, tests[i].count,
+                           key, tests[i].keylen);
+      if (rc)
+        {
+          fprintf (stderr, PGM": test %d failed: %s\n",
+                   i, tgpg_strerror (rc));
+          failed++;
+          continue;
+        }
+      for (n = 0; n < tests[i].keylen; n++)
+        sprintf (hex + 2 * n, "%02x", key[n]);
+      if (strcmp (hex, tests[i].key))
+        {
+          fprintf (stderr, PGM": test %d failed: got %s\n", i, hex);
+          failed++;
+        }
+    }
+
+  free (longpass);
+  if (failed)
+    fprintf (stderr, PGM": %d tests failed\n", failed);
+  return !!failed;
+}
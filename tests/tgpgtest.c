@@ -40,11 +40,35 @@
 
 /* The keystore is linked in.  */
 extern struct tgpg_key_s keystore[];
+/* The keystore compiled with a perfect hash is linked in as well.  */
+extern const struct tgpg_keytable_s keytable;
 
 static int opt_encrypt;
+static int opt_armor;
+static int opt_max_ratio = -1;
+static int opt_compress_algo;
+static int opt_compress_level = -1;
+static int opt_aead_algo;
+static unsigned int opt_chunk_size;
+static int opt_threads = -1;
+static int opt_batch;
+static unsigned int opt_envelopes;
+static const char *opt_passphrase;
+static const char *opt_key_dir;
+static const char *opt_key_cache;
+static unsigned int opt_cache_size;
+static const char *opt_keystore;
+static int opt_keytable;
+static int opt_key_provider;
+static const char *opt_recipient;
+static int opt_cipher_algo = TGPG_CIPHER_AES256;
+static unsigned int opt_cipher_allowed;
 static int verbose;
 static int debug;
 
+/* The number of keys looked up by provider_lookup.  */
+static int provider_lookups;
+
 
 
 /* Read the file with name FNAME into a buffer and return a pointer to
@@ -144,6 +168,113 @@ read_file (const char *fname, size_t *r_length)
 }
 
 
+/* Set the cipher options from LIST, a comma separated list of the
+   names aes128, aes192, aes256 and cast5, or "fastest" for all of
+   them.  A single name selects that cipher and several names the
+   fastest of them.  */
+static void
+parse_ciphers (const char *list)
+{
+  static const struct
+  {
+    const char *name;
+    int algo;
+  } ciphers[] =
+    {
+      { "aes128", TGPG_CIPHER_AES128 },
+      { "aes192", TGPG_CIPHER_AES192 },
+      { "aes256", TGPG_CIPHER_AES256 },
+      { "cast5",  TGPG_CIPHER_CAST5 }
+    };
+  const char *p;
+  size_t i, n;
+  int count = 0;
+
+  opt_cipher_allowed = 0;
+  for (p = list; *p; p += n + !!p[n])
+    {
+      n = strcspn (p, ",");
+      if (n == 7 && !strncmp (p, "fastest", n))
+        {
+          for (i = 0; i < sizeof ciphers / sizeof *ciphers; i++)
+            opt_cipher_allowed |= TGPG_CIPHER_BIT (ciphers[i].algo);
+          count += 2;
+          continue;
+        }
+      for (i = 0; i < sizeof ciphers / sizeof *ciphers; i++)
+        if (strlen (ciphers[i].name) == n && !strncmp (p, ciphers[i].name, n))
+          break;
+      if (i == sizeof ciphers / sizeof *ciphers)
+        {
+          fprintf (stderr, PGM": unknown cipher `%.*s'\n", (int) n, p);
+          exit (1);
+        }
+      opt_cipher_allowed |= TGPG_CIPHER_BIT (ciphers[i].algo);
+      opt_cipher_algo = ciphers[i].algo;
+      count++;
+    }
+  if (count > 1)
+    opt_cipher_algo = TGPG_CIPHER_FASTEST;
+}
+
+
+/* Report the outcome of loading a key.  */
+static void
+load_cb (void *opaque, const char *fname, int err, unsigned long usec)
+{
+  if (fname && err)
+    fprintf (stderr, PGM": can't load key `%s': %s\n",
+             fname, tgpg_strerror (err));
+  else if (fname && verbose)
+    fprintf (stderr, PGM": key `%s' loaded in %lu.%03lu ms\n",
+             fname, usec / 1000, usec % 1000);
+  else if (!fname && verbose)
+    fprintf (stderr, PGM": keys loaded in %lu.%03lu ms\n",
+             usec / 1000, usec % 1000);
+}
+
+
+/* A key provider serving the linked in keys.  Each key is reported
+   as pending on its first lookup to mimic a key service which fetches
+   keys asynchronously.  OPAQUE counts the lookups.  */
+static int
+provider_lookup (void *opaque, int algo,
+                 unsigned long keyid_high, unsigned long keyid_low,
+                 tgpg_key_t *r_key)
+{
+  int *lookups = opaque;
+  int i;
+
+  for (i = 0; keystore[i].algo; i++)
+    if (keystore[i].algo == algo
+        && ((!keyid_high && !keyid_low)
+            || (keystore[i].keyid_high == keyid_high
+                && keystore[i].keyid_low == keyid_low)))
+      {
+        if (!(*lookups)++)
+          {
+            if (verbose)
+              fprintf (stderr, PGM": fetching key %08lX%08lX\n",
+                       keystore[i].keyid_high, keystore[i].keyid_low);
+            return TGPG_PENDING;
+          }
+        *r_key = &keystore[i];
+        return 0;
+      }
+  return TGPG_NO_SECKEY;
+}
+
+
+/* Release a key returned by provider_lookup.  */
+static void
+provider_release (void *opaque, tgpg_key_t key)
+{
+  if (verbose)
+    fprintf (stderr, PGM": key %08lX%08lX released\n",
+             key->keyid_high, key->keyid_low);
+}
+
+
 static int
 do_decrypt (tgpg_t ctx, tgpg_data_t inpdata, tgpg_data_t outdata)
 {
@@ -158,7 +289,14 @@ do_decrypt (tgpg_t ctx, tgpg_data_t inpdata, tgpg_data_t outdata)
       goto leave;
     }
 
-  if (msgtype == TGPG_MSG_ENCRYPTED)
+  if (msgtype == TGPG_MSG_ENCRYPTED && opt_key_provider)
+    {
+      /* Try again once the key has been fetched.  */
+      while (tgpg_decrypt_batch (ctx, &inpdata, &outdata, &rc, 1)
+             == TGPG_PENDING)
+        ;
+    }
+  else if (msgtype == TGPG_MSG_ENCRYPTED)
     rc = tgpg_decrypt (ctx, inpdata, outdata);
   else
     rc = TGPG_MSG_INVALID;
@@ -167,16 +305,95 @@ do_decrypt (tgpg_t ctx, tgpg_data_t inpdata, tgpg_data_t outdata)
   return rc;
 }
 
+/* Return the linked in key with the key ID KEYID, or the first key
+   if KEYID is NULL.  Returns NULL if there is no such key.  */
+static tgpg_key_t
+find_recipient (const char *keyid)
+{
+  char high[9];
+  int i;
+
+  if (!keyid)
+    return &keystore[0];
+  if (strlen (keyid) != 16)
+    return NULL;
+  memcpy (high, keyid, 8);
+  high[8] = 0;
+  for (i = 0; keystore[i].algo; i++)
+    if (keystore[i].keyid_high == strtoul (high, NULL, 16)
+        && keystore[i].keyid_low == strtoul (keyid + 8, NULL, 16))
+      return &keystore[i];
+  return NULL;
+}
+
 static int
 do_encrypt (tgpg_t ctx, tgpg_data_t inpdata, tgpg_data_t outdata)
 {
   int rc;
+  int i;
+  tgpg_data_t *plains = NULL;
+  tgpg_data_t *ciphers = NULL;
+  int *results = NULL;
+  tgpg_key_t key = find_recipient (opt_recipient);
 
-  rc = tgpg_encrypt (ctx, inpdata, &keystore[0], outdata);
-  if (rc)
-    goto leave;
+  if (!key)
+    {
+      fprintf (stderr, PGM": no key for recipient `%s'\n", opt_recipient);
+      return TGPG_NO_PUBKEY;
+    }
+
+  if (opt_envelopes)
+    {
+      rc = tgpg_set_envelope_pool (ctx, key, opt_envelopes);
+      if (rc)
+        {
+          fprintf (stderr, PGM": can't set envelope pool: %s\n",
+                   tgpg_strerror (rc));
+          return rc;
+        }
+    }
+
+  if (opt_batch <= 1)
+    {
+      rc = tgpg_encrypt (ctx, inpdata, key, outdata);
+      goto leave;
+    }
+
+  /* Encrypt the input OPT_BATCH times in one batch; the last message
+     is written out.  */
+  plains = calloc (opt_batch, sizeof *plains);
+  ciphers = calloc (opt_batch, sizeof *ciphers);
+  results = calloc (opt_batch, sizeof *results);
+  if (!plains || !ciphers || !results)
+    {
+      rc = TGPG_SYSERROR;
+      goto leave;
+    }
+  for (i = 0; i < opt_batch; i++)
+    {
+      plains[i] = inpdata;
+      if (i + 1 == opt_batch)
+        ciphers[i] = outdata;
+      else
+        {
+          rc = tgpg_data_new (&ciphers[i]);
+          if (rc)
+            goto leave;
+        }
+    }
+
+  rc = tgpg_encrypt_batch (ctx, plains, key, ciphers, results,
+                           opt_batch);
+  for (i = 0; !rc && i < opt_batch; i++)
+    rc = results[i];
 
  leave:
+  if (ciphers)
+    for (i = 0; i + 1 < opt_batch; i++)
+      tgpg_data_release (ciphers[i]);
+  free (plains);
+  free (ciphers);
+  free (results);
   return rc;
 }
 
@@ -220,6 +437,41 @@ process_file (const char *fname)
                tgpg_strerror (rc));
       goto leave;
     }
+  tgpg_set_armor (ctx, opt_armor);
+  if (opt_key_provider)
+    tgpg_set_key_provider (ctx, provider_lookup, provider_release,
+                           &provider_lookups);
+  if (opt_max_ratio >= 0)
+    tgpg_set_max_ratio (ctx, opt_max_ratio);
+  rc = tgpg_set_compression (ctx, opt_compress_algo, opt_compress_level);
+  if (rc)
+    {
+      fprintf (stderr, PGM": can't set compression: %s\n",
+               tgpg_strerror (rc));
+      goto leave;
+    }
+  rc = tgpg_set_aead (ctx, opt_aead_algo, opt_chunk_size);
+  if (rc)
+    {
+      fprintf (stderr, PGM": can't set AEAD algorithm: %s\n",
+               tgpg_strerror (rc));
+      goto leave;
+    }
+  rc = tgpg_set_cipher (ctx, opt_cipher_algo, opt_cipher_allowed);
+  if (rc)
+    {
+      fprintf (stderr, PGM": can't set cipher: %s\n", tgpg_strerror (rc));
+      goto leave;
+    }
+  if (opt_threads >= 0)
+    tgpg_set_threads (ctx, opt_threads);
+  rc = tgpg_set_passphrase (ctx, opt_passphrase);
+  if (rc)
+    {
+      fprintf (stderr, PGM": can't set passphrase: %s\n",
+               tgpg_strerror (rc));
+      goto leave;
+    }
 
   rc = (opt_encrypt ? do_encrypt : do_decrypt) (ctx, inpdata, outdata);
   if (rc)
@@ -266,15 +518,38 @@ main (int argc, char **argv)
       else if (!strcmp (*argv, "--help"))
         {
           puts (
-                "Usage: " PGM " [OPTION] [FILE]\n"
+                "Usage: " PGM " [OPTION] [FILE...]\n"
                 "Simple tool to test TGPG.\n\n"
                 "  --encrypt   encrypt rather than decrypt (the default)\n"
+                "  --armor     create ASCII armored output\n"
+                "  --recipient KEYID encrypt for the linked in key KEYID\n"
+                "  --cipher NAMES encrypt using aes128, aes192, aes256 or cast5,\n"
+                "              or the fastest of several or all (fastest)\n"
+                "  --aead NAME encrypt using AEAD with ocb, gcm or eax\n"
+                "  --chunk-size N use AEAD chunks of N bytes\n"
+                "  --threads N use N threads for AEAD and large messages\n"
+                "              (0 = one per CPU, default 1)\n"
+                "  --batch N   encrypt the input N times in one batch\n"
+                "  --envelopes N keep N session keys for the recipient ready\n"
+                "  --compress-algo NAME compress using zip or zlib\n"
+                "  --compress-level N use compression level N (1-9)\n"
                 "  --disable-mdc do not use MDC for encryption\n"
+                "  --small-partial write packets in partial length chunks of 512 bytes\n"
                 "  --mandatory-mdc make MDC mandatory for decryption\n"
+                "  --backend NAME use the crypto backend gcrypt, openssl or afalg\n"
+                "  --max-ratio N limit the decompression ratio (0 = no limit)\n"
+                "  --passphrase STRING decrypt symmetric messages using STRING\n"
+                "  --key-dir DIR use the keys in DIR unprotected using the passphrase\n"
+                "  --key-cache DIR load the keys in DIR when needed\n"
+                "  --cache-size N keep at most N keys in the key cache\n"
+                "  --keystore FILE use the keys in the binary keystore FILE\n"
+                "  --keytable  use the keys compiled with a perfect hash\n"
+                "  --key-provider get the linked in keys from a key provider\n"
                 "  --verbose   enable extra informational output\n"
                 "  --debug     enable additional debug output\n"
                 "  --help      display this help and exit\n\n"
-                "With no FILE, or when FILE is -, read standard input.\n\n"
+                "With no FILE, or when FILE is -, read standard input.  Several\n"
+                "FILEs are decrypted in turn.\n\n"
                 "Report bugs to <" PACKAGE_BUGREPORT ">.");
           exit (0);
         }
@@ -283,16 +558,214 @@ main (int argc, char **argv)
           opt_encrypt = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--recipient"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_recipient = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--armor"))
+        {
+          opt_armor = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--cipher"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              parse_ciphers (*argv);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--aead"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              if (!strcmp (*argv, "ocb"))
+                opt_aead_algo = TGPG_AEAD_OCB;
+              else if (!strcmp (*argv, "gcm"))
+                opt_aead_algo = TGPG_AEAD_GCM;
+              else if (!strcmp (*argv, "eax"))
+                opt_aead_algo = TGPG_AEAD_EAX;
+              else if (!strcmp (*argv, "none"))
+                opt_aead_algo = TGPG_AEAD_NONE;
+              else
+                {
+                  fprintf (stderr, PGM": unknown AEAD algorithm `%s'\n",
+                           *argv);
+                  exit (1);
+                }
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--chunk-size"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_chunk_size = strtoul (*argv, NULL, 10);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--threads"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_threads = atoi (*argv);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--batch"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_batch = atoi (*argv);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--envelopes"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_envelopes = atoi (*argv);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--compress-algo"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              if (!strcmp (*argv, "zip"))
+                opt_compress_algo = TGPG_COMPRESS_ZIP;
+              else if (!strcmp (*argv, "zlib"))
+                opt_compress_algo = TGPG_COMPRESS_ZLIB;
+              else if (!strcmp (*argv, "none"))
+                opt_compress_algo = TGPG_COMPRESS_NONE;
+              else
+                {
+                  fprintf (stderr, PGM": unknown compression algorithm `%s'\n",
+                           *argv);
+                  exit (1);
+                }
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--compress-level"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_compress_level = atoi (*argv);
+              argc--; argv++;
+            }
+        }
       else if (!strcmp (*argv, "--disable-mdc"))
         {
           flags |= TGPG_FLAG_DISABLE_MDC;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--small-partial"))
+        {
+          flags |= TGPG_FLAG_SMALL_PARTIAL;
+          argc--; argv++;
+        }
       else if (!strcmp (*argv, "--mandatory-mdc"))
         {
           flags |= TGPG_FLAG_MANDATORY_MDC;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--backend"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              flags &= ~(TGPG_FLAG_BACKEND_OPENSSL | TGPG_FLAG_BACKEND_AFALG);
+              if (!strcmp (*argv, "openssl"))
+                flags |= TGPG_FLAG_BACKEND_OPENSSL;
+              else if (!strcmp (*argv, "afalg"))
+                flags |= TGPG_FLAG_BACKEND_AFALG;
+              else if (strcmp (*argv, "gcrypt"))
+                {
+                  fprintf (stderr, PGM": unknown crypto backend `%s'\n",
+                           *argv);
+                  exit (1);
+                }
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--max-ratio"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_max_ratio = atoi (*argv);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--passphrase"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_passphrase = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--key-dir"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_key_dir = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--key-cache"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_key_cache = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--cache-size"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_cache_size = atoi (*argv);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--keystore"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_keystore = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--key-provider"))
+        {
+          opt_key_provider = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--keytable"))
+        {
+          opt_keytable = 1;
+          argc--; argv++;
+        }
       else if (!strcmp (*argv, "--verbose"))
         {
           verbose = 1;
@@ -305,21 +778,74 @@ main (int argc, char **argv)
         }
     }
 
-  if (argc > 1)
+  if (argc > 1 && opt_encrypt)
     {
       fprintf (stderr, "usage: " PGM
                " [OPTION] [FILE] (try --help for more information)\n");
       exit (1);
     }
 
-  err = tgpg_init (keystore, flags);
+  /* Do not use the linked in keys for decryption if we load keys.  */
+  err = tgpg_init ((opt_key_dir || opt_key_cache || opt_keystore
+                    || opt_keytable || opt_key_provider)
+                   && !opt_encrypt ? NULL : keystore, flags);
   if (err)
-    exit (1);
+    {
+      fprintf (stderr, PGM": initialization failed: %s\n",
+               tgpg_strerror (err));
+      exit (1);
+    }
+  if (verbose)
+    fprintf (stderr, PGM": using the %s crypto backend\n",
+             tgpg_crypto_backend ());
+
+  if (opt_keytable)
+    tgpg_set_keytable (&keytable);
+
+  if (opt_keystore)
+    {
+      err = tgpg_map_keystore (opt_keystore);
+      if (err)
+        {
+          fprintf (stderr, PGM": can't map keystore `%s': %s\n",
+                   opt_keystore, tgpg_strerror (err));
+          exit (1);
+        }
+    }
+
+  if (opt_key_dir)
+    {
+      err = tgpg_load_keys (opt_key_dir, opt_passphrase,
+                            opt_threads >= 0 ? opt_threads : 0,
+                            load_cb, NULL);
+      if (err)
+        exit (1);
+    }
+
+  if (opt_key_cache)
+    {
+      err = tgpg_set_key_cache (opt_key_cache, opt_passphrase,
+                                opt_cache_size);
+      if (err)
+        exit (1);
+    }
 
   if (argc)
-    err = process_file (*argv);
+    for (; argc && !err; argc--, argv++)
+      err = process_file (*argv);
   else
     err = process_file ("-");
 
+  if (opt_key_cache && verbose)
+    {
+      struct tgpg_key_cache_stats_s stats;
+
+      tgpg_get_key_cache_stats (&stats);
+      fprintf (stderr, PGM": key cache: %lu hits, %lu misses,"
+               " %lu evictions, %u of %u keys\n",
+               stats.hits, stats.misses, stats.evictions,
+               stats.used, stats.capacity);
+    }
+
   return err ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -33,12 +33,23 @@
 
 #include <gcrypt.h>
 
+#include "keyfile.h"
+
 #define PGM "tgpg-keystore"
 #define DIM(v)		     (sizeof(v)/sizeof((v)[0]))
+
+/* The OpenPGP public key algorithms of the keys we write.  */
+#define PK_ALGO_RSA	1
+#define PK_ALGO_ECDH	18
+
+/* The length of a v4 fingerprint.  */
+#define FPR_LEN		20
 
 static const char *name = "keystore";
 static int verbose;
 static int debug;
+static int binary;
+static int perfect_hash;
 static FILE *stream;
 
 /* Read the file with name FNAME into a buffer and return a pointer to
@@ -139,15 +150,34 @@ read_file (const char *fname, size_t *r_length)
 
 struct keyid {
   unsigned long high, low;
+  int have_fpr;
+  unsigned char fpr[FPR_LEN];       /* The v4 fingerprint if given.  */
 };
 
+/* Parse the key ID or v4 fingerprint S into ID.  The key ID is the
+   low order 64 bits of the fingerprint.  */
 int
 parse_keyid (const char *s, struct keyid *id)
 {
   char buf[9];
   char *endptr;
+  int i;
 
-  if (strlen (s) != 16)
+  memset (id, 0, sizeof *id);
+  if (strlen (s) == 2 * FPR_LEN)
+    {
+      for (i = 0; i < FPR_LEN; i++)
+        {
+          strncpy (buf, s + 2 * i, 2);
+          buf[2] = 0;
+          id->fpr[i] = strtoul (buf, &endptr, 16);
+          if (*endptr != 0)
+            goto errout;
+        }
+      id->have_fpr = 1;
+      s += 2 * FPR_LEN - 16;
+    }
+  else if (strlen (s) != 16)
     goto errout;
 
   strncpy (buf, s, 8);
@@ -171,22 +201,156 @@ parse_keyid (const char *s, struct keyid *id)
 
 
 
-static void
-process_file (const struct keyid *keyid, const char *fname, FILE *stream)
+/* A secret key read from a private key file.  The values of the
+   MPIs are normalized to the size of the key.  */
+struct key
+{
+  struct keyid id;
+  int algo;                         /* PK_ALGO_RSA or PK_ALGO_ECDH.  */
+  unsigned char *values[KEYFILE_NMPIS];
+  size_t lengths[KEYFILE_NMPIS];
+  unsigned char *sexp;              /* The canonical S-expression.  */
+  size_t sexplen;
+  size_t datalen;                   /* SEXP and the values not in it.  */
+  size_t offsets[KEYFILE_NMPIS];    /* The offsets of the values in it.  */
+};
+
+/* The names of the MPIs of an RSA key and the amount by which the
+   size of the key needs to be shifted to get their size.  */
+static const char keys[] = "nedpqu";
+static const int shifts[] = {0, 0, 0, 1, 1, 1};
+
+/* The names of the MPIs of the keys of each algorithm as printed in
+   the generated source.  See src/tgpg.h for the layout.  */
+static const char *const rsa_names[KEYFILE_NMPIS] =
+  { "n", "e", "d", "p", "q", "u" };
+static const char *const ecdh_names[KEYFILE_NMPIS] =
+  { "oid", "q", "kdf", "d", "fpr", "-" };
+
+/* The OID of Curve25519 and the KDF parameters we assume for ECDH
+   keys, which are those used by GnuPG: SHA256 and AES128.  The KDF
+   parameters are part of the public key and can't be taken from the
+   private key file.  */
+static const unsigned char oid_curve25519[] =
+  { 0x2b, 0x06, 0x01, 0x04, 0x01, 0x97, 0x55, 0x01, 0x05, 0x01 };
+static const unsigned char ecdh_kdf[] = { 3, 1, 8 /* SHA256 */, 7 /* AES */ };
+
+
+/* Return the name of the algorithm of KEY as used in the library.  */
+static const char *
+algo_name (const struct key *key)
+{
+  return key->algo == PK_ALGO_ECDH ? "PK_ALGO_ECDH" : "PK_ALGO_RSA";
+}
+
+/* Return the names of the MPIs of KEY.  */
+static const char *const *
+mpi_names (const struct key *key)
+{
+  return key->algo == PK_ALGO_ECDH ? ecdh_names : rsa_names;
+}
+
+
+/* Store a copy of the LENGTH bytes at DATA as the value with index I
+   of KEY, left padded with zeroes to SIZE bytes.  Returns 0 on
+   success or an error code.  */
+static gcry_error_t
+set_value (struct key *key, int i, const void *data, size_t length,
+           size_t size)
+{
+  if (length > size)
+    return gcry_error (GPG_ERR_INV_VALUE);
+  key->values[i] = calloc (size ? size : 1, 1);
+  if (!key->values[i])
+    return gcry_error_from_errno (errno);
+  key->lengths[i] = size;
+  memcpy (key->values[i] + size - length, data, length);
+  return 0;
+}
+
+
+/* Read the Curve25519 key in SEXP for use with ECDH into KEY, whose
+   ID must carry the fingerprint.  Returns 0 on success or an error
+   code.  */
+static gcry_error_t
+read_ecdh_key (gcry_sexp_t sexp, struct key *key)
+{
+  gcry_sexp_t list;
+  const char *data;
+  size_t len;
+  gcry_error_t err;
+
+  key->algo = PK_ALGO_ECDH;
+  if (!key->id.have_fpr)
+    {
+      fprintf (stderr, PGM": ECDH keys need to be given by fingerprint\n");
+      return gcry_error (GPG_ERR_INV_ARG);
+    }
+
+  list = gcry_sexp_find_token (sexp, "curve", 0);
+  data = list ? gcry_sexp_nth_data (list, 1, &len) : NULL;
+  if (!data || len != 10 || memcmp (data, "Curve25519", 10))
+    {
+      gcry_sexp_release (list);
+      return gcry_error (GPG_ERR_UNKNOWN_CURVE);
+    }
+  gcry_sexp_release (list);
+
+  err = set_value (key, 0, oid_curve25519, sizeof oid_curve25519,
+                   sizeof oid_curve25519);
+  if (!err)
+    err = set_value (key, 2, ecdh_kdf, sizeof ecdh_kdf, sizeof ecdh_kdf);
+  if (!err)
+    err = set_value (key, 4, key->id.fpr, FPR_LEN, FPR_LEN);
+  if (!err)
+    err = set_value (key, 5, NULL, 0, 0);
+  if (err)
+    return err;
+
+  /* The public point is 0x40 followed by the X coordinate; the secret
+     scalar is stored with its full 32 bytes.  */
+  list = gcry_sexp_find_token (sexp, "q", 0);
+  data = list ? gcry_sexp_nth_data (list, 1, &len) : NULL;
+  if (!data || len != 33 || data[0] != 0x40)
+    err = gcry_error (GPG_ERR_INV_VALUE);
+  else
+    err = set_value (key, 1, data, len, len);
+  gcry_sexp_release (list);
+  if (err)
+    return err;
+
+  list = gcry_sexp_find_token (sexp, "d", 0);
+  data = list ? gcry_sexp_nth_data (list, 1, &len) : NULL;
+  if (!data)
+    err = gcry_error (GPG_ERR_INV_VALUE);
+  else
+    err = set_value (key, 3, data, len, 32);
+  gcry_sexp_release (list);
+  return err;
+}
+
+
+/* Read the secret key for KEYID from the file FNAME into KEY.  RSA
+   keys and Curve25519 keys for ECDH are supported.  Returns 0 on
+   success or prints a diagnostic.  */
+static int
+read_key (const struct keyid *keyid, const char *fname, struct key *key)
 {
   char *inpfile;
   size_t inplen;
-  gcry_sexp_t sexp = NULL;
+  gcry_sexp_t sexp = NULL, list;
   gcry_error_t err;
   unsigned int keysize;
-  const char *keys = "nedpqu";
-  const int shifts[] = {0, 0, 0, 1, 1, 1};
   gcry_mpi_t mpis[7] = {};
+  size_t len, size;
   int i;
 
+  memset (key, 0, sizeof *key);
+  key->id = *keyid;
+
   inpfile = read_file (fname, &inplen);
   if (!inpfile)
-    goto leave;
+    return 1;
   if (verbose)
     fprintf (stderr, PGM": file `%s' of size %lu read\n",
              fname, (unsigned long)inplen);
@@ -195,6 +359,15 @@ process_file (const struct keyid *keyid, const char *fname, FILE *stream)
   if (err)
     goto leave;
 
+  list = gcry_sexp_find_token (sexp, "ecc", 0);
+  if (list)
+    {
+      gcry_sexp_release (list);
+      err = read_ecdh_key (sexp, key);
+      goto leave;
+    }
+  key->algo = PK_ALGO_RSA;
+
   err = gcry_sexp_extract_param (sexp, "private-key", keys,
 				 &mpis[0],
 				 &mpis[1],
@@ -208,94 +381,478 @@ process_file (const struct keyid *keyid, const char *fname, FILE *stream)
 
   keysize = gcry_pk_get_nbits (sexp);
 
+  for (i = 0; i < KEYFILE_NMPIS; i++)
+    {
+      err = gcry_mpi_print (GCRYMPI_FMT_USG, NULL, 0, &len, mpis[i]);
+      if (err)
+        goto leave;
+
+      /* Fill up with leading zeroes.  */
+      size = keys[i] == 'e' ? len : keysize >> (3 + shifts[i]);
+      if (size < len)
+        {
+          err = gcry_error (GPG_ERR_INV_VALUE);
+          goto leave;
+        }
+      key->values[i] = calloc (size ? size : 1, 1);
+      if (!key->values[i])
+        {
+          err = gcry_error_from_errno (errno);
+          goto leave;
+        }
+      key->lengths[i] = size;
+      err = gcry_mpi_print (GCRYMPI_FMT_USG, key->values[i] + size - len,
+                            len, NULL, mpis[i]);
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  if (err)
+    fprintf (stderr, PGM": can't read key from `%s': %s\n",
+             fname, gcry_strerror (err));
+  free (inpfile);
+  gcry_sexp_release (sexp);
+  for (i = 0; i < DIM (mpis); i++)
+    gcry_mpi_release (mpis[i]);
+  return !!err;
+}
+
+
+/* Print the LENGTH bytes at DATA as a C string literal to STREAM,
+   using lines of 8 bytes indented by INDENT.  */
+static void
+print_bytes (const unsigned char *data, size_t length, const char *indent,
+             FILE *stream)
+{
+  size_t j;
+
+  fprintf (stream, "\"");
+  for (j = 0; j < length; j++)
+    {
+      if (j > 0 && j % 8 == 0)
+        fprintf (stream, "\"\n%s\"", indent);
+
+      fprintf (stream, "\\x%02X", data[j]);
+    }
+  fprintf (stream, "\"");
+}
+
+
+/* Print KEY as an element of a C array to STREAM.  */
+static void
+print_key (const struct key *key, FILE *stream)
+{
+  int i;
+
   fprintf (stream,
            "  {\n"
-           "    1 /* PK_ALGO_RSA */, 0x%08lx, 0x%08lx,\n"
+           "    %d /* %s */, 0x%08lx, 0x%08lx,\n"
            "    {\n",
-           keyid->high, keyid->low);
+           key->algo, algo_name (key), key->id.high, key->id.low);
 
-  for (i = 0; i < 6; i++)
+  for (i = 0; i < KEYFILE_NMPIS; i++)
     {
-      unsigned char *buf, *data;
-      int size_delta;
-      size_t len;
+#define INDENT	"        "
+      fprintf (stream,
+               "      { /* %s: */ %u /* bits */, %u /* bytes */,\n"
+               INDENT,
+               mpi_names (key)[i], (unsigned int) key->lengths[i] << 3,
+               (unsigned int) key->lengths[i]);
 
-      err = gcry_mpi_aprint (GCRYMPI_FMT_HEX, &buf, &len, mpis[i]);
-      if (err)
-	goto leave;
+      print_bytes (key->values[i], key->lengths[i], INDENT, stream);
+#undef INDENT
 
-      data = buf;
-      len -= 1;	/* trailing zero */
-      assert (len % 2 == 0);
+      fprintf (stream, " },\n");
+    }
 
-      if (keys[i] != 'e')
-        {
-          /* Normalize data.  */
-          size_delta = (keysize >> (3 + shifts[i])) - (len / 2);
+  fprintf (stream,
+           "    },\n"
+           "  },\n");
+}
 
-          /* Skip leading zeroes.  */
-          while (size_delta < 0
-                 && strncmp ((const char *) data, "00", 2) == 0)
-            data += 2, len -= 2;
 
-          /* Fill up with leading zeroes.  */
-          if (size_delta > 0)
-            {
-              size_t new_len = keysize >> (3 + shifts[i] - 1 /* hex */);
-              char *p, *new = malloc (new_len);
-              if (! new)
-                goto leave;
+/* Compare two keys by their key IDs.  */
+static int
+compare_keys (const void *a, const void *b)
+{
+  const struct keyid *x = &((const struct key *) a)->id;
+  const struct keyid *y = &((const struct key *) b)->id;
 
-              fprintf (stderr, "%d %d\n", size_delta, 0);
-              for (p = new; p - new < size_delta * 2 /* hex */; p++)
-                *p = '0';
+  if (x->high != y->high)
+    return x->high < y->high ? -1 : 1;
+  if (x->low != y->low)
+    return x->low < y->low ? -1 : 1;
+  return 0;
+}
 
-              memcpy (p, data, len);
-              free (buf);
 
-              buf = data = new, len = new_len;
+/* Sort the NKEYS keys at KEYS by their key IDs.  Returns 0 on success
+   or prints a diagnostic if a key ID is not unique.  */
+static int
+sort_keys (struct key *keys, size_t nkeys)
+{
+  size_t k;
+
+  qsort (keys, nkeys, sizeof *keys, compare_keys);
+  for (k = 1; k < nkeys; k++)
+    if (!compare_keys (&keys[k - 1], &keys[k]))
+      {
+        fprintf (stderr, PGM": duplicate key id %08lX%08lX\n",
+                 keys[k].id.high, keys[k].id.low);
+        return 1;
+      }
+  return 0;
+}
+
+
+/* Round N up to the alignment of values in binary keystores.  */
+#define KEYFILE_ROUND(n) (((n) + KEYFILE_ALIGN - 1) \
+                          & ~(size_t)(KEYFILE_ALIGN - 1))
+
+/* Write the NKEYS keys at KEYS as a binary keystore to STREAM.  The
+   keys are sorted by key ID.  Returns 0 on success or prints a
+   diagnostic.  See src/keyfile.h for a description of the format.  */
+static int
+write_binary (struct key *keys, size_t nkeys, FILE *stream)
+{
+  static const char zeroes[KEYFILE_ALIGN];
+  struct keyfile_header_s hdr;
+  struct keyfile_entry_s entry;
+  size_t k, offset, pos;
+  int i;
+
+  if (sort_keys (keys, nkeys))
+    return 1;
+
+#ifdef HAVE_DOSISH_SYSTEM
+  setmode (fileno (stream), O_BINARY);
+#endif
+
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, KEYFILE_MAGIC, sizeof hdr.magic);
+  hdr.version = KEYFILE_VERSION;
+  hdr.bom = KEYFILE_BOM;
+  hdr.nkeys = nkeys;
+  fwrite (&hdr, sizeof hdr, 1, stream);
+
+  /* Write the index.  */
+  pos = sizeof hdr + nkeys * sizeof entry;
+  offset = KEYFILE_ROUND (pos);
+  for (k = 0; k < nkeys; k++)
+    {
+      memset (&entry, 0, sizeof entry);
+      entry.keyid_high = keys[k].id.high;
+      entry.keyid_low = keys[k].id.low;
+      entry.algo = keys[k].algo;
+      for (i = 0; i < KEYFILE_NMPIS; i++)
+        {
+          if (offset + keys[k].lengths[i] > (uint32_t)-1)
+            {
+              fprintf (stderr, PGM": keystore too large\n");
+              return 1;
             }
-          size_delta = (keysize >> (3 + shifts[i])) - (len / 2);
-          assert (size_delta == 0);
+          entry.mpis[i].offset = offset;
+          entry.mpis[i].length = keys[k].lengths[i];
+          entry.mpis[i].nbits = keys[k].lengths[i] << 3;
+          offset = KEYFILE_ROUND (offset + keys[k].lengths[i]);
         }
+      fwrite (&entry, sizeof entry, 1, stream);
+    }
 
-#define INDENT	"        "
-      fprintf (stream,
-               "      { /* %c: */ %u /* bits */, %u /* bytes */,\n"
-               INDENT "\"",
-               keys[i], len << 2, len / 2);
+  /* Write the values.  */
+  for (k = 0; k < nkeys; k++)
+    for (i = 0; i < KEYFILE_NMPIS; i++)
+      {
+        fwrite (zeroes, KEYFILE_ROUND (pos) - pos, 1, stream);
+        pos = KEYFILE_ROUND (pos);
+        fwrite (keys[k].values[i], keys[k].lengths[i], 1, stream);
+        pos += keys[k].lengths[i];
+      }
+
+  if (fflush (stream) || ferror (stream))
+    {
+      fprintf (stderr, PGM": error writing keystore: %s\n",
+               strerror (errno));
+      return 1;
+    }
+  return 0;
+}
+
+/* Append the value with index I of KEY to the S-expression at *P
+   as an element named NAME, or as a bare value if NAME is NULL, and
+   advance *P accordingly.  */
+static void
+append_value (struct key *key, int i, const char *name, char **p)
+{
+  if (name)
+    *p += sprintf (*p, "(%u:%s%u:", (unsigned int) strlen (name), name,
+                   (unsigned int) key->lengths[i]);
+  key->offsets[i] = *p - (char *) key->sexp;
+  memcpy (*p, key->values[i], key->lengths[i]);
+  *p += key->lengths[i];
+  if (name)
+    *(*p)++ = ')';
+}
 
-      const unsigned char *c;
-      for (c = data; c - data < len; c += 2)
+/* Build the canonical S-expression of KEY in the form built by the
+   crypto backend of TGPG and store it at KEY->SEXP.  The values of
+   an ECDH key which are not part of the S-expression are appended to
+   it.  Returns 0 on success or prints a diagnostic.  */
+static int
+build_sexp (struct key *key)
+{
+  size_t size;
+  char *p;
+  int i;
+
+  size = 96;
+  for (i = 0; i < KEYFILE_NMPIS; i++)
+    size += key->lengths[i] + 32;
+  key->sexp = malloc (size);
+  if (!key->sexp)
+    {
+      fprintf (stderr, PGM": malloc failed: %s\n", strerror (errno));
+      return 1;
+    }
+
+  p = (char *) key->sexp;
+  if (key->algo == PK_ALGO_ECDH)
+    {
+      p += sprintf (p, "(11:private-key(3:ecc(5:curve10:Curve25519)"
+                    "(5:flags9:djb-tweak)");
+      append_value (key, 1, "q", &p);
+      append_value (key, 3, "d", &p);
+    }
+  else
+    {
+      p += sprintf (p, "(11:private-key(3:rsa");
+      for (i = 0; i < KEYFILE_NMPIS; i++)
+        append_value (key, i, rsa_names[i], &p);
+    }
+  *p++ = ')';
+  *p++ = ')';
+  key->sexplen = p - (char *) key->sexp;
+
+  if (key->algo == PK_ALGO_ECDH)
+    {
+      append_value (key, 0, NULL, &p);
+      append_value (key, 2, NULL, &p);
+      append_value (key, 4, NULL, &p);
+      append_value (key, 5, NULL, &p);
+    }
+  key->datalen = p - (char *) key->sexp;
+  return 0;
+}
+
+
+/* We give up if no displacement below this value places all keys of
+   a bucket.  */
+#define MAX_DISPLACEMENT (1 << 20)
+
+/* Marks an unused slot.  */
+#define NO_SLOT ((size_t) -1)
+
+/* The bucket of each key and the size of each bucket while computing
+   the perfect hash.  */
+static uint32_t *key_buckets;
+static size_t *bucket_sizes;
+
+/* Compare two key indices by the size of their bucket (largest
+   first) and by their bucket.  */
+static int
+compare_buckets (const void *a, const void *b)
+{
+  uint32_t x = key_buckets[*(const size_t *) a];
+  uint32_t y = key_buckets[*(const size_t *) b];
+
+  if (bucket_sizes[x] != bucket_sizes[y])
+    return bucket_sizes[x] > bucket_sizes[y] ? -1 : 1;
+  if (x != y)
+    return x < y ? -1 : 1;
+  return 0;
+}
+
+
+/* Compute a minimal perfect hash for the NKEYS keys at KEYS using
+   NBUCKETS buckets as described in src/keyfile.h.  Store the
+   displacement of each bucket at DISP and the index of the key in
+   each slot at SLOTS.  Returns 0 on success or prints a
+   diagnostic.  */
+static int
+compute_perfect_hash (const struct key *keys, size_t nkeys, size_t nbuckets,
+                      unsigned int *disp, size_t *slots)
+{
+  size_t *order = NULL;
+  size_t i, j, k, end, slot;
+  uint32_t d;
+  int rc = 1;
+
+  key_buckets = calloc (nkeys, sizeof *key_buckets);
+  bucket_sizes = calloc (nbuckets, sizeof *bucket_sizes);
+  order = calloc (nkeys, sizeof *order);
+  if (!key_buckets || !bucket_sizes || !order)
+    {
+      fprintf (stderr, PGM": malloc failed: %s\n", strerror (errno));
+      goto leave;
+    }
+
+  for (k = 0; k < nkeys; k++)
+    {
+      key_buckets[k] = (keyfile_hash (keys[k].id.high, keys[k].id.low, 0)
+                        % nbuckets);
+      bucket_sizes[key_buckets[k]]++;
+      order[k] = k;
+      slots[k] = NO_SLOT;
+    }
+
+  /* Place the keys of the largest buckets first, while there are
+     still many free slots.  */
+  qsort (order, nkeys, sizeof *order, compare_buckets);
+  for (i = 0; i < nkeys; i = end)
+    {
+      for (end = i + 1;
+           end < nkeys && key_buckets[order[end]] == key_buckets[order[i]];
+           end++)
+        ;
+
+      for (d = 1; d < MAX_DISPLACEMENT; d++)
         {
-          ptrdiff_t d = c - data;
-          if (d > 0 && d % 16 == 0)
-            fprintf (stream, "\"\n" INDENT "\"");
+          for (j = i; j < end; j++)
+            {
+              slot = (keyfile_hash (keys[order[j]].id.high,
+                                    keys[order[j]].id.low, d) % nkeys);
+              if (slots[slot] != NO_SLOT)
+                break;
+              slots[slot] = order[j];
+            }
+          if (j == end)
+            break;
 
-          fprintf (stream, "\\x%.2s", c);
+          /* Release the slots taken by this attempt.  */
+          while (j-- > i)
+            slots[keyfile_hash (keys[order[j]].id.high,
+                                keys[order[j]].id.low, d) % nkeys] = NO_SLOT;
         }
-#undef INDENT
+      if (d == MAX_DISPLACEMENT)
+        {
+          fprintf (stderr, PGM": can't compute a perfect hash\n");
+          goto leave;
+        }
+      disp[key_buckets[order[i]]] = d;
+    }
+  rc = 0;
+
+ leave:
+  free (order);
+  free (bucket_sizes);
+  free (key_buckets);
+  bucket_sizes = NULL;
+  key_buckets = NULL;
+  return rc;
+}
 
-      fprintf (stream, "\" },\n");
 
-      free (buf);
+/* Write the NKEYS keys at KEYLIST as C source for a keystore with a
+   minimal perfect hash of the key IDs (struct tgpg_keytable_s) to
+   STREAM.  The canonical S-expression of each key is emitted as well,
+   so that the library can pass the keys on without preparing them.
+   Returns 0 on success or prints a diagnostic.  */
+static int
+write_perfect_hash (struct key *keylist, size_t nkeys, FILE *stream)
+{
+  size_t nbuckets = (nkeys + 1) / 2;
+  unsigned int *disp;
+  size_t *slots;
+  size_t i;
+  const struct key *key;
+  int k, rc = 1;
+
+  if (sort_keys (keylist, nkeys))
+    return 1;
+
+  disp = calloc (nbuckets, sizeof *disp);
+  slots = calloc (nkeys, sizeof *slots);
+  if (!disp || !slots)
+    {
+      fprintf (stderr, PGM": malloc failed: %s\n", strerror (errno));
+      goto leave;
     }
+  for (i = 0; i < nkeys; i++)
+    if (build_sexp (&keylist[i]))
+      goto leave;
+  if (compute_perfect_hash (keylist, nkeys, nbuckets, disp, slots))
+    goto leave;
 
   fprintf (stream,
-           "    },\n"
-           "  },\n");
+           "#include <stdio.h>\n"
+           "#include <tgpg.h>\n"
+           "\n");
+
+  for (i = 0; i < nkeys; i++)
+    {
+      key = &keylist[slots[i]];
+      fprintf (stream, "static const char %s_sexp%lu[%lu] =\n  ",
+               name, (unsigned long) i, (unsigned long) key->datalen);
+      print_bytes (key->sexp, key->datalen, "  ", stream);
+      fprintf (stream, ";\n\n");
+    }
+
+  fprintf (stream, "static const unsigned int %s_disp[%lu] = {",
+           name, (unsigned long) nbuckets);
+  for (i = 0; i < nbuckets; i++)
+    fprintf (stream, "%s%u,", i % 8 ? " " : "\n  ", disp[i]);
+  fprintf (stream, "\n};\n\n");
+
+  fprintf (stream, "static const struct tgpg_compiled_key_s %s_keys[] = {\n",
+           name);
+  for (i = 0; i < nkeys; i++)
+    {
+      key = &keylist[slots[i]];
+      fprintf (stream,
+               "  {\n"
+               "    {\n"
+               "      %d /* %s */, 0x%08lx, 0x%08lx,\n"
+               "      {\n",
+               key->algo, algo_name (key), key->id.high, key->id.low);
+      for (k = 0; k < KEYFILE_NMPIS; k++)
+        fprintf (stream,
+                 "        { /* %s: */ %u /* bits */, %u /* bytes */,"
+                 " %s_sexp%lu + %lu },\n",
+                 mpi_names (key)[k], (unsigned int) key->lengths[k] << 3,
+                 (unsigned int) key->lengths[k],
+                 name, (unsigned long) i, (unsigned long) key->offsets[k]);
+      fprintf (stream,
+               "      },\n"
+               "    },\n"
+               "    %lu, %s_sexp%lu\n"
+               "  },\n",
+               (unsigned long) key->sexplen, name, (unsigned long) i);
+    }
+  fprintf (stream, "};\n\n");
+
+  fprintf (stream,
+           "const struct tgpg_keytable_s %s = {\n"
+           "  %lu, %lu, %s_disp, %s_keys\n"
+           "};\n",
+           name, (unsigned long) nkeys, (unsigned long) nbuckets,
+           name, name);
+  rc = 0;
 
  leave:
-  free (inpfile);
-  gcry_sexp_release (sexp);
-  for (i = 0; i < DIM (mpis); i++)
-    gcry_mpi_release (mpis[i]);
+  free (slots);
+  free (disp);
+  return rc;
 }
 
+
 int
 main (int argc, char **argv)
 {
   int last_argc = -1;
+  struct key *keylist;
+  size_t nkeys = 0;
+  int rc = 0;
 
   if (argc)
     {
@@ -322,8 +879,12 @@ main (int argc, char **argv)
         {
           puts (
                 "Usage: " PGM " [OPTION] KEYID PRIVATE-KEY-FILE [KEYID PKF...]\n"
-                "Simple tool to generate static keystores for TGPG.\n\n"
+                "Simple tool to generate static keystores for TGPG.\n"
+                "ECDH keys on Curve25519 need to be given by fingerprint\n"
+                "instead of KEYID.\n\n"
                 "  --name NAME specify name of the symbol [default: keystore]\n"
+                "  --binary    write a binary keystore for tgpg_map_keystore\n"
+                "  --perfect-hash write a keystore for tgpg_set_keytable\n"
                 "  --verbose   enable extra informational output\n"
                 "  --debug     enable additional debug output\n"
                 "  --help      display this help and exit\n\n"
@@ -340,6 +901,16 @@ main (int argc, char **argv)
           name = argv[1];
           argc -= 2, argv += 2;
         }
+      else if (!strcmp (*argv, "--binary"))
+        {
+          binary = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--perfect-hash"))
+        {
+          perfect_hash = 1;
+          argc--; argv++;
+        }
       else if (!strcmp (*argv, "--verbose"))
         {
           verbose = 1;
@@ -362,24 +933,43 @@ main (int argc, char **argv)
 
   stream = stdout;
 
-  fprintf (stream,
-           "#include <stdio.h>\n"
-           "#include <tgpg.h>\n"
-           "\n"
-           "struct tgpg_key_s %s[] = {\n",
-           name);
-
+  keylist = calloc (argc / 2, sizeof *keylist);
+  if (!keylist)
+    {
+      fprintf (stderr, PGM": malloc failed: %s\n", strerror (errno));
+      return EXIT_FAILURE;
+    }
   for (; argc; argc -= 2, argv += 2)
     {
       struct keyid id;
       if (parse_keyid (argv[0], &id))
         return EXIT_FAILURE;
 
-      process_file (&id, argv[1], stream);
+      if (read_key (&id, argv[1], &keylist[nkeys]))
+        return EXIT_FAILURE;
+      nkeys++;
+    }
+
+  if (binary)
+    rc = write_binary (keylist, nkeys, stream);
+  else if (perfect_hash)
+    rc = write_perfect_hash (keylist, nkeys, stream);
+  else
+    {
+      size_t k;
+
+      fprintf (stream,
+               "#include <stdio.h>\n"
+               "#include <tgpg.h>\n"
+               "\n"
+               "struct tgpg_key_s %s[] = {\n",
+               name);
+      for (k = 0; k < nkeys; k++)
+        print_key (&keylist[k], stream);
+      fprintf (stream,
+               "  { /* sentinel */ 0 },\n"
+               "};\n");
     }
-  fprintf (stream,
-           "  { /* sentinel */ 0 },\n"
-           "};\n");
 
-  return EXIT_SUCCESS;
+  return rc ? EXIT_FAILURE : EXIT_SUCCESS;
 }